@@ -39,6 +39,7 @@
 #define ZLIB_BUFFER_SIZE 16384
 #endif
 #include "./bitio.h"
+#include "./os.h"
 
 /* ---------------------------- null reader ------------------------------- */
 
@@ -645,7 +646,7 @@ static void writer_zlibdeflate_finish(writer_t*writer)
     exit(1);
 #endif
 }
-void writer_init_zlibdeflate(writer_t*w, writer_t*output)
+static void writer_init_zlibdeflate_single(writer_t*w, writer_t*output, int level, char raw)
 {
 #ifdef HAVE_ZLIB
     zlibdeflate_t*z;
@@ -664,7 +665,7 @@ void writer_init_zlibdeflate(writer_t*w, writer_t*output)
     z->zs.zalloc = Z_NULL;
     z->zs.zfree  = Z_NULL;
     z->zs.opaque = Z_NULL;
-    ret = deflateInit(&z->zs, 9);
+    ret = deflateInit2(&z->zs, level, Z_DEFLATED, raw?-MAX_WBITS:MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
     if (ret != Z_OK) zlib_error(ret, "bitio:deflate_init", &z->zs);
     w->bitpos = 0;
     w->mybyte = 0;
@@ -676,6 +677,274 @@ void writer_init_zlibdeflate(writer_t*w, writer_t*output)
 #endif
 }
 
+/* ----------------------- parallel zlibdeflate writer ---------------------- */
+
+/* Splits the input into blocks which are compressed independently (and
+   concurrently), each one primed with the last 32k of the previous block as
+   preset dictionary. Every block but the last one ends in a sync flush, so
+   the raw deflate streams can just be concatenated. Together with a zlib
+   header and the adler32 of the whole input, that's one valid zlib stream,
+   which is only slightly larger than what a single deflate stream would
+   produce. The output only depends on the block size, not on the number
+   of threads. */
+
+#define PARALLEL_ZLIB_BLOCKSIZE (128*1024)
+#define PARALLEL_ZLIB_DICTSIZE (32*1024)
+
+#ifdef HAVE_ZLIB
+typedef struct _zlibblock
+{
+    unsigned char*data;
+    int len;
+    unsigned char*dict;
+    int dictlen;
+    int level;
+    char last;
+
+    unsigned char*out;
+    int outlen;
+    thread_t*thread;
+    struct _zlibblock*next;
+} zlibblock_t;
+#endif
+
+typedef struct _zlibparallel
+{
+#ifdef HAVE_ZLIB
+    writer_t*output;
+    int level;
+    int threads;
+    char raw; // no zlib header and trailer
+    uLong adler;
+    unsigned char*block;
+    int blockpos;
+    unsigned char*dict;
+    int dictlen;
+    zlibblock_t*first; // blocks currently being compressed, in stream order
+    zlibblock_t*last;
+    int num_running;
+#endif
+} zlibparallel_t;
+
+#ifdef HAVE_ZLIB
+static void* zlibblock_compress(void*_b)
+{
+    zlibblock_t*b = (zlibblock_t*)_b;
+    z_stream zs;
+    int ret;
+    memset(&zs, 0, sizeof(z_stream));
+    ret = deflateInit2(&zs, b->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) zlib_error(ret, "bitio:deflate_init", &zs);
+    if(b->dictlen)
+	deflateSetDictionary(&zs, b->dict, b->dictlen);
+
+    int size = deflateBound(&zs, b->len) + 16;
+    b->out = (unsigned char*)malloc(size);
+    zs.next_in = b->data;
+    zs.avail_in = b->len;
+    zs.next_out = b->out;
+    zs.avail_out = size;
+    ret = deflate(&zs, b->last?Z_FINISH:Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END) zlib_error(ret, "bitio:deflate_deflate", &zs);
+    b->outlen = zs.next_out - b->out;
+    deflateEnd(&zs);
+    return 0;
+}
+
+static void zlibparallel_writeblock(writer_t*writer, zlibblock_t*b)
+{
+    zlibparallel_t*z = (zlibparallel_t*)writer->internal;
+    thread_join(b->thread);
+    z->output->write(z->output, b->out, b->outlen);
+    writer->pos += b->outlen;
+    free(b->out);
+    free(b->data);
+    if(b->dict) 
+	free(b->dict);
+    free(b);
+}
+
+/* write out finished blocks, until at most "max_running" are left */
+static void zlibparallel_drain(writer_t*writer, int max_running)
+{
+    zlibparallel_t*z = (zlibparallel_t*)writer->internal;
+    while(z->num_running > max_running) {
+	zlibblock_t*b = z->first;
+	z->first = b->next;
+	if(!z->first)
+	    z->last = 0;
+	z->num_running--;
+	zlibparallel_writeblock(writer, b);
+    }
+}
+
+static void zlibparallel_startblock(writer_t*writer, char last)
+{
+    zlibparallel_t*z = (zlibparallel_t*)writer->internal;
+    zlibblock_t*b = (zlibblock_t*)malloc(sizeof(zlibblock_t));
+    memset(b, 0, sizeof(zlibblock_t));
+    b->data = z->block;
+    b->len = z->blockpos;
+    b->level = z->level;
+    b->last = last;
+    if(z->dictlen) {
+	b->dict = (unsigned char*)malloc(z->dictlen);
+	memcpy(b->dict, z->dict, z->dictlen);
+	b->dictlen = z->dictlen;
+    }
+    z->adler = adler32(z->adler, b->data, b->len);
+
+    /* the end of this block is the dictionary for the next one */
+    if(b->len >= PARALLEL_ZLIB_DICTSIZE) {
+	memcpy(z->dict, b->data + b->len - PARALLEL_ZLIB_DICTSIZE, PARALLEL_ZLIB_DICTSIZE);
+	z->dictlen = PARALLEL_ZLIB_DICTSIZE;
+    } else {
+	int keep = z->dictlen + b->len > PARALLEL_ZLIB_DICTSIZE ? PARALLEL_ZLIB_DICTSIZE - b->len : z->dictlen;
+	memmove(z->dict, z->dict + z->dictlen - keep, keep);
+	memcpy(z->dict + keep, b->data, b->len);
+	z->dictlen = keep + b->len;
+    }
+
+    z->block = (unsigned char*)malloc(PARALLEL_ZLIB_BLOCKSIZE);
+    z->blockpos = 0;
+
+    zlibparallel_drain(writer, z->threads-1);
+    b->thread = thread_start(zlibblock_compress, b);
+    if(z->last)
+	z->last->next = b;
+    else
+	z->first = b;
+    z->last = b;
+    z->num_running++;
+}
+#endif
+
+static int writer_zlibparallel_write(writer_t*writer, void* data, int len) 
+{
+#ifdef HAVE_ZLIB
+    zlibparallel_t*z = (zlibparallel_t*)writer->internal;
+    if(writer->type != WRITER_TYPE_ZLIB_PARALLEL) {
+	fprintf(stderr, "Wrong writer ID (writer not initialized?)\n");
+	return 0;
+    }
+    unsigned char*d = (unsigned char*)data;
+    int left = len;
+    while(left) {
+	int l = PARALLEL_ZLIB_BLOCKSIZE - z->blockpos;
+	if(l > left)
+	    l = left;
+	memcpy(z->block + z->blockpos, d, l);
+	z->blockpos += l;
+	d += l;
+	left -= l;
+	if(z->blockpos == PARALLEL_ZLIB_BLOCKSIZE)
+	    zlibparallel_startblock(writer, 0);
+    }
+    return len;
+#else
+    fprintf(stderr, "Error: swftools was compiled without zlib support");
+    exit(1);
+#endif
+}
+
+static void writer_zlibparallel_flush(writer_t*writer)
+{
+#ifdef HAVE_ZLIB
+    zlibparallel_t*z = (zlibparallel_t*)writer->internal;
+    if(z->blockpos)
+	zlibparallel_startblock(writer, 0);
+    zlibparallel_drain(writer, 0);
+#endif
+}
+
+static void writer_zlibparallel_finish(writer_t*writer)
+{
+#ifdef HAVE_ZLIB
+    zlibparallel_t*z = (zlibparallel_t*)writer->internal;
+    if(writer->type != WRITER_TYPE_ZLIB_PARALLEL) {
+	fprintf(stderr, "Wrong writer ID (writer not initialized?)\n");
+	return;
+    }
+    zlibparallel_startblock(writer, 1);
+    zlibparallel_drain(writer, 0);
+
+    if(!z->raw) {
+	unsigned char trailer[4];
+	trailer[0] = z->adler >> 24;
+	trailer[1] = z->adler >> 16;
+	trailer[2] = z->adler >> 8;
+	trailer[3] = z->adler;
+	z->output->write(z->output, trailer, 4);
+	writer->pos += 4;
+    }
+
+    free(z->block);
+    free(z->dict);
+    free(writer->internal);
+    memset(writer, 0, sizeof(writer_t));
+#endif
+}
+
+static void writer_init_deflate(writer_t*w, writer_t*output, int level, int threads, char raw)
+{
+#ifdef HAVE_ZLIB
+    if(threads<=1) {
+	writer_init_zlibdeflate_single(w, output, level, raw);
+	return;
+    }
+    if(level<0 || level>9)
+	level = Z_DEFAULT_COMPRESSION==-1?6:Z_DEFAULT_COMPRESSION;
+    memset(w, 0, sizeof(writer_t));
+    zlibparallel_t*z = (zlibparallel_t*)malloc(sizeof(zlibparallel_t));
+    memset(z, 0, sizeof(zlibparallel_t));
+    w->internal = z;
+    w->write = writer_zlibparallel_write;
+    w->flush = writer_zlibparallel_flush;
+    w->finish = writer_zlibparallel_finish;
+    w->type = WRITER_TYPE_ZLIB_PARALLEL;
+    z->output = output;
+    z->level = level;
+    z->threads = threads;
+    z->raw = raw;
+    z->adler = adler32(0, 0, 0);
+    z->block = (unsigned char*)malloc(PARALLEL_ZLIB_BLOCKSIZE);
+    z->dict = (unsigned char*)malloc(PARALLEL_ZLIB_DICTSIZE);
+    if(raw)
+	return;
+
+    /* zlib header: deflate, 32k window, no preset dictionary */
+    unsigned char header[2];
+    int flevel = level<2 ? 0 : (level<6 ? 1 : (level==6 ? 2 : 3));
+    header[0] = 0x78;
+    header[1] = flevel<<6;
+    header[1] += 31 - (header[0]*256 + header[1]) % 31;
+    output->write(output, header, 2);
+    w->pos = 2;
+#else
+    fprintf(stderr, "Error: swftools was compiled without zlib support");
+    exit(1);
+#endif
+}
+
+/* level: zlib compression level (0-9), threads: number of blocks to compress
+   at the same time. With threads<=1, this is a plain single deflate stream */
+void writer_init_zlibdeflate2(writer_t*w, writer_t*output, int level, int threads)
+{
+    writer_init_deflate(w, output, level, threads, 0);
+}
+
+/* like writer_init_zlibdeflate2, but produces a raw deflate stream, without
+   zlib header and adler32 trailer */
+void writer_init_rawdeflate(writer_t*w, writer_t*output, int level, int threads)
+{
+    writer_init_deflate(w, output, level, threads, 1);
+}
+
+void writer_init_zlibdeflate(writer_t*w, writer_t*output)
+{
+    writer_init_zlibdeflate_single(w, output, 9, 0);
+}
+
 /* ----------------------- bit handling routines -------------------------- */
 
 void writer_writebit(writer_t*w, int bit)
@@ -692,10 +961,20 @@ void writer_writebit(writer_t*w, int bit)
 }
 void writer_writebits(writer_t*w, unsigned int data, int bits)
 {
-    int t;
-    for(t=0;t<bits;t++)
-    {
-	writer_writebit(w, (data >> (bits-t-1))&1);
+    /* store as many bits as fit into the current byte at once */
+    while(bits) {
+	int n;
+	if(w->bitpos==8) {
+	    w->write(w, &w->mybyte, 1);
+	    w->bitpos = 0;
+	    w->mybyte = 0;
+	}
+	n = 8 - w->bitpos;
+	if(n > bits)
+	    n = bits;
+	bits -= n;
+	w->mybyte |= ((data >> bits) & (0xff >> (8-n))) << (8 - w->bitpos - n);
+	w->bitpos += n;
     }
 }
 void writer_resetbits(writer_t*w)
@@ -717,12 +996,21 @@ unsigned int reader_readbit(reader_t*r)
 }
 unsigned int reader_readbits(reader_t*r, int num)
 {
-    int t;
-    int val = 0;
-    for(t=0;t<num;t++)
-    {
-	val<<=1;
-	val|=reader_readbit(r);
+    /* take as many bits as are left in the current byte at once. We can't
+       read ahead further than that, as the reader is a stream. */
+    unsigned int val = 0;
+    while(num) {
+	int n;
+	if(r->bitpos==8) {
+	    r->bitpos=0;
+	    r->read(r, &r->mybyte, 1);
+	}
+	n = 8 - r->bitpos;
+	if(n > num)
+	    n = num;
+	val = (val << n) | ((r->mybyte >> (8 - r->bitpos - n)) & (0xff >> (8-n)));
+	r->bitpos += n;
+	num -= n;
     }
     return val;
 }
@@ -45,6 +45,7 @@
 #define WRITER_TYPE_ZLIB_U 4
 #define WRITER_TYPE_NULL 5
 #define WRITER_TYPE_GROWING_MEM  6
+#define WRITER_TYPE_ZLIB_PARALLEL 7
 #define WRITER_TYPE_ZLIB WRITER_TYPE_ZLIB_C
 
 typedef struct _reader
@@ -115,6 +116,8 @@ void reader_init_zzipreader(reader_t*r,ZZIP_FILE*z);
 void writer_init_filewriter(writer_t*w, int handle);
 void writer_init_filewriter2(writer_t*w, char*filename);
 void writer_init_zlibdeflate(writer_t*w, writer_t*output);
+void writer_init_zlibdeflate2(writer_t*w, writer_t*output, int level, int threads);
+void writer_init_rawdeflate(writer_t*w, writer_t*output, int level, int threads);
 void writer_init_memwriter(writer_t*r, void*data, int length);
 void writer_init_nullwriter(writer_t*w);
 
@@ -230,6 +230,7 @@ static void dumpImage(writer_t*w, state_t*state, gfximage_t*img)
 static gfximage_t readImage(reader_t*r, state_t*state)
 {
     gfximage_t img;
+    memset(&img, 0, sizeof(img));
     img.width = reader_readU16(r);
     img.height = reader_readU16(r);
     uLongf size = img.width*img.height*sizeof(gfxcolor_t);
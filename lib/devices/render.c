@@ -48,6 +48,7 @@ typedef struct _internal_result {
     gfximage_t img;
     struct _internal_result*next;
     char palette;
+    int pngthreads;
 } internal_result_t;
 
 typedef struct _clipbuffer {
@@ -68,6 +69,7 @@ typedef struct _internal {
     int fillwhite;
 
     char palette;
+    int pngthreads;
 
     RGBA* img;
 
@@ -523,6 +525,9 @@ int render_setparameter(struct _gfxdevice*dev, const char*key, const char*value)
     } else if(!strcmp(key, "palette")) {
 	i->palette = atoi(value);
 	return 1;
+    } else if(!strcmp(key, "pngthreads")) {
+	i->pngthreads = atoi(value);
+	return 1;
     }
     return 0;
 }
@@ -785,6 +790,7 @@ int render_result_save(gfxresult_t*r, const char*filename)
     if(!i) {
 	return 0; // no pages drawn
     }
+    png_encoder_t*e = png_encoder_new(9, i->pngthreads);
     if(i->next) {
 	int nr=0;
 	char filenamebuf[256];
@@ -794,23 +800,17 @@ int render_result_save(gfxresult_t*r, const char*filename)
 		strchr("pP",origname[l-3]) && filename[l-4]=='.') {
 	    origname[l-4] = 0;
 	}
-	while(i->next) {
+	while(i) {
 	    sprintf(filenamebuf, "%s.%d.png", origname, nr);
-            if(!i->palette) {
-	        png_write(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-            } else {
-	        png_write_palette_based_2(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-            }
+	    png_encoder_write(e, filenamebuf, (unsigned char*)i->img.data, i->img.width, i->img.height, i->palette?256:0);
+	    i = i->next;
 	    nr++;
 	}
 	free(origname);
     } else {
-        if(!i->palette) {
-	    png_write(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-	} else {
-	    png_write_palette_based_2(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-	}
+	png_encoder_write(e, filename, (unsigned char*)i->img.data, i->img.width, i->img.height, i->palette?256:0);
     }
+    png_encoder_destroy(e);
     return 1;
 }
 char*gfximage_asXPM(gfximage_t*img, int depth)
@@ -1013,6 +1013,7 @@ void render_endpage(struct _gfxdevice*dev)
     
     internal_result_t*ir= (internal_result_t*)rfx_calloc(sizeof(internal_result_t));
     ir->palette = i->palette;
+    ir->pngthreads = i->pngthreads;
 
     int y,x;
 
@@ -1058,6 +1059,7 @@ void gfxdevice_render_init(gfxdevice_t*dev)
     i->height2 = 0;
     i->antialize = 1;
     i->multiply = 1;
+    i->pngthreads = 1;
     i->zoom = 1;
 
     dev->setparameter = render_setparameter;
@@ -43,8 +43,10 @@
 #include "swf.h"
 #include "../gfxpoly.h"
 #include "../gfximage.h"
+#include "../stats.h"
+#include "../os.h"
 
-#define CHARDATAMAX 1024
+#define CHARDATAMIN 256
 #define CHARMIDX 0
 #define CHARMIDY 0
 
@@ -57,16 +59,16 @@ typedef struct _charatposition {
     RGBA color;
 } charatposition_t;
 
-typedef struct _chararray {
-    charatposition_t chr[CHARDATAMAX+1];
-    int pos;
-    struct _chararray *next;
-} chararray_t;
-
+/* all characters drawn (consecutively) with the same matrix. They end up
+   in one DEFINETEXT2 tag. */
 typedef struct _charbuffer {
     MATRIX matrix;
-    chararray_t*array;
-    chararray_t*last;
+    charatposition_t*chr;
+    int num;
+    int size;
+    SRECT bbox; // of all characters so far
+    int glyphbits; // bits needed to store the largest glyph index
+    int advancebits; // bits needed to store the largest advance, without sign bit
     struct _charbuffer *next;
 } charbuffer_t;
 
@@ -76,12 +78,36 @@ typedef struct _fontlist
     struct _fontlist*next;
 } fontlist_t;
 
+typedef struct _imagecache
+{
+    U32 hash;
+    int width, height; // of the image passed to fillbitmap
+    int targetwidth, targetheight; // size we were asked to scale it to
+    int quality;
+    RGBA*data; // copy of the original pixels, to rule out hash collisions
+    int bitid;
+    int newwidth, newheight; // size of the image stored in the swf
+    struct _imagecache*prev;
+    struct _imagecache*next;
+} imagecache_t;
+
 typedef long int twip;
 
 typedef struct _swfmatrix {
     double m11,m12,m21,m22,m31,m32;
 } swfmatrix_t;
 
+/* with "streaming", the tags of finished pages are written to a temporary
+   file instead of being kept in memory */
+typedef struct _spool
+{
+    FILE*file;
+    TAG*tag;     // placeholder for the spooled tags in the tag list
+    int frames;
+    U32 len;
+    char actions; // contains flash 8 actionscript
+} spool_t;
+
 typedef struct _swfoutput_internal
 {
     gfxdevice_t*dev; // the gfxdevice object where this internal struct resides
@@ -99,8 +125,14 @@ typedef struct _swfoutput_internal
     int config_frameresets;
     int config_linknameurl;
     int config_jpegquality;
+    int config_imageprediction;
+    int config_parallelimages;
+    int config_scalefilter;
+    int config_scalethreads;
     int config_storeallcharacters;
     int config_enablezlib;
+    int config_zliblevel;
+    int config_zlibthreads;
     int config_insertstoptag;
     int config_showimages;
     int config_watermark;
@@ -134,6 +166,21 @@ typedef struct _swfoutput_internal
 
     fontlist_t* fontlist;
 
+    imagecache_t* imagecache; // most recently used first
+    imagecache_t* imagecache_last;
+    int imagecache_size;
+    int config_imagecachesize;
+    int imagecache_hits;
+    int imagecache_misses;
+
+    struct _imagejob* imagejobs; // images being encoded in the background, oldest first
+    struct _imagejob* imagejobs_last;
+    int num_imagejobs;
+    int config_imagethreads;
+
+    char config_streaming;
+    spool_t spool;
+
     char storefont;
 
     MATRIX page_matrix;
@@ -227,9 +274,11 @@ static void swf_addfont(gfxdevice_t*dev, gfxfont_t*font);
 static void swf_drawlink(gfxdevice_t*dev, gfxline_t*line, const char*action, const char*text);
 static void swf_startframe(gfxdevice_t*dev, int width, int height);
 static void swf_endframe(gfxdevice_t*dev);
+static void finish_images(swfoutput_internal*i);
 static void swfoutput_namedlink(gfxdevice_t*dev, char*name, gfxline_t*points);
 static void swfoutput_linktopage(gfxdevice_t*dev, int page, gfxline_t*points);
 static void swfoutput_linktourl(gfxdevice_t*dev, const char*url, gfxline_t*points);
+static void clearImageCache(swfoutput_internal*i);
 
 static gfxresult_t* swf_finish(gfxdevice_t*driver);
 
@@ -275,9 +324,15 @@ static swfoutput_internal* init_internal_struct()
     i->config_ignoredraworder=0;
     i->config_drawonlyshapes=0;
     i->config_jpegquality=85;
+    i->config_imageprediction=1;
+    i->config_imagecachesize=32*1024*1024;
+    i->config_scalefilter=GFXIMAGE_FILTER_BOX;
+    i->config_scalethreads=1;
     i->config_storeallcharacters=0;
     i->config_dots=1;
     i->config_enablezlib=0;
+    i->config_zliblevel=-1;
+    i->config_zlibthreads=1;
     i->config_insertstoptag=0;
     i->config_flashversion=6;
     i->config_framerate=0.25;
@@ -549,241 +604,145 @@ static inline int colorcompare(RGBA*a,RGBA*b)
     return 1;
 }
 
-static SRECT getcharacterbbox(chararray_t*chardata, MATRIX* m, int flashversion)
+/* bounding box of a single character, in the coordinate system the
+   text's matrix maps to */
+static SRECT getcharacterbbox(charatposition_t*chr, MATRIX* m, int flashversion)
 {
-    SRECT r;
-    char debug = 0;
-    memset(&r, 0, sizeof(r));
-
-    int t;
-    if(debug) printf("\n");
-
     double div = 1.0 / 1024.0;
     if(flashversion>=8 && !NO_FONT3) {
 	div = 1.0 / 20480.0;
     }
 
-    while(chardata) {
-	for(t=0;t<chardata->pos;t++) {
-	    charatposition_t*chr = &chardata->chr[t];
-	    SRECT b = chr->font->layout->bounds[chr->charid];
-	    b.xmin = floor((b.xmin*(double)chr->size) *div);
-	    b.ymin = floor((b.ymin*(double)chr->size) *div);
-	    b.xmax = ceil((b.xmax*(double)chr->size)  *div);
-	    b.ymax = ceil((b.ymax*(double)chr->size)  *div);
-
-	    b.xmin += chr->x;
-	    b.ymin += chr->y;
-	    b.xmax += chr->x;
-	    b.ymax += chr->y;
-
-	    /* until we solve the INTERNAL_SCALING problem (see below)
-	       make sure the bounding box is big enough */
-	    b.xmin -= 20;
-	    b.ymin -= 20;
-	    b.xmax += 20;
-	    b.ymax += 20;
-
-	    b = swf_TurnRect(b, m);
-
-	    if(debug) printf("(%f,%f,%f,%f) -> (%f,%f,%f,%f) [font %d, char %d]\n",
-		    chr->font->layout->bounds[chr->charid].xmin/20.0,
-		    chr->font->layout->bounds[chr->charid].ymin/20.0,
-		    chr->font->layout->bounds[chr->charid].xmax/20.0,
-		    chr->font->layout->bounds[chr->charid].ymax/20.0,
-		    b.xmin/20.0,
-		    b.ymin/20.0,
-		    b.xmax/20.0,
-		    b.ymax/20.0,
-		    chr->font->id,
-		    chr->charid);
-	    swf_ExpandRect2(&r, &b);
-	}
-	chardata = chardata->next;
-    }
-    if(debug) printf("-----> (%f,%f,%f,%f)\n",
-	    r.xmin/20.0,
-	    r.ymin/20.0,
-	    r.xmax/20.0,
-	    r.ymax/20.0);
-    return r;
-}
+    SRECT b = chr->font->layout->bounds[chr->charid];
+    b.xmin = floor((b.xmin*(double)chr->size) *div);
+    b.ymin = floor((b.ymin*(double)chr->size) *div);
+    b.xmax = ceil((b.xmax*(double)chr->size)  *div);
+    b.ymax = ceil((b.ymax*(double)chr->size)  *div);
 
-static chararray_t*chararray_reverse(chararray_t*buf)
-{
-    chararray_t*prev = 0;
-    while(buf) {
-	chararray_t*next = buf->next;
-	buf->next = prev;
-	prev = buf;
-	buf = next;
-    }
-    return prev;
+    b.xmin += chr->x;
+    b.ymin += chr->y;
+    b.xmax += chr->x;
+    b.ymax += chr->y;
+
+    /* until we solve the INTERNAL_SCALING problem (see below)
+       make sure the bounding box is big enough */
+    b.xmin -= 20;
+    b.ymin -= 20;
+    b.xmax += 20;
+    b.ymax += 20;
+
+    return swf_TurnRect(b, m);
 }
 
-static void chararray_writetotag(chararray_t*_chardata, TAG*tag)
+/* Write the text records of a charbuffer. The bounding box and the number
+   of bits needed for glyph indices and advances were already collected
+   by charbuffer_append(), so this is a single pass over the characters. */
+static void charbuffer_writetotag(charbuffer_t*buf, TAG*tag)
 {
     SWFFONT font;
     RGBA color;
-    color.r = _chardata?_chardata->chr[0].color.r^255:0;
+    color.r = buf->num?buf->chr[0].color.r^255:0;
     color.g = 0;
     color.b = 0;
     color.a = 0;
-    SWFFONT*lastfont;
-    int lastx;
-    int lasty;
-    int lastsize;
-    int lastchar;
+    SWFFONT*lastfont = 0;
+    int lastx = CHARMIDX;
+    int lasty = CHARMIDY;
+    int lastsize = -1;
     int charids[128];
     int charadvance[128];
-    int charstorepos;
-    int pass;
-    int glyphbits=1; //TODO: can this be zero?
-    int advancebits=1;
+    int charstorepos = 0;
+    int glyphbits = buf->glyphbits;
+    int advancebits = buf->advancebits+1; // add sign bit
+    int t;
 
     if(tag->id != ST_DEFINETEXT &&
         tag->id != ST_DEFINETEXT2) {
         msg("<error> internal error: charbuffer_put needs an text tag, not %d\n",tag->id);
         exit(1);
     }
-    if(!_chardata) {
+    if(!buf->num) {
         msg("<warning> charbuffer_put called with zero characters");
     }
 
-    for(pass = 0; pass < 2; pass++)
-    {
-        charstorepos = 0;
-        lastfont = 0;
-        lastx = CHARMIDX;
-        lasty = CHARMIDY;
-        lastsize = -1;
-	lastchar = -1;
-
-        if(pass==1)
-        {
-            advancebits++; // add sign bit
-            swf_SetU8(tag, glyphbits);
-            swf_SetU8(tag, advancebits);
-        }
-
-	chararray_t*chardata = _chardata;
-
-	while(chardata) {
-	    int t;
-	    
-	    assert(!chardata->next || chardata->pos == CHARDATAMAX);
-	    assert(chardata->pos);
-
-	    int to = chardata->next?chardata->pos-1:chardata->pos;
+    swf_SetU8(tag, glyphbits);
+    swf_SetU8(tag, advancebits);
 
-	    for(t=0;t<=to;t++)
+    for(t=0;t<=buf->num;t++)
+    {
+	char islast = t==buf->num;
+	charatposition_t*chr = &buf->chr[t];
+
+	if(islast ||
+	   lastfont != chr->font || 
+	   lastx!=chr->x ||
+	   lasty!=chr->y ||
+	   !colorcompare(&color, &chr->color) ||
+	   charstorepos==127 ||
+	   lastsize != chr->size)
+	{
+	    if(charstorepos)
 	    {
-		char islast = t==chardata->pos;
-
-		charatposition_t*chr = &chardata->chr[t];
-
-		if(lastfont != chr->font || 
-			lastx!=chr->x ||
-			lasty!=chr->y ||
-			!colorcompare(&color, &chardata->chr[t].color) ||
-			charstorepos==127 ||
-			lastsize != chardata->chr[t].size ||
-			islast)
+		tag->writeBit = 0; // Q&D
+		swf_SetBits(tag, 0, 1); // GLYPH Record
+		swf_SetBits(tag, charstorepos, 7); // number of glyphs
+		int s;
+		for(s=0;s<charstorepos;s++)
 		{
-		    if(charstorepos && pass==0)
-		    {
-			int s;
-			for(s=0;s<charstorepos;s++)
-			{
-			    while(charids[s]>=(1<<glyphbits))
-				glyphbits++;
-			    while(charadvance[s]>=(1<<advancebits))
-				advancebits++;
-			}
-		    }
-		    if(charstorepos && pass==1)
-		    {
-			tag->writeBit = 0; // Q&D
-			swf_SetBits(tag, 0, 1); // GLYPH Record
-			swf_SetBits(tag, charstorepos, 7); // number of glyphs
-			int s;
-			for(s=0;s<charstorepos;s++)
-			{
-			    swf_SetBits(tag, charids[s], glyphbits);
-			    swf_SetBits(tag, charadvance[s], advancebits);
-			}
-		    }
-		    charstorepos = 0;
-
-		    if(pass == 1 && !islast)
-		    {
-			RGBA*newcolor=0;
-			SWFFONT*newfont=0;
-			int newx = 0;
-			int newy = 0;
-			if(lastx != chr->x ||
-			   lasty != chr->y)
-			{
-			    newx = chr->x;
-			    newy = chr->y;
-			    if(newx == 0)
-				newx = SET_TO_ZERO;
-			    if(newy == 0)
-				newy = SET_TO_ZERO;
-			}
-			if(!colorcompare(&color, &chr->color)) 
-			{
-			    color = chr->color;
-			    newcolor = &color;
-			}
-			font.id = chr->font->id;
-			if(lastfont != chr->font || lastsize != chr->size)
-			    newfont = &font;
-
-			tag->writeBit = 0; // Q&D
-			swf_TextSetInfoRecord(tag, newfont, chr->size, newcolor, newx, newy);
-		    }
-
-		    lastfont = chr->font;
-		    lastx = chr->x;
-		    lasty = chr->y;
-		    lastsize = chr->size;
+		    swf_SetBits(tag, charids[s], glyphbits);
+		    swf_SetBits(tag, charadvance[s], advancebits);
 		}
+	    }
+	    charstorepos = 0;
 
-		if(islast)
-			break;
-
-		int nextx = chr->x;
-		if(t<chardata->pos-1) nextx = chardata->chr[t+1].x;
-		if(t==chardata->pos-1 && chardata->next) nextx = chardata->next->chr[0].x;
-		int dx = nextx-chr->x;
-		
-		int advance;
-		if(dx>=0 && (dx<(1<<(advancebits-1)) || pass==0)) {
-		   advance = dx;
-		   lastx=nextx;
-		} else {
-		   advance = 0;
-		   lastx=chr->x;
-		}
+	    if(islast)
+		break;
 
-		charids[charstorepos] = chr->charid;
-		charadvance[charstorepos] = advance;
-		lastchar = chr->charid;
-		charstorepos ++;
+	    RGBA*newcolor=0;
+	    SWFFONT*newfont=0;
+	    int newx = 0;
+	    int newy = 0;
+	    if(lastx != chr->x ||
+	       lasty != chr->y)
+	    {
+		newx = chr->x;
+		newy = chr->y;
+		if(newx == 0)
+		    newx = SET_TO_ZERO;
+		if(newy == 0)
+		    newy = SET_TO_ZERO;
 	    }
-	    chardata = chardata->next;
+	    if(!colorcompare(&color, &chr->color)) 
+	    {
+		color = chr->color;
+		newcolor = &color;
+	    }
+	    font.id = chr->font->id;
+	    if(lastfont != chr->font || lastsize != chr->size)
+		newfont = &font;
+
+	    tag->writeBit = 0; // Q&D
+	    swf_TextSetInfoRecord(tag, newfont, chr->size, newcolor, newx, newy);
+
+	    lastfont = chr->font;
+	    lastx = chr->x;
+	    lasty = chr->y;
+	    lastsize = chr->size;
 	}
-    }
-}
 
-static void chararray_destroy(chararray_t*chr)
-{
-    while(chr) {
-	chararray_t*next = chr->next;
-	chr->next = 0;
-	free(chr);
-	chr = next;
+	/* charbuffer_append() made sure that advancebits is large enough for
+	   all non-negative advances. Going backwards needs a new text record. */
+	int nextx = t<buf->num-1 ? chr[1].x : chr->x;
+	int dx = nextx-chr->x;
+	if(dx>=0) {
+	   charadvance[charstorepos] = dx;
+	   lastx=nextx;
+	} else {
+	   charadvance[charstorepos] = 0;
+	   lastx=chr->x;
+	}
+	charids[charstorepos] = chr->charid;
+	charstorepos ++;
     }
 }
 
@@ -791,31 +750,39 @@ static inline int matrix_diff(MATRIX*m1, MATRIX*m2)
 {
     return memcmp(m1,m2,sizeof(MATRIX));
 }
-static charbuffer_t*charbuffer_append(charbuffer_t*buf, SWFFONT*font, int charid, int x,int y, int size, RGBA color, MATRIX*m)
+static charbuffer_t*charbuffer_append(charbuffer_t*buf, SWFFONT*font, int charid, int x,int y, int size, RGBA color, MATRIX*m, int flashversion)
 {
     if(!buf || matrix_diff(&buf->matrix,m)) {
 	charbuffer_t*n = rfx_calloc(sizeof(charbuffer_t));
 	n->matrix = *m;
+	n->glyphbits = 1; //TODO: can this be zero?
+	n->advancebits = 1;
 	n->next = buf;
 	buf = n;
     }
-    if(!buf->last || buf->last->pos == CHARDATAMAX) {
-	chararray_t*n = rfx_calloc(sizeof(chararray_t));
-	if(!buf->array) {
-	    buf->array = buf->last = n;
-	} else {
-	    buf->last->next = n;
-	    buf->last = n;
-	}
-    }
-    chararray_t*a = buf->last;
-    a->chr[a->pos].font = font;
-    a->chr[a->pos].charid = charid;
-    a->chr[a->pos].x = x;
-    a->chr[a->pos].y = y;
-    a->chr[a->pos].color = color;
-    a->chr[a->pos].size = size;
-    a->pos++;
+    if(buf->num == buf->size) {
+	buf->size = buf->size ? buf->size*2 : CHARDATAMIN;
+	buf->chr = rfx_realloc(buf->chr, buf->size*sizeof(charatposition_t));
+    }
+    if(buf->num) {
+	/* now that we know where this character is, we know the advance of the previous one */
+	int dx = x - buf->chr[buf->num-1].x;
+	while(dx >= (1<<buf->advancebits))
+	    buf->advancebits++;
+    }
+    while(charid >= (1<<buf->glyphbits))
+	buf->glyphbits++;
+
+    charatposition_t*chr = &buf->chr[buf->num++];
+    chr->font = font;
+    chr->charid = charid;
+    chr->x = x;
+    chr->y = y;
+    chr->color = color;
+    chr->size = size;
+
+    SRECT b = getcharacterbbox(chr, &buf->matrix, flashversion);
+    swf_ExpandRect2(&buf->bbox, &b);
     return buf;
 }
 
@@ -824,20 +791,18 @@ static charbuffer_t*charbuffer_append(charbuffer_t*buf, SWFFONT*font, int charid
    If we set it to low, however, the char positions will be inaccurate */
 #define GLYPH_SCALE 1
 
-static void chararray_writetodev(gfxdevice_t*dev, chararray_t*array, MATRIX*matrix, char invisible)
+static void charbuffer_writetodev(gfxdevice_t*dev, charbuffer_t*buf, char invisible)
 {
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
    
     int textid = getNewID(dev);
     i->tag = swf_InsertTag(i->tag,ST_DEFINETEXT2);
     swf_SetU16(i->tag, textid);
-    SRECT r;
-    r = getcharacterbbox(array, matrix, i->config_flashversion);
-    r = swf_ClipRect(i->pagebbox, r);
+    SRECT r = swf_ClipRect(i->pagebbox, buf->bbox);
     swf_SetRect(i->tag,&r);
-    swf_SetMatrix(i->tag, matrix);
+    swf_SetMatrix(i->tag, &buf->matrix);
     msg("<trace> Placing text as ID %d", textid);
-    chararray_writetotag(array, i->tag);
+    charbuffer_writetotag(buf, i->tag);
     i->chardata = 0;
 
     swf_SetU8(i->tag,0);
@@ -869,8 +834,8 @@ static void charbuffer_writetodevandfree(gfxdevice_t*dev, charbuffer_t*buf, char
 {
     while(buf) {
 	charbuffer_t*next = buf->next;buf->next = 0;
-	chararray_writetodev(dev, buf->array, &buf->matrix, invisible);
-	chararray_destroy(buf->array);
+	charbuffer_writetodev(dev, buf, invisible);
+	free(buf->chr);
 	free(buf);
 	buf = next;
     }
@@ -1066,6 +1031,73 @@ static void addViewer(gfxdevice_t* dev)
 }
 
 
+/* write all tags up to the last showframe to the spool file, and free them */
+static void spool_pages(swfoutput_internal*i)
+{
+    spool_t*spool = &i->spool;
+    writer_t w;
+    TAG*tag, *end;
+    if(!spool->file) {
+	spool->file = tmpfile();
+	if(!spool->file) {
+	    msg("<warning> Couldn't create temporary file, keeping all pages in memory");
+	    i->config_streaming = 0;
+	    return;
+	}
+	spool->tag = swf_InsertTag(i->swf->firstTag, ST_REFLEX);
+    }
+    end = i->tag;
+    while(end != spool->tag && end->id != ST_SHOWFRAME)
+	end = end->prev;
+    if(end == spool->tag)
+	return;
+    if(i->tag == end)
+	i->tag = spool->tag;
+
+    writer_init_filewriter(&w, fileno(spool->file));
+    tag = spool->tag->next;
+    while(1) {
+	TAG*next = tag->next;
+	char last = tag == end;
+	spool->len += swf_WriteTag2(&w, tag);
+	if(tag->id == ST_SHOWFRAME)
+	    spool->frames++;
+	if(tag->id == ST_DOACTION || tag->id == ST_DOINITACTION ||
+	   (tag->id == ST_PLACEOBJECT2 && tag->len && (tag->data[0]&0x80)))
+	    spool->actions = 1;
+	swf_DeleteTag(i->swf, tag);
+	if(last)
+	    break;
+	tag = next;
+    }
+    w.finish(&w);
+}
+
+/* read the spooled tags back into the tag list */
+static void unspool(SWF*swf, spool_t*spool)
+{
+    reader_t r;
+    TAG*tag, *prev;
+    if(!spool->file)
+	return;
+    fflush(spool->file);
+    lseek(fileno(spool->file), 0, SEEK_SET);
+    reader_init_filereader(&r, fileno(spool->file));
+    prev = spool->tag;
+    while((tag = swf_ReadTag(&r, 0))) {
+	tag->next = prev->next;
+	tag->prev = prev;
+	if(prev->next)
+	    prev->next->prev = tag;
+	prev->next = tag;
+	prev = tag;
+    }
+    r.dealloc(&r);
+    fclose(spool->file);
+    swf_DeleteTag(swf, spool->tag);
+    memset(spool, 0, sizeof(spool_t));
+}
+
 void swf_startframe(gfxdevice_t*dev, int width, int height)
 {
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
@@ -1118,6 +1150,9 @@ void swf_endframe(gfxdevice_t*dev)
     if(!i->pagefinished)
         endpage(dev);
 
+    /* all bitmaps of this frame need to be defined before the showframe */
+    finish_images(i);
+
     if( (i->swf->fileVersion <= 8) && (i->config_insertstoptag) ) {
 	ActionTAG*atag=0;
 	atag = action_Stop(atag);
@@ -1140,7 +1175,11 @@ void swf_endframe(gfxdevice_t*dev)
 	    swf_SetU16(i->tag,i->currentswfid);
 	}
 	i->currentswfid = i->startids;
+	clearImageCache(i);
     }
+
+    if(i->config_streaming)
+	spool_pages(i);
 }
 
 static void setBackground(gfxdevice_t*dev, int x1, int y1, int x2, int y2)
@@ -1451,6 +1490,8 @@ void swfoutput_finalize(gfxdevice_t*dev)
     if(i->tag && i->tag->id == ST_END)
         return; //already done
 
+    finish_images(i);
+
     i->swf->fileVersion = i->config_flashversion;
     i->swf->frameRate = i->config_framerate*0x100;
 
@@ -1514,6 +1555,7 @@ void swfoutput_finalize(gfxdevice_t*dev)
     TAG* tag = i->tag->prev;
    
     if(use_font3 && i->config_storeallcharacters && i->config_alignfonts) {
+	unspool(i->swf, &i->spool);
 	swf_FontPostprocess(i->swf); // generate alignment information
     }
 
@@ -1526,6 +1568,7 @@ void swfoutput_finalize(gfxdevice_t*dev)
     }
     
     if(i->overflow) {
+	unspool(i->swf, &i->spool);
 	wipeSWF(i->swf);
     }
     if(i->config_enablezlib || i->config_flashversion>=6) {
@@ -1535,6 +1578,7 @@ void swfoutput_finalize(gfxdevice_t*dev)
     /* Add AVM2 actionscript */
     if(i->config_flashversion>=9 && 
             (i->config_insertstoptag || i->hasbuttons) && !i->config_linknameurl) {
+	unspool(i->swf, &i->spool);
         swf_AddButtonLinks(i->swf, i->config_insertstoptag, 
                 i->config_internallinkfunction||i->config_externallinkfunction);
     }
@@ -1542,9 +1586,84 @@ void swfoutput_finalize(gfxdevice_t*dev)
 //	swf_Optimize(i->swf);
 }
 
+typedef struct _swfresult_internal
+{
+    SWF*swf;
+    spool_t spool;
+} swfresult_internal_t;
+
+/* like swf_WriteSWF, but reads the spooled pages back one tag at a time */
+static int write_spooled(SWF*swf, spool_t*spool, int fi)
+{
+    SWF header;
+    swfwriter_t w;
+    reader_t r;
+    TAG*tag, *fileattrib = 0, *newfileattrib = 0;
+    char v8_actions = spool->actions, v9_actions = 0;
+    int lastid = -1;
+
+    memcpy(&header, swf, sizeof(SWF));
+    header.fileSize = swf_GetHeaderLength(swf) + spool->len;
+    header.frameCount = 0;
+    for(tag = swf->firstTag; tag; tag = tag->next) {
+	if(tag == spool->tag) {
+	    header.frameCount += spool->frames;
+	    if(spool->frames)
+		lastid = ST_SHOWFRAME;
+	    continue;
+	}
+	header.fileSize += swf_WriteTag(-1, tag);
+	if(tag->id == ST_SHOWFRAME ||
+	   (tag->id == ST_END && lastid >= 0 && lastid != ST_SHOWFRAME))
+	    header.frameCount++;
+	if(tag->id == ST_FILEATTRIBUTES)
+	    fileattrib = tag;
+	if(tag->id == ST_DOABC)
+	    v9_actions = 1;
+	if(tag->id == ST_DOACTION || tag->id == ST_DOINITACTION ||
+	   (tag->id == ST_PLACEOBJECT2 && tag->len && (tag->data[0]&0x80)))
+	    v8_actions = 1;
+	lastid = tag->id;
+    }
+    /* swf_WriteSWF puts a fileattributes tag in front of flash 9 files */
+    if(swf->fileVersion >= 9 && !fileattrib) {
+	U32 flags = swf->fileAttributes|FILEATTRIBUTE_AS3;
+	if(v8_actions && !v9_actions)
+	    flags &= ~FILEATTRIBUTE_AS3;
+	fileattrib = newfileattrib = swf_InsertTag(0, ST_FILEATTRIBUTES);
+	swf_SetU32(fileattrib, flags);
+	header.fileSize += swf_WriteTag(-1, fileattrib);
+    }
+
+    if(swf_WriterStart(&w, fi, &header) < 0)
+	return -1;
+    if(fileattrib)
+	swf_WriterAddTag(&w, fileattrib);
+    for(tag = swf->firstTag; tag; tag = tag->next) {
+	if(tag == spool->tag) {
+	    TAG*t;
+	    fflush(spool->file);
+	    lseek(fileno(spool->file), 0, SEEK_SET);
+	    reader_init_filereader(&r, fileno(spool->file));
+	    while((t = swf_ReadTag(&r, 0))) {
+		swf_WriterAddTag(&w, t);
+		swf_DeleteTag(0, t);
+	    }
+	    r.dealloc(&r);
+	} else if(tag != fileattrib) {
+	    swf_WriterAddTag(&w, tag);
+	}
+    }
+    if(newfileattrib)
+	swf_DeleteTag(0, newfileattrib);
+    return swf_WriterFinish(&w);
+}
+
 int swfresult_save(gfxresult_t*gfx, const char*filename)
 {
-    SWF*swf = (SWF*)gfx->internal;
+    swfresult_internal_t*ri = (swfresult_internal_t*)gfx->internal;
+    SWF*swf = ri->swf;
+    int ret;
     int fi;
     if(filename)
      fi = open(filename, O_BINARY|O_CREAT|O_TRUNC|O_WRONLY, 0777);
@@ -1556,8 +1675,14 @@ int swfresult_save(gfxresult_t*gfx, const char*filename)
 	return -1;
     }
     
-    if FAILED(swf_WriteSWF(fi,swf)) 
+    STATS_START(starttime);
+    if(ri->spool.file)
+	ret = write_spooled(swf, &ri->spool, fi);
+    else
+	ret = swf_WriteSWF(fi,swf);
+    if FAILED(ret)
         msg("<error> WriteSWF() failed.\n");
+    STATS_END(STATS_SWF_WRITE, starttime);
 
     if(filename)
      close(fi);
@@ -1565,8 +1690,10 @@ int swfresult_save(gfxresult_t*gfx, const char*filename)
 }
 void* swfresult_get(gfxresult_t*gfx, const char*name)
 {
-    SWF*swf = (SWF*)gfx->internal;
+    swfresult_internal_t*ri = (swfresult_internal_t*)gfx->internal;
+    SWF*swf = ri->swf;
     if(!strcmp(name, "swf")) {
+	unspool(swf, &ri->spool);
 	return (void*)swf_CopySWF(swf);
     } else if(!strcmp(name, "xmin")) {
 	return (void*)(ptroff_t)(swf->movieSize.xmin/20);
@@ -1585,9 +1712,13 @@ void* swfresult_get(gfxresult_t*gfx, const char*name)
 }
 void swfresult_destroy(gfxresult_t*gfx)
 {
-    if(gfx->internal) {
-	swf_FreeTags((SWF*)gfx->internal);
-	free(gfx->internal);
+    swfresult_internal_t*ri = (swfresult_internal_t*)gfx->internal;
+    if(ri) {
+	if(ri->spool.file)
+	    fclose(ri->spool.file);
+	swf_FreeTags(ri->swf);
+	free(ri->swf);
+	free(ri);
 	gfx->internal = 0;
     }
     memset(gfx, 0, sizeof(gfxresult_t));
@@ -1607,11 +1738,14 @@ gfxresult_t* swf_finish(gfxdevice_t* dev)
     }
 
     swfoutput_finalize(dev);
-    SWF* swf = i->swf;i->swf = 0;
+    swfresult_internal_t*ri = (swfresult_internal_t*)rfx_calloc(sizeof(swfresult_internal_t));
+    ri->swf = i->swf;i->swf = 0;
+    ri->spool = i->spool;
+    memset(&i->spool, 0, sizeof(spool_t));
     swfoutput_destroy(dev);
 
     result = (gfxresult_t*)rfx_calloc(sizeof(gfxresult_t));
-    result->internal = swf;
+    result->internal = ri;
     result->save = swfresult_save;
     result->write = 0;
     result->get = swfresult_get;
@@ -1637,8 +1771,17 @@ static void swfoutput_destroy(gfxdevice_t* dev)
         iterator = iterator->next;
         free(tmp);
     }
+    finish_images(i);
+    if(i->spool.file)
+	fclose(i->spool.file);
     if(i->swf) {swf_FreeTags(i->swf);free(i->swf);i->swf = 0;}
 
+    if(i->imagecache_hits || i->imagecache_misses) {
+	msg("<verbose> Image cache: %d hits, %d misses", i->imagecache_hits, i->imagecache_misses);
+    }
+    clearImageCache(i);
+    swf_FreeJPEGCompressor();
+
     free(i);i=0;
     memset(dev, 0, sizeof(gfxdevice_t));
 }
@@ -2090,6 +2233,14 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
 	i->config_alignfonts = atoi(value);
     } else if(!strcmp(name, "enablezlib")) {
 	i->config_enablezlib = atoi(value);
+    } else if(!strcmp(name, "zliblevel")) {
+	i->config_zliblevel = atoi(value);
+	swf_SetCompressionParameters(i->config_zliblevel, i->config_zlibthreads);
+    } else if(!strcmp(name, "zlibthreads")) {
+	i->config_zlibthreads = atoi(value);
+	swf_SetCompressionParameters(i->config_zliblevel, i->config_zlibthreads);
+    } else if(!strcmp(name, "streaming")) {
+	i->config_streaming = atoi(value);
     } else if(!strcmp(name, "bboxvars")) {
 	i->config_bboxvars = atoi(value);
     } else if(!strcmp(name, "dots")) {
@@ -2159,6 +2310,32 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
 	i->config_simpleviewer = atoi(value);
     } else if(!strcmp(name, "next_bitmap_is_jpeg")) {
 	i->jpeg = 1;
+    } else if(!strcmp(name, "imagecache")) {
+	i->config_imagecachesize = atoi(value)*1024;
+	if(!i->config_imagecachesize)
+	    clearImageCache(i);
+    } else if(!strcmp(name, "imageprediction")) {
+	i->config_imageprediction = atoi(value);
+    } else if(!strcmp(name, "parallelimages")) {
+	i->config_parallelimages = atoi(value);
+    } else if(!strcmp(name, "scalefilter")) {
+	if(!strcmp(value, "box")) {
+	    i->config_scalefilter = GFXIMAGE_FILTER_BOX;
+	} else if(!strcmp(value, "bilinear")) {
+	    i->config_scalefilter = GFXIMAGE_FILTER_BILINEAR;
+	} else if(!strcmp(value, "lanczos")) {
+	    i->config_scalefilter = GFXIMAGE_FILTER_LANCZOS;
+	} else {
+	    fprintf(stderr, "unknown scale filter: %s\n", value);
+	    return 0;
+	}
+	/* cached images were scaled with the previous filter */
+	clearImageCache(i);
+    } else if(!strcmp(name, "scalethreads")) {
+	i->config_scalethreads = atoi(value);
+    } else if(!strcmp(name, "imagethreads")) {
+	finish_images(i);
+	i->config_imagethreads = atoi(value);
     } else if(!strcmp(name, "jpegquality")) {
 	int val = atoi(value);
 	if(val<0) val=0;
@@ -2197,6 +2374,9 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
         printf("linknameurl		    Link buttons will be named like the URL they refer to (handy for iterating through links with actionscript)\n");
         printf("storeallcharacters          don't reduce the fonts to used characters in the output file\n");
         printf("enablezlib                  switch on zlib compression (also done if flashversion>=6)\n");
+        printf("zliblevel=<0-9>             zlib compression level for the swf and lossless images (lower is faster)\n");
+        printf("zlibthreads=<n>             compress in <n> parallel blocks (0: number of cpus, default: 1)\n");
+        printf("streaming                   keep only the current page in memory, spooling finished pages to a temporary file\n");
         printf("bboxvars                    store the bounding box of the SWF file in actionscript variables\n");
         printf("dots                        Take care to handle dots correctly\n");
         printf("reordertags=0/1             (default: 1) perform some tag optimizations\n");
@@ -2212,6 +2392,12 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
         printf("simpleviewer                Add next/previous buttons to the SWF\n");
         printf("animate                     insert a showframe tag after each placeobject (animate draw order of PDF files)\n");
         printf("jpegquality=<quality>       set compression quality of jpeg images\n");
+        printf("imagecache=<kb>             memory used for detecting repeated images (default: 32768, 0 disables)\n");
+        printf("imageprediction=0/1         guess whether jpeg or lossless compression is better, instead of trying both (default: 1)\n");
+        printf("parallelimages=0/1          run jpeg and lossless compression of large images concurrently\n");
+        printf("scalefilter=box|bilinear|lanczos  filter used for downscaling images (default: box)\n");
+        printf("scalethreads=<n>            number of threads used for downscaling images (default: 1, 0 = number of cpus)\n");
+        printf("imagethreads=<n>            encode up to <n> images in the background while drawing continues (default: 0)\n");
 	printf("splinequality=<value>       Set the quality of spline convertion to value (0-100, default: 100).\n");
 	printf("disablelinks                Disable links.\n");
     } else {
@@ -2245,19 +2431,277 @@ static CXFORM gfxcxform_to_cxform(gfxcxform_t* c)
     return cx;
 }
 
-/* TODO */
-static int imageInCache(gfxdevice_t*dev, void*data, int width, int height)
+static U32 hashImage(RGBA*data, int width, int height)
 {
+    U32*p = (U32*)data;
+    int size = width*height;
+    U32 hash = 2166136261u;
+    int t;
+    for(t=0;t<size;t++) {
+	hash = (hash ^ p[t]) * 16777619u;
+    }
+    return hash;
+}
+
+static void unlinkCachedImage(swfoutput_internal*i, imagecache_t*c)
+{
+    if(c->prev) c->prev->next = c->next;
+    else i->imagecache = c->next;
+    if(c->next) c->next->prev = c->prev;
+    else i->imagecache_last = c->prev;
+    c->prev = c->next = 0;
+}
+
+static void prependCachedImage(swfoutput_internal*i, imagecache_t*c)
+{
+    c->prev = 0;
+    c->next = i->imagecache;
+    if(i->imagecache) i->imagecache->prev = c;
+    else i->imagecache_last = c;
+    i->imagecache = c;
+}
+
+static void removeCachedImage(swfoutput_internal*i, imagecache_t*c)
+{
+    unlinkCachedImage(i, c);
+    i->imagecache_size -= c->width*c->height*sizeof(RGBA);
+    free(c->data);
+    free(c);
+}
+
+static void clearImageCache(swfoutput_internal*i)
+{
+    while(i->imagecache) {
+	removeCachedImage(i, i->imagecache);
+    }
+}
+
+/* returns the bitmap id of an identical image that was scaled to the same size 
+   before, or -1 */
+static int imageInCache(swfoutput_internal*i, U32 hash, RGBA*data, int width, int height, 
+	                int targetwidth, int targetheight, int*newwidth, int*newheight)
+{
+    imagecache_t*c = i->imagecache;
+    while(c) {
+	if(c->hash == hash && c->width == width && c->height == height &&
+	   c->targetwidth == targetwidth && c->targetheight == targetheight &&
+	   c->quality == i->config_jpegquality &&
+	   !memcmp(c->data, data, width*height*sizeof(RGBA))) {
+	    if(c != i->imagecache) {
+		/* move to front */
+		unlinkCachedImage(i, c);
+		prependCachedImage(i, c);
+	    }
+	    *newwidth = c->newwidth;
+	    *newheight = c->newheight;
+	    i->imagecache_hits++;
+	    return c->bitid;
+	}
+	c = c->next;
+    }
+    i->imagecache_misses++;
     return -1;
 }
-static void addImageToCache(gfxdevice_t*dev, void*data, int width, int height)
+
+static void addImageToCache(swfoutput_internal*i, U32 hash, RGBA*data, int width, int height, 
+	                    int targetwidth, int targetheight, int bitid, int newwidth, int newheight)
 {
+    int size = width*height*sizeof(RGBA);
+    if(size > i->config_imagecachesize)
+	return;
+    /* evict the least recently used images */
+    while(i->imagecache_last && i->imagecache_size + size > i->config_imagecachesize) {
+	removeCachedImage(i, i->imagecache_last);
+    }
+    imagecache_t*c = (imagecache_t*)rfx_calloc(sizeof(imagecache_t));
+    c->hash = hash;
+    c->width = width;
+    c->height = height;
+    c->targetwidth = targetwidth;
+    c->targetheight = targetheight;
+    c->quality = i->config_jpegquality;
+    c->data = (RGBA*)rfx_alloc(size);
+    memcpy(c->data, data, size);
+    c->bitid = bitid;
+    c->newwidth = newwidth;
+    c->newheight = newheight;
+    prependCachedImage(i, c);
+    i->imagecache_size += size;
 }
     
+/* Everything needed to turn one bitmap into a DEFINEBITS* tag. Jobs either
+   run right away, or in a background thread, in which case a placeholder
+   tag holds the bitmap's place in the tag list until the job is finished. */
+typedef struct _imagejob
+{
+    gfximage_t img; // private copy of the image, if the job runs in the background
+    char owns_data;
+    int newwidth, newheight; // size to store the image at
+    int targetwidth, targetheight;
+    char is_jpeg;
+    int bitid;
+
+    /* the settings in effect when the image was drawn */
+    int quality;
+    int scalefilter;
+    int scalethreads;
+    int prediction;
+    int parallel;
+
+    int num_colors;
+    int has_alpha;
+    char jpeg_rejected;
+    TAG*placeholder;
+    TAG*result;
+    double encode_time; // accounted by finish_image(), on the main thread
+
+    thread_t*thread;
+    struct _imagejob*next;
+} imagejob_t;
+
+/* rescale and encode a bitmap. Only touches the job, so it's safe to run in
+   a thread of its own. */
+static void* encode_image(void*_job)
+{
+    imagejob_t*job = (imagejob_t*)_job;
+    gfximage_t*img = &job->img;
+    RGBA*mem = (RGBA*)img->data;
+    RGBA*newpic = 0;
+    int width = job->newwidth;
+    int height = job->newheight;
+    STATS_START(starttime);
+
+    if(width != img->width || height != img->height) {
+	gfximage_t*ni = gfximage_rescale2(img, width, height, job->scalefilter, job->scalethreads);
+	newpic = mem = (RGBA*)ni->data;
+	free(ni);
+    }
+
+    job->num_colors = swf_ImageGetNumberOfPaletteEntries(mem,width,height,0);
+    job->has_alpha = swf_ImageHasAlpha(mem,width,height);
+
+    if(img->jpeg && !newpic && !job->has_alpha && job->quality <= 100) {
+	/* the image is used at its original size, so we can store the jpeg
+	   it was decoded from instead of compressing the pixels again */
+	TAG*tag = swf_InsertTag(0, ST_DEFINEBITSJPEG2);
+	swf_SetU16(tag, job->bitid);
+	if(swf_SetJPEGBitsRaw(tag, img->jpeg, img->jpeg_size, width, height) < 0) {
+	    job->jpeg_rejected = 1;
+	    swf_DeleteTag(0, tag);
+	} else {
+	    job->result = tag;
+	}
+    }
+    if(!job->result) {
+	if(job->has_alpha && !newpic && !job->owns_data) {
+	    /* swf_AddImage premultiplies the alpha in place- not something to
+	       do to the caller's pixels, which might get drawn again */
+	    newpic = mem = (RGBA*)rfx_alloc(width*height*sizeof(RGBA));
+	    memcpy(mem, img->data, width*height*sizeof(RGBA));
+	}
+	job->result = swf_AddImage2(0, job->bitid, mem, width, height, job->quality, job->prediction, job->parallel);
+    }
+
+    if(newpic)
+	free(newpic);
+    if(stats_enabled)
+	job->encode_time = stats_time() - starttime;
+    return 0;
+}
+
+/* put the tag of a finished job into the tag list (in place of its placeholder,
+   if it has one), and free the job */
+static void finish_image(swfoutput_internal*i, imagejob_t*job)
+{
+    if(job->thread) {
+	thread_join(job->thread);
+	job->thread = 0;
+    }
+    if(stats_enabled)
+	stats_add_time(STATS_IMAGE_ENCODE, job->encode_time);
+    msg("<verbose> Drawing %dx%d %s%simage (id %d) at size %dx%d (%dx%d), %s%d colors",
+	    job->newwidth, job->newheight,
+	    job->has_alpha?(job->has_alpha==2?"semi-transparent ":"transparent "):"", 
+	    job->is_jpeg?"jpeg-":"", job->bitid,
+	    job->newwidth, job->newheight,
+	    job->targetwidth, job->targetheight,
+	    job->num_colors>256?">":"", job->num_colors>256?256:job->num_colors);
+    if(job->jpeg_rejected) {
+	msg("<verbose> Can't store jpeg data of image %d directly, recompressing", job->bitid);
+    }
+
+    TAG*after = job->placeholder ? job->placeholder : i->tag;
+    TAG*t = job->result;
+    t->prev = after;
+    t->next = after->next;
+    if(t->next)
+	t->next->prev = t;
+    after->next = t;
+    if(i->tag == after)
+	i->tag = t;
+    if(job->placeholder)
+	swf_DeleteTag(i->swf, job->placeholder);
+
+    if(job->owns_data) {
+	free(job->img.data);
+	if(job->img.jpeg)
+	    free((void*)job->img.jpeg);
+    }
+    free(job);
+}
+
+/* wait for all background image jobs, and move their tags into place */
+static void finish_images(swfoutput_internal*i)
+{
+    while(i->imagejobs) {
+	imagejob_t*job = i->imagejobs;
+	i->imagejobs = job->next;
+	finish_image(i, job);
+    }
+    i->imagejobs_last = 0;
+    i->num_imagejobs = 0;
+}
+
+static void queue_image(swfoutput_internal*i, imagejob_t*job)
+{
+    gfximage_t*img = &job->img;
+
+    /* the caller owns the pixels (and jpeg data), so we need a copy */
+    int size = img->width*img->height*sizeof(gfxcolor_t);
+    gfxcolor_t*data = (gfxcolor_t*)rfx_alloc(size);
+    memcpy(data, img->data, size);
+    img->data = data;
+    if(img->jpeg) {
+	unsigned char*jpeg = (unsigned char*)rfx_alloc(img->jpeg_size);
+	memcpy(jpeg, img->jpeg, img->jpeg_size);
+	img->jpeg = jpeg;
+    }
+    job->owns_data = 1;
+
+    /* reserve the bitmap's position in the tag list */
+    job->placeholder = i->tag = swf_InsertTag(i->tag, ST_DEFINEBITSLOSSLESS);
+
+    if(i->num_imagejobs >= i->config_imagethreads) {
+	imagejob_t*oldest = i->imagejobs;
+	i->imagejobs = oldest->next;
+	if(!i->imagejobs)
+	    i->imagejobs_last = 0;
+	i->num_imagejobs--;
+	finish_image(i, oldest);
+    }
+
+    job->thread = thread_start(encode_image, job);
+    if(i->imagejobs_last)
+	i->imagejobs_last->next = job;
+    else
+	i->imagejobs = job;
+    i->imagejobs_last = job;
+    i->num_imagejobs++;
+}
+
 static int add_image(swfoutput_internal*i, gfximage_t*img, int targetwidth, int targetheight, int* newwidth, int* newheight)
 {
     gfxdevice_t*dev = i->dev;
-    RGBA*newpic = 0;
     RGBA*mem = (RGBA*)img->data;
     
     int sizex = img->width;
@@ -2284,58 +2728,53 @@ static int add_image(swfoutput_internal*i, gfximage_t*img, int targetwidth, int
     if(newsizey<=0)
 	newsizey = 1;
 
-    /* TODO: cache images */
+    /* the same image might have been used on a previous page (or earlier on this page) */
+    U32 hash = 0;
+    if(i->config_imagecachesize) {
+	hash = hashImage(mem, sizex, sizey);
+	int cacheid = imageInCache(i, hash, mem, sizex, sizey, newsizex, newsizey, newwidth, newheight);
+	if(cacheid>0) {
+	    msg("<verbose> Reusing %dx%d image (id %d)", sizex, sizey, cacheid);
+	    return cacheid;
+	}
+    }
+    int cachesizex = newsizex, cachesizey = newsizey;
     
     if(newsizex<sizex || newsizey<sizey) {
 	msg("<verbose> Scaling %dx%d image to %dx%d", sizex, sizey, newsizex, newsizey);
-	gfximage_t*ni = gfximage_rescale(img, newsizex, newsizey);
-	newpic = (RGBA*)ni->data;
-	free(ni);
-	*newwidth = sizex = newsizex;
-	*newheight  = sizey = newsizey;
-	mem = newpic;
     } else {
-	*newwidth = newsizex = sizex;
-	*newheight = newsizey  = sizey;
-    }
-
-    int num_colors = swf_ImageGetNumberOfPaletteEntries(mem,sizex,sizey,0);
-    int has_alpha = swf_ImageHasAlpha(mem,sizex,sizey);
-    
-    msg("<verbose> Drawing %dx%d %s%simage (id %d) at size %dx%d (%dx%d), %s%d colors",
-	    sizex, sizey, 
-	    has_alpha?(has_alpha==2?"semi-transparent ":"transparent "):"", 
-	    is_jpeg?"jpeg-":"", i->currentswfid+1,
-	    newsizex, newsizey,
-	    targetwidth, targetheight,
-	    /*newsizex, newsizey,*/
-	    num_colors>256?">":"", num_colors>256?256:num_colors);
-
-    /*RGBA* pal = (RGBA*)rfx_alloc(sizeof(RGBA)*num_colors);
-    swf_ImageGetNumberOfPaletteEntries(mem,sizex,sizey,pal);
-    int t;
-    for(t=0;t<num_colors;t++) {
-	printf("%02x%02x%02x%02x ",
-		pal[t].r, pal[t].g, pal[t].b, pal[t].a);
-	if((t&7)==7)
-	    printf("\n");
-    }
-    printf("\n");*/
-
-    int bitid = -1;
-    int cacheid = imageInCache(dev, mem, sizex, sizey);
-
-    if(cacheid<=0) {
-	bitid = getNewID(dev);
-
-	i->tag = swf_AddImage(i->tag, bitid, mem, sizex, sizey, i->config_jpegquality);
-	addImageToCache(dev, mem, sizex, sizey);
+	newsizex = sizex;
+	newsizey = sizey;
+    }
+    *newwidth = newsizex;
+    *newheight = newsizey;
+
+    int bitid = getNewID(dev);
+
+    imagejob_t*job = (imagejob_t*)rfx_calloc(sizeof(imagejob_t));
+    job->img = *img;
+    job->newwidth = newsizex;
+    job->newheight = newsizey;
+    job->targetwidth = targetwidth;
+    job->targetheight = targetheight;
+    job->is_jpeg = is_jpeg;
+    job->bitid = bitid;
+    job->quality = i->config_jpegquality;
+    job->scalefilter = i->config_scalefilter;
+    job->scalethreads = i->config_scalethreads;
+    job->prediction = i->config_imageprediction;
+    job->parallel = i->config_parallelimages;
+
+    if(i->config_imagecachesize) {
+	addImageToCache(i, hash, mem, sizex, sizey, cachesizex, cachesizey, bitid, *newwidth, *newheight);
+    }
+
+    if(i->config_imagethreads > 0) {
+	queue_image(i, job);
     } else {
-	bitid = cacheid;
+	encode_image(job);
+	finish_image(i, job);
     }
-
-    if(newpic)
-	free(newpic);
     return bitid;
 }
 
@@ -3186,10 +3625,96 @@ static void swf_drawchar(gfxdevice_t*dev, gfxfont_t*font, int glyph, gfxcolor_t*
 	    // use "multiply" blend mode
 	    color2.a = color2.r = color2.g = color2.b = 255;
 	}
-	i->topchardata = charbuffer_append(i->topchardata, i->swffont, glyph, x, y, i->current_font_size, color2, &i->fontmatrix);
+	i->topchardata = charbuffer_append(i->topchardata, i->swffont, glyph, x, y, i->current_font_size, color2, &i->fontmatrix, i->config_flashversion);
     } else {
-	i->chardata = charbuffer_append(i->chardata, i->swffont, glyph, x, y, i->current_font_size, *(RGBA*)color, &i->fontmatrix);
+	i->chardata = charbuffer_append(i->chardata, i->swffont, glyph, x, y, i->current_font_size, *(RGBA*)color, &i->fontmatrix, i->config_flashversion);
     }
     swf_FontUseGlyph(i->swffont, glyph, i->current_font_size);
     return;
 }
+
+#ifdef MAIN
+/* draws the same semi-transparent bitmap twice, and checks that it's only
+   stored once, and that the output doesn't depend on whether images are
+   encoded in the background. Build with something like
+   gcc -DMAIN -I../.. swf.c ../libgfx.a ../librfxswf.a ../libbase.a -ljpeg -lz -lm -lpthread -o swf_imagecache */
+
+static int count_images(gfxresult_t*result)
+{
+    SWF*swf = (SWF*)result->get(result, "swf");
+    TAG*tag;
+    int num = 0;
+    for(tag=swf->firstTag;tag;tag=tag->next) {
+	if(swf_isImageTag(tag))
+	    num++;
+    }
+    return num;
+}
+
+static int test_imagecache(const char*imagethreads, const char*filename)
+{
+    gfxdevice_t dev;
+    gfximage_t img;
+    gfxmatrix_t m;
+    gfxcolor_t*data = (gfxcolor_t*)malloc(64*64*sizeof(gfxcolor_t));
+    int t;
+    for(t=0;t<64*64;t++) {
+	data[t].r = t;
+	data[t].g = t>>4;
+	data[t].b = 0x40;
+	data[t].a = 0x80 + (t&0x3f);
+    }
+    memset(&img, 0, sizeof(img));
+    img.data = data;
+    img.width = img.height = 64;
+    gfxmatrix_unit(&m);
+
+    gfxdevice_swf_init(&dev);
+    dev.setparameter(&dev, "imagethreads", imagethreads);
+    dev.startpage(&dev, 200, 200);
+    for(t=0;t<2;t++) {
+	gfxline_t*line = gfxline_makerectangle(0, 0, 64, 64);
+	dev.fillbitmap(&dev, line, &img, &m, 0);
+	gfxline_free(line);
+    }
+    dev.endpage(&dev);
+    gfxresult_t*result = dev.finish(&dev);
+    int num = count_images(result);
+    result->save(result, filename);
+    result->destroy(result);
+    free(data);
+
+    printf("imagethreads=%s: %d image tag(s) %s\n", imagethreads, num, num==1?"ok":"FAILED");
+    return num==1;
+}
+
+static int same_file(const char*file1, const char*file2)
+{
+    FILE*fi1 = fopen(file1, "rb");
+    FILE*fi2 = fopen(file2, "rb");
+    int same = fi1 && fi2;
+    while(same) {
+	int c1 = fgetc(fi1), c2 = fgetc(fi2);
+	if(c1 != c2)
+	    same = 0;
+	if(c1 == EOF)
+	    break;
+    }
+    if(fi1) fclose(fi1);
+    if(fi2) fclose(fi2);
+    return same;
+}
+
+int main()
+{
+    int ok = test_imagecache("0", "imagecache0.swf");
+    ok &= test_imagecache("4", "imagecache4.swf");
+    if(!same_file("imagecache0.swf", "imagecache4.swf")) {
+	printf("output differs between imagethreads=0 and imagethreads=4\n");
+	ok = 0;
+    }
+    unlink("imagecache0.swf");
+    unlink("imagecache4.swf");
+    return ok?0:1;
+}
+#endif
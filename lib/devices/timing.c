@@ -0,0 +1,157 @@
+/* timing.c
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <memory.h>
+#include <string.h>
+#include "../types.h"
+#include "../mem.h"
+#include "../gfxdevice.h"
+#include "../stats.h"
+#include "timing.h"
+
+typedef struct _internal {
+    gfxdevice_t*out;
+} internal_t;
+
+static int timing_setparameter(struct _gfxdevice*dev, const char*key, const char*value)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    return i->out->setparameter(i->out,key,value);
+}
+
+static void timing_startpage(struct _gfxdevice*dev, int width, int height)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    stats_startpage(width, height);
+    i->out->startpage(i->out,width,height);
+}
+
+static void timing_startclip(struct _gfxdevice*dev, gfxline_t*line)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->startclip(i->out,line);
+    STATS_END(STATS_STARTCLIP, t);
+}
+
+static void timing_endclip(struct _gfxdevice*dev)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->endclip(i->out);
+    STATS_END(STATS_ENDCLIP, t);
+}
+
+static void timing_stroke(struct _gfxdevice*dev, gfxline_t*line, gfxcoord_t width, gfxcolor_t*color, gfx_capType cap_style, gfx_joinType joint_style, gfxcoord_t miterLimit)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->stroke(i->out, line, width, color, cap_style, joint_style, miterLimit);
+    STATS_END(STATS_STROKE, t);
+}
+
+static void timing_fill(struct _gfxdevice*dev, gfxline_t*line, gfxcolor_t*color)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->fill(i->out, line, color);
+    STATS_END(STATS_FILL, t);
+}
+
+static void timing_fillbitmap(struct _gfxdevice*dev, gfxline_t*line, gfximage_t*img, gfxmatrix_t*matrix, gfxcxform_t*cxform)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->fillbitmap(i->out, line, img, matrix, cxform);
+    STATS_END(STATS_FILLBITMAP, t);
+}
+
+static void timing_fillgradient(struct _gfxdevice*dev, gfxline_t*line, gfxgradient_t*gradient, gfxgradienttype_t type, gfxmatrix_t*matrix)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->fillgradient(i->out, line, gradient, type, matrix);
+    STATS_END(STATS_FILLGRADIENT, t);
+}
+
+static void timing_addfont(struct _gfxdevice*dev, gfxfont_t*font)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->addfont(i->out, font);
+    STATS_END(STATS_ADDFONT, t);
+}
+
+static void timing_drawchar(struct _gfxdevice*dev, gfxfont_t*font, int glyphnr, gfxcolor_t*color, gfxmatrix_t*matrix)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->drawchar(i->out, font, glyphnr, color, matrix);
+    STATS_END(STATS_DRAWCHAR, t);
+}
+
+static void timing_drawlink(struct _gfxdevice*dev, gfxline_t*line, const char*action, const char*text)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    STATS_START(t);
+    i->out->drawlink(i->out, line, action, text);
+    STATS_END(STATS_DRAWLINK, t);
+}
+
+static void timing_endpage(struct _gfxdevice*dev)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    i->out->endpage(i->out);
+    stats_endpage();
+}
+
+static gfxresult_t* timing_finish(struct _gfxdevice*dev)
+{
+    internal_t*i = (internal_t*)dev->internal;
+    gfxdevice_t*out = i->out;
+    free(dev->internal);dev->internal = 0;i=0;
+    return out->finish(out);
+}
+
+void gfxdevice_timing_init(gfxdevice_t*dev, gfxdevice_t*out)
+{
+    internal_t*i = (internal_t*)rfx_calloc(sizeof(internal_t));
+    memset(dev, 0, sizeof(gfxdevice_t));
+
+    dev->name = "timing";
+
+    dev->internal = i;
+
+    dev->setparameter = timing_setparameter;
+    dev->startpage = timing_startpage;
+    dev->startclip = timing_startclip;
+    dev->endclip = timing_endclip;
+    dev->stroke = timing_stroke;
+    dev->fill = timing_fill;
+    dev->fillbitmap = timing_fillbitmap;
+    dev->fillgradient = timing_fillgradient;
+    dev->addfont = timing_addfont;
+    dev->drawchar = timing_drawchar;
+    dev->drawlink = timing_drawlink;
+    dev->endpage = timing_endpage;
+    dev->finish = timing_finish;
+
+    i->out = out;
+}
@@ -123,6 +123,7 @@ static void pass2_drawchar(gfxfilter_t*f, gfxfont_t*font, int glyphnr, gfxcolor_
 	out->drawchar(out, font, 1, &red, &m2);*/
 	gfxline_t*line = gfxline_makerectangle(0, 0, 1, 1);
 	gfximage_t img;
+	memset(&img, 0, sizeof(img));
 	img.data = color;
 	img.width = 1;
 	img.height = 1;
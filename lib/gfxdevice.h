@@ -63,6 +63,14 @@ typedef struct _gfximage
     gfxcolor_t*data;
     unsigned width;
     unsigned height;
+
+    /* optional: the (baseline) JPEG stream data was decoded from. Devices may
+       store this instead of recompressing data, as long as they don't
+       need to modify the pixels. Not owned by the image, and only valid
+       during the call it's passed to. Filters which change the pixels
+       must not pass it on. */
+    const unsigned char*jpeg;
+    int jpeg_size;
 } gfximage_t;
 
 /* gradients: A radial gradient will start at 0,0 and have a radius of 1,0 
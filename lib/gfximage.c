@@ -4,11 +4,16 @@
 #include <memory.h>
 #include <assert.h>
 #include "../config.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "jpeg.h"
 #include "png.h"
 #include "mem.h"
+#include "palette.h"
 #include "gfximage.h"
 #include "types.h"
+#include "os.h"
 #ifdef HAVE_FFTW3
 #include <fftw3.h>
 #endif
@@ -244,31 +249,13 @@ void blurImage(gfxcolor_t*src, int width, int height, int r)
     rfx_free(gauss);
 }
 
+/* returns 1, 2 or (for images with more than two colors) width*height */
 int gfximage_getNumberOfPaletteEntries(gfximage_t*img)
 {
-    int width = img->width;
-    int height = img->height;
-
-    int size = width*height;
-    int t;
-    U32* data = (U32*)img->data;
-    U32 color1 = data[0];
-    U32 color2 = 0;
-    for(t=1;t<size;t++) {
-	if(data[t] != color1) {
-	    color2 = data[t];
-	    break;
-	}
-    }
-    if(t==size)
-	return 1;
-
-    for(;t<size;t++) {
-	if(data[t] != color1 && data[t] != color2) {
-	    return width*height;
-	}
-    }
-    return 2;
+    int num = palette_count_colors(img->data, img->width*img->height, 2, 0, 0);
+    if(num<0)
+	return img->width*img->height;
+    return num;
 }
 
 gfximage_t* gfximage_rescale_old(gfximage_t*image, int newwidth, int newheight)
@@ -363,7 +350,7 @@ gfximage_t* gfximage_rescale_old(gfximage_t*image, int newwidth, int newheight)
     rfx_free(*lblocky);
     rfx_free(lblocky);
 
-    gfximage_t*image2 = (gfximage_t*)malloc(sizeof(gfximage_t));
+    gfximage_t*image2 = (gfximage_t*)rfx_calloc(sizeof(gfximage_t));
     image2->data = newdata;
     image2->width = newwidth;
     image2->height = newheight;
@@ -460,7 +447,7 @@ gfximage_t* gfximage_rescale_fft(gfximage_t*image, int newwidth, int newheight)
     if(monochrome)
 	decodeMonochromeImage(rgba_new, newwidth, newheight, monochrome_colors);
 
-    gfximage_t*image2 = (gfximage_t*)malloc(sizeof(gfximage_t));
+    gfximage_t*image2 = (gfximage_t*)rfx_calloc(sizeof(gfximage_t));
     image2->data = rgba_new;
     image2->width = newwidth;
     image2->height = newheight;
@@ -468,18 +455,308 @@ gfximage_t* gfximage_rescale_fft(gfximage_t*image, int newwidth, int newheight)
 }
 #endif
 
-#ifdef HAVE_FFTW3
-gfximage_t* gfximage_rescale(gfximage_t*image, int newwidth, int newheight)
+/* ------------------------- separable resampler ---------------------------- 
+
+   Scales horizontally first, into 16 bit intermediate rows (8.7 fixed point,
+   kept in a small ring buffer), then vertically. Filter weights are 14 bit 
+   fixed point. Both passes work on pairs of taps, which maps onto pmaddwd
+   if SSE2 is available; the plain C versions compute exactly the same
+   results. Horizontal bands of the destination image can be processed by
+   separate threads.
+*/
+
+#define WEIGHT_BITS 14
+#define INTERMEDIATE_BITS 7
+
+typedef struct _filter_table {
+    int*start;      // first source pixel
+    int*num;        // number of taps
+    S16*weights;    // maxnum weights per destination pixel
+    int maxnum;
+} filter_table_t;
+
+static double filter_triangle(double x)
 {
-    //return gfximage_rescale_fft(image, newwidth, newheight);
-    return gfximage_rescale_old(image, newwidth, newheight);
+    if(x<0) x=-x;
+    return x<1.0 ? 1.0-x : 0.0;
 }
+static double filter_lanczos3(double x)
+{
+    if(x==0) return 1.0;
+    if(x<=-3.0 || x>=3.0) return 0.0;
+    x *= M_PI;
+    return 3.0*sin(x)*sin(x/3.0)/(x*x);
+}
+
+static filter_table_t* make_filter_table(int size, int newsize, int filter)
+{
+    double scale = (double)size/(double)newsize;
+    double fscale = scale>1.0 ? scale : 1.0;
+    double support;
+    if(filter == GFXIMAGE_FILTER_LANCZOS)
+	support = 3.0*fscale;
+    else if(filter == GFXIMAGE_FILTER_BOX && scale>1.0)
+	support = scale/2.0;
+    else
+	support = fscale;
+
+    filter_table_t*t = (filter_table_t*)rfx_calloc(sizeof(filter_table_t));
+    t->maxnum = (int)ceil(support*2)+2;
+    if(t->maxnum > size)
+	t->maxnum = size;
+    t->start = (int*)rfx_alloc(newsize*sizeof(int));
+    t->num = (int*)rfx_alloc(newsize*sizeof(int));
+    t->weights = (S16*)rfx_calloc(newsize*t->maxnum*sizeof(S16));
+    double*w = (double*)rfx_alloc(t->maxnum*sizeof(double));
+
+    int i;
+    for(i=0;i<newsize;i++) {
+	double center = (i+0.5)*scale;
+	int x1 = (int)floor(center-support);
+	int x2 = (int)ceil(center+support);
+	if(x1<0) x1=0;
+	if(x2>size) x2=size;
+	if(x2-x1 > t->maxnum) x2 = x1+t->maxnum;
+	double sum = 0;
+	int x;
+	for(x=x1;x<x2;x++) {
+	    double v;
+	    if(filter == GFXIMAGE_FILTER_BOX && scale>1.0) {
+		/* overlap of the source pixel with the destination pixel */
+		double l = x > center-support ? x : center-support;
+		double r = x+1 < center+support ? x+1 : center+support;
+		v = r>l ? r-l : 0;
+	    } else if(filter == GFXIMAGE_FILTER_LANCZOS) {
+		v = filter_lanczos3((x+0.5-center)/fscale);
+	    } else {
+		v = filter_triangle((x+0.5-center)/fscale);
+	    }
+	    w[x-x1] = v;
+	    sum += v;
+	}
+	if(sum==0) {
+	    /* can only happen when enlarging with the box filter at the border */
+	    x1 = (int)center;
+	    if(x1>=size) x1=size-1;
+	    x2 = x1+1;
+	    w[0] = sum = 1.0;
+	}
+	int num = x2-x1;
+	/* convert to fixed point, making sure the weights sum up to exactly 1.0 */
+	S16*fw = &t->weights[i*t->maxnum];
+	int isum = 0, imax = 0;
+	for(x=0;x<num;x++) {
+	    fw[x] = (S16)floor(w[x]/sum*(1<<WEIGHT_BITS)+0.5);
+	    isum += fw[x];
+	    if(fw[x] > fw[imax])
+		imax = x;
+	}
+	fw[imax] += (1<<WEIGHT_BITS) - isum;
+	t->start[i] = x1;
+	t->num[i] = num;
+    }
+    free(w);
+    return t;
+}
+
+static void filter_table_destroy(filter_table_t*t)
+{
+    free(t->start);
+    free(t->num);
+    free(t->weights);
+    free(t);
+}
+
+/* scale one row horizontally, into 8.7 fixed point */
+static void rescale_row(const gfxcolor_t*src, S16*dest, filter_table_t*t, int newwidth)
+{
+    int x;
+    for(x=0;x<newwidth;x++) {
+	const U8*p = (const U8*)&src[t->start[x]];
+	const S16*w = &t->weights[x*t->maxnum];
+	int num = t->num[x];
+	int k;
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+	__m128i zero = _mm_setzero_si128();
+	for(k=0;k<num;k+=2) {
+	    /* interleave the channels of two neighboring pixels, a0 a1 r0 r1 g0 g1 b0 b1 */
+	    __m128i p0 = _mm_cvtsi32_si128(*(const int*)&p[k*4]);
+	    __m128i p1 = k+1<num ? _mm_cvtsi32_si128(*(const int*)&p[k*4+4]) : zero;
+	    __m128i pp = _mm_unpacklo_epi8(_mm_unpacklo_epi8(p0, p1), zero);
+	    __m128i ww = _mm_set1_epi32((U16)w[k] | (k+1<num ? (U32)(U16)w[k+1]<<16 : 0));
+	    acc = _mm_add_epi32(acc, _mm_madd_epi16(pp, ww));
+	}
+	acc = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1<<(WEIGHT_BITS-INTERMEDIATE_BITS-1))), 
+		             WEIGHT_BITS-INTERMEDIATE_BITS);
+	_mm_storel_epi64((__m128i*)&dest[x*4], _mm_packs_epi32(acc, acc));
 #else
+	int c;
+	for(c=0;c<4;c++) {
+	    int acc = 0;
+	    for(k=0;k<num;k++) {
+		acc += p[k*4+c]*w[k];
+	    }
+	    acc = (acc + (1<<(WEIGHT_BITS-INTERMEDIATE_BITS-1))) >> (WEIGHT_BITS-INTERMEDIATE_BITS);
+	    dest[x*4+c] = acc<-32768 ? -32768 : (acc>32767 ? 32767 : acc);
+	}
+#endif
+    }
+}
+
+/* combine intermediate rows into one destination row */
+static void rescale_column(S16**rows, const S16*w, int num, gfxcolor_t*dest, int newwidth)
+{
+    int len = newwidth*4;
+    int x = 0, k;
+    const int round = 1<<(WEIGHT_BITS+INTERMEDIATE_BITS-1);
+    U8*d = (U8*)dest;
+#ifdef __SSE2__
+    for(;x+8<=len;x+=8) {
+	__m128i acc1 = _mm_setzero_si128();
+	__m128i acc2 = _mm_setzero_si128();
+	for(k=0;k<num;k+=2) {
+	    __m128i r0 = _mm_loadu_si128((const __m128i*)&rows[k][x]);
+	    __m128i r1 = k+1<num ? _mm_loadu_si128((const __m128i*)&rows[k+1][x]) : _mm_setzero_si128();
+	    __m128i ww = _mm_set1_epi32((U16)w[k] | (k+1<num ? (U32)(U16)w[k+1]<<16 : 0));
+	    acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), ww));
+	    acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), ww));
+	}
+	acc1 = _mm_srai_epi32(_mm_add_epi32(acc1, _mm_set1_epi32(round)), WEIGHT_BITS+INTERMEDIATE_BITS);
+	acc2 = _mm_srai_epi32(_mm_add_epi32(acc2, _mm_set1_epi32(round)), WEIGHT_BITS+INTERMEDIATE_BITS);
+	__m128i v = _mm_packs_epi32(acc1, acc2);
+	_mm_storel_epi64((__m128i*)&d[x], _mm_packus_epi16(v, v));
+    }
+#endif
+    for(;x<len;x++) {
+	int acc = 0;
+	for(k=0;k<num;k++) {
+	    acc += rows[k][x]*w[k];
+	}
+	acc = (acc + round) >> (WEIGHT_BITS+INTERMEDIATE_BITS);
+	d[x] = acc<0 ? 0 : (acc>255 ? 255 : acc);
+    }
+}
+
+typedef struct _rescale_job {
+    gfxcolor_t*src;
+    int width;
+    gfxcolor_t*dest;
+    int newwidth;
+    filter_table_t*tx;
+    filter_table_t*ty;
+    int y1, y2; // destination rows to process
+} rescale_job_t;
+
+static void* rescale_band(void*_job)
+{
+    rescale_job_t*job = (rescale_job_t*)_job;
+    filter_table_t*ty = job->ty;
+    int ringsize = ty->maxnum;
+    int rowlen = job->newwidth*4;
+    S16*ring = (S16*)rfx_alloc(ringsize*rowlen*sizeof(S16));
+    int*ringy = (int*)rfx_alloc(ringsize*sizeof(int));
+    S16**rows = (S16**)rfx_alloc(ringsize*sizeof(S16*));
+    int k,y;
+    for(k=0;k<ringsize;k++)
+	ringy[k] = -1;
+
+    for(y=job->y1;y<job->y2;y++) {
+	int start = ty->start[y];
+	int num = ty->num[y];
+	for(k=0;k<num;k++) {
+	    int sy = start+k;
+	    int slot = sy%ringsize;
+	    S16*row = &ring[slot*rowlen];
+	    if(ringy[slot] != sy) {
+		rescale_row(&job->src[sy*job->width], row, job->tx, job->newwidth);
+		ringy[slot] = sy;
+	    }
+	    rows[k] = row;
+	}
+	rescale_column(rows, &ty->weights[y*ty->maxnum], num, &job->dest[y*job->newwidth], job->newwidth);
+    }
+    free(rows);
+    free(ringy);
+    free(ring);
+    return 0;
+}
+
+gfximage_t* gfximage_rescale2(gfximage_t*image, int newwidth, int newheight, int filter, int threads)
+{
+    int monochrome = 0;
+    gfxcolor_t monochrome_colors[2];
+   
+    if(newwidth<1)
+	newwidth=1;
+    if(newheight<1)
+	newheight=1;
+    if(threads<=0)
+	threads = os_get_number_of_cpus();
+    if(threads>newheight)
+	threads = newheight;
+
+    int width = image->width;
+    int height = image->height;
+    gfxcolor_t*data = image->data;
+
+    if(gfximage_getNumberOfPaletteEntries(image) == 2) {
+	monochrome=1;
+	encodeMonochromeImage(data, width, height, monochrome_colors);
+        int r1 = width / newwidth;
+        int r2 = height / newheight;
+        int r = r1<r2?r1:r2;
+        if(r>4) {
+            /* high-resolution monochrome images are usually dithered, so 
+               low-pass filter them first to get rid of any moire patterns */
+            blurImage(data, width, height, r+1);
+        }
+    }
+
+    gfxcolor_t*newdata = (gfxcolor_t*)rfx_alloc(newwidth*newheight*sizeof(gfxcolor_t));
+    filter_table_t*tx = make_filter_table(width, newwidth, filter);
+    filter_table_t*ty = make_filter_table(height, newheight, filter);
+
+    rescale_job_t*jobs = (rescale_job_t*)rfx_calloc(threads*sizeof(rescale_job_t));
+    thread_t**t = (thread_t**)rfx_calloc(threads*sizeof(thread_t*));
+    int i;
+    for(i=0;i<threads;i++) {
+	jobs[i].src = data;
+	jobs[i].width = width;
+	jobs[i].dest = newdata;
+	jobs[i].newwidth = newwidth;
+	jobs[i].tx = tx;
+	jobs[i].ty = ty;
+	jobs[i].y1 = newheight*i/threads;
+	jobs[i].y2 = newheight*(i+1)/threads;
+	if(i<threads-1)
+	    t[i] = thread_start(rescale_band, &jobs[i]);
+	else
+	    rescale_band(&jobs[i]);
+    }
+    for(i=0;i<threads-1;i++)
+	thread_join(t[i]);
+    free(t);
+    free(jobs);
+
+    filter_table_destroy(tx);
+    filter_table_destroy(ty);
+
+    if(monochrome)
+	decodeMonochromeImage(newdata, newwidth, newheight, monochrome_colors);
+
+    gfximage_t*image2 = (gfximage_t*)rfx_calloc(sizeof(gfximage_t));
+    image2->data = newdata;
+    image2->width = newwidth;
+    image2->height = newheight;
+    return image2;
+}
+
 gfximage_t* gfximage_rescale(gfximage_t*image, int newwidth, int newheight)
 {
-    return gfximage_rescale_old(image, newwidth, newheight);
+    //return gfximage_rescale_fft(image, newwidth, newheight);
+    return gfximage_rescale2(image, newwidth, newheight, GFXIMAGE_FILTER_BOX, 1);
 }
-#endif
 
 bool gfximage_has_alpha(gfximage_t*img)
 {
@@ -500,3 +777,143 @@ void gfximage_free(gfximage_t*b)
     free(b);
 }
 
+
+#ifdef MAIN
+/* quality/speed comparison of the rescalers. The psnr column is measured against
+   an exact area average, so it favors the box filter- for bilinear and lanczos
+   it mostly shows how much aliasing they let through. Build with something like
+   gcc -DMAIN -I.. gfximage.c libbase.a -ljpeg -lz -lpthread -lm -o gfximage_bench */
+
+#include <sys/time.h>
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static gfximage_t* make_test_image(int type, int width, int height)
+{
+    gfximage_t*img = gfximage_new(width, height);
+    int x,y;
+    for(y=0;y<height;y++)
+    for(x=0;x<width;x++) {
+	gfxcolor_t*c = &img->data[y*width+x];
+	double fx = (double)x/width, fy = (double)y/height;
+	if(type==0) {
+	    /* photo-like: gradients, some texture, some noise */
+	    c->r = (int)(128+100*sin(fx*7+fy*3)) + (lrand48()%9) - 4;
+	    c->g = (int)(128+90*cos(fx*4-fy*9)*sin(fx*40)) + (lrand48()%9) - 4;
+	    c->b = (int)(255*fy);
+	    c->a = 255;
+	} else if(type==1) {
+	    /* zone plate: every frequency, lots of potential for aliasing */
+	    double dx = x-width/2, dy = y-height/2;
+	    int v = (int)(127.5+127.5*cos((dx*dx+dy*dy)*M_PI/(width*2)));
+	    c->r = c->g = c->b = v;
+	    c->a = 255;
+	} else {
+	    /* text-like: hard edges */
+	    int v = ((x/3+y/7)%11 < 3 || (x%23)<2) ? 0 : 255;
+	    c->r = c->g = v;
+	    c->b = 255-v/2;
+	    c->a = (y%50)<40 ? 255 : 128;
+	}
+    }
+    return img;
+}
+
+/* exact area average (or, when enlarging, bilinear interpolation) in floating point */
+static double* reference_rescale(gfximage_t*img, int newwidth, int newheight)
+{
+    double*out = (double*)rfx_calloc(newwidth*newheight*4*sizeof(double));
+    double*tmp = (double*)rfx_calloc(newwidth*img->height*4*sizeof(double));
+    int pass;
+    for(pass=0;pass<2;pass++) {
+	int size = pass ? img->height : img->width;
+	int newsize = pass ? newheight : newwidth;
+	int lines = pass ? newwidth : img->height;
+	double scale = (double)size/newsize;
+	int l,i,c;
+	for(l=0;l<lines;l++)
+	for(i=0;i<newsize;i++) {
+	    double sum[4] = {0,0,0,0}, wsum = 0;
+	    int j;
+	    double c1 = i*scale, c2 = (i+1)*scale, center = (i+0.5)*scale;
+	    for(j=(int)c1-1;j<=(int)c2+1;j++) {
+		double w;
+		if(j<0 || j>=size) continue;
+		if(scale>1) {
+		    double a = j>c1?j:c1, b = j+1<c2?j+1:c2;
+		    w = b>a ? b-a : 0;
+		} else {
+		    w = filter_triangle(j+0.5-center);
+		}
+		for(c=0;c<4;c++) {
+		    double v = pass ? tmp[(j*newwidth+l)*4+c] : ((U8*)&img->data[l*img->width+j])[c];
+		    sum[c] += v*w;
+		}
+		wsum += w;
+	    }
+	    for(c=0;c<4;c++) {
+		if(pass)
+		    out[(i*newwidth+l)*4+c] = sum[c]/wsum;
+		else
+		    tmp[(l*newwidth+i)*4+c] = sum[c]/wsum;
+	    }
+	}
+    }
+    free(tmp);
+    return out;
+}
+
+static double psnr(gfximage_t*img, double*ref)
+{
+    int len = img->width*img->height*4;
+    double err = 0;
+    int t;
+    for(t=0;t<len;t++) {
+	double d = ((U8*)img->data)[t] - ref[t];
+	err += d*d;
+    }
+    err /= len;
+    return err>0 ? 10*log10(255*255/err) : 99.0;
+}
+
+int main(int argn, char*argv[])
+{
+    int width = 2000, height = 1500;
+    double factors[] = {0.5, 0.37, 0.1, 1.7};
+    char*names[] = {"photo", "zoneplate", "text"};
+    char*methods[] = {"old", "box", "bilinear", "lanczos", "box/4 threads"};
+    int type,f,m;
+    printf("%-10s %-7s %-14s %10s %10s\n", "image", "factor", "method", "ms", "psnr");
+    for(type=0;type<3;type++) 
+    for(f=0;f<sizeof(factors)/sizeof(factors[0]);f++) {
+	gfximage_t*img = make_test_image(type, width, height);
+	int newwidth = (int)(width*factors[f]);
+	int newheight = (int)(height*factors[f]);
+	double*ref = reference_rescale(img, newwidth, newheight);
+	for(m=0;m<5;m++) {
+	    gfximage_t*scaled = 0;
+	    double best = 1e10;
+	    int run;
+	    for(run=0;run<3;run++) {
+		double t0 = seconds();
+		if(scaled) gfximage_free(scaled);
+		if(m==0) scaled = gfximage_rescale_old(img, newwidth, newheight);
+		else if(m==4) scaled = gfximage_rescale2(img, newwidth, newheight, GFXIMAGE_FILTER_BOX, 4);
+		else scaled = gfximage_rescale2(img, newwidth, newheight, m-1, 1);
+		double t = seconds()-t0;
+		if(t<best) best = t;
+	    }
+	    printf("%-10s %-7.2f %-14s %10.1f %10.2f\n", names[type], factors[f], methods[m], best*1000, psnr(scaled, ref));
+	    gfximage_free(scaled);
+	}
+	free(ref);
+	gfximage_free(img);
+    }
+    return 0;
+}
+#endif
@@ -9,6 +9,12 @@ void gfximage_save_jpeg(gfximage_t*image, const char*filename, int quality);
 void gfximage_save_png(gfximage_t*image, const char*filename);
 void gfximage_save_png_quick(gfximage_t*image, const char*filename);
 gfximage_t* gfximage_rescale(gfximage_t*image, int newwidth, int newheight);
+
+#define GFXIMAGE_FILTER_BOX 0      // area average when shrinking, bilinear when enlarging
+#define GFXIMAGE_FILTER_BILINEAR 1
+#define GFXIMAGE_FILTER_LANCZOS 2  // lanczos3
+/* threads: number of horizontal bands to process concurrently (0 = number of cpus) */
+gfximage_t* gfximage_rescale2(gfximage_t*image, int newwidth, int newheight, int filter, int threads);
 bool gfximage_has_alpha(gfximage_t*image);
 void gfximage_free(gfximage_t*b);
 
@@ -5,6 +5,7 @@
 #include <time.h>
 #include "../mem.h"
 #include "../types.h"
+#include "../stats.h"
 #include "poly.h"
 #include "active.h"
 #include "xrow.h"
@@ -1503,6 +1504,7 @@ static void check_status(status_t*status)
 
 gfxpoly_t* gfxpoly_process(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule, windcontext_t*context, moments_t*moments)
 {
+    STATS_START(starttime);
     current_polygon = poly1;
 
     status_t status;
@@ -1603,6 +1605,7 @@ gfxpoly_t* gfxpoly_process(gfxpoly_t*poly1, gfxpoly_t*poly2, windrule_t*windrule
 	stroke = stroke->next;
     }
 #endif
+    STATS_END(STATS_POLY_PROCESS, starttime);
     return p;
 }
 
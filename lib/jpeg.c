@@ -76,6 +76,48 @@ static void mem_term_destination(j_compress_ptr cinfo)
   dmgr->free_in_buffer = 0;
 }
 
+/* feed an rgb (components=3) or argb (components=4) image to libjpeg.
+   With libjpeg-turbo, argb rows are passed without converting them first. */
+static void compress_image(struct jpeg_compress_struct*cinfo, unsigned char*data, unsigned width, unsigned height, int quality, int components)
+{
+    int t;
+    cinfo->image_width  = width;
+    cinfo->image_height = height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+#ifdef JCS_EXTENSIONS
+    if(components == 4) {
+        cinfo->input_components = 4;
+        cinfo->in_color_space = JCS_EXT_XRGB;
+    }
+#endif
+    jpeg_set_defaults(cinfo);
+    cinfo->dct_method = JDCT_IFAST;
+    jpeg_set_quality(cinfo,quality,TRUE);
+
+    jpeg_start_compress(cinfo, FALSE);
+    if(cinfo->input_components == components) {
+        for(t=0;t<height;t++) {
+            unsigned char*data2 = &data[width*components*t];
+            jpeg_write_scanlines(cinfo, &data2, 1);
+        }
+    } else {
+        unsigned char*data2 = malloc(width*3);
+        for(t=0;t<height;t++) {
+            unsigned char*line = &data[width*4*t];
+            int x;
+            for(x=0;x<width;x++) {
+                data2[x*3+0] = line[x*4+1];
+                data2[x*3+1] = line[x*4+2];
+                data2[x*3+2] = line[x*4+3];
+            }
+            jpeg_write_scanlines(cinfo, &data2, 1);
+        }
+        free(data2);
+    }
+    jpeg_finish_compress(cinfo);
+}
+
 int jpeg_save(unsigned char*data, unsigned width, unsigned height, int quality, const char*filename)
 {
   struct jpeg_destination_mgr mgr;
@@ -211,7 +253,6 @@ int jpeg_save_to_mem(unsigned char*data, unsigned width, unsigned height, int qu
     struct jpeg_destination_mgr mgr;
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
-    int t;
 
     memset(&cinfo, 0, sizeof(cinfo));
     memset(&jerr, 0, sizeof(jerr));
@@ -228,40 +269,12 @@ int jpeg_save_to_mem(unsigned char*data, unsigned width, unsigned height, int qu
     mgr.term_destination = mem_term_destination;
     cinfo.dest = &mgr;
 
-    // init compression
-
-    cinfo.image_width  = width;
-    cinfo.image_height = height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-    jpeg_set_defaults(&cinfo);
-    cinfo.dct_method = JDCT_IFAST;
-    jpeg_set_quality(&cinfo,quality,TRUE);
-
-    jpeg_start_compress(&cinfo, FALSE);
-    if(components == 3) {
-        for(t=0;t<height;t++) {
-            unsigned char*data2 = &data[width*3*t];
-            jpeg_write_scanlines(&cinfo, &data2, 1);
-        }
-    } else if(components == 4) {
-        unsigned char*data2 = malloc(width*3);
-        for(t=0;t<height;t++) {
-            unsigned char*line = &data[width*4*t];
-            int x;
-            for(x=0;x<width;x++) {
-                data2[x*3+0] = line[x*4+1];
-                data2[x*3+1] = line[x*4+2];
-                data2[x*3+2] = line[x*4+3];
-            }
-            jpeg_write_scanlines(&cinfo, &data2, 1);
-        }
-        free(data2);
-    } else {
+    if(components != 3 && components != 4) {
         fprintf(stderr, "unsupported number of components in jpeg_save_to_mem()\n");
+        jpeg_destroy_compress(&cinfo);
+        return 0;
     }
-
-    jpeg_finish_compress(&cinfo);
+    compress_image(&cinfo, data, width, height, quality, components);
     jpeg_destroy_compress(&cinfo);
     return len;
 }
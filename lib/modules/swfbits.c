@@ -44,9 +44,19 @@ extern "C" {
 #endif // HAVE_JPEGLIB
 
 #include "../rfxswf.h"
+#include "../os.h"
+#include "../palette.h"
 
 #define OUTBUFFER_SIZE 0x8000
 
+extern int swf_compression_level;
+extern int swf_compression_threads;
+
+static int zlib_level()
+{
+    return swf_compression_level<0 ? Z_DEFAULT_COMPRESSION : swf_compression_level;
+}
+
 int swf_ImageHasAlpha(RGBA*img, int width, int height)
 {
     int len = width*height;
@@ -104,142 +114,160 @@ int swf_ImageHasAlpha(RGBA*img, int width, int height)
 
 int swf_ImageGetNumberOfPaletteEntries(RGBA*img, int width, int height, RGBA*palette)
 {
-    int len = width*height;
-    int t;
-    int palsize = 0;
-    U32* pal;
-    int size[256];
-    int palette_overflow = 0;
-    U32 lastcol32 = 0;
-
-    pal = (U32*)malloc(65536*sizeof(U32));
-
-    memset(size, 0, sizeof(size));
-
-    if(sizeof(RGBA)!=sizeof(U32))
-	fprintf(stderr, "rfxswf: sizeof(RGBA)!=sizeof(U32))");
-
-    lastcol32 = (*(U32*)&img[0])^0xffffffff; // don't match
-
-    for(t=0;t<len;t++) {
-	RGBA col = img[t];
-	U32 col32 = *(U32*)&img[t];
-	int i;
-	int csize;
-	U32 hash;
-	U32* cpal;
-	if(col32 == lastcol32)
-	    continue;
-	hash = (col32 >> 17) ^ col32;
-	hash ^= ((hash>>8) + 1) ^ hash;
-	hash &= 255;
-
-	csize = size[hash];
-	cpal = &pal[hash*256];
-	for(i=0;i<csize;i++) {
-	    if(col32 == cpal[i])
-		break;
-	}
-	if(i==csize) {
-	    if(palsize==256) {
-		palette_overflow = 1;
-		break;
-	    }
-	    cpal[size[hash]++] = col32;
-	    palsize++;
-	}
-	lastcol32 = col32;
-    }
-    if(palette_overflow) {
-	free(pal);
+    U32 pal[256];
+    int num = palette_count_colors(img, width*height, 256, palette?pal:0, 0);
+    if(num<0)
 	return width*height;
-    }
     if(palette) {
-	int i = 0;
-	for(t=0;t<256;t++) {
-	    int s;
-	    int csize = size[t];
-	    U32* cpal = &pal[t*256];
-	    for(s=0;s<csize;s++)
-		palette[i++] = *(RGBA*)(&cpal[s]);
+	/* sort the colors by hash bucket (keeping the order in which they
+	   appear within each bucket), like previous versions did, so that
+	   the generated lossless bitmaps stay the same */
+	U8 hash[256];
+	int start[257];
+	int t;
+	memset(start, 0, sizeof(start));
+	for(t=0;t<num;t++) {
+	    U32 h = (pal[t] >> 17) ^ pal[t];
+	    h ^= ((h>>8) + 1) ^ h;
+	    hash[t] = h&255;
+	    start[hash[t]+1]++;
 	}
+	for(t=0;t<256;t++)
+	    start[t+1] += start[t];
+	for(t=0;t<num;t++)
+	    *(U32*)&palette[start[hash[t]]++] = pal[t];
     }
-    free(pal);
-    return palsize;
+    return num;
 }
 
-
-
 #ifdef HAVE_JPEGLIB
 
 typedef struct _JPEGDESTMGR {
     struct jpeg_destination_mgr mgr;
     TAG *t;
-    JOCTET *buffer;
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
 } JPEGDESTMGR, *LPJPEGDESTMGR;
 
-// Destination manager callbacks
+// Destination manager callbacks. libjpeg writes straight into the tag data,
+// which is grown whenever libjpeg runs out of space.
+
+static void tag_reserve(TAG * t, int bytes)
+{
+    swf_ReserveTag(t, t->len + bytes);
+}
 
 static void RFXSWF_init_destination(j_compress_ptr cinfo)
 {
     JPEGDESTMGR *dmgr = (JPEGDESTMGR *) cinfo->dest;
-    dmgr->buffer = (JOCTET *) rfx_alloc(OUTBUFFER_SIZE);
-    dmgr->mgr.next_output_byte = dmgr->buffer;
-    dmgr->mgr.free_in_buffer = OUTBUFFER_SIZE;
+    TAG *t = dmgr->t;
+    swf_ResetWriteBits(t);
+    tag_reserve(t, OUTBUFFER_SIZE);
+    dmgr->mgr.next_output_byte = &t->data[t->len];
+    dmgr->mgr.free_in_buffer = t->memsize - t->len;
 }
 
 static boolean RFXSWF_empty_output_buffer(j_compress_ptr cinfo)
 {
     JPEGDESTMGR *dmgr = (JPEGDESTMGR *) cinfo->dest;
-    swf_SetBlock(dmgr->t, (U8 *) dmgr->buffer, OUTBUFFER_SIZE);
-    dmgr->mgr.next_output_byte = dmgr->buffer;
-    dmgr->mgr.free_in_buffer = OUTBUFFER_SIZE;
+    TAG *t = dmgr->t;
+    /* libjpeg only calls us once everything up to memsize is filled */
+    t->len = t->memsize;
+    tag_reserve(t, OUTBUFFER_SIZE);
+    dmgr->mgr.next_output_byte = &t->data[t->len];
+    dmgr->mgr.free_in_buffer = t->memsize - t->len;
     return TRUE;
 }
 
 static void RFXSWF_term_destination(j_compress_ptr cinfo)
 {
     JPEGDESTMGR *dmgr = (JPEGDESTMGR *) cinfo->dest;
-    swf_SetBlock(dmgr->t, (U8 *) dmgr->buffer,
-		 OUTBUFFER_SIZE - dmgr->mgr.free_in_buffer);
-    rfx_free(dmgr->buffer);
+    TAG *t = dmgr->t;
+    t->len = t->memsize - dmgr->mgr.free_in_buffer;
     dmgr->mgr.free_in_buffer = 0;
 }
 
-JPEGBITS *swf_SetJPEGBitsStart(TAG * t, int width, int height, int quality)
+static int reuse_jpeg_compressor = 1;
+#ifdef __GNUC__
+/* a compressor from a previous image, kept around so that libjpeg's memory
+   pools and tables don't have to be set up again for every image */
+static JPEGDESTMGR *spare_jpeg_compressor = 0;
+#endif
+
+static JPEGDESTMGR *jpeg_get_compressor()
 {
-    JPEGDESTMGR *jpeg;
+    JPEGDESTMGR *jpeg = 0;
+#ifdef __GNUC__
+    if (reuse_jpeg_compressor)
+	jpeg = (JPEGDESTMGR *) __sync_lock_test_and_set(&spare_jpeg_compressor, 0);
+#endif
+    if (!jpeg) {
+	jpeg = (JPEGDESTMGR *) rfx_calloc(sizeof(JPEGDESTMGR));
+	jpeg->cinfo.err = jpeg_std_error(&jpeg->jerr);
+	jpeg_create_compress(&jpeg->cinfo);
+	jpeg->mgr.init_destination = RFXSWF_init_destination;
+	jpeg->mgr.empty_output_buffer = RFXSWF_empty_output_buffer;
+	jpeg->mgr.term_destination = RFXSWF_term_destination;
+	jpeg->cinfo.dest = (struct jpeg_destination_mgr *) jpeg;
+    }
+    return jpeg;
+}
 
-    // redirect compression lib output to local SWF Tag structure
+static void jpeg_free_compressor(JPEGDESTMGR * jpeg)
+{
+    if (!jpeg)
+	return;
+    jpeg_destroy_compress(&jpeg->cinfo);
+    rfx_free(jpeg);
+}
 
-    jpeg = (JPEGDESTMGR *) rfx_calloc(sizeof(JPEGDESTMGR));
+static void jpeg_release_compressor(JPEGDESTMGR * jpeg)
+{
+#ifdef __GNUC__
+    if (reuse_jpeg_compressor) {
+	jpeg->t = 0;
+	/* if another thread put back a compressor in the meantime, drop that one */
+	jpeg = (JPEGDESTMGR *) __sync_lock_test_and_set(&spare_jpeg_compressor, jpeg);
+    }
+#endif
+    jpeg_free_compressor(jpeg);
+}
 
-    jpeg->cinfo.err = jpeg_std_error(&jpeg->jerr);
+void swf_FreeJPEGCompressor()
+{
+#ifdef __GNUC__
+    jpeg_free_compressor((JPEGDESTMGR *) __sync_lock_test_and_set(&spare_jpeg_compressor, 0));
+#endif
+}
 
-    jpeg_create_compress(&jpeg->cinfo);
+void swf_SetJPEGCompressorReuse(int reuse)
+{
+    reuse_jpeg_compressor = reuse;
+    if (!reuse)
+	swf_FreeJPEGCompressor();
+}
 
-    jpeg->mgr.init_destination = RFXSWF_init_destination;
-    jpeg->mgr.empty_output_buffer = RFXSWF_empty_output_buffer;
-    jpeg->mgr.term_destination = RFXSWF_term_destination;
+static JPEGDESTMGR *jpeg_start(TAG * t, int width, int height, int quality, int components, J_COLOR_SPACE colorspace)
+{
+    // redirect compression lib output to local SWF Tag structure
 
+    JPEGDESTMGR *jpeg = jpeg_get_compressor();
     jpeg->t = t;
 
-    jpeg->cinfo.dest = (struct jpeg_destination_mgr *) jpeg;
-
     // init compression
 
     jpeg->cinfo.image_width = width;
     jpeg->cinfo.image_height = height;
-    jpeg->cinfo.input_components = 3;
-    jpeg->cinfo.in_color_space = JCS_RGB;
+    jpeg->cinfo.input_components = components;
+    jpeg->cinfo.in_color_space = colorspace;
 
     jpeg_set_defaults(&jpeg->cinfo);
     jpeg_set_quality(&jpeg->cinfo, quality, TRUE);
 
-    // write tables to SWF
+    // write tables to SWF. (A reused compressor still has its huffman
+    // tables marked as sent, so unmark them first.)
 
+    jpeg_suppress_tables(&jpeg->cinfo, FALSE);
     jpeg_write_tables(&jpeg->cinfo);
 
     // compess image to SWF
@@ -247,7 +275,12 @@ JPEGBITS *swf_SetJPEGBitsStart(TAG * t, int width, int height, int quality)
     jpeg_suppress_tables(&jpeg->cinfo, TRUE);
     jpeg_start_compress(&jpeg->cinfo, FALSE);
 
-    return (JPEGBITS *) jpeg;
+    return jpeg;
+}
+
+JPEGBITS *swf_SetJPEGBitsStart(TAG * t, int width, int height, int quality)
+{
+    return (JPEGBITS *) jpeg_start(t, width, height, quality, 3, JCS_RGB);
 }
 
 int swf_SetJPEGBitsLines(JPEGBITS * jpegbits, U8 ** data, int n)
@@ -270,18 +303,29 @@ int swf_SetJPEGBitsFinish(JPEGBITS * jpegbits)
     if (!jpeg)
 	return -1;
     jpeg_finish_compress(&jpeg->cinfo);
-    jpeg_destroy_compress(&jpeg->cinfo);
-    rfx_free(jpeg);
+    jpeg_release_compressor(jpeg);
     return 0;
 }
 
-#if defined(HAVE_JPEGLIB)
-void swf_SetJPEGBits2(TAG * tag, U16 width, U16 height, RGBA * bitmap, int quality)
+/* compress a whole RGBA bitmap into the tag. With libjpeg-turbo, libjpeg
+   reads the rows right out of the bitmap (as xrgb), otherwise they're
+   converted to rgb one by one. */
+static void jpeg_compress_bitmap(TAG * tag, U16 width, U16 height, RGBA * bitmap, int quality)
 {
-    JPEGBITS *jpeg;
     int y;
-    jpeg = swf_SetJPEGBitsStart(tag, width, height, quality);
-	U8 *scanline = (U8*)rfx_alloc(3 * width);
+#ifdef JCS_EXTENSIONS
+    JSAMPROW rows[16];
+    JPEGDESTMGR *jpeg = jpeg_start(tag, width, height, quality, 4, JCS_EXT_XRGB);
+    for (y = 0; y < height; y += 16) {
+	int n = height - y < 16 ? height - y : 16;
+	int t;
+	for (t = 0; t < n; t++)
+	    rows[t] = (JSAMPROW) & bitmap[width * (y + t)];
+	jpeg_write_scanlines(&jpeg->cinfo, rows, n);
+    }
+#else
+    JPEGDESTMGR *jpeg = jpeg_start(tag, width, height, quality, 3, JCS_RGB);
+    U8 *scanline = (U8*)rfx_alloc(3 * width);
     for (y = 0; y < height; y++) {
 	int x, p = 0;
 	for (x = 0; x < width; x++) {
@@ -289,10 +333,17 @@ void swf_SetJPEGBits2(TAG * tag, U16 width, U16 height, RGBA * bitmap, int quali
 	    scanline[p++] = bitmap[width * y + x].g;
 	    scanline[p++] = bitmap[width * y + x].b;
 	}
-	swf_SetJPEGBitsLine(jpeg, scanline);
+	jpeg_write_scanlines(&jpeg->cinfo, &scanline, 1);
     }
     rfx_free(scanline);
-    swf_SetJPEGBitsFinish(jpeg);
+#endif
+    swf_SetJPEGBitsFinish((JPEGBITS *) jpeg);
+}
+
+#if defined(HAVE_JPEGLIB)
+void swf_SetJPEGBits2(TAG * tag, U16 width, U16 height, RGBA * bitmap, int quality)
+{
+    jpeg_compress_bitmap(tag, width, height, bitmap, quality);
 }
 #else
 void swf_SetJPEGBits2(TAG * tag, U16 width, U16 height, RGBA * bitmap, int quality)
@@ -664,6 +715,16 @@ RGBA *swf_JPEG2TagToImage(TAG * tag, int *width, int *height)
     return dest;
 }
 
+#else				// HAVE_JPEGLIB
+
+void swf_SetJPEGCompressorReuse(int reuse)
+{
+}
+
+void swf_FreeJPEGCompressor()
+{
+}
+
 #endif				// HAVE_JPEGLIB
 
 // Lossless compression texture based on zlib
@@ -721,6 +782,34 @@ int RFXSWF_deflate_wraper(TAG * t, z_stream * zs, boolean finish)
 }
 
 
+static int tagwriter_write(writer_t*w, void*data, int len)
+{
+    swf_SetBlock((TAG*)w->internal, (U8*)data, len);
+    return len;
+}
+static void tagwriter_finish(writer_t*w)
+{
+}
+
+/* bitmaps above this size are compressed in parallel, if enabled */
+#define PARALLEL_DEFLATE_MIN (512*1024)
+
+/* compress data1 and data2 into one zlib stream, on several threads */
+static int deflate_parallel(TAG*t, U8*data1, int len1, U8*data2, int len2)
+{
+    writer_t tagwriter, zwriter;
+    memset(&tagwriter, 0, sizeof(writer_t));
+    tagwriter.internal = t;
+    tagwriter.write = tagwriter_write;
+    tagwriter.finish = tagwriter_finish;
+    writer_init_zlibdeflate2(&zwriter, &tagwriter, swf_compression_level<0?6:swf_compression_level, swf_compression_threads);
+    if(len1)
+	zwriter.write(&zwriter, data1, len1);
+    zwriter.write(&zwriter, data2, len2);
+    zwriter.finish(&zwriter);
+    return 0;
+}
+
 int swf_SetLosslessBits(TAG * t, U16 width, U16 height, void *bitmap, U8 bitmap_flags)
 {
     int res = 0;
@@ -744,14 +833,16 @@ int swf_SetLosslessBits(TAG * t, U16 width, U16 height, void *bitmap, U8 bitmap_
     swf_SetU16(t, width);
     swf_SetU16(t, height);
 
-    {
+    if(swf_compression_threads>1 && bps*height >= PARALLEL_DEFLATE_MIN) {
+	res = deflate_parallel(t, 0, 0, (U8*)bitmap, bps*height);
+    } else {
 	z_stream zs;
 
 	memset(&zs, 0x00, sizeof(z_stream));
 	zs.zalloc = Z_NULL;
 	zs.zfree = Z_NULL;
 
-	if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) == Z_OK) {
+	if (deflateInit(&zs, zlib_level()) == Z_OK) {
 	    zs.avail_in = bps * height;
 	    zs.next_in = (Bytef *)bitmap;
 
@@ -793,14 +884,28 @@ int swf_SetLosslessBitsIndexed(TAG * t, U16 width, U16 height, U8 * bitmap, RGBA
     swf_SetU16(t, height);
     swf_SetU8(t, ncolors - 1);	// number of pal entries
 
-    {
+    if(swf_compression_threads>1 && bps*height >= PARALLEL_DEFLATE_MIN) {
+	/* the palette goes into the same zlib stream as the pixels */
+	int pallen = swf_GetTagID(t) == ST_DEFINEBITSLOSSLESS2 ? 4 : 3;
+	U8*zpal = (U8*)rfx_alloc(ncolors * pallen);
+	int i;
+	for (i = 0; i < ncolors; i++) {
+	    zpal[i*pallen+0] = pal[i].r;
+	    zpal[i*pallen+1] = pal[i].g;
+	    zpal[i*pallen+2] = pal[i].b;
+	    if(pallen==4)
+		zpal[i*pallen+3] = pal[i].a;
+	}
+	res = deflate_parallel(t, zpal, ncolors * pallen, bitmap, bps * height);
+	rfx_free(zpal);
+    } else {
 	z_stream zs;
 
 	memset(&zs, 0x00, sizeof(z_stream));
 	zs.zalloc = Z_NULL;
 	zs.zfree = Z_NULL;
 
-	if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) == Z_OK) {
+	if (deflateInit(&zs, zlib_level()) == Z_OK) {
 	    U8 *zpal;		// compress palette
 	    if ((zpal = (U8*)rfx_alloc(ncolors * 4))) {
 		U8 *pp = zpal;
@@ -881,17 +986,16 @@ void swf_PreMultiplyAlpha(RGBA*data, int width, int height)
     }
 }
 
-/* expects mem to be non-premultiplied */
-void swf_SetLosslessImage(TAG*tag, RGBA*data, int width, int height)
+static void set_lossless_image(TAG*tag, RGBA*data, int width, int height, int hasalpha, char premultiply)
 {
-    int hasalpha = swf_ImageHasAlpha(data, width, height);
     int num;
     if(!hasalpha) {
 	tag->id = ST_DEFINEBITSLOSSLESS;
     } else {
 	tag->id = ST_DEFINEBITSLOSSLESS2;
 	/* FIXME: we're destroying the callers data here */
-	swf_PreMultiplyAlpha(data, width, height);
+	if(premultiply)
+	    swf_PreMultiplyAlpha(data, width, height);
     }
     num = swf_ImageGetNumberOfPaletteEntries(data, width, height, 0);
     if(num>1 && num<=256) {
@@ -928,6 +1032,13 @@ void swf_SetLosslessImage(TAG*tag, RGBA*data, int width, int height)
     }
 }
 
+/* expects mem to be non-premultiplied */
+void swf_SetLosslessImage(TAG*tag, RGBA*data, int width, int height)
+{
+    int hasalpha = swf_ImageHasAlpha(data, width, height);
+    set_lossless_image(tag, data, width, height, hasalpha, 1);
+}
+
 RGBA *swf_DefineLosslessBitsTagToImage(TAG * tag, int *dwidth, int *dheight)
 {
     int id, format, height, width, pos;
@@ -1055,42 +1166,23 @@ RGBA *swf_DefineLosslessBitsTagToImage(TAG * tag, int *dwidth, int *dheight)
 /* expects bitmap to be non-premultiplied */
 int swf_SetJPEGBits3(TAG * tag, U16 width, U16 height, RGBA * bitmap, int quality)
 {
-    JPEGBITS *jpeg;
     int y;
     int pos;
     int res = 0;
     U8 *data;
     z_stream zs;
 
+    U8 *scanline;
+
     pos = tag->len;
     swf_SetU32(tag, 0);		//placeholder
-    jpeg = swf_SetJPEGBitsStart(tag, width, height, quality);
-	U8 *scanline = (U8*)rfx_alloc(3 * width);
-    for (y = 0; y < height; y++) {
-	int x, p = 0;
-	for (x = 0; x < width; x++) {
-	    //int ia = bitmap[width*y+x].a;
-	    //if(ia) {
-	    //    /* remove premultiplication */
-	    //    ia = 0xff0000/ia;
-	    //}
-	    //scanline[p++] = (bitmap[width * y + x].r*ia)>>16;
-	    //scanline[p++] = (bitmap[width * y + x].g*ia)>>16;
-	    //scanline[p++] = (bitmap[width * y + x].b*ia)>>16;
-	    scanline[p++] = bitmap[width * y + x].r;
-	    scanline[p++] = bitmap[width * y + x].g;
-	    scanline[p++] = bitmap[width * y + x].b;
-	}
-	swf_SetJPEGBitsLine(jpeg, scanline);
-    }
-    rfx_free(scanline);
-    swf_SetJPEGBitsFinish(jpeg);
+    jpeg_compress_bitmap(tag, width, height, bitmap, quality);
     PUT32(&tag->data[pos], tag->len - pos - 4);
 
     data = (U8*)rfx_alloc(OUTBUFFER_SIZE);
     memset(&zs, 0x00, sizeof(z_stream));
 
-    if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    if (deflateInit(&zs, zlib_level()) != Z_OK) {
 	fprintf(stderr, "rfxswf: zlib compression failed");
 	return -3;
     }
@@ -1154,50 +1246,219 @@ int swf_SetJPEGBits3(TAG * tag, U16 width, U16 height, RGBA * bitmap, int qualit
 }
 #endif
 
+/* Walk the markers of a jpeg file up to the first scan, and return the
+   dimensions stored in its frame header. Only 8 bit huffman coded sequential
+   (baseline) jpegs are accepted- progressive or arithmetic coded files
+   can't be displayed by all Flash players. */
+static int jpeg_get_baseline_info(const U8*data, int len, int*width, int*height, int*components)
+{
+    int pos = 2;
+    char got_frame = 0;
+    char rgb = 0;
+    if(len < 4 || data[0] != 0xff || data[1] != 0xd8)
+	return 0;
+    while(pos+4 <= len) {
+	if(data[pos] != 0xff)
+	    return 0;
+	U8 marker = data[pos+1];
+	if(marker == 0xff) {
+	    pos++; // fill byte
+	    continue;
+	}
+	if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+	    pos += 2;
+	    continue;
+	}
+	int l = data[pos+2]<<8 | data[pos+3];
+	if(l < 2 || pos+2+l > len)
+	    return 0;
+	const U8*seg = &data[pos+4];
+	if(marker == 0xda) {
+	    /* an Adobe marker can declare the color components to be
+	       RGB instead of YCbCr, which Flash would ignore */
+	    if(rgb && *components == 3)
+		return 0;
+	    return got_frame;
+	} else if(marker == 0xee && l >= 14 && !memcmp(seg, "Adobe", 5)) {
+	    rgb = seg[11] == 0;
+	} else if(marker == 0xc0 || marker == 0xc1) {
+	    if(l < 8 || seg[0] != 8)
+		return 0;
+	    *height = seg[1]<<8 | seg[2];
+	    *width = seg[3]<<8 | seg[4];
+	    *components = seg[5];
+	    got_frame = 1;
+	} else if(marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+	    /* progressive, lossless, hierarchical or arithmetic coding */
+	    return 0;
+	} else if(marker == 0xd9) {
+	    return 0;
+	}
+	pos += 2+l;
+    }
+    return 0;
+}
+
+/* Store an existing jpeg file as the image data of a DEFINEBITSJPEG2 tag,
+   without recompressing it. Returns -1 (and doesn't touch the tag) if
+   the data isn't a baseline grayscale or YCbCr jpeg of the given size. */
+int swf_SetJPEGBitsRaw(TAG * t, const U8 * data, int len, int width, int height)
+{
+    int w = 0, h = 0, components = 0;
+    if(!jpeg_get_baseline_info(data, len, &w, &h, &components))
+	return -1;
+    if(w != width || h != height || (components != 1 && components != 3))
+	return -1;
+    swf_SetBlock(t, data, len);
+    return 0;
+}
+
+
+#define ENCODE_BOTH 0
+#define ENCODE_LOSSLESS 1
+#define ENCODE_JPEG 2
+
+/* Guess which of the two encodings will produce the smaller tag. Images with
+   only a few colors are stored as palette images, which jpeg hardly ever beats.
+   Otherwise, the lossless version stores 32 bits per pixel, and only wins if
+   the image is made of large areas of identical pixels with hard edges in
+   between (diagrams, screenshots, text). Smooth color transitions and noise,
+   on the other hand, are what jpeg is good at. We look at a subsample of the
+   horizontal pixel differences to tell those apart, and return ENCODE_BOTH
+   if the image doesn't clearly fall into one of the two categories. */
+static int predict_encoding(RGBA*mem, int width, int height, int has_alpha, int quality)
+{
+    if(quality>100)
+	return ENCODE_LOSSLESS;
+    /* small images are cheap to encode twice, and the jpeg tables
+       make the outcome hard to guess */
+    if(width*height < 64*64)
+	return ENCODE_BOTH;
+
+    int num_colors = swf_ImageGetNumberOfPaletteEntries(mem, width, height, 0);
+    if(num_colors <= 64)
+	return ENCODE_LOSSLESS;
+    if(num_colors <= 256)
+	return ENCODE_BOTH;
+
+    int ystep = height/64;if(ystep<1) ystep=1;
+    int xstep = width/256;if(xstep<1) xstep=1;
+    int flat = 0, smooth = 0, edge = 0;
+    int x,y;
+    for(y=0;y<height;y+=ystep) {
+	RGBA*line = &mem[y*width];
+	for(x=1;x<width;x+=xstep) {
+	    RGBA*p1 = &line[x-1];
+	    RGBA*p2 = &line[x];
+	    int d = abs(p1->r - p2->r) + abs(p1->g - p2->g) + 
+		    abs(p1->b - p2->b) + abs(p1->a - p2->a);
+	    if(!d) flat++;
+	    else if(d<=24) smooth++;
+	    else edge++;
+	}
+    }
+    int total = flat + smooth + edge;
+    if(flat*100 < total*30)
+	return ENCODE_JPEG;
+    /* with alpha, the jpeg version carries a zlib compressed alpha
+       channel around, which makes it too close to call */
+    if(!has_alpha && smooth*100 >= total*10 && flat*100 < total*85)
+	return ENCODE_JPEG;
+    return ENCODE_BOTH;
+}
+
+typedef struct _lossless_job {
+    TAG*tag;
+    RGBA*mem;
+    int width, height;
+    int has_alpha;
+} lossless_job_t;
+
+static void* encode_lossless(void*_job)
+{
+    lossless_job_t*job = (lossless_job_t*)_job;
+    set_lossless_image(job->tag, job->mem, job->width, job->height, job->has_alpha, 0);
+    return 0;
+}
 
 /* expects mem to be non-premultiplied */
 TAG* swf_AddImage(TAG*tag, int bitid, RGBA*mem, int width, int height, int quality)
+{
+    return swf_AddImage2(tag, bitid, mem, width, height, quality, 1, 0);
+}
+
+TAG* swf_AddImage2(TAG*tag, int bitid, RGBA*mem, int width, int height, int quality, int predict, int parallel)
 {
     TAG *tag1 = 0, *tag2 = 0;
     int has_alpha = swf_ImageHasAlpha(mem,width,height);
-
-    /* try lossless image */
-
-#ifdef NO_LOSSLESS
-    tag1 = swf_InsertTag(0, /*ST_DEFINEBITSLOSSLESS1/2*/0);
-    tag1->len = 0x7fffffff;
+    int mode = ENCODE_BOTH;
+    thread_t*thread = 0;
+    lossless_job_t job;
+
+#if !defined(HAVE_JPEGLIB)
+    mode = ENCODE_LOSSLESS;
+#elif defined(NO_LOSSLESS)
+    mode = ENCODE_JPEG;
 #else
-    tag1 = swf_InsertTag(0, /*ST_DEFINEBITSLOSSLESS1/2*/0);
-    swf_SetU16(tag1, bitid);
-    swf_SetLosslessImage(tag1, mem, width, height);
+    if(predict)
+	mode = predict_encoding(mem, width, height, has_alpha, quality);
+    else if(quality>100)
+	mode = ENCODE_LOSSLESS;
+#endif
+
+#if !defined(NO_LOSSLESS)
+    /* the lossless encoding needs premultiplied alpha. This happens in place,
+       and the jpeg version always got to see the premultiplied data, too. */
+    if(has_alpha)
+	swf_PreMultiplyAlpha(mem, width, height);
 #endif
 
+    if(mode != ENCODE_JPEG) {
+	tag1 = swf_InsertTag(0, /*ST_DEFINEBITSLOSSLESS1/2*/0);
+	swf_SetU16(tag1, bitid);
+	job.tag = tag1;
+	job.mem = mem;
+	job.width = width;
+	job.height = height;
+	job.has_alpha = has_alpha;
+	/* both encoders only read the image from now on, so they can run side by side */
+	if(mode == ENCODE_BOTH && parallel && width*height >= 256*256)
+	    thread = thread_start(encode_lossless, &job);
+	else
+	    encode_lossless(&job);
+    }
+
 #if defined(HAVE_JPEGLIB)
-    /* try jpeg image. Notice that if (and only if) we tried the lossless compression
-       above, the data will now be premultiplied with alpha. */
-    if(has_alpha) {
-	tag2 = swf_InsertTag(0, ST_DEFINEBITSJPEG3);
-	swf_SetU16(tag2, bitid);
-	swf_SetJPEGBits3(tag2, width, height, mem, quality);
-    } else {
-	tag2 = swf_InsertTag(0, ST_DEFINEBITSJPEG2);
-	swf_SetU16(tag2, bitid);
-	swf_SetJPEGBits2(tag2, width, height, mem, quality);
+    if(mode != ENCODE_LOSSLESS) {
+	if(has_alpha) {
+	    tag2 = swf_InsertTag(0, ST_DEFINEBITSJPEG3);
+	    swf_SetU16(tag2, bitid);
+	    swf_SetJPEGBits3(tag2, width, height, mem, quality);
+	} else {
+	    tag2 = swf_InsertTag(0, ST_DEFINEBITSJPEG2);
+	    swf_SetU16(tag2, bitid);
+	    swf_SetJPEGBits2(tag2, width, height, mem, quality);
+	}
     }
 #endif
 
-    if(quality>100 || !tag2 || (tag1 && tag1->len < tag2->len)) {
+    if(thread)
+	thread_join(thread);
+
+    if(tag1 && (!tag2 || quality>100 || tag1->len < tag2->len)) {
 	/* use the zlib version- it's smaller */
 	tag1->prev = tag;
 	if(tag) tag->next = tag1;
 	tag = tag1;
-	swf_DeleteTag(0, tag2);
+	if(tag2)
+	    swf_DeleteTag(0, tag2);
     } else {
 	/* use the jpeg version- it's smaller */
 	tag2->prev = tag;
 	if(tag) tag->next = tag2;
 	tag = tag2;
-	swf_DeleteTag(0, tag1);
+	if(tag1)
+	    swf_DeleteTag(0, tag1);
     }
     return tag;
 }
@@ -36,7 +36,8 @@ typedef struct _renderpoint
     float x;
     U32 depth;
 
-    SHAPELINE*shapeline;
+    int fillstyle0;
+    int fillstyle1;
     SHAPE2*s;
     
 } renderpoint_t;
@@ -121,7 +122,7 @@ static void add_line(RENDERBUF*buf, double x1, double y1, double x2, double y2,
         int l = sqrt((x2-x1)*(x2-x1) + (y2-y1)*(y2-y1));
         printf(" l[%d - %.2f/%.2f -> %.2f/%.2f]\n", l, x1/20.0, y1/20.0, x2/20.0, y2/20.0);
     }*/
-    assert(p->shapeline);
+    assert(p->s);
 
     y1=y1*i->multiply;
     y2=y2*i->multiply;
@@ -381,19 +382,16 @@ void swf_Render_Delete(RENDERBUF*dest)
     rfx_free(dest->internal); dest->internal = 0;
 }
 
-static SHAPE2* linestyle2fillstyle(SHAPE2*shape)
+static void linestyle2fillstyle(SHAPE2*shape, SHAPE2*s)
 {
-    SHAPE2*s = (SHAPE2*)rfx_calloc(sizeof(SHAPE2));
     int t;
+    memset(s, 0, sizeof(SHAPE2));
     s->numfillstyles = shape->numlinestyles;
     s->fillstyles = (FILLSTYLE*)rfx_calloc(sizeof(FILLSTYLE)*shape->numlinestyles);
-    s->lines = (SHAPELINE*)rfx_calloc(sizeof(SHAPELINE)*shape->numlinestyles);
     for(t=0;t<shape->numlinestyles;t++) {
-        s->lines[t].fillstyle0 = t+1;
         s->fillstyles[t].type = FILL_SOLID;
         s->fillstyles[t].color = shape->linestyles[t].color;
     }
-    return s;
 }
 
 void swf_Process(RENDERBUF*dest, U32 clipdepth);
@@ -405,21 +403,22 @@ double matrixsize(MATRIX*m)
     return sqrt(l1*l2);
 }
 
-void swf_RenderShape(RENDERBUF*dest, SHAPE2*shape, MATRIX*m, CXFORM*c, U16 _depth,U16 _clipdepth)
+static void render_edges(RENDERBUF*dest, SHAPE2*shape, SHAPEEDGES*edges, MATRIX*m, CXFORM*c, U16 _depth,U16 _clipdepth)
 {
     renderbuf_internal*i = (renderbuf_internal*)dest->internal;
     
-    SHAPELINE*line;
     int x=0,y=0;
+    int n;
     MATRIX mat = *m;
-    SHAPE2* s2 = 0;
-    SHAPE2* lshape = 0;
+    SHAPE2 s2, lshape;
     renderpoint_t p, lp;
     U32 clipdepth;
     double widthmultiply = matrixsize(m);
 
     memset(&p, 0, sizeof(renderpoint_t));
     memset(&lp, 0, sizeof(renderpoint_t));
+    memset(&s2, 0, sizeof(SHAPE2));
+    memset(&lshape, 0, sizeof(SHAPE2));
     
     clipdepth = _clipdepth? _clipdepth << 16 | 0xffff : 0;
     p.depth = _depth << 16;
@@ -427,59 +426,63 @@ void swf_RenderShape(RENDERBUF*dest, SHAPE2*shape, MATRIX*m, CXFORM*c, U16 _dept
     mat.tx -= dest->posx*20;
     mat.ty -= dest->posy*20;
 
-    s2 = swf_Shape2Clone(shape);
-    line = s2->lines;
     if(shape->numfillstyles) {
         int t;
-        p.s = s2;
+        /* only the fillstyles are modified, so that's all we need to copy */
+        s2.numfillstyles = shape->numfillstyles;
+        s2.fillstyles = (FILLSTYLE*)rfx_alloc(sizeof(FILLSTYLE)*shape->numfillstyles);
+        memcpy(s2.fillstyles, shape->fillstyles, sizeof(FILLSTYLE)*shape->numfillstyles);
+        p.s = &s2;
         /* multiply fillstyles matrices with placement matrix-
            important for texture and gradient fill */
-        for(t=0;t<s2->numfillstyles;t++) {
+        for(t=0;t<s2.numfillstyles;t++) {
             MATRIX nm;
-            swf_MatrixJoin(&nm, &mat, &s2->fillstyles[t].m);
+            swf_MatrixJoin(&nm, &mat, &s2.fillstyles[t].m);
             /*nm.sx *= i->multiply;
             nm.sy *= i->multiply;
             nm.r0 *= i->multiply;
             nm.r1 *= i->multiply;
             nm.tx *= i->multiply;
             nm.ty *= i->multiply;*/
-            s2->fillstyles[t].m = nm;
+            s2.fillstyles[t].m = nm;
         }
     }
 
     if(shape->numlinestyles) {
-        lshape = linestyle2fillstyle(shape);
-        lp.s = lshape;
+        linestyle2fillstyle(shape, &lshape);
+        lp.s = &lshape;
         lp.depth = (_depth << 16)+1;
     }
 
 
-    while(line)
+    for(n=0;n<edges->num;n++)
     {
+        EDGESTYLE*style = &edges->styles[edges->style[n]];
         int x1,y1,x2,y2,x3,y3;
 
-        if(line->type == moveTo) {
-        } else if(line->type == lineTo) {
+        if(edges->type[n] == moveTo) {
+        } else if(edges->type[n] == lineTo) {
             transform_point(&mat, x, y, &x1, &y1);
-            transform_point(&mat, line->x, line->y, &x3, &y3);
+            transform_point(&mat, edges->x[n], edges->y[n], &x3, &y3);
             
-            if(line->linestyle && ! clipdepth) {
-                lp.shapeline = &lshape->lines[line->linestyle-1];
-                add_solidline(dest, x1, y1, x3, y3, shape->linestyles[line->linestyle-1].width * widthmultiply, &lp);
+            if(style->linestyle && ! clipdepth) {
+                lp.fillstyle0 = style->linestyle;
+                add_solidline(dest, x1, y1, x3, y3, shape->linestyles[style->linestyle-1].width * widthmultiply, &lp);
                 lp.depth++;
             }
-            if(line->fillstyle0 || line->fillstyle1) {
+            if(style->fillstyle0 || style->fillstyle1) {
                 assert(shape->numfillstyles);
-		p.shapeline = line;
+		p.fillstyle0 = style->fillstyle0;
+		p.fillstyle1 = style->fillstyle1;
                 add_line(dest, x1, y1, x3, y3, &p);
             }
-        } else if(line->type == splineTo) {
+        } else if(edges->type[n] == splineTo) {
 	    int c,t,parts,qparts;
 	    double xx,yy;
             
             transform_point(&mat, x, y, &x1, &y1);
-            transform_point(&mat, line->sx, line->sy, &x2, &y2);
-            transform_point(&mat, line->x, line->y, &x3, &y3);
+            transform_point(&mat, edges->sx[n], edges->sy[n], &x2, &y2);
+            transform_point(&mat, edges->x[n], edges->y[n], &x3, &y3);
             
             c = abs(x3-2*x2+x1) + abs(y3-2*y2+y1);
             xx=x1;
@@ -492,14 +495,15 @@ void swf_RenderShape(RENDERBUF*dest, SHAPE2*shape, MATRIX*m, CXFORM*c, U16 _dept
                 double nx = (double)(t*t*x3 + 2*t*(parts-t)*x2 + (parts-t)*(parts-t)*x1)/(double)(parts*parts);
                 double ny = (double)(t*t*y3 + 2*t*(parts-t)*y2 + (parts-t)*(parts-t)*y1)/(double)(parts*parts);
                 
-                if(line->linestyle && ! clipdepth) {
-                    lp.shapeline = &lshape->lines[line->linestyle-1];
-                    add_solidline(dest, xx, yy, nx, ny, shape->linestyles[line->linestyle-1].width * widthmultiply, &lp);
+                if(style->linestyle && ! clipdepth) {
+                    lp.fillstyle0 = style->linestyle;
+                    add_solidline(dest, xx, yy, nx, ny, shape->linestyles[style->linestyle-1].width * widthmultiply, &lp);
                     lp.depth++;
                 }
-                if(line->fillstyle0 || line->fillstyle1) {
+                if(style->fillstyle0 || style->fillstyle1) {
                     assert(shape->numfillstyles);
-		    p.shapeline = line;
+		    p.fillstyle0 = style->fillstyle0;
+		    p.fillstyle1 = style->fillstyle1;
                     add_line(dest, xx, yy, nx, ny, &p);
                 }
 
@@ -507,20 +511,26 @@ void swf_RenderShape(RENDERBUF*dest, SHAPE2*shape, MATRIX*m, CXFORM*c, U16 _dept
                 yy = ny;
             }
         }
-        x = line->x;
-        y = line->y;
-        line = line->next;
+        x = edges->x[n];
+        y = edges->y[n];
     }
     
     swf_Process(dest, clipdepth);
     
-    if(s2) {
-	swf_Shape2Free(s2);rfx_free(s2);s2=0;
+    if(s2.fillstyles) {
+	rfx_free(s2.fillstyles);
     }
-    if(lshape) {
-	swf_Shape2Free(lshape);rfx_free(lshape);lshape=0;
+    if(lshape.fillstyles) {
+	rfx_free(lshape.fillstyles);
     }
+}
 
+void swf_RenderShape(RENDERBUF*dest, SHAPE2*shape, MATRIX*m, CXFORM*c, U16 _depth,U16 _clipdepth)
+{
+    SHAPEEDGES edges;
+    swf_Shape2ToEdges(shape, &edges);
+    render_edges(dest, shape, &edges, m, c, _depth, _clipdepth);
+    swf_ShapeEdgesFree(&edges);
 }
 
 static RGBA color_red = {255,255,0,0};
@@ -832,26 +842,26 @@ static void change_state(int y, state_t* state, renderpoint_t*p)
     layer_t*before=0, *self=0, *after=0;
 
     if(DEBUG&2) { 
-        printf("[(%f,%d)/%d/%d-%d]", p->x, y, p->depth, p->shapeline->fillstyle0, p->shapeline->fillstyle1);
+        printf("[(%f,%d)/%d/%d-%d]", p->x, y, p->depth, p->fillstyle0, p->fillstyle1);
     }
 
     search_layer(state, p->depth, &before, &self, &after);
 
     if(self) {
         /* shape update */
-        if(self->fillid<0/*??*/ || !p->shapeline->fillstyle0 || !p->shapeline->fillstyle1) {
+        if(self->fillid<0/*??*/ || !p->fillstyle0 || !p->fillstyle1) {
             /* filling ends */
             if(DEBUG&2) printf("<D>");
             
             delete_layer(state, self);
         } else { 
             /*both fill0 and fill1 are set- exchange the two, updating the layer */
-            if(self->fillid == p->shapeline->fillstyle0) {
-                self->fillid = p->shapeline->fillstyle1;
+            if(self->fillid == p->fillstyle0) {
+                self->fillid = p->fillstyle1;
                 self->p = p;
                 if(DEBUG&2) printf("<X>");
-            } else if(self->fillid == p->shapeline->fillstyle1) {
-                self->fillid = p->shapeline->fillstyle0;
+            } else if(self->fillid == p->fillstyle1) {
+                self->fillid = p->fillstyle0;
                 self->p = p;
                 if(DEBUG&2) printf("<X>");
             } else {
@@ -863,7 +873,7 @@ static void change_state(int y, state_t* state, renderpoint_t*p)
         return;
     } else {
         layer_t* n = 0;
-        if(p->shapeline && p->shapeline->fillstyle0 && p->shapeline->fillstyle1) {
+        if(p->fillstyle0 && p->fillstyle1) {
             /* this is a hack- a better way would be to make sure that
                we always get (0,32), (32, 33), (33, 0) in the right order if
                they happen to fall on the same pixel.
@@ -878,7 +888,7 @@ static void change_state(int y, state_t* state, renderpoint_t*p)
 
         if(DEBUG&2) printf("<+>");
 
-	n->fillid = p->shapeline->fillstyle0 ? p->shapeline->fillstyle0 : p->shapeline->fillstyle1;
+	n->fillid = p->fillstyle0 ? p->fillstyle0 : p->fillstyle1;
 	n->p = p;
 
         add_layer(state, before, n);
@@ -932,9 +942,8 @@ void swf_Process(RENDERBUF*dest, U32 clipdepth)
 	/*if(y==884) {
 	    for(n=0;n<num;n++) {
 		printf("%f (%d/%d) %d\n", points[n].x, 
-			points[n].shapeline->fillstyle0,
-			points[n].shapeline->fillstyle1,
-			points[n].shapeline->linestyle);
+			points[n].fillstyle0,
+			points[n].fillstyle1);
 	    }
 	}*/
 
@@ -1045,6 +1054,7 @@ typedef struct
 {
     int numchars;
     SHAPE2**glyphs;
+    SHAPEEDGES*edges;
 } font_t;
 
 enum CHARACTER_TYPE {none_type, shape_type, image_type, text_type, edittext_type, font_type, sprite_type};
@@ -1057,6 +1067,7 @@ typedef struct
         SHAPE2*shape;
         font_t*font;
     } obj;
+    SHAPEEDGES*edges;
 } character_t;
 
 int compare_placements(const void *v1, const void *v2)
@@ -1148,7 +1159,7 @@ static void textcallback(void*self, int*chars, int*xpos, int nr, int fontid, int
 		    color->a, color->r, color->g, color->b);
 	    swf_DumpMatrix(stdout, &m);
 	    swf_DumpShape(shape);*/
-	    swf_RenderShape(info->buf, shape, &m, info->cxform, info->depth, info->clipdepth);
+	    render_edges(info->buf, shape, &font->edges[chars[t]], &m, info->cxform, info->depth, info->clipdepth);
 	}
     }
 }
@@ -1203,7 +1214,7 @@ static void renderFromTag(RENDERBUF*buf, character_t*idtable, TAG*firstTag, MATR
 
         if(idtable[id].type == shape_type) {
             //SRECT sbbox = swf_TurnRect(*idtable[id].bbox, &p->matrix);
-            swf_RenderShape(buf, idtable[id].obj.shape, &m2, &p->cxform, p->depth, p->clipdepth);
+            render_edges(buf, idtable[id].obj.shape, idtable[id].edges, &m2, &p->cxform, p->depth, p->clipdepth);
 	} else if(idtable[id].type == sprite_type) {
 	    swf_UnFoldSprite(idtable[id].tag);
 	    renderFromTag(buf, idtable, idtable[id].tag->next, &m2);
@@ -1272,9 +1283,11 @@ void swf_RenderSWF(RENDERBUF*buf, SWF*swf)
 
             if(swf_isShapeTag(tag)) {
                 SHAPE2* shape = (SHAPE2*)rfx_calloc(sizeof(SHAPE2));
-                swf_ParseDefineShape(tag, shape);
+                SHAPEEDGES* edges = (SHAPEEDGES*)rfx_calloc(sizeof(SHAPEEDGES));
+                swf_ParseDefineShapeEdges(tag, shape, edges);
                 idtable[id].type = shape_type;
                 idtable[id].obj.shape = shape;
+                idtable[id].edges = edges;
             } else if(swf_isImageTag(tag)) {
 		int width,height;
                 RGBA*data = swf_ExtractImage(tag, &width, &height);
@@ -1290,12 +1303,14 @@ void swf_RenderSWF(RENDERBUF*buf, SWF*swf)
                 swf_FontExtract(swf,id,&swffont);
 		font->numchars = swffont->numchars;
 		font->glyphs = (SHAPE2**)rfx_calloc(sizeof(SHAPE2*)*font->numchars);
+		font->edges = (SHAPEEDGES*)rfx_calloc(sizeof(SHAPEEDGES)*font->numchars);
 		for(t=0;t<font->numchars;t++) {
 		    if(!swffont->glyph[t].shape->fillstyle.n) {
 			/* the actual fill color will be overwritten while rendering */
 			swf_ShapeAddSolidFillStyle(swffont->glyph[t].shape, &color_white);
 		    }
 		    font->glyphs[t] = swf_ShapeToShape2(swffont->glyph[t].shape);
+		    swf_Shape2ToEdges(font->glyphs[t], &font->edges[t]);
 		}
 		swf_FontFree(swffont);
                 idtable[id].type = font_type;
@@ -1330,6 +1345,10 @@ void swf_RenderSWF(RENDERBUF*buf, SWF*swf)
                 swf_Shape2Free(shape); // FIXME
                 free(idtable[t].obj.shape);idtable[t].obj.shape = 0;
             }
+            if(idtable[t].edges) {
+                swf_ShapeEdgesFree(idtable[t].edges);
+                free(idtable[t].edges);idtable[t].edges = 0;
+            }
         } else if(idtable[t].type == font_type) {
 	    font_t* font = idtable[t].obj.font;
 	    if(font) {
@@ -1338,9 +1357,12 @@ void swf_RenderSWF(RENDERBUF*buf, SWF*swf)
 		    for(t=0;t<font->numchars;t++) {
 			swf_Shape2Free(font->glyphs[t]);
 			free(font->glyphs[t]); font->glyphs[t] = 0;
+			swf_ShapeEdgesFree(&font->edges[t]);
 		    }
 		    free(font->glyphs);
 		    font->glyphs = 0;
+		    free(font->edges);
+		    font->edges = 0;
 		}
 		free(idtable[t].obj.font); idtable[t].obj.font = 0;
 		font = 0;
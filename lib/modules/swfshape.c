@@ -646,12 +646,81 @@ char swf_ShapeIsEmpty(SHAPE*s)
     return 1;
 }
 
-/* todo: merge this with swf_GetSimpleShape */
-static SHAPELINE* swf_ParseShapeData(U8*data, int bits, int fillbits, int linebits, int version, SHAPE2*shape2)
+static void edges_init(SHAPEEDGES*edges)
 {
-    SHAPELINE _lines;
-    SHAPELINE*lines = &_lines;
+    memset(edges, 0, sizeof(SHAPEEDGES));
+}
 
+/* all edge arrays live in one block, which doubles in size when full */
+static void edges_grow(SHAPEEDGES*edges)
+{
+    int size = edges->size?edges->size*2:64;
+    int n = edges->num;
+    S32*block = (S32*)rfx_alloc(size*(5*sizeof(S32)+1));
+    S32*x = block, *y = x+size, *sx = y+size, *sy = sx+size;
+    int*style = (int*)(sy+size);
+    U8*type = (U8*)(style+size);
+    if(n) {
+	memcpy(x, edges->x, n*sizeof(S32));
+	memcpy(y, edges->y, n*sizeof(S32));
+	memcpy(sx, edges->sx, n*sizeof(S32));
+	memcpy(sy, edges->sy, n*sizeof(S32));
+	memcpy(style, edges->style, n*sizeof(int));
+	memcpy(type, edges->type, n);
+    }
+    if(edges->x)
+	rfx_free(edges->x);
+    edges->x = x;edges->y = y;
+    edges->sx = sx;edges->sy = sy;
+    edges->style = style;
+    edges->type = type;
+    edges->size = size;
+}
+
+static void edges_add(SHAPEEDGES*edges, U8 type, S32 x, S32 y, S32 sx, S32 sy)
+{
+    int n = edges->num;
+    if(n == edges->size)
+	edges_grow(edges);
+    edges->type[n] = type;
+    edges->x[n] = x;
+    edges->y[n] = y;
+    edges->sx[n] = sx;
+    edges->sy[n] = sy;
+    edges->style[n] = edges->numstyles-1;
+    edges->num = n+1;
+}
+
+static void edges_style(SHAPEEDGES*edges, int fill0, int fill1, int line)
+{
+    EDGESTYLE*s;
+    if(edges->numstyles) {
+	s = &edges->styles[edges->numstyles-1];
+	if(s->fillstyle0 == fill0 && s->fillstyle1 == fill1 && s->linestyle == line)
+	    return;
+    }
+    if(edges->numstyles == edges->stylesize) {
+	edges->stylesize = edges->stylesize?edges->stylesize*2:8;
+	edges->styles = (EDGESTYLE*)rfx_realloc(edges->styles, sizeof(EDGESTYLE)*edges->stylesize);
+    }
+    s = &edges->styles[edges->numstyles++];
+    s->fillstyle0 = fill0;
+    s->fillstyle1 = fill1;
+    s->linestyle = line;
+}
+
+void swf_ShapeEdgesFree(SHAPEEDGES*edges)
+{
+    if(edges->x)
+	rfx_free(edges->x);
+    if(edges->styles)
+	rfx_free(edges->styles);
+    edges_init(edges);
+}
+
+/* decodes the shape records into edges. Returns 0 if the shape is broken. */
+static int swf_ParseShapeEdges(U8*data, int bits, int fillbits, int linebits, int version, SHAPE2*shape2, SHAPEEDGES*edges)
+{
     TAG _tag;
     TAG* tag = &_tag;
     int fill0 = 0;
@@ -667,7 +736,9 @@ static SHAPELINE* swf_ParseShapeData(U8*data, int bits, int fillbits, int linebi
     tag->pos = 0;
     tag->id = version==1?ST_DEFINESHAPE:(version==2?ST_DEFINESHAPE2:(version==3?ST_DEFINESHAPE3:ST_DEFINESHAPE4));
 
-    lines->next = 0;
+    edges->num = 0;
+    edges->numstyles = 0;
+    edges_style(edges, 0, 0, 0);
     while(1) {
 	int flags;
 	flags = swf_GetBits(tag, 1);
@@ -693,24 +764,18 @@ static SHAPELINE* swf_ParseShapeData(U8*data, int bits, int fillbits, int linebi
 		} else {
 		    linestyleadd = shape2->numlinestyles;
 		    fillstyleadd = shape2->numfillstyles;
-		    if(!parseFillStyleArray(tag, shape2))
+		    if(!parseFillStyleArray(tag, shape2)) {
+			edges->num = 0;
 			return 0;
+		    }
 		}
 		fillbits = swf_GetBits(tag, 4);
 		linebits = swf_GetBits(tag, 4);
 	    }
-	    if(flags&1) { //move
-		lines->next = (SHAPELINE*)rfx_alloc(sizeof(SHAPELINE));
-		lines = lines->next;
-		lines->type = moveTo;
-		lines->x = x; 
-		lines->y = y; 
-		lines->sx = lines->sy = 0;
-		lines->fillstyle0 = fill0;
-		lines->fillstyle1 = fill1;
-		lines->linestyle = line;
-		lines->next = 0;
-	    }
+	    if(flags&14)
+		edges_style(edges, fill0, fill1, line);
+	    if(flags&1) //move
+		edges_add(edges, moveTo, x, y, 0, 0);
 	} else {
 	    flags = swf_GetBits(tag, 1);
 	    if(flags) { //straight edge
@@ -725,16 +790,7 @@ static SHAPELINE* swf_ParseShapeData(U8*data, int bits, int fillbits, int linebi
 		    if(v) y += d;
 		    else  x += d;
 		}
-		lines->next = (SHAPELINE*)rfx_alloc(sizeof(SHAPELINE));
-		lines = lines->next;
-		lines->type = lineTo;
-		lines->x = x; 
-		lines->y = y; 
-		lines->sx = lines->sy = 0;
-		lines->fillstyle0 = fill0;
-		lines->fillstyle1 = fill1;
-		lines->linestyle = line;
-		lines->next = 0;
+		edges_add(edges, lineTo, x, y, 0, 0);
 	    } else { //curved edge
 		int n = swf_GetBits(tag, 4) + 2;
 		int x1,y1;
@@ -744,24 +800,105 @@ static SHAPELINE* swf_ParseShapeData(U8*data, int bits, int fillbits, int linebi
 		y1 = y;
 		x += swf_GetSBits(tag, n);
 		y += swf_GetSBits(tag, n);
-
-		lines->next = (SHAPELINE*)rfx_alloc(sizeof(SHAPELINE));
-		lines = lines->next;
-		lines->type = splineTo;
-		lines->sx = x1; 
-		lines->sy = y1; 
-		lines->x = x; 
-		lines->y = y; 
-		lines->fillstyle0 = fill0;
-		lines->fillstyle1 = fill1;
-		lines->linestyle = line;
-		lines->next = 0;
+		edges_add(edges, splineTo, x, y, x1, y1);
 	    }
 	}
     }
+    return 1;
+}
+
+static SHAPELINE* edges_to_lines(SHAPEEDGES*edges)
+{
+    SHAPELINE _lines;
+    SHAPELINE*lines = &_lines;
+    int t;
+    lines->next = 0;
+    for(t=0;t<edges->num;t++) {
+	EDGESTYLE*s = &edges->styles[edges->style[t]];
+	lines->next = (SHAPELINE*)rfx_alloc(sizeof(SHAPELINE));
+	lines = lines->next;
+	lines->type = edges->type[t];
+	lines->x = edges->x[t];
+	lines->y = edges->y[t];
+	lines->sx = edges->sx[t];
+	lines->sy = edges->sy[t];
+	lines->fillstyle0 = s->fillstyle0;
+	lines->fillstyle1 = s->fillstyle1;
+	lines->linestyle = s->linestyle;
+	lines->next = 0;
+    }
     return _lines.next;
 }
 
+/* todo: merge this with swf_GetSimpleShape */
+static SHAPELINE* swf_ParseShapeData(U8*data, int bits, int fillbits, int linebits, int version, SHAPE2*shape2)
+{
+    SHAPEEDGES edges;
+    SHAPELINE*lines = 0;
+    edges_init(&edges);
+    if(swf_ParseShapeEdges(data, bits, fillbits, linebits, version, shape2, &edges))
+	lines = edges_to_lines(&edges);
+    swf_ShapeEdgesFree(&edges);
+    return lines;
+}
+
+void swf_Shape2ToEdges(SHAPE2*shape, SHAPEEDGES*edges)
+{
+    SHAPELINE*l = shape->lines;
+    edges_init(edges);
+    edges_style(edges, 0, 0, 0);
+    while(l) {
+	edges_style(edges, l->fillstyle0, l->fillstyle1, l->linestyle);
+	edges_add(edges, l->type, l->x, l->y, l->sx, l->sy);
+	l = l->next;
+    }
+}
+
+SRECT swf_GetShapeEdgesBoundingBox(SHAPE2*shape2, SHAPEEDGES*edges)
+{
+    SRECT r;
+    int lastx=0,lasty=0;
+    int valid = 0;
+    int t;
+    r.xmin = r.ymin = SCOORD_MAX;
+    r.xmax = r.ymax = SCOORD_MIN;
+
+    for(t=0;t<edges->num;t++) {
+	int linestyle = edges->styles[edges->style[t]].linestyle;
+	int x = edges->x[t], y = edges->y[t];
+	int t1;
+	if(linestyle>0) {
+	    t1 = shape2->linestyles[linestyle - 1].width*3/2;
+	} else {
+	    t1 = 0;
+	}
+
+	if(edges->type[t] != moveTo)
+	{
+	    valid = 1;
+	    if(lastx - t1 < r.xmin) r.xmin = lastx - t1;
+	    if(lasty - t1 < r.ymin) r.ymin = lasty - t1;
+	    if(lastx + t1 > r.xmax) r.xmax = lastx + t1;
+	    if(lasty + t1 > r.ymax) r.ymax = lasty + t1;
+	    if(x - t1 < r.xmin) r.xmin = x - t1;
+	    if(y - t1 < r.ymin) r.ymin = y - t1;
+	    if(x + t1 > r.xmax) r.xmax = x + t1;
+	    if(y + t1 > r.ymax) r.ymax = y + t1;
+	    if(edges->type[t] == splineTo) {
+		int sx = edges->sx[t], sy = edges->sy[t];
+		if(sx - t1 < r.xmin) r.xmin = sx - t1;
+		if(sy - t1 < r.ymin) r.ymin = sy - t1;
+		if(sx + t1 > r.xmax) r.xmax = sx + t1;
+		if(sy + t1 > r.ymax) r.ymax = sy + t1;
+	    }
+	}
+	lastx = x;
+	lasty = y;
+    }
+    if(!valid) memset(&r, 0, sizeof(SRECT));
+    return r;
+}
+
 SRECT swf_GetShapeBoundingBox(SHAPE2*shape2)
 {
     SRECT r;
@@ -1038,11 +1175,11 @@ void swf_SetShape2(TAG*tag, SHAPE2*shape2)
     swf_SetBlock(tag, shape.data, (shape.bitlen+7)/8);
 }
 
-void swf_ParseDefineShape(TAG*tag, SHAPE2*shape)
+/* parses everything up to the shape records. Returns the shape version
+   (1-4), or 0 if the styles are broken. */
+static int parseDefineShapeHeader(TAG*tag, SHAPE2*shape, U16*fill, U16*line)
 {
     int num = 0, id;
-    U16 fill,line;
-    SHAPELINE*l;
     if(tag->id == ST_DEFINESHAPE)
 	num = 1;
     else if(tag->id == ST_DEFINESHAPE2)
@@ -1068,19 +1205,36 @@ void swf_ParseDefineShape(TAG*tag, SHAPE2*shape)
     }
 
     if(!parseFillStyleArray(tag, shape)) {
-	return;
+	return 0;
     }
 
     swf_ResetReadBits(tag); 
-    fill = (U16)swf_GetBits(tag,4);
-    line = (U16)swf_GetBits(tag,4);
-    if(!fill && !line) {
+    *fill = (U16)swf_GetBits(tag,4);
+    *line = (U16)swf_GetBits(tag,4);
+    if(!*fill && !*line) {
 	fprintf(stderr, "fill/line bits are both zero\n");
     }
+    return num;
+}
 
+void swf_ParseDefineShape(TAG*tag, SHAPE2*shape)
+{
+    U16 fill,line;
+    int num = parseDefineShapeHeader(tag, shape, &fill, &line);
+    if(!num)
+	return;
     shape->lines = swf_ParseShapeData(&tag->data[tag->pos], (tag->len - tag->pos)*8, fill, line, num, shape);
+}
 
-    l = shape->lines;
+void swf_ParseDefineShapeEdges(TAG*tag, SHAPE2*shape, SHAPEEDGES*edges)
+{
+    U16 fill,line;
+    int num;
+    edges_init(edges);
+    num = parseDefineShapeHeader(tag, shape, &fill, &line);
+    if(!num)
+	return;
+    swf_ParseShapeEdges(&tag->data[tag->pos], (tag->len - tag->pos)*8, fill, line, num, shape, edges);
 }
 
 static void free_lines(SHAPELINE* lines)
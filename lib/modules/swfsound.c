@@ -21,10 +21,17 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 
-#ifndef NO_MP3
-
 #include "../rfxswf.h"
 
+void swf_SetSoundDefineRaw(TAG*tag, S16*samples, int numsamples)
+{
+    swf_SetU8(tag,(/*compression*/0<<4)|(/*rate*/3<<2)|(/*size*/1<<1)|/*mono*/0);
+    swf_SetU32(tag, numsamples); // 44100 -> 11025
+    swf_SetBlock(tag, (U8*)samples, numsamples*2);
+}
+
+#ifndef NO_MP3
+
 #ifdef BLADEENC
 #define HAVE_SOUND
 
@@ -77,13 +84,6 @@ void swf_SetSoundStreamBlock(TAG*tag, S16*samples, int numsamples, char first)
 }
 #endif
 
-void swf_SetSoundDefineRaw(TAG*tag, S16*samples, int numsamples)
-{
-    swf_SetU8(tag,(/*compression*/0<<4)|(/*rate*/3<<2)|(/*size*/1<<1)|/*mono*/0);
-    swf_SetU32(tag, numsamples); // 44100 -> 11025
-    swf_SetBlock(tag, (U8*)samples, numsamples*2);
-}
-
 /* TODO: find a better way to set these from the outside */
 
 int swf_mp3_in_samplerate = 44100;
@@ -96,32 +96,170 @@ int swf_mp3_bitrate = 32;
 
 #include <stdarg.h>
 #include <lame.h>
+#endif
+#include "../os.h"
+
+#define MP3_BLOCK_BUFSIZE 16384
+
+/* segments shorter than this many blocks aren't worth a thread of their own */
+#define MP3_MIN_SEGMENT_BLOCKS 64
+/* blocks encoded (and thrown away) in front of every segment but the first,
+   so that the encoder starts the segment with the same psychoacoustic
+   and filterbank history it would have had in a single pass */
+#define MP3_SEGMENT_OVERLAP 4
 
-static lame_global_flags*lame_flags;
+/* one initial sample plus 4095 codes */
+#define ADPCM_PACKET_SAMPLES 4096
+
+typedef struct _soundblock {
+    U8*data;
+    int len;
+} soundblock_t;
+
+struct _SOUNDENCODER {
+    int in_samplerate;
+    int out_samplerate;
+    int channels;
+    int bitrate;
+    int threads;
+    int quality;
+    int compression;
+    int adpcm_bits;
+
+    struct lame_global_struct*lame_flags;
+
+    /* blocks encoded ahead of time by swf_SoundEncoderEncode(), in stream order */
+    soundblock_t*blocks;
+    int num_blocks;
+    int pos;
+
+    /* adpcm state */
+    int predictor;
+    int index;
+    int packetpos;
+};
+
+static int get_samplerate_code(int samplerate)
+{
+    if(samplerate == 5512) return 0; // lame doesn't support this
+    else if(samplerate == 11025) return 1;
+    else if(samplerate == 22050) return 2;
+    else if(samplerate == 44100) return 3;
+    fprintf(stderr, "Invalid samplerate: %d\n", samplerate);
+    return 1;
+}
+
+/* ------------------------------ adpcm ---------------------------------- */
+
+/* The SWF flavor of IMA ADPCM, with 2 to 5 bits per sample. Cheap enough
+   to not need any of the mp3 machinery. Doesn't resample, so the sound
+   is encoded at in_samplerate. */
+
+static const int adpcm_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+
+static const int adpcm_index2[2] = {-1, 2};
+static const int adpcm_index3[4] = {-1, -1, 2, 4};
+static const int adpcm_index4[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+static const int adpcm_index5[16] = {-1, -1, -1, -1, -1, -1, -1, -1, 1, 2, 4, 6, 8, 10, 13, 16};
+static const int*adpcm_indices[4] = {adpcm_index2, adpcm_index3, adpcm_index4, adpcm_index5};
+
+/* starts a new ADPCMSOUNDDATA record */
+static void adpcm_start(SOUNDENCODER*enc, TAG*tag)
+{
+    swf_SetBits(tag, enc->adpcm_bits-2, 2);
+    enc->packetpos = 0;
+}
+
+static void adpcm_encode(SOUNDENCODER*enc, TAG*tag, S16*samples, int num)
+{
+    int bits = enc->adpcm_bits;
+    int signmask = 1<<(bits-1);
+    const int*indextable = adpcm_indices[bits-2];
+    int predictor = enc->predictor;
+    int index = enc->index;
+    int t;
+    for(t=0;t<num;t++) {
+	int diff, step, vpdiff, code, k;
+	if(enc->packetpos == 0) {
+	    /* every packet starts with a verbatim sample. The step index
+	       is only stored with 6 bits, so limit it to 63 from here on */
+	    predictor = samples[t];
+	    if(index > 63)
+		index = 63;
+	    swf_SetBits(tag, (U16)predictor, 16);
+	    swf_SetBits(tag, index, 6);
+	    enc->packetpos = 1;
+	    continue;
+	}
+	/* same arithmetic as the decoder, so that the predictors don't drift apart */
+	diff = samples[t] - predictor;
+	code = 0;
+	if(diff < 0) {
+	    code = signmask;
+	    diff = -diff;
+	}
+	step = adpcm_steps[index];
+	vpdiff = 0;
+	for(k=signmask>>1;k;k>>=1) {
+	    if(diff >= step) {
+		code |= k;
+		diff -= step;
+		vpdiff += step;
+	    }
+	    step >>= 1;
+	}
+	vpdiff += step;
+	predictor += (code&signmask) ? -vpdiff : vpdiff;
+	if(predictor > 32767) predictor = 32767;
+	else if(predictor < -32768) predictor = -32768;
+
+	index += indextable[code&~signmask];
+	if(index < 0) index = 0;
+	else if(index > 88) index = 88;
+
+	swf_SetBits(tag, code, bits);
+	if(++enc->packetpos == ADPCM_PACKET_SAMPLES)
+	    enc->packetpos = 0;
+    }
+    enc->predictor = predictor;
+    enc->index = index;
+}
+
+/* ------------------------------- mp3 ----------------------------------- */
+
+#ifdef HAVE_LAME
 
 void null_errorf(const char *format, va_list ap)
 {
 }
 
-static void initlame()
+static lame_global_flags* initlame(SOUNDENCODER*enc)
 {
     unsigned char buf[4096];
     int bufsize = 1152*2;
 
-    lame_flags = lame_init();
+    lame_global_flags*lame_flags = lame_init();
 
-    lame_set_in_samplerate(lame_flags, swf_mp3_in_samplerate);
-    lame_set_num_channels(lame_flags, swf_mp3_channels);
+    lame_set_in_samplerate(lame_flags, enc->in_samplerate);
+    lame_set_num_channels(lame_flags, enc->channels);
     lame_set_scale(lame_flags, 0);
 
     // MPEG1    32, 44.1,   48khz
     // MPEG2    16, 22.05,  24
     // MPEG2.5   8, 11.025, 12
-    lame_set_out_samplerate(lame_flags, swf_mp3_out_samplerate);
+    lame_set_out_samplerate(lame_flags, enc->out_samplerate);
 
-    lame_set_quality(lame_flags, 0);
+    lame_set_quality(lame_flags, enc->quality);
     lame_set_mode(lame_flags, MONO/*3*/);
-    lame_set_brate(lame_flags, swf_mp3_bitrate);
+    lame_set_brate(lame_flags, enc->bitrate);
     //lame_set_compression_ratio(lame_flags, 11.025);
     lame_set_bWriteVbrTag(lame_flags, 0);
 
@@ -136,115 +274,349 @@ static void initlame()
     lame_encode_flush(lame_flags, buf, bufsize);
     //printf("init:flush():%d\n", len);
     lame_set_errorf(lame_flags, 0);
+    return lame_flags;
 }
 
-void swf_SetSoundStreamHead(TAG*tag, int avgnumsamples)
+/* every block is flushed completely, so that it doesn't depend on the bit
+   reservoir of the blocks before it */
+static int encode_block(lame_global_flags*lame_flags, S16*samples, int numsamples, U8*buf, int bufsize)
 {
-    int len;
+    int len = 0, l;
+    l = lame_encode_buffer(lame_flags, samples, samples, numsamples, &buf[len], bufsize-len);
+    if(l>0) len += l;
+    l = lame_encode_flush_nogap(lame_flags, &buf[len], bufsize-len);
+    if(l>0) len += l;
+    return len;
+}
 
-    U8 playbackrate = 1; // 0 = 5.5 Khz, 1 = 11 Khz, 2 = 22 Khz, 3 = 44 Khz
-    U8 playbacksize = 1; // 0 = 8 bit, 1 = 16 bit
-    U8 playbacktype = 0; // 0 = mono, 1 = stereo
-    U8 compression = 2; // 0 = raw, 1 = ADPCM, 2 = mp3, 3 = raw le, 6 = nellymoser
-    U8 rate = 1; // 0 = 5.5 Khz, 1 = 11 Khz, 2 = 22 Khz, 3 = 44 Khz
-    U8 size = 1; // 0 = 8 bit, 1 = 16 bit
-    U8 type = 0; // 0 = mono, 1 = stereo
+static void free_blocks(SOUNDENCODER*enc)
+{
+    int t;
+    for(t=enc->pos;t<enc->num_blocks;t++) {
+	if(enc->blocks[t].data)
+	    rfx_free(enc->blocks[t].data);
+    }
+    if(enc->blocks)
+	rfx_free(enc->blocks);
+    enc->blocks = 0;
+    enc->num_blocks = enc->pos = 0;
+}
 
-    if(swf_mp3_out_samplerate == 5512) playbackrate = rate = 0; // lame doesn't support this
-    else if(swf_mp3_out_samplerate == 11025) playbackrate = rate = 1;
-    else if(swf_mp3_out_samplerate == 22050) playbackrate = rate = 2;
-    else if(swf_mp3_out_samplerate == 44100) playbackrate = rate = 3;
-    else fprintf(stderr, "Invalid samplerate: %d\n", swf_mp3_out_samplerate);
-    
-    initlame();
+typedef struct _segment {
+    SOUNDENCODER*enc;
+    lame_global_flags*lame_flags;
+    S16*samples;
+    int start;
+    int end;
+    int overlap;
+} segment_t;
+
+/* runs in a worker thread. Only touches its own lame context and its
+   own range of enc->blocks. */
+static void* encode_segment(void*_segment)
+{
+    segment_t*s = (segment_t*)_segment;
+    int blocksize = swf_SoundEncoderBlockSize(s->enc);
+    U8*buf = (U8*)rfx_alloc(MP3_BLOCK_BUFSIZE);
+    int t;
+    for(t=s->start-s->overlap;t<s->end;t++) {
+	int len = encode_block(s->lame_flags, &s->samples[t*blocksize], blocksize, buf, MP3_BLOCK_BUFSIZE);
+	if(t>=s->start) {
+	    soundblock_t*b = &s->enc->blocks[t];
+	    b->len = len;
+	    b->data = (U8*)rfx_alloc(len?len:1);
+	    memcpy(b->data, buf, len);
+	}
+    }
+    rfx_free(buf);
+    return 0;
+}
 
-    swf_SetU8(tag,(playbackrate<<2)|(playbacksize<<1)|playbacktype);
-    swf_SetU8(tag,(compression<<4)|(rate<<2)|(size<<1)|type);
-    swf_SetU16(tag,avgnumsamples);
+void swf_SoundEncoderEncode(SOUNDENCODER*enc, S16*samples, int numblocks)
+{
+    int num_segments = enc->threads;
+    int segsize, t;
+    segment_t*segments;
+    thread_t**threads;
+
+    free_blocks(enc);
+    if(numblocks<=0 || enc->compression != 2)
+	return;
+    enc->blocks = (soundblock_t*)rfx_calloc(numblocks*sizeof(soundblock_t));
+    enc->num_blocks = numblocks;
+
+    if(num_segments > numblocks/MP3_MIN_SEGMENT_BLOCKS)
+	num_segments = numblocks/MP3_MIN_SEGMENT_BLOCKS;
+    if(num_segments < 1)
+	num_segments = 1;
+    segsize = (numblocks+num_segments-1)/num_segments;
+
+    segments = (segment_t*)rfx_calloc(num_segments*sizeof(segment_t));
+    threads = (thread_t**)rfx_calloc(num_segments*sizeof(thread_t*));
+
+    /* the first segment continues where the stream left off, every other
+       one gets a fresh encoder. Those are all set up here, as lame
+       initializes some global tables in lame_init_params(). */
+    if(!enc->lame_flags)
+	enc->lame_flags = initlame(enc);
+    for(t=0;t<num_segments;t++) {
+	segment_t*s = &segments[t];
+	s->enc = enc;
+	s->samples = samples;
+	s->start = t*segsize;
+	s->end = s->start+segsize < numblocks ? s->start+segsize : numblocks;
+	s->overlap = t ? (s->start < MP3_SEGMENT_OVERLAP ? s->start : MP3_SEGMENT_OVERLAP) : 0;
+	s->lame_flags = t ? initlame(enc) : enc->lame_flags;
+    }
+
+    for(t=1;t<num_segments;t++)
+	threads[t] = thread_start(encode_segment, &segments[t]);
+    encode_segment(&segments[0]);
+    for(t=1;t<num_segments;t++)
+	thread_join(threads[t]);
+
+    /* whatever is encoded next continues where the last segment ended */
+    for(t=0;t<num_segments-1;t++)
+	lame_close(segments[t].lame_flags);
+    enc->lame_flags = segments[num_segments-1].lame_flags;
+
+    rfx_free(threads);
+    rfx_free(segments);
 }
 
-void swf_SetSoundStreamBlock(TAG*tag, S16*samples, int seek, char first)
+static void mp3_stream_block(TAG*tag, SOUNDENCODER*enc, S16*samples, int seek, char first)
 {
-    char*buf;
-    int len = 0;
-    int bufsize = 16384;
-    int numsamples = (int)(((swf_mp3_out_samplerate > 22050) ? 1152 : 576) * ((double)swf_mp3_in_samplerate/swf_mp3_out_samplerate));
+    int numsamples = swf_SoundEncoderBlockSize(enc);
     int fs = 0;
+    int len;
 
-    buf = rfx_alloc(bufsize);
-    if(!buf)
-	return;
+    if(!enc->lame_flags)
+	enc->lame_flags = initlame(enc);
 
     if(first) {
-	fs = lame_get_framesize(lame_flags);
+	fs = lame_get_framesize(enc->lame_flags);
 	swf_SetU16(tag, fs * first); // samples per mp3 frame
 	swf_SetU16(tag, seek); // seek
     }
 
-    len += lame_encode_buffer(lame_flags, samples, samples, numsamples, &buf[len], bufsize-len);
-    len += lame_encode_flush_nogap(lame_flags, &buf[len], bufsize-len);
-    swf_SetBlock(tag, buf, len);
+    if(enc->pos < enc->num_blocks) {
+	/* encoded ahead of time */
+	soundblock_t*b = &enc->blocks[enc->pos++];
+	len = b->len;
+	swf_SetBlock(tag, b->data, len);
+	rfx_free(b->data);
+	b->data = 0;
+	if(enc->pos == enc->num_blocks)
+	    free_blocks(enc);
+    } else {
+	U8*buf = (U8*)rfx_alloc(MP3_BLOCK_BUFSIZE);
+	len = encode_block(enc->lame_flags, samples, numsamples, buf, MP3_BLOCK_BUFSIZE);
+	swf_SetBlock(tag, buf, len);
+	rfx_free(buf);
+    }
     if(len == 0) {
 	fprintf(stderr, "error: mp3 empty block, %d samples, first:%d, framesize:%d\n",
 		numsamples, first, fs);
-    }/* else {
-	fprintf(stderr, "ok: mp3 nonempty block, %d samples, first:%d, framesize:%d\n",
-		numsamples, first, fs);
-    }*/
-    rfx_free(buf);
+    }
 }
 
-void swf_SetSoundStreamEnd(TAG*tag)
+static void mp3_define(TAG*tag, SOUNDENCODER*enc, S16*samples, int blocks)
 {
-    lame_close (lame_flags);
+    int blocksize = swf_SoundEncoderBlockSize(enc);
+    int t;
+    if(enc->threads>1) {
+	swf_SoundEncoderEncode(enc, samples, blocks);
+	for(t=0;t<enc->num_blocks;t++)
+	    swf_SetBlock(tag, enc->blocks[t].data, enc->blocks[t].len);
+	free_blocks(enc);
+    } else {
+	U8*buf = (U8*)rfx_alloc(MP3_BLOCK_BUFSIZE);
+	if(!enc->lame_flags)
+	    enc->lame_flags = initlame(enc);
+	for(t=0;t<blocks;t++) {
+	    int len = encode_block(enc->lame_flags, &samples[t*blocksize], blocksize, buf, MP3_BLOCK_BUFSIZE);
+	    swf_SetBlock(tag, buf, len);
+	}
+	rfx_free(buf);
+    }
 }
 
-void swf_SetSoundDefine(TAG*tag, S16*samples, int num)
+#else
+
+void swf_SoundEncoderEncode(SOUNDENCODER*enc, S16*samples, int numblocks)
 {
-    char*buf;
-    int oldlen=0,len = 0;
-    int bufsize = 16384;
-    int blocksize = (int)(((swf_mp3_out_samplerate > 22050) ? 1152 : 576) * ((double)swf_mp3_in_samplerate/swf_mp3_out_samplerate));
-    int t;
+}
+
+#endif
+
+/* ---------------------------- the encoder ------------------------------ */
+
+SOUNDENCODER* swf_SoundEncoderNew(int in_samplerate, int out_samplerate, int channels, int bitrate)
+{
+    SOUNDENCODER*enc = (SOUNDENCODER*)rfx_calloc(sizeof(SOUNDENCODER));
+    enc->in_samplerate = in_samplerate;
+    enc->out_samplerate = out_samplerate;
+    enc->channels = channels;
+    enc->bitrate = bitrate;
+    enc->threads = 1;
+    enc->quality = 0;
+    enc->compression = 2;
+    enc->adpcm_bits = 4;
+    return enc;
+}
+
+void swf_SoundEncoderSetThreads(SOUNDENCODER*enc, int threads)
+{
+    enc->threads = threads>1 ? threads : 1;
+}
+
+void swf_SoundEncoderSetQuality(SOUNDENCODER*enc, int quality)
+{
+    enc->quality = quality<0 ? 0 : (quality>9 ? 9 : quality);
+}
+
+void swf_SoundEncoderSetCompression(SOUNDENCODER*enc, int compression, int adpcm_bits)
+{
+    if(compression != 1 && compression != 2) {
+	fprintf(stderr, "Unsupported sound compression: %d\n", compression);
+	return;
+    }
+    enc->compression = compression;
+    if(compression == 1)
+	enc->adpcm_bits = adpcm_bits<2 ? 2 : (adpcm_bits>5 ? 5 : adpcm_bits);
+}
+
+int swf_SoundEncoderBlockSize(SOUNDENCODER*enc)
+{
+    return (int)(((enc->out_samplerate > 22050) ? 1152 : 576) * ((double)enc->in_samplerate/enc->out_samplerate));
+}
+
+void swf_SoundEncoderDelete(SOUNDENCODER*enc)
+{
+#ifdef HAVE_LAME
+    free_blocks(enc);
+    if(enc->lame_flags)
+	lame_close(enc->lame_flags);
+#endif
+    rfx_free(enc);
+}
+
+void swf_SetSoundStreamHead2(TAG*tag, SOUNDENCODER*enc, int avgnumsamples)
+{
+    U8 playbackrate = 1; // 0 = 5.5 Khz, 1 = 11 Khz, 2 = 22 Khz, 3 = 44 Khz
+    U8 playbacksize = 1; // 0 = 8 bit, 1 = 16 bit
+    U8 playbacktype = 0; // 0 = mono, 1 = stereo
+    U8 compression = enc->compression; // 0 = raw, 1 = ADPCM, 2 = mp3, 3 = raw le, 6 = nellymoser
+    U8 rate = 1; // 0 = 5.5 Khz, 1 = 11 Khz, 2 = 22 Khz, 3 = 44 Khz
+    U8 size = 1; // 0 = 8 bit, 1 = 16 bit
+    U8 type = 0; // 0 = mono, 1 = stereo
+
+    if(compression == 1) {
+	playbackrate = rate = get_samplerate_code(enc->in_samplerate);
+    } else {
+#ifdef HAVE_LAME
+	playbackrate = rate = get_samplerate_code(enc->out_samplerate);
+	if(!enc->lame_flags)
+	    enc->lame_flags = initlame(enc);
+#else
+	swf_SetSoundStreamHead(tag, avgnumsamples);
+	return;
+#endif
+    }
+
+    swf_SetU8(tag,(playbackrate<<2)|(playbacksize<<1)|playbacktype);
+    swf_SetU8(tag,(compression<<4)|(rate<<2)|(size<<1)|type);
+    swf_SetU16(tag,avgnumsamples);
+}
+
+void swf_SetSoundStreamBlock2(TAG*tag, SOUNDENCODER*enc, S16*samples, int seek, char first)
+{
+    if(enc->compression == 1) {
+	/* every SoundStreamBlock tag holds one ADPCMSOUNDDATA record,
+	   which further blocks in the same tag continue */
+	if(first)
+	    adpcm_start(enc, tag);
+	adpcm_encode(enc, tag, samples, swf_SoundEncoderBlockSize(enc));
+	return;
+    }
+#ifdef HAVE_LAME
+    mp3_stream_block(tag, enc, samples, seek, first);
+#else
+    swf_SetSoundStreamBlock(tag, samples, seek, first);
+#endif
+}
+
+void swf_SetSoundDefine2(TAG*tag, SOUNDENCODER*enc, S16*samples, int num)
+{
+    int blocksize = swf_SoundEncoderBlockSize(enc);
     int blocks;
 
-    U8 compression = 2; // 0 = raw, 1 = ADPCM, 2 = mp3, 3 = raw le, 6 = nellymoser
+    U8 compression = enc->compression; // 0 = raw, 1 = ADPCM, 2 = mp3, 3 = raw le, 6 = nellymoser
     U8 rate = 1; // 0 = 5.5 Khz, 1 = 11 Khz, 2 = 22 Khz, 3 = 44 Khz
     U8 size = 1; // 0 = 8 bit, 1 = 16 bit
     U8 type = 0; // 0 = mono, 1 = stereo
     
-    if(swf_mp3_out_samplerate == 5512) rate = 0;
-    else if(swf_mp3_out_samplerate == 11025) rate = 1;
-    else if(swf_mp3_out_samplerate == 22050) rate = 2;
-    else if(swf_mp3_out_samplerate == 44100) rate = 3;
-    else fprintf(stderr, "Invalid samplerate: %d\n", swf_mp3_out_samplerate);
+    if(compression == 1) {
+	rate = get_samplerate_code(enc->in_samplerate);
+	swf_SetU8(tag,(compression<<4)|(rate<<2)|(size<<1)|type);
+	swf_SetU32(tag, num);
+	adpcm_start(enc, tag);
+	adpcm_encode(enc, tag, samples, num);
+	return;
+    }
+#ifdef HAVE_LAME
+    rate = get_samplerate_code(enc->out_samplerate);
 
     blocks = num / (blocksize);
 
     swf_SetU8(tag,(compression<<4)|(rate<<2)|(size<<1)|type);
 
-    swf_SetU32(tag, (int)(tag,blocks*blocksize / 
-	    ((double)swf_mp3_in_samplerate/swf_mp3_out_samplerate)) // account for resampling
+    swf_SetU32(tag, (int)(blocks*blocksize / 
+	    ((double)enc->in_samplerate/enc->out_samplerate)) // account for resampling
 	    );
 
-    buf = rfx_alloc(bufsize);
-    if(!buf)
-	return;
+    swf_SetU16(tag, 0); //delayseek
 
-    initlame();
+    mp3_define(tag, enc, samples, blocks);
+#else
+    swf_SetSoundDefine(tag, samples, num);
+#endif
+}
 
-    swf_SetU16(tag, 0); //delayseek
-    for(t=0;t<blocks;t++) {
-	int s;
-	U16*pos;
-	pos= &samples[t*blocksize];
-	len += lame_encode_buffer(lame_flags, pos, pos, blocksize, &buf[len], bufsize-len);
-	len += lame_encode_flush_nogap(lame_flags, &buf[len], bufsize-len);
-	swf_SetBlock(tag, buf, len);
-	len = 0;
-    }
+#ifdef HAVE_LAME
 
-    rfx_free(buf);
+/* the old interface, which keeps its encoder in a global */
+
+static SOUNDENCODER*global_encoder = 0;
+
+static SOUNDENCODER* new_global_encoder()
+{
+    if(global_encoder)
+	swf_SoundEncoderDelete(global_encoder);
+    global_encoder = swf_SoundEncoderNew(swf_mp3_in_samplerate, swf_mp3_out_samplerate, swf_mp3_channels, swf_mp3_bitrate);
+    return global_encoder;
+}
+
+void swf_SetSoundStreamHead(TAG*tag, int avgnumsamples)
+{
+    swf_SetSoundStreamHead2(tag, new_global_encoder(), avgnumsamples);
+}
+
+void swf_SetSoundStreamBlock(TAG*tag, S16*samples, int seek, char first)
+{
+    swf_SetSoundStreamBlock2(tag, global_encoder, samples, seek, first);
+}
+
+void swf_SetSoundStreamEnd(TAG*tag)
+{
+    if(global_encoder)
+	swf_SoundEncoderDelete(global_encoder);
+    global_encoder = 0;
+}
+
+void swf_SetSoundDefine(TAG*tag, S16*samples, int num)
+{
+    swf_SetSoundDefine2(tag, new_global_encoder(), samples, num);
 }
 
 #endif
@@ -274,6 +646,58 @@ void swf_SetSoundDefine(TAG*tag, S16*samples, int num)
 
 #endif
 
+#ifdef NO_MP3
+
+/* without sound support, an encoder object only stores its settings, and
+   everything else is passed on to the functions above */
+
+struct _SOUNDENCODER {
+    int in_samplerate;
+    int out_samplerate;
+};
+
+SOUNDENCODER* swf_SoundEncoderNew(int in_samplerate, int out_samplerate, int channels, int bitrate)
+{
+    SOUNDENCODER*enc = (SOUNDENCODER*)rfx_calloc(sizeof(SOUNDENCODER));
+    enc->in_samplerate = in_samplerate;
+    enc->out_samplerate = out_samplerate;
+    return enc;
+}
+void swf_SoundEncoderSetThreads(SOUNDENCODER*enc, int threads)
+{
+}
+void swf_SoundEncoderSetQuality(SOUNDENCODER*enc, int quality)
+{
+}
+void swf_SoundEncoderSetCompression(SOUNDENCODER*enc, int compression, int adpcm_bits)
+{
+}
+int swf_SoundEncoderBlockSize(SOUNDENCODER*enc)
+{
+    return (int)(((enc->out_samplerate > 22050) ? 1152 : 576) * ((double)enc->in_samplerate/enc->out_samplerate));
+}
+void swf_SoundEncoderEncode(SOUNDENCODER*enc, S16*samples, int numblocks)
+{
+}
+void swf_SoundEncoderDelete(SOUNDENCODER*enc)
+{
+    rfx_free(enc);
+}
+void swf_SetSoundStreamHead2(TAG*tag, SOUNDENCODER*enc, int avgnumsamples)
+{
+    swf_SetSoundStreamHead(tag, avgnumsamples);
+}
+void swf_SetSoundStreamBlock2(TAG*tag, SOUNDENCODER*enc, S16*samples, int seek, char first)
+{
+    swf_SetSoundStreamBlock(tag, samples, seek, first);
+}
+void swf_SetSoundDefine2(TAG*tag, SOUNDENCODER*enc, S16*samples, int num)
+{
+    swf_SetSoundDefine(tag, samples, num);
+}
+
+#endif
+
 #define SOUNDINFO_STOP 32
 #define SOUNDINFO_NOMULTIPLE 16
 #define SOUNDINFO_HASENVELOPE 8
@@ -331,3 +755,121 @@ void swf_SetSoundDefineMP3(TAG*tag, U8* data, unsigned length,
     swf_SetU16(tag, 0); //delayseek
     swf_SetBlock(tag, data, length);
 }
+
+#ifdef MAIN
+/* encode speed and output size of the mp3 presets and of adpcm, on the
+   given .wav files. Build with something like
+   gcc -DMAIN -I../.. -I../lame swfsound.c ../librfxswf.a ../libbase.a -lz -lm -lpthread -o swfsound_bench */
+
+#include <sys/time.h>
+#include "../wav.h"
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+/* decodes an ADPCMSOUNDDATA record, to measure the signal to noise ratio */
+static int adpcm_decode(TAG*tag, S16*out, int max)
+{
+    int bits, signmask, n = 0;
+    const int*indextable;
+    tag->pos = 0;
+    tag->readBit = 0;
+    bits = swf_GetBits(tag, 2)+2;
+    signmask = 1<<(bits-1);
+    indextable = adpcm_indices[bits-2];
+    while(n < max) {
+	int predictor = swf_GetSBits(tag, 16);
+	int index = swf_GetBits(tag, 6);
+	int t;
+	out[n++] = predictor;
+	for(t=1;t<ADPCM_PACKET_SAMPLES && n<max;t++) {
+	    int code = swf_GetBits(tag, bits);
+	    int step = adpcm_steps[index], vpdiff = 0, k;
+	    for(k=signmask>>1;k;k>>=1) {
+		if(code&k)
+		    vpdiff += step;
+		step >>= 1;
+	    }
+	    vpdiff += step;
+	    predictor += (code&signmask) ? -vpdiff : vpdiff;
+	    predictor = predictor>32767 ? 32767 : (predictor<-32768 ? -32768 : predictor);
+	    index += indextable[code&~signmask];
+	    index = index<0 ? 0 : (index>88 ? 88 : index);
+	    out[n++] = predictor;
+	}
+    }
+    return n;
+}
+
+int main(int argn, char*argv[])
+{
+    static const char*names[] = {"best", "high", "standard", "fast", "fastest"};
+    static const int qualities[] = {0, 2, 5, 7, 9};
+    int f;
+    for(f=1;f<argn;f++) {
+	struct WAVReader reader;
+	S16*samples;
+	int num, pos = 0, l, t, blocksize, numblocks;
+	int rate;
+	if(!wav_open(&reader, argv[f], 22050)) {
+	    fprintf(stderr, "Couldn't read %s\n", argv[f]);
+	    continue;
+	}
+	rate = 22050;
+	samples = (S16*)rfx_calloc((reader.total+1152)*sizeof(S16));
+	while((l = wav_read_mono(&reader, &samples[pos], reader.total-pos)) > 0)
+	    pos += l;
+	wav_close(&reader);
+	num = pos;
+	printf("%s: %.1f seconds at %d Hz\n", argv[f], (double)num/rate, rate);
+	printf("%-16s %10s %10s %10s %8s\n", "encoder", "seconds", "realtime", "bytes", "snr");
+
+	for(t=0;t<5+4;t++) {
+	    SOUNDENCODER*enc = swf_SoundEncoderNew(rate, rate, 1, 32);
+	    TAG*tag = swf_InsertTag(0, ST_DEFINESOUND);
+	    double start, time;
+	    char name[32];
+	    if(t<5) {
+		swf_SoundEncoderSetQuality(enc, qualities[t]);
+		sprintf(name, "mp3 %s", names[t]);
+	    } else {
+		swf_SoundEncoderSetCompression(enc, 1, t-5+2);
+		sprintf(name, "adpcm %d bit", t-5+2);
+	    }
+	    blocksize = swf_SoundEncoderBlockSize(enc);
+	    numblocks = (num+blocksize-1)/blocksize;
+	    start = seconds();
+	    swf_SetSoundDefine2(tag, enc, samples, numblocks*blocksize);
+	    time = seconds() - start;
+	    printf("%-16s %10.3f %9.0fx %10d", name, time, (double)num/rate/time, tag->len);
+	    if(t>=5) {
+		S16*out = (S16*)rfx_alloc(num*sizeof(S16));
+		double s = 0, e = 0;
+		int i;
+		{
+		    /* skip the format byte and the sample count */
+		    TAG*data = swf_InsertTag(0, ST_DEFINESOUND);
+		    swf_SetBlock(data, &tag->data[5], tag->len-5);
+		    adpcm_decode(data, out, num);
+		    swf_DeleteTag(0, data);
+		}
+		for(i=0;i<num;i++) {
+		    s += (double)samples[i]*samples[i];
+		    e += (double)(samples[i]-out[i])*(samples[i]-out[i]);
+		}
+		printf(" %6.1fdB", e>0 ? 10*log10(s/e) : 99.0);
+		rfx_free(out);
+	    }
+	    printf("\n");
+	    swf_DeleteTag(0, tag);
+	    swf_SoundEncoderDelete(enc);
+	}
+	rfx_free(samples);
+    }
+    return 0;
+}
+#endif
@@ -45,6 +45,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 #else
 #undef HAVE_STAT
 #endif
+#if !defined(WIN32) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
 
 #if defined(CYGWIN)
 char path_seperator = '/';
@@ -355,3 +358,73 @@ int open_file_or_stdin(const char*filename, int attr)
     return f;
 }
 
+
+struct _thread {
+#if defined(WIN32)
+    HANDLE handle;
+    void*(*func)(void*);
+    void*data;
+#elif defined(HAVE_PTHREAD_H)
+    pthread_t handle;
+#endif
+    char synchronous;
+    void*result;
+};
+
+#ifdef WIN32
+static DWORD WINAPI thread_main(LPVOID _thread)
+{
+    thread_t*thread = (thread_t*)_thread;
+    thread->result = thread->func(thread->data);
+    return 0;
+}
+#endif
+
+thread_t* thread_start(void*(*func)(void*), void*data)
+{
+    thread_t*thread = (thread_t*)malloc(sizeof(thread_t));
+    memset(thread, 0, sizeof(thread_t));
+#if defined(WIN32)
+    thread->func = func;
+    thread->data = data;
+    thread->handle = CreateThread(0, 0, thread_main, thread, 0, 0);
+    if(thread->handle)
+	return thread;
+#elif defined(HAVE_PTHREAD_H)
+    if(!pthread_create(&thread->handle, 0, func, data))
+	return thread;
+#endif
+    /* no threads available- do the work synchronously */
+    thread->synchronous = 1;
+    thread->result = func(data);
+    return thread;
+}
+
+void* thread_join(thread_t*thread)
+{
+    if(!thread->synchronous) {
+#if defined(WIN32)
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+#elif defined(HAVE_PTHREAD_H)
+	pthread_join(thread->handle, &thread->result);
+#endif
+    }
+    void*result = thread->result;
+    free(thread);
+    return result;
+}
+
+int os_get_number_of_cpus()
+{
+#if defined(WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    int num = sysconf(_SC_NPROCESSORS_ONLN);
+    return num>0 ? num : 1;
+#else
+    return 1;
+#endif
+}
@@ -55,6 +55,13 @@ int file_size(const char*filename);
 
 int open_file_or_stdin(const char*filename, int attr);
 
+/* minimal thread support. If the system has no threads, thread_start()
+   runs the function right away, and thread_join() just returns its result. */
+typedef struct _thread thread_t;
+thread_t* thread_start(void*(*func)(void*), void*data);
+void* thread_join(thread_t*thread);
+int os_get_number_of_cpus();
+
 #ifdef __cplusplus
 }
 #endif
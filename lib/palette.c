@@ -0,0 +1,96 @@
+/* palette.c
+
+   Exact color counting for 32 bit images.
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <string.h>
+#include "../config.h"
+#include "palette.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef unsigned int u32;
+
+/* open addressing, at most half full */
+#define HASH_SIZE (PALETTE_MAX_COLORS*2)
+#define HASH_BITS 9
+
+static inline u32 hash_color(u32 c)
+{
+    return (c * 0x9e3779b1u) >> (32 - HASH_BITS);
+}
+
+/* returns the position of the first pixel after pos which differs from c */
+static inline int skip_run(const u32*pixels, int pos, int num_pixels, u32 c)
+{
+    int t = pos;
+#ifdef __SSE2__
+    __m128i c4 = _mm_set1_epi32(c);
+    while(t+4 <= num_pixels) {
+	__m128i p4 = _mm_loadu_si128((const __m128i*)&pixels[t]);
+	if(_mm_movemask_epi8(_mm_cmpeq_epi32(p4, c4)) != 0xffff)
+	    break;
+	t += 4;
+    }
+#endif
+    while(t < num_pixels && pixels[t] == c)
+	t++;
+    return t;
+}
+
+int palette_count_colors(const void*_pixels, int num_pixels, int max_colors, u32*palette, int*counts)
+{
+    const u32*pixels = (const u32*)_pixels;
+    u32 keys[HASH_SIZE];
+    unsigned short index[HASH_SIZE]; // palette index+1, 0 = empty slot
+    u32 colors[PALETTE_MAX_COLORS];
+    int num = 0;
+    int t;
+
+    if(max_colors > PALETTE_MAX_COLORS)
+	max_colors = PALETTE_MAX_COLORS;
+    memset(index, 0, sizeof(index));
+
+    t = 0;
+    while(t < num_pixels) {
+	u32 c = pixels[t];
+	int start = t++;
+	/* only go looking for a run if there is one */
+	if(t < num_pixels && pixels[t] == c)
+	    t = skip_run(pixels, t+1, num_pixels, c);
+
+	u32 h = hash_color(c);
+	while(index[h] && keys[h] != c)
+	    h = (h+1)&(HASH_SIZE-1);
+	if(!index[h]) {
+	    if(num == max_colors)
+		return -1;
+	    keys[h] = c;
+	    colors[num] = c;
+	    if(counts)
+		counts[num] = 0;
+	    index[h] = ++num;
+	}
+	if(counts)
+	    counts[index[h]-1] += t - start;
+    }
+    if(palette)
+	memcpy(palette, colors, num*sizeof(u32));
+    return num;
+}
@@ -0,0 +1,41 @@
+/* palette.h
+
+   Exact color counting for 32 bit images.
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __palette_h__
+#define __palette_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PALETTE_MAX_COLORS 256
+
+/* Counts the distinct 32 bit values in pixels[0..num_pixels-1]. Stops as soon
+   as there are more than max_colors (at most PALETTE_MAX_COLORS) of them, and
+   returns -1 in that case. Otherwise, returns the number of colors, and if
+   palette/counts are given, stores the colors (in the order in which they first
+   appear in the image) and how often each of them occurs. */
+int palette_count_colors(const void*pixels, int num_pixels, int max_colors, unsigned int*palette, int*counts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
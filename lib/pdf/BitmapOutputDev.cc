@@ -259,7 +259,7 @@ void BitmapOutputDev::flushBitmap()
 
 	int rangex = xmax-xmin;
 	int rangey = ymax-ymin;
-	gfximage_t*img = (gfximage_t*)malloc(sizeof(gfximage_t)); 
+	gfximage_t*img = (gfximage_t*)calloc(1, sizeof(gfximage_t));
 	img->data = (gfxcolor_t*)malloc(rangex * rangey * 4);
 	img->width = rangex;
 	img->height = rangey;
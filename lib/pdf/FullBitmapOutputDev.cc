@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <memory.h>
+#include <string.h>
 #include "FullBitmapOutputDev.h"
 #include "CharOutputDev.h"
 
@@ -34,6 +35,8 @@
 #endif
 
 #include "../log.h"
+#include "../mem.h"
+#include "../os.h"
 #include "../png.h"
 #include "../devices/record.h"
 
@@ -54,6 +57,9 @@ FullBitmapOutputDev::FullBitmapOutputDev(InfoOutputDev*info, PDFDoc*doc, int*pag
     /* device for handling links */
     this->gfxdev = new CharOutputDev(info, this->doc, page2page, num_pages, x, y, x1, y1, x2, y2);
 
+    this->config_bands = 1;
+    this->userPW = 0;
+
     this->rgbdev->startDoc(this->xref);
 }
 FullBitmapOutputDev::~FullBitmapOutputDev()
@@ -82,6 +88,13 @@ void FullBitmapOutputDev::setDevice(gfxdevice_t*dev)
 
 void FullBitmapOutputDev::setParameter(const char*key, const char*value)
 {
+    if(!strcmp(key, "bands")) {
+	this->config_bands = atoi(value);
+    }
+}
+void FullBitmapOutputDev::setUserPassword(GString*userPW)
+{
+    this->userPW = userPW;
 }
 static void getBitmapBBox(Guchar*alpha, int width, int height, int*xmin, int*ymin, int*xmax, int*ymax)
 {
@@ -148,7 +161,7 @@ void FullBitmapOutputDev::flushBitmap()
 
     int rangex = xmax-xmin;
     int rangey = ymax-ymin;
-    gfximage_t*img = (gfximage_t*)malloc(sizeof(gfximage_t)); 
+    gfximage_t*img = (gfximage_t*)rfx_calloc(sizeof(gfximage_t));
     img->data = (gfxcolor_t*)malloc(rangex * rangey * 4);
     img->width = rangex;
     img->height = rangey;
@@ -184,6 +197,146 @@ void FullBitmapOutputDev::flushBitmap()
     free(img->data);img->data=0;free(img);img=0;
 }
 
+typedef struct _band {
+    GString*fileName;
+    GString*userPW;
+    int pageNum;
+    double hDPI, vDPI;
+    int rotate;
+    GBool useMediaBox, crop, printing;
+    GBool antialias;
+
+    SplashBitmap*bitmap; // the page bitmap, of which we render rows y1 to y2
+    int y1,y2;
+} band_t;
+
+/* Renders rows y1 to y2 of a page. Rendering a slice of the page via
+   displayPageSlice() would give us a coordinate system, and clip region,
+   of our own, which moves text by a pixel here and there and makes xpdf
+   subdivide shadings and place pattern tiles differently than for the
+   whole page. So instead we render the whole page, in the page's own
+   coordinate system moved up by y1 rows, onto a bitmap which only
+   has room for our rows. (Moving the coordinate system still changes how
+   xpdf rounds device coordinates, so edges, glyphs and images which lie
+   exactly on a pixel boundary can end up one pixel off.)
+
+   endPage() would composite the background into the bitmap, but like
+   FullBitmapOutputDev we need the alpha channel for determining
+   the bitmap's bounding box */
+class BandOutputDev: public SplashOutputDev {
+public:
+    BandOutputDev(int width, int y1, int y2):SplashOutputDev(splashModeRGB8, 1, gFalse, splash_white, gTrue, gTrue) {
+	this->width = width;
+	this->y1 = y1;
+	this->y2 = y2;
+    }
+    virtual void startPage(int pageNum, GfxState *state) {
+	state->shiftCTM(0, -y1);
+	/* SplashOutputDev sizes the bitmap after the state's page size */
+	PDFRectangle box;
+	box.x1 = box.y1 = 0;
+	box.x2 = width * 72.0 / state->getHDPI();
+	box.y2 = (y2 - y1) * 72.0 / state->getVDPI();
+	GfxState bandstate(state->getHDPI(), state->getVDPI(), &box, 0, upsideDown());
+	SplashOutputDev::startPage(pageNum, &bandstate);
+	updateCTM(state, 1, 0, 0, 1, 0, 0);
+    }
+    virtual void endPage() {}
+private:
+    int width;
+    int y1,y2;
+};
+
+static void* render_band(void*_band)
+{
+    band_t*band = (band_t*)_band;
+    PDFDoc*doc = new PDFDoc(band->fileName->copy(), band->userPW ? band->userPW->copy() : NULL);
+    if(!doc->isOk()) {
+	msg("<error> Couldn't reopen %s for rendering page %d", band->fileName->getCString(), band->pageNum);
+	delete doc;
+	return 0;
+    }
+    int width = band->bitmap->getWidth();
+    BandOutputDev*dev = new BandOutputDev(width, band->y1, band->y2);
+    dev->setVectorAntialias(band->antialias);
+    dev->startDoc(doc->getXRef());
+
+    doc->displayPage(dev, band->pageNum, band->hDPI, band->vDPI, band->rotate,
+		     band->useMediaBox, band->crop, band->printing);
+
+    /* copy our rows into the page bitmap */
+    SplashBitmap*slice = dev->getBitmap();
+    int w = slice->getWidth() < width ? slice->getWidth() : width;
+    int h = slice->getHeight() < band->y2 - band->y1 ? slice->getHeight() : band->y2 - band->y1;
+    int y;
+    for(y=0;y<h;y++) {
+	memcpy(band->bitmap->getDataPtr() + (band->y1+y)*band->bitmap->getRowSize(),
+	       slice->getDataPtr() + y*slice->getRowSize(), w*sizeof(SplashColor));
+	memcpy(band->bitmap->getAlphaPtr() + (band->y1+y)*width,
+	       slice->getAlphaPtr() + y*slice->getWidth(), w);
+    }
+    delete dev;
+    delete doc;
+    return 0;
+}
+
+/* Render the page in config_bands horizontal slices, concurrently. Every
+   slice gets its own PDFDoc and SplashOutputDev (xpdf documents are
+   not thread-safe), the results are copied into our own page bitmap, which
+   is then flushed like in the single-threaded case. */
+void FullBitmapOutputDev::renderBands(Page *page, double hDPI, double vDPI, int rotate,
+				      GBool useMediaBox, GBool crop, GBool printing)
+{
+    /* set up the page the same way Page::displaySlice() does */
+    int pageRotate = rotate + page->getRotate();
+    if(pageRotate >= 360) pageRotate -= 360;
+    else if(pageRotate < 0) pageRotate += 360;
+
+    PDFRectangle box;
+    GBool pageCrop = crop;
+    page->makeBox(hDPI, vDPI, pageRotate, useMediaBox, this->upsideDown(), -1, -1, -1, -1, &box, &pageCrop);
+    GfxState*state = new GfxState(hDPI, vDPI, &box, pageRotate, this->upsideDown());
+    this->startPage(page->getNum(), state);
+    this->setDefaultCTM(state->getCTM());
+
+    SplashBitmap*bitmap = rgbdev->getBitmap();
+    int height = bitmap->getHeight();
+    int num = this->config_bands;
+    if(num > height)
+	num = height;
+
+    msg("<verbose> Rendering page %d in %d bands", page->getNum(), num);
+
+    band_t*bands = (band_t*)rfx_calloc(sizeof(band_t)*num);
+    thread_t**threads = (thread_t**)rfx_calloc(sizeof(thread_t*)*num);
+    int t;
+    for(t=0;t<num;t++) {
+	band_t*b = &bands[t];
+	b->fileName = this->doc->getFileName();
+	b->userPW = this->userPW;
+	b->pageNum = page->getNum();
+	b->hDPI = hDPI;
+	b->vDPI = vDPI;
+	b->rotate = rotate;
+	b->useMediaBox = useMediaBox;
+	b->crop = crop;
+	b->printing = printing;
+	b->antialias = rgbdev->getVectorAntialias();
+	b->bitmap = bitmap;
+	b->y1 = height*t/num;
+	b->y2 = height*(t+1)/num;
+	threads[t] = thread_start(render_band, b);
+    }
+    for(t=0;t<num;t++) {
+	thread_join(threads[t]);
+    }
+    free(threads);
+    free(bands);
+
+    this->endPage();
+    delete state;
+}
+
 GBool FullBitmapOutputDev::checkPageSlice(Page *page, double hDPI, double vDPI,
              int rotate, GBool useMediaBox, GBool crop,
              int sliceX, int sliceY, int sliceW, int sliceH,
@@ -193,6 +346,11 @@ GBool FullBitmapOutputDev::checkPageSlice(Page *page, double hDPI, double vDPI,
 {
     this->setPage(page);
     gfxdev->setPage(page);
+    if(this->config_bands > 1 && sliceW < 0 && sliceH < 0) {
+	renderBands(page, hDPI, vDPI, rotate, useMediaBox, crop, printing);
+	/* we already did everything, the page doesn't need to be displayed again */
+	return gFalse;
+    }
     return gTrue;
 }
 
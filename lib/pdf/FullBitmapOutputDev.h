@@ -43,6 +43,8 @@ public:
     virtual void setDevice(gfxdevice_t*dev);
     virtual void setParameter(const char*key, const char*value);
 
+    void setUserPassword(GString*userPW);
+
     // OutputDev:
     virtual GBool upsideDown();
     virtual GBool useDrawChar();
@@ -174,7 +176,11 @@ public:
     
 private:
     void flushBitmap();
+    void renderBands(Page *page, double hDPI, double vDPI, int rotate,
+		     GBool useMediaBox, GBool crop, GBool printing);
     char config_extrafontdata;
+    int config_bands;
+    GString*userPW;
     SplashOutputDev*rgbdev;
 
     CharOutputDev*gfxdev;
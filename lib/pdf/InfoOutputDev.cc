@@ -4,6 +4,7 @@
 #include "SplashOutputDev.h"
 #include "GfxState.h"
 #include "CommonOutputDev.h"
+#include "glyphcache.h"
 #include "../log.h"
 #include "../types.h"
 #include "../q.h"
@@ -105,6 +106,7 @@ InfoOutputDev::InfoOutputDev(XRef*xref)
     SplashColor white = {255,255,255};
     splash = new SplashOutputDev(splashModeRGB8,320,0,white,0,0);
     splash->startDoc(xref);
+    this->xref = xref;
     last_font = 0;
     current_type3_font = 0;
     fontcache = dict_new2(&fontclass_type);
@@ -145,6 +147,7 @@ FontInfo::FontInfo(fontclass_t*fontclass)
     this->num_glyphs = 0;
     this->glyphs = 0;
     this->gfxfont = 0;
+    this->fonthash = 0;
     this->space_char = -1;
     this->ascender = 0;
     this->descender = 0;
@@ -168,6 +171,7 @@ FontInfo::~FontInfo()
     free(glyphs);glyphs=0;
     if(this->gfxfont)
         gfxfont_free(this->gfxfont);
+    if(this->fonthash) {free(this->fonthash);this->fonthash=0;}
 
     if(this->fontclass) {
 	fontclass_type.free(this->fontclass);
@@ -297,39 +301,43 @@ gfxfont_t* FontInfo::createGfxFont()
 	    gfxglyph_t*glyph = &font->glyphs[font->num_glyphs];
 	    this->glyphs[t]->glyphid = font->num_glyphs;
 	    glyph->unicode = this->glyphs[t]->unicode;
-	    gfxdrawer_t drawer;
-	    gfxdrawer_target_gfxline(&drawer);
-	    int s;
-	    int count = 0;
 	    double xmax = 0;
-	    for(s=0;s<len;s++) {
-		Guchar f;
-		double x, y;
-		path->getPoint(s, &x, &y, &f);
-		if(!s || x > xmax)
-		    xmax = x;
-		if(f&splashPathFirst) {
-		    drawer.moveTo(&drawer, x, y);
-		}
-		if(f&splashPathCurve) {
-		    double x2,y2;
-		    path->getPoint(++s, &x2, &y2, &f);
+	    glyph->line = glyphcache_getline(this->fonthash, t, quality, &xmax);
+	    if(!glyph->line) {
+		gfxdrawer_t drawer;
+		gfxdrawer_target_gfxline(&drawer);
+		int s;
+		int count = 0;
+		for(s=0;s<len;s++) {
+		    Guchar f;
+		    double x, y;
+		    path->getPoint(s, &x, &y, &f);
+		    if(!s || x > xmax)
+			xmax = x;
+		    if(f&splashPathFirst) {
+			drawer.moveTo(&drawer, x, y);
+		    }
 		    if(f&splashPathCurve) {
-			double x3,y3;
-			path->getPoint(++s, &x3, &y3, &f);
-			gfxdraw_cubicTo(&drawer, x, y, x2, y2, x3, y3, quality);
+			double x2,y2;
+			path->getPoint(++s, &x2, &y2, &f);
+			if(f&splashPathCurve) {
+			    double x3,y3;
+			    path->getPoint(++s, &x3, &y3, &f);
+			    gfxdraw_cubicTo(&drawer, x, y, x2, y2, x3, y3, quality);
+			} else {
+			    drawer.splineTo(&drawer, x, y, x2, y2);
+			}
 		    } else {
-			drawer.splineTo(&drawer, x, y, x2, y2);
+			drawer.lineTo(&drawer, x, y);
 		    }
-		} else {
-		    drawer.lineTo(&drawer, x, y);
+		 //   printf("%f %f %s %s\n", x, y, (f&splashPathCurve)?"curve":"",
+		 //                           (f&splashPathFirst)?"first":"",
+		 //                           (f&splashPathLast)?"last":"");
 		}
-	     //   printf("%f %f %s %s\n", x, y, (f&splashPathCurve)?"curve":"",
-	     //       			  (f&splashPathFirst)?"first":"",
-	     //       			  (f&splashPathLast)?"last":"");
-	    }
 
-	    glyph->line = (gfxline_t*)drawer.result(&drawer);
+		glyph->line = (gfxline_t*)drawer.result(&drawer);
+		glyphcache_putline(this->fonthash, t, quality, glyph->line, xmax);
+	    }
 	    if(this->glyphs[t]->advance>0) {
 		glyph->advance = this->glyphs[t]->advance;
 	    } else {
@@ -681,6 +689,17 @@ static inline void fontclass_clear(fontclass_t*cls)
     free(cls->id);cls->id=0;
 }
 
+/* the file a (possibly substituted) font was loaded from */
+static const char* splashfont_filename(SplashFont*font)
+{
+#ifdef HAVE_POPPLER
+    return 0;
+#else
+    GString*name = font->getFontFile()->getFileName();
+    return name?name->getCString():0;
+#endif
+}
+
 FontInfo* InfoOutputDev::getOrCreateFontInfo(GfxState*state)
 {
     GfxFont*font = state->getFont();
@@ -691,6 +710,8 @@ FontInfo* InfoOutputDev::getOrCreateFontInfo(GfxState*state)
 	fontinfo = new FontInfo(&fontclass);
 	dict_put(this->fontcache, &fontclass, fontinfo);
 	fontinfo->font = font;
+	if(current_splash_font)
+	    fontinfo->fonthash = glyphcache_fonthash(font, xref, splashfont_filename(current_splash_font));
 	fontinfo->max_size = 0;
 	if(current_splash_font) {
 	    fontinfo->ascender = current_splash_font->ascender;
@@ -778,9 +799,13 @@ void InfoOutputDev::drawChar(GfxState *state, double x, double y,
     if(!g) {
 	g = fontinfo->glyphs[code] = new GlyphInfo();
 	g->advance_max = 0;
-	current_splash_font->last_advance = -1;
-	g->path = current_splash_font->getGlyphPath(code);
-	g->advance = current_splash_font->last_advance;
+	g->path = glyphcache_getpath(fontinfo->fonthash, code, &g->advance);
+	if(!g->path) {
+	    current_splash_font->last_advance = -1;
+	    g->path = current_splash_font->getGlyphPath(code);
+	    g->advance = current_splash_font->last_advance;
+	    glyphcache_putpath(fontinfo->fonthash, code, g->path, g->advance);
+	}
 	g->unicode = 0;
     }
     if(uLen && ((u[0]>=32 && u[0]<g->unicode) || !g->unicode)) {
@@ -852,6 +877,8 @@ GBool InfoOutputDev::beginType3Char(GfxState *state, double x, double y, double
 	fontinfo = new FontInfo(&fontclass);
 	dict_put(this->fontcache, &fontclass, fontinfo);
 	fontinfo->font = font;
+	if(current_splash_font)
+	    fontinfo->fonthash = glyphcache_fonthash(font, xref, splashfont_filename(current_splash_font));
 	fontinfo->max_size = 0;
 	num_fonts++;
     }
@@ -98,6 +98,7 @@ public:
     void resetPositioning();
 
     GfxFont*font;
+    char*fonthash; // key into the glyph cache, or NULL
     double max_size;
     int num_glyphs;
     GlyphInfo**glyphs;
@@ -117,6 +118,7 @@ class InfoOutputDev: public OutputDev
 {
     GlyphInfo* currentglyph;
     SplashOutputDev*splash;
+    XRef*xref;
     char previous_was_char;
     Page *page;
 
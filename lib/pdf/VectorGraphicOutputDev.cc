@@ -102,6 +102,7 @@ VectorGraphicOutputDev::VectorGraphicOutputDev(InfoOutputDev*info, PDFDoc*doc, i
     this->config_disable_polygon_conversion = 0;
     this->config_multiply = 1;
     this->config_textonly = 0;
+    this->config_jpegpassthrough = 0;
 
     /* for processing drawChar events */
     this->charDev = new CharOutputDev(info, doc, page2page, num_pages, x, y, x1, y1, x2, y2);
@@ -129,6 +130,8 @@ void VectorGraphicOutputDev::setParameter(const char*key, const char*value)
         this->config_disable_polygon_conversion = atoi(value);
     } else if(!strcmp(key,"disable_tiling_pattern_fills")) {
         this->config_disable_tiling_pattern_fills = atoi(value);
+    } else if(!strcmp(key,"jpegpassthrough")) {
+        this->config_jpegpassthrough = atoi(value);
     }
     this->charDev->setParameter(key, value);
 }
@@ -1030,7 +1033,8 @@ static void drawimage(gfxdevice_t*dev, gfxcolor_t* data, int sizex,int sizey,
         double x1,double y1,
         double x2,double y2,
         double x3,double y3,
-        double x4,double y4, int type, int multiply)
+        double x4,double y4, int type, int multiply,
+        const unsigned char*jpeg, int jpeg_size)
 {
     gfxcolor_t*newpic=0;
     
@@ -1064,9 +1068,12 @@ static void drawimage(gfxdevice_t*dev, gfxcolor_t* data, int sizex,int sizey,
     m.ty = p1.y - 0.5*multiply;
 
     gfximage_t img;
+    memset(&img, 0, sizeof(img));
     img.data = (gfxcolor_t*)data;
     img.width = sizex;
     img.height = sizey;
+    img.jpeg = jpeg;
+    img.jpeg_size = jpeg_size;
   
     if(type == IMAGE_TYPE_JPEG)
 	/* TODO: pass image_dpi to device instead */
@@ -1077,15 +1084,66 @@ static void drawimage(gfxdevice_t*dev, gfxcolor_t* data, int sizex,int sizey,
 }
 
 void drawimagejpeg(gfxdevice_t*dev, gfxcolor_t*mem, int sizex,int sizey, 
-        double x1,double y1, double x2,double y2, double x3,double y3, double x4,double y4, int multiply)
+        double x1,double y1, double x2,double y2, double x3,double y3, double x4,double y4, int multiply,
+        const unsigned char*jpeg, int jpeg_size)
 {
-    drawimage(dev,mem,sizex,sizey,x1,y1,x2,y2,x3,y3,x4,y4, IMAGE_TYPE_JPEG, multiply);
+    drawimage(dev,mem,sizex,sizey,x1,y1,x2,y2,x3,y3,x4,y4, IMAGE_TYPE_JPEG, multiply, jpeg, jpeg_size);
 }
 
 void drawimagelossless(gfxdevice_t*dev, gfxcolor_t*mem, int sizex,int sizey, 
         double x1,double y1, double x2,double y2, double x3,double y3, double x4,double y4, int multiply)
 {
-    drawimage(dev,mem,sizex,sizey,x1,y1,x2,y2,x3,y3,x4,y4, IMAGE_TYPE_LOSSLESS, multiply);
+    drawimage(dev,mem,sizex,sizey,x1,y1,x2,y2,x3,y3,x4,y4, IMAGE_TYPE_LOSSLESS, multiply, 0, 0);
+}
+
+/* Returns the undecoded data of a DCTDecode image, if the device can show
+   it as-is: The decoded pixels need to be exactly what a jpeg decoder makes
+   of the data, so images with a decode array, non-device colorspaces or
+   decode parameters (ColorTransform) are rejected. Whether the jpeg itself
+   is baseline is left to the device. */
+static unsigned char* getJPEGData(Stream*str, GfxImageColorMap*colorMap, GBool inlineImg, int*len)
+{
+    /* inline image data can't be read twice */
+    if(str->getKind()!=strDCT || !colorMap || inlineImg)
+	return 0;
+    GfxColorSpaceMode mode = colorMap->getColorSpace()->getMode();
+    if(colorMap->getBits()!=8 || (mode!=csDeviceRGB && mode!=csDeviceGray))
+	return 0;
+    int t;
+    for(t=0;t<colorMap->getNumPixelComps();t++) {
+	if(colorMap->getDecodeLow(t)!=0.0 || colorMap->getDecodeHigh(t)!=1.0)
+	    return 0;
+    }
+    Dict*dict = str->getDict();
+    if(!dict)
+	return 0;
+    Object obj;
+    dict->lookup("DecodeParms", &obj);
+    if(obj.isNull()) {
+	obj.free();
+	dict->lookup("DP", &obj);
+    }
+    GBool hasParms = !obj.isNull();
+    obj.free();
+    if(hasParms)
+	return 0;
+
+    Stream*raw = str->getNextStream();
+    if(!raw)
+	return 0;
+    int size = 65536, pos = 0, c;
+    unsigned char*data = (unsigned char*)malloc(size);
+    raw->reset();
+    while((c = raw->getChar()) != EOF) {
+	if(pos == size) {
+	    size *= 2;
+	    data = (unsigned char*)realloc(data, size);
+	}
+	data[pos++] = c;
+    }
+    raw->close();
+    *len = pos;
+    return data;
 }
 
 
@@ -1147,6 +1205,12 @@ void VectorGraphicOutputDev::drawGeneralImage(GfxState *state, Object *ref, Stre
       maskStr->close();
   }
   
+  /* fetch the jpeg data before the image stream starts decoding it */
+  unsigned char*jpeg = 0;
+  int jpeg_size = 0;
+  if(config_jpegpassthrough && !mask && !maskStr)
+      jpeg = getJPEGData(str, colorMap, inlineImg, &jpeg_size);
+
   imgStr = new ImageStream(str, width, ncomps,bits);
   imgStr->reset();
 
@@ -1162,6 +1226,8 @@ void VectorGraphicOutputDev::drawGeneralImage(GfxState *state, Object *ref, Stre
       delete imgStr;
       if(maskbitmap)
 	  free(maskbitmap);
+      if(jpeg)
+	  free(jpeg);
       return;
   }
 
@@ -1296,12 +1362,13 @@ void VectorGraphicOutputDev::drawGeneralImage(GfxState *state, Object *ref, Stre
 	}
       }
       if(str->getKind()==strDCT)
-	  drawimagejpeg(device, pic, width, height, x1,y1,x2,y2,x3,y3,x4,y4, config_multiply);
+	  drawimagejpeg(device, pic, width, height, x1,y1,x2,y2,x3,y3,x4,y4, config_multiply, jpeg, jpeg_size);
       else
 	  drawimagelossless(device, pic, width, height, x1,y1,x2,y2,x3,y3,x4,y4, config_multiply);
       delete[] pic;
       delete imgStr;
       if(maskbitmap) free(maskbitmap);
+      if(jpeg) free(jpeg);
       return;
   } else {
       gfxcolor_t*pic=new gfxcolor_t[width*height];
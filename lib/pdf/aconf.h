@@ -15,6 +15,11 @@
 
 #define TEXTOUT_WORD_LIST 1
 
+/* FullBitmapOutputDev renders pages in several threads */
+#ifdef HAVE_PTHREAD_H
+#define MULTITHREADED 1
+#endif
+
 // todo:
 //
 // HAVE_STRINGS_H
@@ -64,6 +64,400 @@ ibbox_t*get_bitmap_bboxes_simple(unsigned char*alpha, int width, int height, int
     return bbox;
 }
 
+ibbox_t ibbox_clip(ibbox_t* outer, ibbox_t* inner)
+{
+    ibbox_t i = {inner->xmin, inner->ymin, inner->xmax, inner->ymax, 0};
+    if(i.xmax > outer->xmax) i.xmax = outer->xmax;
+    if(i.ymax > outer->ymax) i.ymax = outer->ymax;
+    if(i.xmax < outer->xmin) i.xmax = outer->xmin;
+    if(i.ymax < outer->ymin) i.ymax = outer->ymin;
+    
+    if(i.xmin > outer->xmax) i.xmin = outer->xmax;
+    if(i.ymin > outer->ymax) i.ymin = outer->ymax;
+    if(i.xmin < outer->xmin) i.xmin = outer->xmin;
+    if(i.ymin < outer->ymin) i.ymin = outer->ymin;
+    return i;
+}
+
+/* A run is a horizontal span [x1,x2) of non-transparent pixels in row y.
+   Runs double as union-find nodes. The root of a region is the run at
+   which the old per-pixel code would have created the surviving head_t,
+   so the root's (x1,y) is the "seed" pixel of the region, and only roots
+   carry a valid bbox (which, unlike ibbox_t, is inclusive on all sides)
+   and rank. */
+typedef struct _run {
+    int x1,x2,y;
+    int parent;
+    int rank;
+    int xmin,ymin,xmax,ymax;
+} run_t;
+
+typedef struct _cell {
+    int*ids;
+    int num;
+    int size;
+} cell_t;
+
+typedef struct _circle_coord {
+    S16 x,y;
+} circle_coord_t;
+
+typedef struct _context {
+    unsigned char*alpha;
+    int rowsize;
+    int width;
+    int height;
+
+    run_t*runs;
+    int num_runs;
+    int runs_size;
+    int*row_start; // runs of row y are runs[row_start[y]] ... runs[row_start[y+1]-1]
+
+    circle_coord_t*circle_order;
+    int circle_order_size;
+} context_t;
+
+static inline int find(run_t*runs, int i)
+{
+    while(runs[i].parent != i) {
+	/* path halving */
+	runs[i].parent = runs[runs[i].parent].parent;
+	i = runs[i].parent;
+    }
+    return i;
+}
+
+/* union by (approximate) rank, with the same tie breaking as the old
+   head_t code: the region of r2 survives unless r1 has the higher rank */
+static int merge(context_t*context, int r1, int r2)
+{
+    run_t*runs = context->runs;
+    r1 = find(runs, r1);
+    r2 = find(runs, r2);
+    if(r1 == r2)
+	return r1;
+    if(runs[r1].rank <= runs[r2].rank) {
+	int t = r1;r1 = r2;r2 = t;
+    }
+    run_t*a = &runs[r1];
+    run_t*b = &runs[r2];
+    a->rank++;
+    if(b->xmin < a->xmin) a->xmin = b->xmin;
+    if(b->ymin < a->ymin) a->ymin = b->ymin;
+    if(b->xmax > a->xmax) a->xmax = b->xmax;
+    if(b->ymax > a->ymax) a->ymax = b->ymax;
+    b->parent = r1;
+    return r1;
+}
+
+/* attach run r to the region of run to, without counting it as a merge */
+static void link_to(context_t*context, int r, int to)
+{
+    run_t*runs = context->runs;
+    to = find(runs, to);
+    run_t*a = &runs[to];
+    run_t*b = &runs[r];
+    if(b->xmin < a->xmin) a->xmin = b->xmin;
+    if(b->xmax > a->xmax) a->xmax = b->xmax;
+    if(b->ymax > a->ymax) a->ymax = b->ymax;
+    b->parent = to;
+}
+
+static void add_run(context_t*context, int x1, int x2, int y)
+{
+    if(context->num_runs == context->runs_size) {
+	context->runs_size = context->runs_size ? context->runs_size*2 : 256;
+	context->runs = rfx_realloc(context->runs, context->runs_size*sizeof(run_t));
+    }
+    int nr = context->num_runs++;
+    run_t*r = &context->runs[nr];
+    r->x1 = x1;
+    r->x2 = x2;
+    r->y = y;
+    r->parent = nr;
+    r->rank = 0;
+    r->xmin = x1;
+    r->xmax = x2-1;
+    r->ymin = r->ymax = y;
+}
+
+/* two-pass connected component labelling: first extract the runs of
+   each row, then link every run to the runs of the row above it.
+   Pixels are connected to their left, upper and upper left neighbours
+   (but not to the upper right one), and runs are linked and merged in
+   the order in which the old code visited the corresponding pixels. */
+static void annotate(context_t*context)
+{
+    int width = context->width;
+    int height = context->height;
+    context->row_start = rfx_alloc((height+1)*sizeof(int));
+
+    int x,y;
+    for(y=0;y<height;y++) {
+	unsigned char*a = &context->alpha[y*context->rowsize];
+	context->row_start[y] = context->num_runs;
+	x = 0;
+	while(x<width) {
+	    while(x<width && !a[x]) x++;
+	    if(x==width)
+		break;
+	    int x1 = x;
+	    while(x<width && a[x]) x++;
+	    add_run(context, x1, x, y);
+	}
+    }
+    context->row_start[height] = context->num_runs;
+
+    run_t*runs = context->runs;
+    for(y=1;y<height;y++) {
+	int p = context->row_start[y-1];
+	int pend = context->row_start[y];
+	int c;
+	for(c=context->row_start[y];c<context->row_start[y+1];c++) {
+	    run_t*cur = &runs[c];
+	    /* skip the runs above which end left of our upper left neighbour */
+	    while(p<pend && runs[p].x2 < cur->x1)
+		p++;
+	    int q = p;
+	    if(q<pend && runs[q].x1 <= cur->x1) {
+		/* the pixel above (or, failing that, above left of) our first
+		   pixel determines our region */
+		link_to(context, c, q);
+		q++;
+	    }
+	    for(;q<pend && runs[q].x1 < cur->x2;q++) {
+		merge(context, q, c);
+	    }
+	}
+    }
+}
+
+static int compare_circle_coord(const void *_v1, const void *_v2)
+{
+    circle_coord_t*v1=(circle_coord_t*)_v1;
+    circle_coord_t*v2=(circle_coord_t*)_v2;
+    int d = (v1->x*v1->x + v1->y*v1->y) - (v2->x*v2->x + v2->y*v2->y);
+    if(d)
+	return d;
+    /* keep the generation order for equal distances */
+    if(v1->y != v2->y)
+	return v1->y - v2->y;
+    return v1->x - v2->x;
+}
+
+/* all offsets with 0<=x<=y<max_radius, by increasing distance. Mirrored in
+   both axes, this is the (vertical double cone shaped) area the vicinity
+   search looks at. */
+static void init_circle_order(context_t*context, int max_radius)
+{
+    context->circle_order_size = (max_radius*(max_radius+1))/2;
+    context->circle_order = rfx_alloc(sizeof(circle_coord_t)*context->circle_order_size);
+    int x,y;
+    int i = 0;
+    for(y=0;y<max_radius;y++) {
+	for(x=0;x<=y;x++) {
+	    context->circle_order[i].x=x;
+	    context->circle_order[i].y=y;
+	    i++;
+	}
+    }
+    qsort(context->circle_order, context->circle_order_size, sizeof(circle_coord_t), compare_circle_coord);
+}
+
+/* the run in row y which contains pixel x (which has to be non-transparent) */
+static int run_at(context_t*context, int x, int y)
+{
+    run_t*runs = context->runs;
+    int lo = context->row_start[y];
+    int hi = context->row_start[y+1];
+    while(lo<hi) {
+	int mid = (lo+hi)/2;
+	if(runs[mid].x2 <= x)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* find the closest pixel (within max_radius) around the seed pixel
+   of region r that belongs to a different region */
+static int search_vicinity(context_t*context, int r, int max_radius)
+{
+    if(!context->circle_order)
+	init_circle_order(context, max_radius);
+
+    run_t*runs = context->runs;
+    int sx = runs[r].x1;
+    int sy = runs[r].y;
+    int signx[4] = {-1,1,-1,1};
+    int signy[4] = {-1,-1,1,1};
+    int t;
+    for(t=1;t<context->circle_order_size;t++) {
+	int xx = context->circle_order[t].x;
+	int yy = context->circle_order[t].y;
+	int s;
+	for(s=0;s<4;s++) {
+	    int x = sx+xx*signx[s];
+	    int y = sy+yy*signy[s];
+	    if(x>=0 && y>=0 && x<context->width && y<context->height &&
+	       context->alpha[y*context->rowsize+x]) {
+		int other = find(runs, run_at(context, x, y));
+		if(other != r)
+		    return other;
+	    }
+	}
+    }
+    return -1;
+}
+
+/* merge regions which are smaller than 32 pixels in some direction with
+   whatever other region is closest to them. Regions are visited newest
+   first, like the old head list. */
+static void fix_small_boxes(context_t*context)
+{
+    run_t*runs = context->runs;
+    char*seen = rfx_calloc(context->num_runs);
+    int i;
+    for(i=context->num_runs-1;i>=0;i--) {
+	/* a region only grows by merging, so once it's large or has
+	   nothing in its vicinity, we're done with it */
+	while(runs[i].parent == i && !seen[i] &&
+	      (runs[i].xmax - runs[i].xmin < 32 || runs[i].ymax - runs[i].ymin < 32)) {
+	    int other = search_vicinity(context, i, 64);
+	    if(other>=0) {
+		merge(context, i, other);
+	    } else {
+		seen[i] = 1;
+	    }
+	}
+    }
+    free(seen);
+}
+
+static inline char does_overlap(run_t*b1, run_t*b2)
+{
+    if(b1->xmax < b2->xmin) return 0;
+    if(b2->xmax < b1->xmin) return 0;
+    if(b1->ymax < b2->ymin) return 0;
+    if(b2->ymax < b1->ymin) return 0;
+    return 1;
+}
+
+/* merge regions with overlapping bounding boxes, until all remaining boxes are
+   disjoint. Regions are registered in a uniform grid, so that every box is
+   only compared against the boxes in the grid cells it touches. */
+static void overlap_bboxes(context_t*context)
+{
+    run_t*runs = context->runs;
+    int cellsize = 32;
+    while(context->width/cellsize > 64 || context->height/cellsize > 64)
+	cellsize *= 2;
+    int gridwidth = context->width/cellsize+1;
+    int gridheight = context->height/cellsize+1;
+    cell_t*grid = rfx_calloc(gridwidth*gridheight*sizeof(cell_t));
+
+    int*stack = rfx_alloc(context->num_runs*2*sizeof(int));
+    int stackpos = 0;
+
+#define FOREACH_CELL(r) \
+    int cx,cy; \
+    for(cy=(r)->ymin/cellsize;cy<=(r)->ymax/cellsize;cy++) \
+    for(cx=(r)->xmin/cellsize;cx<=(r)->xmax/cellsize;cx++)
+
+    int i;
+    for(i=context->num_runs-1;i>=0;i--) {
+	if(runs[i].parent == i)
+	    stack[stackpos++] = i;
+    }
+    while(stackpos) {
+	int i = stack[--stackpos];
+	if(runs[i].parent != i)
+	    continue;
+	int other = -1;
+	{FOREACH_CELL(&runs[i]) {
+	    cell_t*cell = &grid[cy*gridwidth+cx];
+	    int j;
+	    for(j=0;j<cell->num;) {
+		int o = find(runs, cell->ids[j]);
+		if(o == i) {
+		    /* left over from a region which was merged into this one.
+		       We register i again once it doesn't overlap anything */
+		    cell->ids[j] = cell->ids[--cell->num];
+		    continue;
+		}
+		cell->ids[j++] = o;
+		if(does_overlap(&runs[i], &runs[o])) {
+		    other = o;
+		    goto found;
+		}
+	    }
+	}}
+found:
+	if(other>=0) {
+	    /* re-examine the merged box, it might overlap with even more boxes now */
+	    i = merge(context, i, other);
+	    stack[stackpos++] = i;
+	} else {
+	    FOREACH_CELL(&runs[i]) {
+		cell_t*cell = &grid[cy*gridwidth+cx];
+		if(cell->num == cell->size) {
+		    cell->size = cell->size ? cell->size*2 : 4;
+		    cell->ids = rfx_realloc(cell->ids, cell->size*sizeof(int));
+		}
+		cell->ids[cell->num++] = i;
+	    }
+	}
+    }
+#undef FOREACH_CELL
+
+    for(i=0;i<gridwidth*gridheight;i++) {
+	if(grid[i].ids)
+	    free(grid[i].ids);
+    }
+    free(grid);
+    free(stack);
+}
+
+ibbox_t*get_bitmap_bboxes(unsigned char*alpha, int width, int height, int rowsize)
+{
+    if(width<=1 || height<=1)
+	return get_bitmap_bboxes_simple(alpha, width, height, rowsize);
+
+    context_t context;
+    memset(&context, 0, sizeof(context));
+    context.alpha = alpha;
+    context.rowsize = rowsize;
+    context.width = width;
+    context.height = height;
+
+    annotate(&context);
+    fix_small_boxes(&context);
+    overlap_bboxes(&context);
+
+    ibbox_t*bboxes = 0;
+    int i;
+    for(i=context.num_runs-1;i>=0;i--) {
+	run_t*r = &context.runs[i];
+	if(r->parent != i)
+	    continue;
+	/* ibbox_t defines the open upper bound */
+	ibbox_t*bbox = ibbox_new(r->xmin, r->ymin, r->xmax+1, r->ymax+1);
+	bbox->next = bboxes;
+	bboxes = bbox;
+    }
+    if(context.runs)
+	free(context.runs);
+    if(context.circle_order)
+	free(context.circle_order);
+    free(context.row_start);
+    return bboxes;
+}
+
+#ifdef MAIN
+/* the head_t based implementation this file used to have, as a reference
+   for the box sets the run based code has to produce */
+
 typedef struct _head {
     ptroff_t magic;
     ibbox_t bbox;
@@ -76,7 +470,7 @@ typedef struct _head {
     struct _head*prev;
 } head_t;
 
-typedef struct _context {
+typedef struct _old_context {
     void**group;
     unsigned char*alpha;
     int rowsize;
@@ -84,11 +478,12 @@ typedef struct _context {
     int height;
     head_t*heads;
     int count;
-} context_t;
+} old_context_t;
 
 #define HEAD_MAGIC ((ptroff_t)-1)
+#define POINTS_TO_HEAD(ptr) (((head_t*)(ptr))->magic==HEAD_MAGIC)
 
-static head_t*head_new(context_t*context, int x, int y)
+static head_t*head_new(old_context_t*context, int x, int y)
 {
     int pos = context->width*y+x;
     head_t*h = rfx_calloc(sizeof(head_t));
@@ -107,7 +502,7 @@ static head_t*head_new(context_t*context, int x, int y)
     return h;
 }
 
-static void head_delete(context_t*context, head_t*h)
+static void head_delete(old_context_t*context, head_t*h)
 {
     if(h->prev) {
 	h->prev->next = h->next;
@@ -122,16 +517,12 @@ static void head_delete(context_t*context, head_t*h)
     free(h);
 }
 
-#define POINTS_TO_HEAD(ptr) (((head_t*)(ptr))->magic==HEAD_MAGIC)
-
-static inline void link_to(context_t*context, int from, int to)
+static void old_link_to(old_context_t*context, int from, int to)
 {
-    // path compression
     void**data = context->group;
     int head = to;
     assert(data[head]);
     while(!POINTS_TO_HEAD(data[head])) {
-	assert(data[head]!=(void*)&data[head]); // check that we're not in an infinite loop
 	head=(void**)data[head]-(void**)data;
     }
     head_t*h = (head_t*)data[head];
@@ -141,9 +532,9 @@ static inline void link_to(context_t*context, int from, int to)
     if(y < h->bbox.ymin) h->bbox.ymin = y;
     if(x > h->bbox.xmax) h->bbox.xmax = x;
     if(y > h->bbox.ymax) h->bbox.ymax = y;
-    
     data[from] = (void*)&data[head];
 }
+
 static char ibbox_does_overlap(ibbox_t*b1, ibbox_t*b2)
 {
     if(b1->xmax < b2->xmin) return 0;
@@ -152,6 +543,7 @@ static char ibbox_does_overlap(ibbox_t*b1, ibbox_t*b2)
     if(b2->ymax < b1->ymin) return 0;
     return 1;
 }
+
 static void ibbox_expand(ibbox_t*src, ibbox_t*add) 
 {
     if(add->xmin < src->xmin)
@@ -163,11 +555,10 @@ static void ibbox_expand(ibbox_t*src, ibbox_t*add)
     if(add->ymax > src->ymax)
 	src->ymax = add->ymax;
 }
-static inline void merge(context_t*context, int set1, int set2)
+
+static void old_merge(old_context_t*context, int set1, int set2)
 {
     void**data = context->group;
-    assert(data[set1]);
-    assert(data[set2]);
     int head1 = set1;
     int head2 = set2;
     while(!POINTS_TO_HEAD(data[head1])) {
@@ -194,22 +585,7 @@ static inline void merge(context_t*context, int set1, int set2)
     }
 }
 
-ibbox_t ibbox_clip(ibbox_t* outer, ibbox_t* inner)
-{
-    ibbox_t i = {inner->xmin, inner->ymin, inner->xmax, inner->ymax, 0};
-    if(i.xmax > outer->xmax) i.xmax = outer->xmax;
-    if(i.ymax > outer->ymax) i.ymax = outer->ymax;
-    if(i.xmax < outer->xmin) i.xmax = outer->xmin;
-    if(i.ymax < outer->ymin) i.ymax = outer->ymin;
-    
-    if(i.xmin > outer->xmax) i.xmin = outer->xmax;
-    if(i.ymin > outer->ymax) i.ymin = outer->ymax;
-    if(i.xmin < outer->xmin) i.xmin = outer->xmin;
-    if(i.ymin < outer->ymin) i.ymin = outer->ymin;
-    return i;
-}
-
-static void** annotate(context_t*context)
+static void old_annotate(old_context_t*context)
 {
     unsigned char*alpha = context->alpha;
     int width = context->width;
@@ -221,7 +597,7 @@ static void** annotate(context_t*context)
     for(x=1;x<width;x++) {
 	if(alpha[x]) {
 	    if(group[x-1])
-		link_to(context,x,x-1);
+		old_link_to(context,x,x-1);
 	    else
 		group[x]=head_new(context,x,0);
 	}
@@ -233,45 +609,42 @@ static void** annotate(context_t*context)
 	apos += context->rowsize;
 	if(alpha[apos]) {
 	    if(group[pos-width])
-		link_to(context,pos,pos-width);
+		old_link_to(context,pos,pos-width);
 	    else
 		group[pos]=head_new(context,0,y);
 	}
 	for(x=1;x<width;x++) {
-	    /* once this code is stable we should copy&paste it
-	       out of the loop, change the loop end to width-1 and
-	       add the pos-width+1 case */
 	    if(alpha[apos+x]) {
 		if(group[pos+x-width]) {
-		    link_to(context,pos+x,pos+x-width);
+		    old_link_to(context,pos+x,pos+x-width);
 		    if(group[pos+x-1])
-			merge(context,pos+x,pos+x-1);
+			old_merge(context,pos+x,pos+x-1);
 		} else if(group[pos+x-1]) {
-		    link_to(context,pos+x,pos+x-1);
+		    old_link_to(context,pos+x,pos+x-1);
 		} else if(group[pos+x-width-1]) {
-		    link_to(context,pos+x,pos+x-width-1);
+		    old_link_to(context,pos+x,pos+x-width-1);
 		} else {
 		    group[pos+x]=head_new(context,x,y);
 		}
 	    }
 	}
     }
-    return group;
 }
 
-static void overlap_bboxes(context_t*context)
+static void old_overlap_bboxes(old_context_t*context)
 {
     char changed;
     do {
 	head_t*h1 = context->heads;
 	changed = 0;
-	while(h1) {
+	/* (restarts after every merge, as the merge might have freed h1->next) */
+	while(h1 && !changed) {
 	    head_t*next = h1->next;
 	    head_t*h2 = context->heads;
 	    while(h2) {
 		if(h1!=h2) {
 		    if(ibbox_does_overlap(&h1->bbox, &h2->bbox)) {
-			merge(context, h1->pos, h2->pos);
+			old_merge(context, h1->pos, h2->pos);
 			changed = 1;
 			break;
 		    }
@@ -283,18 +656,14 @@ static void overlap_bboxes(context_t*context)
     } while(changed);
 }
 
-typedef struct _circle_coord {
-    S16 x,y;
-} circle_coord_t;
-
-static int compare_circle_coord(const void *_v1, const void *_v2)
+static int old_compare_circle_coord(const void *_v1, const void *_v2)
 {
     circle_coord_t*v1=(circle_coord_t*)_v1;
     circle_coord_t*v2=(circle_coord_t*)_v2;
     return (v1->x*v1->x + v1->y*v1->y) - (v2->x*v2->x + v2->y*v2->y);
 }
 
-static head_t* search_vicinity(context_t*context, head_t*h, int max_radius, double*cos, double*sin)
+static head_t* old_search_vicinity(old_context_t*context, head_t*h, int max_radius)
 {
     static circle_coord_t*circle_order = 0;
     static int circle_order_size = 0;
@@ -311,8 +680,7 @@ static head_t* search_vicinity(context_t*context, head_t*h, int max_radius, doub
 		i++;
 	    }
 	}
-	assert(i==circle_order_size);
-	qsort(circle_order, circle_order_size, sizeof(circle_coord_t), compare_circle_coord);
+	qsort(circle_order, circle_order_size, sizeof(circle_coord_t), old_compare_circle_coord);
     }
 
     int t;
@@ -343,16 +711,8 @@ static head_t* search_vicinity(context_t*context, head_t*h, int max_radius, doub
     return 0;
 }
 
-static void fix_small_boxes(context_t*context)
+static void old_fix_small_boxes(old_context_t*context)
 {
-    double sintab[256];
-    double costab[256];
-    int t;
-    for(t=0;t<256;t++) {
-	sintab[t] = sin(t*M_PI/128);
-	costab[t] = cos(t*M_PI/128);
-    }
-	
     head_t*h = context->heads;
     while(h) {
 	h->seen = 0;
@@ -368,66 +728,27 @@ static void fix_small_boxes(context_t*context)
 	    if(!h->seen) {
 		if(h->bbox.xmax - h->bbox.xmin < 32
 		|| h->bbox.ymax - h->bbox.ymin < 32) {
-		    head_t*other = search_vicinity(context, h, 64, costab, sintab);
+		    head_t*other = old_search_vicinity(context, h, 64);
 		    if(other) {
-			merge(context, h->pos, other->pos);
+			old_merge(context, h->pos, other->pos);
 			changed = 1;
 			break;
 		    } else {
-			//printf("nothing in the vicinity of %d,%d,%d,%d\n", h->bbox);
 			h->seen = 1;
 		    }
-		} /*else {
-		    printf("area %d,%d,%d,%d is large enough (%dx%d)\n", 
-			    h->bbox.xmin,
-			    h->bbox.ymin,
-			    h->bbox.xmax,
-			    h->bbox.ymax,
-			    h->bbox.xmax - h->bbox.xmin,
-			    h->bbox.ymax - h->bbox.ymin);
-		} */
+		}
 	    }
 	    h = next;
 	}
     } while(changed);
 }
 
-static void display(context_t*context)
-{
-    int width = context->width;
-    int height = context->height;
-    void**group = context->group;
-
-    int x,y;
-    for(y=0;y<height;y++) {
-	for(x=0;x<width;x++) {
-	    if(!group[y*width+x]) {
-		printf(" -- ");
-	    } else if(POINTS_TO_HEAD(group[y*width+x])) {
-		printf("g%02d ", ((head_t*)group[y*width+x])->nr);
-	    } else {
-		printf("x%02d ", (void**)group[y*width+x]-(void**)group);
-	    }
-	}
-	printf("\n");
-    }
-
-    head_t*h = context->heads;
-    while(h) {
-	printf("head: %d\n", h->nr);
-	printf(" pos: %d/%d\n", h->pos%width, h->pos/width);
-	printf(" bbox: [%d/%d,%d/%d]\n", h->bbox.xmin, h->bbox.ymin, h->bbox.xmax, h->bbox.ymax);
-	h = h->next;
-    }
-}
-
-ibbox_t*get_bitmap_bboxes(unsigned char*alpha, int width, int height, int rowsize)
+static ibbox_t*old_get_bitmap_bboxes(unsigned char*alpha, int width, int height, int rowsize)
 {
-    int size = width*height;
     if(width<=1 || height<=1)
 	return get_bitmap_bboxes_simple(alpha, width, height, rowsize);
     
-    context_t context;
+    old_context_t context;
     context.alpha = alpha;
     context.rowsize = rowsize;
     context.width = width;
@@ -435,25 +756,15 @@ ibbox_t*get_bitmap_bboxes(unsigned char*alpha, int width, int height, int rowsiz
     context.heads = 0;
     context.count = 1;
 
-    void**group = annotate(&context);
-    fix_small_boxes(&context);
-    overlap_bboxes(&context);
-#ifdef MAIN
-    display(&context);
-#endif
+    old_annotate(&context);
+    old_fix_small_boxes(&context);
+    old_overlap_bboxes(&context);
 
     ibbox_t*bboxes = 0;
-
     head_t*h = context.heads;
     while(h) {
 	head_t*next = h->next;
-	ibbox_t*bbox = malloc(sizeof(ibbox_t));
-	memcpy(bbox, &h->bbox, sizeof(ibbox_t));
-
-	/* ibbox_t defines the open upper bound */
-	bbox->xmax++;
-	bbox->ymax++;
-
+	ibbox_t*bbox = ibbox_new(h->bbox.xmin, h->bbox.ymin, h->bbox.xmax+1, h->bbox.ymax+1);
 	bbox->next = bboxes;
 	bboxes = bbox;
 	free(h);
@@ -463,7 +774,96 @@ ibbox_t*get_bitmap_bboxes(unsigned char*alpha, int width, int height, int rowsiz
     return bboxes;
 }
 
-#ifdef MAIN
+static int compare_ibbox(const void*_b1, const void*_b2)
+{
+    const ibbox_t*b1 = *(const ibbox_t**)_b1;
+    const ibbox_t*b2 = *(const ibbox_t**)_b2;
+    if(b1->ymin != b2->ymin) return b1->ymin - b2->ymin;
+    if(b1->xmin != b2->xmin) return b1->xmin - b2->xmin;
+    if(b1->ymax != b2->ymax) return b1->ymax - b2->ymax;
+    return b1->xmax - b2->xmax;
+}
+
+static int sorted_boxes(ibbox_t*boxes, ibbox_t***list)
+{
+    int num = 0;
+    ibbox_t*b;
+    for(b=boxes;b;b=b->next)
+	num++;
+    *list = rfx_alloc((num+1)*sizeof(ibbox_t*));
+    num = 0;
+    for(b=boxes;b;b=b->next)
+	(*list)[num++] = b;
+    qsort(*list, num, sizeof(ibbox_t*), compare_ibbox);
+    return num;
+}
+
+static void fill(unsigned char*alpha, int rowsize, int x1, int y1, int x2, int y2)
+{
+    int x,y;
+    for(y=y1;y<y2;y++)
+    for(x=x1;x<x2;x++)
+	alpha[y*rowsize+x] = 1;
+}
+
+/* checks that the boxes for the given mask are the ones the old code
+   produced (as a set), that they are disjoint and that they cover every
+   non-transparent pixel. The old code never looked at the top left pixel,
+   so masks which set it can't be compared. */
+static int check_boxes(unsigned char*alpha, int width, int height, int rowsize)
+{
+    ibbox_t*boxes = get_bitmap_bboxes(alpha, width, height, rowsize);
+    ibbox_t**list = 0;
+    int num = sorted_boxes(boxes, &list);
+    int t;
+
+    if(!alpha[0]) {
+	ibbox_t*old = old_get_bitmap_bboxes(alpha, width, height, rowsize);
+	ibbox_t**oldlist = 0;
+	int oldnum = sorted_boxes(old, &oldlist);
+	if(num != oldnum) {
+	    fprintf(stderr, "%d boxes, old code found %d\n", num, oldnum);
+	    assert(0);
+	}
+	for(t=0;t<num;t++) {
+	    if(compare_ibbox(&list[t], &oldlist[t])) {
+		fprintf(stderr, "[%d,%d,%d,%d] != old [%d,%d,%d,%d]\n",
+			list[t]->xmin, list[t]->ymin, list[t]->xmax, list[t]->ymax,
+			oldlist[t]->xmin, oldlist[t]->ymin, oldlist[t]->xmax, oldlist[t]->ymax);
+		assert(0);
+	    }
+	}
+	free(oldlist);
+	ibbox_destroy(old);
+    }
+
+    /* boxes must be disjoint */
+    ibbox_t*b;
+    for(b=boxes;b;b=b->next) {
+	ibbox_t*b2;
+	for(b2=b->next;b2;b2=b2->next) {
+	    assert(b->xmax <= b2->xmin || b2->xmax <= b->xmin ||
+		   b->ymax <= b2->ymin || b2->ymax <= b->ymin);
+	}
+    }
+
+    /* every non-transparent pixel must be covered by some box */
+    int x,y;
+    for(y=0;y<height;y++)
+    for(x=0;x<width;x++) {
+	if(!alpha[y*rowsize+x])
+	    continue;
+	for(b=boxes;b;b=b->next) {
+	    if(x>=b->xmin && x<b->xmax && y>=b->ymin && y<b->ymax)
+		break;
+	}
+	assert(b);
+    }
+    free(list);
+    ibbox_destroy(boxes);
+    return num;
+}
+
 int main(int argn, char*argv[])
 {
     unsigned char alpha[8*8]=
@@ -475,7 +875,50 @@ int main(int argn, char*argv[])
 	"\1\0\1\1\1\0\0\1"
 	"\1\0\0\0\0\0\1\0"
 	"\1\1\1\0\0\0\0\0";
+    /* everything is within the vicinity of everything else */
+    assert(check_boxes(alpha, 8,8, 8) == 1);
+
+    int width = 400, height = 300, rowsize = 410;
+    unsigned char*a = rfx_calloc(rowsize*height);
+
+    /* two large regions far apart */
+    fill(a, rowsize, 10,10,60,60);
+    fill(a, rowsize, 200,100,300,200);
+    assert(check_boxes(a, width, height, rowsize) == 2);
 
-    get_bitmap_bboxes(alpha, 8,8, 8);
+    /* a small region with nothing in its vicinity stays on its own */
+    fill(a, rowsize, 380,280,382,282);
+    assert(check_boxes(a, width, height, rowsize) == 3);
+
+    /* a large region whose bbox overlaps another large region */
+    memset(a, 0, rowsize*height);
+    fill(a, rowsize, 1,0,200,40);
+    fill(a, rowsize, 0,40,40,200);
+    fill(a, rowsize, 100,100,180,180);
+    assert(check_boxes(a, width, height, rowsize) == 1);
+
+    /* random masks of rectangles, with increasing density */
+    int t;
+    for(t=0;t<300;t++) {
+	memset(a, 0, rowsize*height);
+	int density = 1+(t%50)*4;
+	int i;
+	for(i=0;i<density;i++) {
+	    int x = lrand48()%width;
+	    int y = lrand48()%height;
+	    int x2 = x+1+lrand48()%(t<150?20:60);
+	    int y2 = y+1+lrand48()%(t<150?4:40);
+	    fill(a, rowsize, x, y, x2<width?x2:width, y2<height?y2:height);
+	}
+	/* and some noise */
+	for(i=0;i<(t%7)*50;i++) {
+	    a[(lrand48()%height)*rowsize+lrand48()%width] = 1;
+	}
+	a[0] = 0;
+	check_boxes(a, width, height, rowsize);
+    }
+    free(a);
+    printf("ok\n");
+    return 0;
 }
 #endif
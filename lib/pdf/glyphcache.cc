@@ -0,0 +1,481 @@
+/* glyphcache.cc
+   Process-wide cache for glyph outlines, shared between documents.
+
+   This file is part of swftools.
+
+   Swftools is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   Swftools is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with swftools; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../config.h"
+#include "glyphcache.h"
+#include "../q.h"
+#include "../mem.h"
+#include "../log.h"
+#include "../gfxtools.h"
+#include "gmem.h"
+
+#define GLYPHCACHE_MAGIC "SWFTOOLS GLYPHCACHE 1\n"
+
+typedef struct _glyphkey {
+    char*font;
+    int code;
+} glyphkey_t;
+
+typedef struct _glyph {
+    glyphkey_t key; // must be the first member
+
+    /* the outline, exactly as returned by SplashFont::getGlyphPath() */
+    char has_path;
+    int len;
+    double*xy;
+    unsigned char*flags;
+    double advance;
+
+    /* the same outline, flattened to a gfxline */
+    gfxline_t*line;
+    double quality;
+    double xmax;
+
+    int size;
+    struct _glyph*prev;
+    struct _glyph*next;
+} glyph_t;
+
+static char glyphkey_equals(const void*o1, const void*o2)
+{
+    const glyphkey_t*k1 = (const glyphkey_t*)o1;
+    const glyphkey_t*k2 = (const glyphkey_t*)o2;
+    return k1->code == k2->code && !strcmp(k1->font, k2->font);
+}
+static unsigned int glyphkey_hash(const void*o)
+{
+    const glyphkey_t*k = (const glyphkey_t*)o;
+    unsigned int crc = crc32_add_string(0, k->font);
+    return crc32_add_bytes(crc, &k->code, sizeof(k->code));
+}
+/* keys are owned by the glyphs they belong to */
+static void* glyphkey_dup(const void*o)
+{
+    return (void*)o;
+}
+static void glyphkey_free(void*o)
+{
+}
+static type_t glyphkey_type = {
+    glyphkey_equals,
+    glyphkey_hash,
+    glyphkey_dup,
+    glyphkey_free
+};
+
+static dict_t*glyphs = 0;
+static glyph_t*lru_first = 0; // most recently used
+static glyph_t*lru_last = 0;
+static int cache_size = 0;
+static int max_size = 64*1024*1024;
+static char*cache_filename = 0;
+static glyphcache_stats_t stats;
+
+static void lru_remove(glyph_t*g)
+{
+    if(g->prev) g->prev->next = g->next;
+    else lru_first = g->next;
+    if(g->next) g->next->prev = g->prev;
+    else lru_last = g->prev;
+    g->prev = g->next = 0;
+}
+static void lru_prepend(glyph_t*g)
+{
+    g->prev = 0;
+    g->next = lru_first;
+    if(lru_first)
+        lru_first->prev = g;
+    lru_first = g;
+    if(!lru_last)
+        lru_last = g;
+}
+
+static int glyph_size(glyph_t*g)
+{
+    int size = sizeof(glyph_t) + strlen(g->key.font) + 1 + g->len*(sizeof(double)*2+1);
+    gfxline_t*l = g->line;
+    while(l) {
+        size += sizeof(gfxline_t);
+        l = l->next;
+    }
+    return size;
+}
+
+static void glyph_destroy(glyph_t*g)
+{
+    if(g->line)
+        gfxline_free(g->line);
+    if(g->xy)
+        free(g->xy);
+    if(g->flags)
+        free(g->flags);
+    free(g->key.font);
+    free(g);
+}
+
+static void remove_glyph(glyph_t*g)
+{
+    dict_del(glyphs, &g->key);
+    lru_remove(g);
+    cache_size -= g->size;
+    glyph_destroy(g);
+}
+
+static void resize(glyph_t*g)
+{
+    cache_size -= g->size;
+    g->size = glyph_size(g);
+    cache_size += g->size;
+
+    /* evict least recently used glyphs, but never the one we just added */
+    while(cache_size > max_size && lru_last && lru_last != g) {
+        remove_glyph(lru_last);
+    }
+}
+
+static glyph_t* lookup(const char*fonthash, int code)
+{
+    if(!glyphs || !fonthash)
+        return 0;
+    glyphkey_t key;
+    key.font = (char*)fonthash;
+    key.code = code;
+    glyph_t*g = (glyph_t*)dict_lookup(glyphs, &key);
+    if(g && g != lru_first) {
+        lru_remove(g);
+        lru_prepend(g);
+    }
+    return g;
+}
+
+static glyph_t* new_glyph(const char*fonthash, int code)
+{
+    if(!glyphs)
+        glyphs = dict_new2(&glyphkey_type);
+    glyph_t*g = (glyph_t*)rfx_calloc(sizeof(glyph_t));
+    g->key.font = strdup(fonthash);
+    g->key.code = code;
+    dict_put(glyphs, &g->key, g);
+    lru_prepend(g);
+    return g;
+}
+
+static void add_bytes(unsigned int*crc, unsigned int*fnv, const void*data, int len)
+{
+    /* crc32 and FNV-1a together, so that two fonts have to collide
+       twice before they share a cache entry */
+    *crc = crc32_add_bytes(*crc, data, len);
+    const unsigned char*p = (const unsigned char*)data;
+    int t;
+    for(t=0;t<len;t++) {
+        *fnv = (*fnv ^ p[t]) * 16777619u;
+    }
+}
+
+char* glyphcache_fonthash(GfxFont*font, XRef*xref, const char*fontfile)
+{
+    if(!max_size)
+        return 0;
+    if(font->getType() == fontType3) {
+        /* type3 glyphs are drawn with ordinary pdf operators */
+        return 0;
+    }
+
+    unsigned int crc = 0;
+    unsigned int fnv = 2166136261u;
+    int len = 0;
+    char*prefix = 0;
+
+    Ref embRef;
+    if(font->getEmbeddedFontID(&embRef)) {
+        char*data = font->readEmbFontFile(xref, &len);
+        if(!data)
+            return 0;
+        add_bytes(&crc, &fnv, data, len);
+        gfree(data);
+        prefix = strdup("emb");
+    } else {
+        /* non-embedded fonts are substituted by name. Which file we end up
+           with depends on the font settings and fontconfig, so hash the
+           substitute, too. (Its contents, not its name- the standard fonts
+           are written to a new temporary file by every process) */
+        GString*name = font->getExtFontFile();
+        if(!name)
+            name = font->getName();
+        if(!name || !fontfile)
+            return 0;
+        FILE*fi = fopen(fontfile, "rb");
+        if(!fi)
+            return 0;
+        char buf[65536];
+        int l;
+        while((l = fread(buf, 1, sizeof(buf), fi)) > 0) {
+            add_bytes(&crc, &fnv, buf, l);
+            len += l;
+        }
+        fclose(fi);
+        prefix = strdup(name->getCString());
+    }
+
+    int type = font->getType();
+    int flags = font->getFlags();
+    add_bytes(&crc, &fnv, &type, sizeof(type));
+    add_bytes(&crc, &fnv, &flags, sizeof(flags));
+    add_bytes(&crc, &fnv, font->getFontMatrix(), sizeof(double)*6);
+
+    if(font->isCIDFont()) {
+        GfxCIDFont*cidfont = (GfxCIDFont*)font;
+        if(cidfont->getCIDToGID()) {
+            add_bytes(&crc, &fnv, cidfont->getCIDToGID(), cidfont->getCIDToGIDLen()*sizeof(Gushort));
+        }
+    } else {
+        Gfx8BitFont*font8 = (Gfx8BitFont*)font;
+        char**enc = font8->getEncoding();
+        int t;
+        for(t=0;t<256;t++) {
+            if(enc[t])
+                add_bytes(&crc, &fnv, enc[t], strlen(enc[t])+1);
+            else
+                add_bytes(&crc, &fnv, "", 1);
+        }
+        char hasEncoding = font8->getHasEncoding();
+        add_bytes(&crc, &fnv, &hasEncoding, 1);
+    }
+
+    char*hash = (char*)malloc(strlen(prefix)+32);
+    sprintf(hash, "%s:%08x%08x:%d", prefix, crc, fnv, len);
+    free(prefix);
+    return hash;
+}
+
+SplashPath* glyphcache_getpath(const char*fonthash, int code, double*advance)
+{
+    glyph_t*g = lookup(fonthash, code);
+    if(!g || !g->has_path) {
+        if(fonthash)
+            stats.path_misses++;
+        return 0;
+    }
+    stats.path_hits++;
+
+    SplashPath*path = new SplashPath();
+    int t;
+    for(t=0;t<g->len;t++) {
+        double x = g->xy[t*2+0];
+        double y = g->xy[t*2+1];
+        if(g->flags[t] & splashPathFirst) {
+            path->moveTo(x, y);
+        } else if((g->flags[t] & splashPathCurve) && t+2<g->len) {
+            path->curveTo(x, y, g->xy[t*2+2], g->xy[t*2+3], g->xy[t*2+4], g->xy[t*2+5]);
+            t+=2;
+        } else {
+            path->lineTo(x, y);
+        }
+        if((g->flags[t] & splashPathLast) && (g->flags[t] & splashPathClosed))
+            path->close();
+    }
+    *advance = g->advance;
+    return path;
+}
+
+void glyphcache_putpath(const char*fonthash, int code, SplashPath*path, double advance)
+{
+    if(!fonthash || !max_size || !path)
+        return;
+    glyph_t*g = lookup(fonthash, code);
+    if(!g)
+        g = new_glyph(fonthash, code);
+    if(g->xy)
+        free(g->xy);
+    if(g->flags)
+        free(g->flags);
+    g->has_path = 1;
+    g->len = path->getLength();
+    g->xy = (double*)rfx_alloc(g->len*sizeof(double)*2);
+    g->flags = (unsigned char*)rfx_alloc(g->len);
+    int t;
+    for(t=0;t<g->len;t++) {
+        Guchar f;
+        path->getPoint(t, &g->xy[t*2+0], &g->xy[t*2+1], &f);
+        g->flags[t] = f;
+    }
+    g->advance = advance;
+    resize(g);
+}
+
+gfxline_t* glyphcache_getline(const char*fonthash, int code, double quality, double*xmax)
+{
+    glyph_t*g = lookup(fonthash, code);
+    if(!g || !g->line || g->quality != quality) {
+        if(fonthash)
+            stats.line_misses++;
+        return 0;
+    }
+    stats.line_hits++;
+    *xmax = g->xmax;
+    return gfxline_clone(g->line);
+}
+
+void glyphcache_putline(const char*fonthash, int code, double quality, gfxline_t*line, double xmax)
+{
+    if(!fonthash || !max_size || !line)
+        return;
+    glyph_t*g = lookup(fonthash, code);
+    if(!g)
+        g = new_glyph(fonthash, code);
+    if(g->line)
+        gfxline_free(g->line);
+    g->line = gfxline_clone(line);
+    g->quality = quality;
+    g->xmax = xmax;
+    resize(g);
+}
+
+void glyphcache_setmaxsize(int bytes)
+{
+    max_size = bytes;
+    if(!max_size) {
+        glyphcache_clear();
+        return;
+    }
+    while(cache_size > max_size && lru_last) {
+        remove_glyph(lru_last);
+    }
+}
+
+static void load(const char*filename)
+{
+    FILE*fi = fopen(filename, "rb");
+    if(!fi)
+        return;
+    char magic[sizeof(GLYPHCACHE_MAGIC)];
+    if(fread(magic, sizeof(GLYPHCACHE_MAGIC)-1, 1, fi)!=1 ||
+       memcmp(magic, GLYPHCACHE_MAGIC, sizeof(GLYPHCACHE_MAGIC)-1)) {
+        msg("<warning> %s is not a glyph cache file", filename);
+        fclose(fi);
+        return;
+    }
+    int num = 0;
+    while(1) {
+        int fontlen, code, len;
+        double advance;
+        if(fread(&fontlen, sizeof(fontlen), 1, fi)!=1)
+            break;
+        if(fontlen<=0 || fontlen>65536)
+            break;
+        char*font = (char*)malloc(fontlen+1);
+        font[fontlen] = 0;
+        if(fread(font, fontlen, 1, fi)!=1 ||
+           fread(&code, sizeof(code), 1, fi)!=1 ||
+           fread(&advance, sizeof(advance), 1, fi)!=1 ||
+           fread(&len, sizeof(len), 1, fi)!=1 || len<0 || len>1048576) {
+            free(font);
+            break;
+        }
+        double*xy = (double*)rfx_alloc(len*sizeof(double)*2);
+        unsigned char*flags = (unsigned char*)rfx_alloc(len);
+        if(len && (fread(xy, len*sizeof(double)*2, 1, fi)!=1 ||
+                   fread(flags, len, 1, fi)!=1)) {
+            free(font);free(xy);free(flags);
+            break;
+        }
+        glyph_t*g = lookup(font, code);
+        if(!g)
+            g = new_glyph(font, code);
+        free(font);
+        if(g->xy)
+            free(g->xy);
+        if(g->flags)
+            free(g->flags);
+        g->has_path = 1;
+        g->len = len;
+        g->xy = xy;
+        g->flags = flags;
+        g->advance = advance;
+        resize(g);
+        num++;
+    }
+    fclose(fi);
+    msg("<verbose> Loaded %d glyphs from %s", num, filename);
+}
+
+void glyphcache_setfilename(const char*filename)
+{
+    if(cache_filename)
+        free(cache_filename);
+    cache_filename = filename ? strdup(filename) : 0;
+    if(cache_filename && max_size)
+        load(cache_filename);
+}
+
+void glyphcache_save()
+{
+    if(!cache_filename || !lru_last)
+        return;
+    FILE*fi = fopen(cache_filename, "wb");
+    if(!fi) {
+        msg("<error> Couldn't write glyph cache %s", cache_filename);
+        return;
+    }
+    fwrite(GLYPHCACHE_MAGIC, sizeof(GLYPHCACHE_MAGIC)-1, 1, fi);
+    int num = 0;
+    glyph_t*g;
+    /* oldest first, so that the most recently used glyphs survive
+       a smaller cache size when loading */
+    for(g=lru_last;g;g=g->prev) {
+        if(!g->has_path)
+            continue;
+        int fontlen = strlen(g->key.font);
+        fwrite(&fontlen, sizeof(fontlen), 1, fi);
+        fwrite(g->key.font, fontlen, 1, fi);
+        fwrite(&g->key.code, sizeof(g->key.code), 1, fi);
+        fwrite(&g->advance, sizeof(g->advance), 1, fi);
+        fwrite(&g->len, sizeof(g->len), 1, fi);
+        if(g->len) {
+            fwrite(g->xy, g->len*sizeof(double)*2, 1, fi);
+            fwrite(g->flags, g->len, 1, fi);
+        }
+        num++;
+    }
+    fclose(fi);
+    msg("<verbose> Saved %d glyphs to %s", num, cache_filename);
+}
+
+void glyphcache_clear()
+{
+    while(lru_last) {
+        remove_glyph(lru_last);
+    }
+    if(glyphs) {
+        dict_destroy(glyphs);
+        glyphs = 0;
+    }
+    cache_size = 0;
+}
+
+glyphcache_stats_t glyphcache_getstats()
+{
+    glyphcache_stats_t s = stats;
+    s.num_glyphs = glyphs ? glyphs->num : 0;
+    s.size = cache_size;
+    return s;
+}
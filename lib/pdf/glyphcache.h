@@ -0,0 +1,70 @@
+/* glyphcache.h
+   Process-wide cache for glyph outlines, shared between documents.
+
+   This file is part of swftools.
+
+   Swftools is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   Swftools is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with swftools; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __glyphcache_h__
+#define __glyphcache_h__
+
+#include "popplercompat.h"
+#include "GfxFont.h"
+#ifdef HAVE_POPPLER
+  #include <splash/SplashPath.h>
+#else
+  #include "SplashPath.h"
+#endif
+#include "../gfxdevice.h"
+
+/* Glyphs are identified by a hash of the font program plus everything that
+   influences the code->glyph mapping (encoding, CIDToGIDMap), and the
+   character code. The same fonts hence share their outlines across
+   documents, as long as the process lives (or, with a cache file, across
+   processes).
+   The cache is not thread-safe. It's only accessed from InfoOutputDev,
+   which runs while a document is opened. */
+
+typedef struct _glyphcache_stats {
+    int path_hits;
+    int path_misses;
+    int line_hits;
+    int line_misses;
+    int num_glyphs;
+    int size;
+} glyphcache_stats_t;
+
+/* returns a malloc()ed key for the given font, or NULL if the font's glyphs
+   can't be cached (e.g. Type3 fonts). fontfile is the file the font was
+   actually loaded from- for non-embedded fonts that's the substitute, which
+   depends on the font directories and fontconfig rather than the pdf, and
+   is hashed into the key. */
+char* glyphcache_fonthash(GfxFont*font, XRef*xref, const char*fontfile);
+
+/* returns a new SplashPath, or NULL if the glyph isn't cached */
+SplashPath* glyphcache_getpath(const char*fonthash, int code, double*advance);
+void glyphcache_putpath(const char*fonthash, int code, SplashPath*path, double advance);
+
+/* outlines converted to gfxlines, at a given flattening quality */
+gfxline_t* glyphcache_getline(const char*fonthash, int code, double quality, double*xmax);
+void glyphcache_putline(const char*fonthash, int code, double quality, gfxline_t*line, double xmax);
+
+void glyphcache_setmaxsize(int bytes);
+void glyphcache_setfilename(const char*filename);
+void glyphcache_save();
+void glyphcache_clear();
+glyphcache_stats_t glyphcache_getstats();
+
+#endif //__glyphcache_h__
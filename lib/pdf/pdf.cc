@@ -16,6 +16,8 @@
 #include "FullBitmapOutputDev.h"
 #include "BitmapOutputDev.h"
 #include "VectorGraphicOutputDev.h"
+#include "glyphcache.h"
+#include "../stats.h"
 #include "../mem.h"
 #include "pdf.h"
 #define NO_ARGPARSER
@@ -113,6 +115,7 @@ static void render2(gfxpage_t*page, gfxdevice_t*dev, int x,int y, int x1,int y1,
     CommonOutputDev*outputDev = 0;
     if(pi->config_full_bitmap_optimizing) {
 	FullBitmapOutputDev*d = new FullBitmapOutputDev(pi->info, pi->doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
+	d->setUserPassword(pi->userPW);
 	outputDev = (CommonOutputDev*)d;
     } else if(pi->config_bitmap_optimizing) {
 	BitmapOutputDev*d = new BitmapOutputDev(pi->info, pi->doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
@@ -177,7 +180,9 @@ static void render2(gfxpage_t*page, gfxdevice_t*dev, int x,int y, int x1,int y1,
 void pdfpage_render(gfxpage_t*page, gfxdevice_t*output)
 {
     pdf_doc_internal_t*pi = (pdf_doc_internal_t*)page->parent->internal;
+    STATS_START(t);
     render2(page, output, 0,0, 0,0,0,0);
+    STATS_END(STATS_PDF_RENDER, t);
 }
 
 void pdfpage_rendersection(gfxpage_t*page, gfxdevice_t*output, gfxcoord_t x, gfxcoord_t y, gfxcoord_t _x1, gfxcoord_t _y1, gfxcoord_t _x2, gfxcoord_t _y2)
@@ -187,8 +192,10 @@ void pdfpage_rendersection(gfxpage_t*page, gfxdevice_t*output, gfxcoord_t x, gfx
     int x1=(int)_x1,y1=(int)_y1,x2=(int)_x2,y2=(int)_y2;
     if((x1|y1|x2|y2)==0) x2++;
 
+    STATS_START(t);
     render2(page, output, (int)x*multiply,(int)y*multiply,
                           (int)x1*multiply,(int)y1*multiply,(int)x2*multiply,(int)y2*multiply);
+    STATS_END(STATS_PDF_RENDER, t);
 }
 
 void pdf_doc_destroy(gfxdocument_t*gfx)
@@ -441,7 +448,10 @@ static void pdf_setparameter(gfxsource_t*src, const char*name, const char*value)
     } else if(!strcmp(name, "bigchar")) {
 	config_bigchar = atoi(value);
     } else if(!strcmp(name, "pages")) {
-	global_page_range = strdup(value);
+	/* an empty range selects all pages */
+	if(global_page_range)
+	    free(global_page_range);
+	global_page_range = *value?strdup(value):0;
     } else if(!strncmp(name, "font", strlen("font")) && name[4]!='q') {
 	addGlobalFont(value);
     } else if(!strncmp(name, "languagedir", strlen("languagedir"))) {
@@ -457,6 +467,10 @@ static void pdf_setparameter(gfxsource_t*src, const char*name, const char*value)
 	msg("<error> %s not supported anymore. Please use jpegsubpixels/ppmsubpixels");
     } else if(!strcmp(name, "multiply")) {
         multiply = atof(value);
+    } else if(!strcmp(name, "glyphcache")) {
+	glyphcache_setmaxsize(atoi(value)*1024);
+    } else if(!strcmp(name, "glyphcachefile")) {
+	glyphcache_setfilename(value);
     } else if(!strcmp(name, "help")) {
 	printf("\nPDF device global parameters:\n");
 	printf("fontdir=<dir>     a directory with additional fonts\n");
@@ -467,6 +481,13 @@ static void pdf_setparameter(gfxsource_t*src, const char*name, const char*value)
 	printf("multiply=<times>  Render everything at <times> the resolution\n");
 	printf("poly2bitmap       Convert graphics to bitmaps\n");
 	printf("bitmap            Convert everything to bitmaps\n");
+	printf("jpegpassthrough   Hand the original data of jpeg images to the output device, so that\n");
+	printf("                  unscaled baseline jpegs can be stored without recompressing them\n");
+	printf("bands=<n>         Together with \"bitmap\": render every page in <n> threads. Edges,\n");
+	printf("                  glyphs and images lying exactly on a pixel boundary may end up one\n");
+	printf("                  pixel off, compared to rendering the page in one thread\n");
+	printf("glyphcache=<kb>   Size of the glyph outline cache (default: 65536, 0 disables it)\n");
+	printf("glyphcachefile=<file> Load glyph outlines from, and save them to, <file>\n");
     }	
 }
 
@@ -478,6 +499,7 @@ void pdf_doc_prepare(gfxdocument_t*doc, gfxdevice_t*dev)
 
 static gfxdocument_t*pdf_open(gfxsource_t*src, const char*filename)
 {
+    STATS_START(starttime);
     gfxsource_internal_t*isrc = (gfxsource_internal_t*)src->internal;
     gfxdocument_t*pdf_doc = (gfxdocument_t*)malloc(sizeof(gfxdocument_t));
     memset(pdf_doc, 0, sizeof(gfxdocument_t));
@@ -567,6 +589,7 @@ static gfxdocument_t*pdf_open(gfxsource_t*src, const char*filename)
 	pdf_doc->setparameter(pdf_doc, p->key, p->value);
 	p = p->next;
     }
+    STATS_END(STATS_PDF_OPEN, starttime);
     return pdf_doc;
 }
     
@@ -581,6 +604,14 @@ void pdf_destroy(gfxsource_t*src)
     
     free(src->internal);src->internal=0;
 
+    glyphcache_stats_t stats = glyphcache_getstats();
+    msg("<verbose> Glyph cache: %d/%d outline hits, %d/%d gfxline hits, %d glyphs, %d bytes",
+	    stats.path_hits, stats.path_hits+stats.path_misses,
+	    stats.line_hits, stats.line_hits+stats.line_misses,
+	    stats.num_glyphs, stats.size);
+    glyphcache_save();
+    glyphcache_clear();
+
     delete globalParams;globalParams = 0;
     free(src);
 }
@@ -24,6 +24,12 @@
 #include <fcntl.h>
 #include <zlib.h>
 #include <limits.h>
+#include "palette.h"
+#include "bitio.h"
+#include "os.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef EXPORT
 #undef EXPORT
@@ -31,6 +37,7 @@
 
 #ifdef PNG_INLINE_EXPORTS
 #define EXPORT static
+typedef struct _png_encoder png_encoder_t;
 #else
 #define EXPORT
 #include "png.h"
@@ -1021,9 +1028,8 @@ static void png_patch_len(FILE*fi, int pos, int len)
 }
 static void png_write_bytes(FILE*fi, unsigned char*bytes, int len)
 {
-    int t;
-    for(t=0;t<len;t++)
-	png_write_byte(fi,bytes[t]);
+    fwrite(bytes, len, 1, fi);
+    mycrc32 = crc32(mycrc32^0xffffffff, bytes, len)^0xffffffff;
 }
 static void png_write_dword(FILE*fi, u32 dword)
 {
@@ -1043,108 +1049,6 @@ static void png_end_chunk(FILE*fi)
     fwrite(&tmp2,4,1,fi);
 }
 
-#define ZLIB_BUFFER_SIZE 16384
-
-static long compress_line(z_stream*zs, Bytef*line, int len, FILE*fi)
-{
-    long size = 0;
-    zs->next_in = line;
-    zs->avail_in = len;
-
-    while(1) {
-	int ret = deflate(zs, Z_NO_FLUSH);
-	if (ret != Z_OK) {
-	    fprintf(stderr, "error in deflate(): %s", zs->msg?zs->msg:"unknown");
-	    return 0;
-	}
-	if(zs->avail_out != ZLIB_BUFFER_SIZE) {
-	    int consumed = ZLIB_BUFFER_SIZE - zs->avail_out;
-	    size += consumed;
-	    png_write_bytes(fi, zs->next_out - consumed , consumed);
-	    zs->next_out = zs->next_out - consumed;
-	    zs->avail_out = ZLIB_BUFFER_SIZE;
-	}
-	if(!zs->avail_in) {
-	    break;
-	}
-    }
-    return size;
-}
-
-static int test_line(z_stream*zs_orig, Bytef*line, int linelen)
-{
-    z_stream zs;
-    int ret = deflateCopy(&zs, zs_orig);
-    if(ret != Z_OK) {
-	fprintf(stderr, "Couldn't copy stream\n");
-	return 0;
-    }
-
-    zs.next_in = line;
-    zs.avail_in = linelen;
-
-    long size = 0;
-
-    int mode = Z_SYNC_FLUSH;
-    while(1) {
-	int ret = deflate(&zs, mode);
-	if (ret != Z_OK && ret != Z_STREAM_END) {
-	    fprintf(stderr, "error in deflate(): %s (mode %s, %d bytes remaining)\n", zs.msg?zs.msg:"unknown", 
-		    mode==Z_SYNC_FLUSH?"Z_SYNC_FLUSH":"Z_FINISH", zs.avail_in);
-	    return 0;
-	}
-	if(zs.avail_out != ZLIB_BUFFER_SIZE) {
-	    int consumed = ZLIB_BUFFER_SIZE - zs.avail_out;
-	    size += consumed;
-	    zs.next_out = zs.next_out - consumed;
-	    zs.avail_out = ZLIB_BUFFER_SIZE;
-	}
-        if (ret == Z_STREAM_END) {
-            break;
-        }
-	if(!zs.avail_in) {
-	    mode = Z_FINISH;
-	}
-    }
-    ret = deflateEnd(&zs);
-    if (ret != Z_OK) {
-	fprintf(stderr, "error in deflateEnd(): %s\n", zs.msg?zs.msg:"unknown");
-	return 0;
-    }
-    return size;
-}
-
-static int finishzlib(z_stream*zs, FILE*fi)
-{
-    int size = 0;
-    int ret;
-    while(1) {
-        ret = deflate(zs, Z_FINISH);
-        if (ret != Z_OK &&
-            ret != Z_STREAM_END) {
-	    fprintf(stderr, "error in deflate(finish): %s\n", zs->msg?zs->msg:"unknown");
-	    return 0;
-	}
-
-	if(zs->avail_out != ZLIB_BUFFER_SIZE) {
-	    int consumed = ZLIB_BUFFER_SIZE - zs->avail_out;
-	    size += consumed;
-	    png_write_bytes(fi, zs->next_out - consumed , consumed);
-	    zs->next_out = zs->next_out - consumed;
-	    zs->avail_out = ZLIB_BUFFER_SIZE;
-	}
-        if (ret == Z_STREAM_END) {
-            break;
-        }
-    }
-    ret = deflateEnd(zs);
-    if (ret != Z_OK) {
-	fprintf(stderr, "error in deflateEnd(): %s\n", zs->msg?zs->msg:"unknown");
-	return 0;
-    }
-    return size;
-}
-
 static inline u32 color_hash(COL*col)
 {
     u32 col32 = *(u32*)col;
@@ -1156,69 +1060,35 @@ static inline u32 color_hash(COL*col)
 static int png_get_number_of_palette_entries(COL*img, unsigned width, unsigned height, COL*palette, char*has_alpha)
 {
     int len = width*height;
+    u32 pal[256];
+    COL cols[256];
+    int count[256];
     int t;
-    int palsize = 0;
-    int size[256];
-    int palette_overflow = 0;
-    u32 lastcol32 = 0;
-    
-    memset(size, 0, sizeof(size));
-
-    u32*pal = (u32*)malloc(65536*sizeof(u32));
-    int*count = (int*)malloc(65536*sizeof(int));
 
     assert(sizeof(COL)==sizeof(u32));
     assert(width && height);
 
-    lastcol32 = (*(u32*)&img[0])^0xffffffff; // don't match
-
-    for(t=0;t<len;t++) {
-	u32 col32 = *(u32*)&img[t];
-	if(col32 == lastcol32)
-	    continue;
-	
-	if(img[t].a!=255)
-	    *has_alpha=1;
-	int i;
-	
-	u32 hash = color_hash(&img[t])&255;
-
-	int csize = size[hash];
-	u32*cpal = &pal[hash*256];
-	int*ccount = &count[hash*256];
-	for(i=0;i<csize;i++) {
-	    if(col32 == cpal[i]) {
-		ccount[i]++;
-		break;
-	    }
-	}
-	if(i==csize) {
-	    if(palsize==256) {
-		palette_overflow = 1;
-		break;
-	    }
-	    count[size[hash]] = 1;
-	    cpal[size[hash]++] = col32;
-	    palsize++;
-	}
-	lastcol32 = col32;
-    }
-    if(palette_overflow) {
-	free(pal);
+    int palsize = palette_count_colors(img, len, 256, pal, count);
+    if(palsize<0) {
 	*has_alpha=1;
 	return width*height;
     }
+    memcpy(cols, pal, palsize*sizeof(COL));
+    for(t=0;t<palsize;t++) {
+	if(cols[t].a!=255)
+	    *has_alpha=1;
+    }
     if(palette) {
+	/* order by hash bucket first, then sort by number of occurences */
 	int i = 0;
 	int occurences[256];
-	for(t=0;t<256;t++) {
-	    int s;
-	    int csize = size[t];
-	    u32* cpal = &pal[t*256];
-	    int* ccount = &count[t*256];
-	    for(s=0;s<csize;s++) {
-		occurences[i] = ccount[s];
-		palette[i++] = *(COL*)(&cpal[s]);
+	int h;
+	for(h=0;h<256;h++) {
+	    for(t=0;t<palsize;t++) {
+		if((color_hash(&cols[t])&255) == h) {
+		    occurences[i] = count[t];
+		    palette[i++] = cols[t];
+		}
 	    }
 	}
 	assert(i==palsize);
@@ -1236,8 +1106,6 @@ static int png_get_number_of_palette_entries(COL*img, unsigned width, unsigned h
 	    }
 	}
     }
-    free(pal);
-    free(count);
     return palsize;
 }
 
@@ -1268,262 +1136,260 @@ static void png_map_to_palette(COL*src, unsigned char*dest, int size, COL*palett
     }
 }
 
-static int png_apply_specific_filter_8(int filtermode, unsigned char*dest, unsigned char*src, unsigned width)
+/* ------------------------------ encoder -------------------------------- */
+
+struct _png_encoder {
+    int level;
+    int threads;
+
+    /* the current line, run through each of the five filters (in source byte order) */
+    unsigned char*rows;
+    int rows_size;
+
+    /* the filter heuristic counts distinct byte pairs. A pair is already present
+       if its entry in the table of its filter equals "generation", so the tables
+       never need to be cleared between lines. */
+    unsigned short*seen;
+    unsigned short generation;
+};
+
+#ifdef __SSE2__
+static inline __m128i abs_epi16(__m128i x)
 {
-    int pos2 = 0;
-    int pos = 0;
-    int srcwidth = width;
-    int x;
-    if(filtermode == 0) {
-	for(x=0;x<width;x++) {
-	    dest[pos2++]=src[pos++]; //alpha
-	}
-    } else if(filtermode == 1) {
-	/* x difference filter */
-	dest[pos2++]=src[pos++];
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos] - src[pos-1];
-	    pos++;
-	}
-    } else if(filtermode == 2) {
-	/* y difference filter */
-	for(x=0;x<width;x++) {
-	    dest[pos2++]=src[pos+0] - src[pos-srcwidth+0]; //alpha
-	    pos++;
-	}
-    } else if(filtermode == 3) {
-	dest[pos2++]=src[pos+0] - src[pos-srcwidth+0]/2;
-	pos++;
-	/* x+y difference filter */
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+0] - (src[pos-1+0] + src[pos-srcwidth+0])/2; //alpha
-	    pos++;
-	}
-    } else if(filtermode == 4) {
-	dest[pos2++]=src[pos+0] - PaethPredictor(0, src[pos-srcwidth+0], 0);
-	pos++;
-	/* paeth difference filter */
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+0] - PaethPredictor(src[pos-1+0], src[pos-srcwidth+0], src[pos-1-srcwidth+0]);
-	    pos++;
-	}
-    }
-    return filtermode;
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+/* PaethPredictor() for eight 16 bit values at once */
+static inline __m128i paeth_epi16(__m128i a, __m128i b, __m128i c)
+{
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+    pa = abs_epi16(pa);
+    pb = abs_epi16(pb);
+    __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+    __m128i bc = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+    return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
 }
+#endif
 
-static int png_apply_specific_filter_32(int filtermode, unsigned char*dest, unsigned char*src, unsigned width)
+/* run one line through all the filters. Pixels left of the image are zero, for
+   the first line only filters 0 and 1 are computed. */
+static void png_filter_line(png_encoder_t*e, unsigned char*src, int w, int bypp, int y)
 {
-    int pos2 = 0;
-    int pos = 0;
-    int srcwidth = width*4;
+    unsigned char*r0 = e->rows;
+    unsigned char*r1 = r0 + w;
+    unsigned char*r2 = r1 + w;
+    unsigned char*r3 = r2 + w;
+    unsigned char*r4 = r3 + w;
+    unsigned char*up = src - w;
     int x;
-    if(filtermode == 0) {
-	for(x=0;x<width;x++) {
-	    dest[pos2++]=src[pos+1];
-	    dest[pos2++]=src[pos+2];
-	    dest[pos2++]=src[pos+3];
-	    dest[pos2++]=src[pos+0]; //alpha
-	    pos+=4;
+    for(x=0;x<bypp;x++) {
+	r0[x] = r1[x] = src[x];
+	if(y) {
+	    r2[x] = src[x] - up[x];
+	    r3[x] = src[x] - up[x]/2;
+	    r4[x] = src[x] - PaethPredictor(0, up[x], 0);
 	}
-    } else if(filtermode == 1) {
-	/* x difference filter */
-	dest[pos2++]=src[pos+1];
-	dest[pos2++]=src[pos+2];
-	dest[pos2++]=src[pos+3];
-	dest[pos2++]=src[pos+0];
-	pos+=4;
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+1] - src[pos-4+1];
-	    dest[pos2++]=src[pos+2] - src[pos-4+2];
-	    dest[pos2++]=src[pos+3] - src[pos-4+3];
-	    dest[pos2++]=src[pos+0] - src[pos-4+0]; //alpha
-	    pos+=4;
-	}
-    } else if(filtermode == 2) {
-	/* y difference filter */
-	for(x=0;x<width;x++) {
-	    dest[pos2++]=src[pos+1] - src[pos-srcwidth+1];
-	    dest[pos2++]=src[pos+2] - src[pos-srcwidth+2];
-	    dest[pos2++]=src[pos+3] - src[pos-srcwidth+3];
-	    dest[pos2++]=src[pos+0] - src[pos-srcwidth+0]; //alpha
-	    pos+=4;
-	}
-    } else if(filtermode == 3) {
-	dest[pos2++]=src[pos+1] - src[pos-srcwidth+1]/2;
-	dest[pos2++]=src[pos+2] - src[pos-srcwidth+2]/2;
-	dest[pos2++]=src[pos+3] - src[pos-srcwidth+3]/2;
-	dest[pos2++]=src[pos+0] - src[pos-srcwidth+0]/2;
-	pos+=4;
-	/* x+y difference filter */
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+1] - (src[pos-4+1] + src[pos-srcwidth+1])/2;
-	    dest[pos2++]=src[pos+2] - (src[pos-4+2] + src[pos-srcwidth+2])/2;
-	    dest[pos2++]=src[pos+3] - (src[pos-4+3] + src[pos-srcwidth+3])/2;
-	    dest[pos2++]=src[pos+0] - (src[pos-4+0] + src[pos-srcwidth+0])/2; //alpha
-	    pos+=4;
-	}
-    } else if(filtermode == 4) {
-	dest[pos2++]=src[pos+1] - PaethPredictor(0, src[pos-srcwidth+1], 0);
-	dest[pos2++]=src[pos+2] - PaethPredictor(0, src[pos-srcwidth+2], 0);
-	dest[pos2++]=src[pos+3] - PaethPredictor(0, src[pos-srcwidth+3], 0);
-	dest[pos2++]=src[pos+0] - PaethPredictor(0, src[pos-srcwidth+0], 0);
-	pos+=4;
-	/* paeth difference filter */
-	for(x=1;x<width;x++) {
-	    dest[pos2++]=src[pos+1] - PaethPredictor(src[pos-4+1], src[pos-srcwidth+1], src[pos-4-srcwidth+1]);
-	    dest[pos2++]=src[pos+2] - PaethPredictor(src[pos-4+2], src[pos-srcwidth+2], src[pos-4-srcwidth+2]);
-	    dest[pos2++]=src[pos+3] - PaethPredictor(src[pos-4+3], src[pos-srcwidth+3], src[pos-4-srcwidth+3]);
-	    dest[pos2++]=src[pos+0] - PaethPredictor(src[pos-4+0], src[pos-srcwidth+0], src[pos-4-srcwidth+0]);
-	    pos+=4;
+    }
+    if(!y) {
+	memcpy(r0+bypp, src+bypp, w-bypp);
+	for(;x<w;x++) {
+	    r1[x] = src[x] - src[x-bypp];
 	}
+	return;
+    }
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi8(1);
+    for(;x+16<=w;x+=16) {
+	__m128i s = _mm_loadu_si128((__m128i*)(src+x));
+	__m128i a = _mm_loadu_si128((__m128i*)(src+x-bypp));
+	__m128i b = _mm_loadu_si128((__m128i*)(up+x));
+	__m128i c = _mm_loadu_si128((__m128i*)(up+x-bypp));
+	_mm_storeu_si128((__m128i*)(r0+x), s);
+	_mm_storeu_si128((__m128i*)(r1+x), _mm_sub_epi8(s, a));
+	_mm_storeu_si128((__m128i*)(r2+x), _mm_sub_epi8(s, b));
+	/* _mm_avg_epu8 rounds up, the png average filter rounds down */
+	__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+	_mm_storeu_si128((__m128i*)(r3+x), _mm_sub_epi8(s, avg));
+	__m128i plo = paeth_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+	__m128i phi = paeth_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+	_mm_storeu_si128((__m128i*)(r4+x), _mm_sub_epi8(s, _mm_packus_epi16(plo, phi)));
+    }
+#endif
+    for(;x<w;x++) {
+	r0[x] = src[x];
+	r1[x] = src[x] - src[x-bypp];
+	r2[x] = src[x] - up[x];
+	r3[x] = src[x] - (src[x-bypp] + up[x])/2;
+	r4[x] = src[x] - PaethPredictor(src[x-bypp], up[x], up[x-bypp]);
     }
-    return filtermode;
 }
 
-static int*num_bits_table = 0;
-
-static void make_num_bits_table()
+/* approximation for zlib compressability: count how many different
+   (byte, previous byte) pairs occur. Only pairs with a previous byte
+   divisible by 8 are sampled, and only its upper five bits are looked at.
+   "prev" is the byte to use as predecessor of row[bypp]. */
+static int png_count_pairs(png_encoder_t*e, unsigned short*seen, unsigned char*row, int w, int bypp, unsigned char prev)
 {
-    if(num_bits_table) return;
-    num_bits_table = malloc(sizeof(num_bits_table[0])*256);
-    int t;
-    for(t=0;t<256;t++) {
-	int bits=0;
-	int v = t;
-	while(v) {
-	    bits++;
-	    v&=v-1;
+    unsigned short generation = e->generation;
+    int count = 0;
+    int x;
+#define SAMPLE(byte, prevbyte) \
+    if(!((prevbyte)&7)) { \
+	int v = (byte)<<5|(prevbyte)>>3; \
+	if(seen[v] != generation) { \
+	    seen[v] = generation; \
+	    count++; \
+	} \
+    }
+    for(x=bypp;x<w && x<bypp+2;x++) {
+	SAMPLE(row[x], prev);
+	prev = row[x];
+    }
+#ifdef __SSE2__
+    __m128i seven = _mm_set1_epi8(7);
+    __m128i zero = _mm_setzero_si128();
+    for(;x+16<=w;x+=16) {
+	__m128i cur = _mm_loadu_si128((__m128i*)(row+x));
+	__m128i prev1 = _mm_loadu_si128((__m128i*)(row+x-1));
+	__m128i prev2 = _mm_loadu_si128((__m128i*)(row+x-2));
+	__m128i sampled = _mm_cmpeq_epi8(_mm_and_si128(prev1, seven), zero);
+	/* inside a run of identical bytes, the pair is the same one as
+	   the pair before it, so it's been counted already */
+	__m128i repeated = _mm_and_si128(_mm_cmpeq_epi8(cur, prev1), _mm_cmpeq_epi8(prev1, prev2));
+	int mask = _mm_movemask_epi8(_mm_andnot_si128(repeated, sampled));
+	while(mask) {
+	    int pos = x + __builtin_ctz(mask);
+	    SAMPLE(row[pos], row[pos-1]);
+	    mask &= mask-1;
 	}
-	num_bits_table[t]=bits;
     }
+#endif
+    for(;x<w;x++) {
+	SAMPLE(row[x], row[x-1]);
+    }
+#undef SAMPLE
+    return count;
 }
 
-static int png_find_best_filter(unsigned char*src, unsigned width, int bpp, int y)
+static int png_find_best_filter(png_encoder_t*e, unsigned char*src, int w, int bypp, int y)
 {
-    make_num_bits_table();
-    
     int num_filters = y>0?5:2; //don't apply y-direction filter in first line
-    
-    int bytes_per_pixel = bpp>>3;
-    int w = width*bytes_per_pixel;
-    int back_x = bytes_per_pixel;
-    int back_y = y?width*bytes_per_pixel:0;
-
-    unsigned char*pairs[5];
-    pairs[0] = calloc(1, 8192);
-    pairs[1] = calloc(1, 8192);
-    pairs[2] = calloc(1, 8192);
-    pairs[3] = calloc(1, 8192);
-    pairs[4] = calloc(1, 8192);
-    
-    unsigned char old[5];
-    int l = bytes_per_pixel - 1;
-    old[0] = src[l];
-    old[1] = src[l];
-    old[2] = src[l] - src[l-back_y];
-    old[3] = src[l] - src[l-back_y];
-    old[4] = src[l] - PaethPredictor(0, src[l-back_y], 0);
-
-    int different_pairs[5] = {0,0,0,0,0};
+    int f;
 
-    int x;
-    for(x=bytes_per_pixel;x<w;x++) {
-	unsigned char dest[5];
-	dest[0] = src[x];
-	dest[1] = src[x] - src[x-back_x];
-	dest[2] = src[x] - src[x-back_y];
-	dest[3] = src[x] - (src[x-back_x] + src[x-back_y])/2;
-	dest[4] = src[x] - PaethPredictor(src[x-back_x], src[x-back_y], src[x-back_x-back_y]);
-
-	int i;
-	for(i=0;i<5;i++) {
-	    int v = dest[i]<<8|old[i];
-	    int p = v>>3;
-	    int b = 1<<(v&7);
-	    if(!pairs[i][p]&b) {
-		pairs[i][p]|=b;
-		different_pairs[i]++;
-	    }
-	}
-	memcpy(old, dest, sizeof(old));
+    if(!++e->generation) {
+	memset(e->seen, 0, sizeof(e->seen[0])*5*8192);
+	e->generation = 1;
     }
-    int f;
+
     int best_nr = 0;
     int best_energy = INT_MAX;
     for(f=0;f<num_filters;f++) {
-	int energy = different_pairs[f];
+	unsigned char*row = &e->rows[f*w];
+	unsigned char prev = row[bypp-1];
+	if(f==3) {
+	    /* for the average filter, the first pixel is predicted from the
+	       full (not the halved) pixel above */
+	    prev = src[bypp-1] - src[bypp-1-w];
+	}
+	int energy = png_count_pairs(e, &e->seen[f*8192], row, w, bypp, prev);
 	if(energy<best_energy) {
 	    best_nr = f;
 	    best_energy = energy;
 	}
     }
-    free(pairs[0]);
-    free(pairs[1]);
-    free(pairs[2]);
-    free(pairs[3]);
-    free(pairs[4]);
     return best_nr;
 }
-    
-    
-static int png_apply_filter(unsigned char*dest, unsigned char*src, unsigned width, int y, int bpp)
+
+static void png_encoder_prepare(png_encoder_t*e, int w)
 {
-    int best_nr = 0;
-#if 0
-    make_num_bits_table();
-    int num_filters = y>0?5:2; //don't apply y-direction filter in first line
-    int f;
-    int best_energy = INT_MAX;
-    int w = width*(bpp/8);
-    unsigned char* pairs = malloc(8192);
-    assert(bpp==8 || bpp==32);
-    for(f=0;f<num_filters;f++) {
-	if(bpp==8)
-	    png_apply_specific_filter_8(f, dest, src, width);
-	else
-	    png_apply_specific_filter_32(f, dest, src, width);
-	int x;
-
-	/* approximation for zlib compressability: test how many different
-	   (byte1,byte2) occur */
-	memset(pairs, 0, 8192);
-	int different_pairs = 0;
-	for(x=0;x<w-1;x++) {
-	    int v = dest[x+1]<<8|dest[x];
-	    int p = v>>3;
-	    int b = 1<<(v&7);
-	    if(!pairs[p]&b) {
-		pairs[p]|=b;
-		different_pairs ++;
-	    }
-	}
-	int energy = different_pairs;
-	if(energy<best_energy) {
-	    best_nr = f;
-	    best_energy = energy;
-	}
+    if(e->rows_size < w*5) {
+	if(e->rows)
+	    free(e->rows);
+	e->rows_size = w*5;
+	e->rows = (unsigned char*)malloc(e->rows_size);
+    }
+}
+
+/* filter one line of an 8 or 32 bit image, store the result (with the
+   filter type prepended) in dest */
+static void png_encoder_filter_line(png_encoder_t*e, unsigned char*dest, unsigned char*src, unsigned width, int y, int bpp)
+{
+    int bypp = bpp/8;
+    int w = width*bypp;
+    png_filter_line(e, src, w, bypp, y);
+    int f = png_find_best_filter(e, src, w, bypp, y);
+    unsigned char*row = &e->rows[f*w];
+    dest[0] = f;
+    dest++;
+    if(bpp==8) {
+	memcpy(dest, row, w);
+	return;
+    }
+    /* png wants rgba, we have argb */
+    int x = 0;
+#ifdef __SSE2__
+    for(;x+16<=w;x+=16) {
+	__m128i v = _mm_loadu_si128((__m128i*)(row+x));
+	_mm_storeu_si128((__m128i*)(dest+x), _mm_or_si128(_mm_srli_epi32(v, 8), _mm_slli_epi32(v, 24)));
     }
-    free(pairs);
-#else
-    best_nr = png_find_best_filter(src, width, bpp, y);
 #endif
-    if(bpp==8)
-	png_apply_specific_filter_8(best_nr, dest, src, width);
-    else
-	png_apply_specific_filter_32(best_nr, dest, src, width);
-    return best_nr;
+    for(;x<w;x+=4) {
+	dest[x+0] = row[x+1];
+	dest[x+1] = row[x+2];
+	dest[x+2] = row[x+3];
+	dest[x+3] = row[x+0];
+    }
 }
 
-int png_apply_filter_8(unsigned char*dest, unsigned char*src, unsigned width, int y)
+/* level: zlib compression level, threads: number of threads compressing
+   image stripes concurrently (0 = number of cpus) */
+EXPORT void png_encoder_set_parameters(png_encoder_t*e, int level, int threads)
 {
-    return png_apply_filter(dest, src, width, y, 8);
+    e->level = level;
+    e->threads = threads>0 ? threads : os_get_number_of_cpus();
 }
-int png_apply_filter_32(unsigned char*dest, unsigned char*src, unsigned width, int y)
+
+EXPORT png_encoder_t* png_encoder_new(int level, int threads)
 {
-    return png_apply_filter(dest, src, width, y, 32);
+    png_encoder_t*e = (png_encoder_t*)calloc(1, sizeof(png_encoder_t));
+    e->seen = (unsigned short*)calloc(5*8192, sizeof(unsigned short));
+    png_encoder_set_parameters(e, level, threads);
+    return e;
 }
 
-static void png_write_palette_based2(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors, int compression)
+EXPORT void png_encoder_destroy(png_encoder_t*e)
+{
+    if(e->rows)
+	free(e->rows);
+    free(e->seen);
+    free(e);
+}
+
+static int png_chunkwriter_write(writer_t*w, void*data, int len)
+{
+    png_write_bytes((FILE*)w->internal, (unsigned char*)data, len);
+    w->pos += len;
+    return len;
+}
+static void png_chunkwriter_flush(writer_t*w)
+{
+}
+static void png_chunkwriter_finish(writer_t*w)
+{
+}
+static void png_init_chunkwriter(writer_t*w, FILE*fi)
+{
+    memset(w, 0, sizeof(writer_t));
+    w->write = png_chunkwriter_write;
+    w->flush = png_chunkwriter_flush;
+    w->finish = png_chunkwriter_finish;
+    w->internal = fi;
+}
+
+EXPORT void png_encoder_write(png_encoder_t*e, const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors)
 {
     FILE*fi;
     int crc;
@@ -1538,9 +1404,7 @@ static void png_write_palette_based2(const char*filename, unsigned char*data, un
     int error;
     u32 tmp32;
     int bpp;
-    int ret;
     char has_alpha=0;
-    z_stream zs;
     COL palette[256];
 
     make_crc32_table();
@@ -1614,85 +1478,66 @@ static void png_write_palette_based2(const char*filename, unsigned char*data, un
     }
 
     long idatpos = png_start_chunk(fi, "IDAT", 0);
-    
-    memset(&zs,0,sizeof(z_stream));
-    Bytef*writebuf = (Bytef*)malloc(ZLIB_BUFFER_SIZE);
-    zs.zalloc = Z_NULL;
-    zs.zfree  = Z_NULL;
-    zs.opaque = Z_NULL;
-    zs.next_out = writebuf;
-    zs.avail_out = ZLIB_BUFFER_SIZE;
-    ret = deflateInit(&zs, compression);
-    if (ret != Z_OK) {
-	fprintf(stderr, "error in deflateInit(): %s", zs.msg?zs.msg:"unknown");
-	return;
-    }
-
-    long idatsize = 0;
+    writer_t chunkwriter, zwriter;
+    png_init_chunkwriter(&chunkwriter, fi);
+    writer_init_zlibdeflate2(&zwriter, &chunkwriter, e->level, e->threads);
     {
-	int x,y;
+	int y;
         int bypp = bpp/8;
 	unsigned srcwidth = width * bypp;
 	unsigned linelen = 1 + srcwidth;
-        if(bypp==2) 
-            linelen = 1 + ((srcwidth+1)&~1);
-        else if(bypp==3) 
-            linelen = 1 + ((srcwidth+2)/3)*3;
-        else if(bypp==4) 
-            linelen = 1 + ((srcwidth+3)&~3);
+	png_encoder_prepare(e, srcwidth);
 	unsigned char* line = (unsigned char*)malloc(linelen);
-	memset(line, 0, linelen);
-#if 0
-	unsigned char* bestline = (unsigned char*)malloc(linelen);
-	memset(bestline, 0, linelen);
-	for(y=0;y<height;y++)
-	{
-	    int filtermode;
-	    int bestsize = 0x7fffffff;
-	    for(filtermode=0;filtermode<=4;filtermode++) {
-		if(!y && filtermode>=2)
-		    continue; // don't do y direction filters in the first row
-		
-		line[0]=filtermode; //filter type
-                if(bpp==8)
-		    png_apply_specific_filter_8(filtermode, line+1, &data[y*srcwidth], width);
-                else
-		    png_apply_specific_filter_32(filtermode, line+1, &data[y*srcwidth], width);
-
-		int size = test_line(&zs, line, linelen);
-		if(size < bestsize) {
-		    memcpy(bestline, line, linelen);
-		    bestsize = size;
-		}
-	    }
-	    idatsize += compress_line(&zs, bestline, linelen, fi);
-	}
-	free(bestline);
-#else
 	for(y=0;y<height;y++) {
-            if(bpp==8)
-		line[0] = png_apply_filter_8(line+1, &data[y*srcwidth], width, y);
-            else
-		line[0] = png_apply_filter_32(line+1, &data[y*srcwidth], width, y);
-
-	    idatsize += compress_line(&zs, line, linelen, fi);
+	    png_encoder_filter_line(e, line, &data[y*srcwidth], width, y, bpp);
+	    zwriter.write(&zwriter, line, linelen);
 	}
-#endif
 	free(line);
     }
-    idatsize += finishzlib(&zs, fi);
-    png_patch_len(fi, idatpos, idatsize);
+    zwriter.finish(&zwriter);
+    png_patch_len(fi, idatpos, chunkwriter.pos);
     png_end_chunk(fi);
 
     png_start_chunk(fi, "IEND", 0);
     png_end_chunk(fi);
 
-    free(writebuf);
     if(data2)
 	free(data2);
     fclose(fi);
 }
 
+
+/* filters a line the same way the png writer does. Only meant for
+   occasional use, png_encoder_write() reuses its scratch memory across lines. */
+static int png_apply_filter(unsigned char*dest, unsigned char*src, unsigned width, int y, int bpp)
+{
+    png_encoder_t*e = png_encoder_new(0, 1);
+    png_encoder_prepare(e, width*(bpp/8));
+    unsigned char*line = (unsigned char*)malloc(width*(bpp/8)+1);
+    png_encoder_filter_line(e, line, src, width, y, bpp);
+    memcpy(dest, line+1, width*(bpp/8));
+    int filter = line[0];
+    free(line);
+    png_encoder_destroy(e);
+    return filter;
+}
+
+int png_apply_filter_8(unsigned char*dest, unsigned char*src, unsigned width, int y)
+{
+    return png_apply_filter(dest, src, width, y, 8);
+}
+int png_apply_filter_32(unsigned char*dest, unsigned char*src, unsigned width, int y)
+{
+    return png_apply_filter(dest, src, width, y, 32);
+}
+
+static void png_write_palette_based2(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors, int compression)
+{
+    png_encoder_t*e = png_encoder_new(compression, 1);
+    png_encoder_write(e, filename, data, width, height, numcolors);
+    png_encoder_destroy(e);
+}
+
 EXPORT void png_write_palette_based(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors)
 {
     png_write_palette_based2(filename, data, width, height, numcolors, Z_BEST_COMPRESSION);
@@ -35,6 +35,15 @@ void png_write(const char*filename, unsigned char*data, unsigned width, unsigned
 void png_write_quick(const char*filename, unsigned char*data, unsigned width, unsigned height);
 void png_write_palette_based_2(const char*filename, unsigned char*data, unsigned width, unsigned height);
 
+/* an encoder keeps its scratch memory between images, and can compress
+   with several threads. numcolors is as for png_write_palette_based(), 0
+   meaning "use a palette if the image has few enough colors" */
+typedef struct _png_encoder png_encoder_t;
+png_encoder_t* png_encoder_new(int level, int threads);
+void png_encoder_set_parameters(png_encoder_t*e, int level, int threads);
+void png_encoder_write(png_encoder_t*e, const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors);
+void png_encoder_destroy(png_encoder_t*e);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1582,7 +1582,7 @@ PyDoc_STRVAR(f_createBitmap_doc, \
 static PyObject* create_bitmap(gfximage_t*img)
 {
     BitmapObject*self = PyObject_New(BitmapObject, &BitmapClass);
-    self->image = malloc(sizeof(gfximage_t));
+    self->image = calloc(1, sizeof(gfximage_t));
     self->image->data = malloc(sizeof(gfxcolor_t)*img->width*img->height);
     memcpy(self->image->data, img->data, sizeof(gfxcolor_t)*img->width*img->height);
     self->image->width = img->width;
@@ -419,11 +419,8 @@ void swf_FreeTaglist(TAG*tag)
 { 
     while(tag)
     { 
-	TAG * tnew = tag->next;
-	if (tag->data) 
-	    rfx_free(tag->data);
-	rfx_free(tag);
-	tag = tnew;
+	tag->prev = 0;
+	tag = swf_DeleteTag(0, tag);
     }
 }
 
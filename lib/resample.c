@@ -0,0 +1,226 @@
+/* resample.c
+
+   Streaming sample rate conversion for 16 bit mono audio.
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../config.h"
+#include "types.h"
+#include "mem.h"
+#include "resample.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* zero crossings of the sinc on each side, at the lower of the two rates */
+#define ZEROS 16
+/* cutoff, relative to the nyquist frequency of the lower rate */
+#define ROLLOFF 0.9
+#define KAISER_BETA 8.0
+/* the filter bank has one phase per distinct output position between two
+   input samples, but not more than this */
+#define MAX_PHASES 512
+#define WEIGHT_BITS 14
+
+struct _resampler {
+    int inrate;
+    int outrate;
+
+    int phases;
+    int taps; /* per phase, a multiple of 8 */
+    S16*weights;
+
+    /* position of the next output sample, in input samples: ipos + frac/outrate */
+    S64 ipos;
+    int frac;
+    int step;
+    int stepfrac;
+
+    /* input samples, buf[0] is at position bufstart */
+    S16*buf;
+    int buflen;
+    int bufsize;
+    S64 bufstart;
+};
+
+static int gcd(int a, int b)
+{
+    while(b) {
+	int t = a%b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    int k;
+    for(k=1;k<50;k++) {
+	term *= (x/(2*k))*(x/(2*k));
+	sum += term;
+	if(term < sum*1e-12)
+	    break;
+    }
+    return sum;
+}
+
+static void init_weights(resampler_t*r)
+{
+    /* cutoff, in cycles per input sample */
+    double fc = 0.5*ROLLOFF*(r->outrate < r->inrate ? (double)r->outrate/r->inrate : 1.0);
+    double halflen = ZEROS/(2*fc);
+    double i0beta = bessel_i0(KAISER_BETA);
+    double*w;
+    int p, k;
+
+    r->taps = ((int)ceil(halflen)*2 + 7)&~7;
+    r->weights = (S16*)rfx_calloc(r->phases*r->taps*sizeof(S16));
+    w = (double*)rfx_alloc(r->taps*sizeof(double));
+
+    for(p=0;p<r->phases;p++) {
+	S16*dest = &r->weights[p*r->taps];
+	double sum = 0;
+	int isum = 0, center = 0;
+	for(k=0;k<r->taps;k++) {
+	    /* distance between input sample k of the window and the output position */
+	    double d = k - (r->taps/2-1) - (double)p/r->phases;
+	    double x = d/halflen;
+	    w[k] = 0;
+	    if(x > -1 && x < 1) {
+		double s = d ? sin(2*M_PI*fc*d)/(M_PI*d) : 2*fc;
+		w[k] = s*bessel_i0(KAISER_BETA*sqrt(1-x*x))/i0beta;
+	    }
+	    sum += w[k];
+	}
+	/* normalize, so that every phase has a DC gain of exactly one */
+	for(k=0;k<r->taps;k++) {
+	    dest[k] = (S16)floor(w[k]/sum*(1<<WEIGHT_BITS)+0.5);
+	    isum += dest[k];
+	    if(dest[k] > dest[center])
+		center = k;
+	}
+	dest[center] += (1<<WEIGHT_BITS) - isum;
+    }
+    rfx_free(w);
+}
+
+resampler_t* resampler_new(int inrate, int outrate)
+{
+    resampler_t*r = (resampler_t*)rfx_calloc(sizeof(resampler_t));
+    int g = gcd(inrate, outrate);
+    r->inrate = inrate;
+    r->outrate = outrate;
+    /* output positions repeat every outrate/g samples */
+    r->phases = outrate/g <= MAX_PHASES ? outrate/g : MAX_PHASES;
+    r->step = inrate/outrate;
+    r->stepfrac = inrate%outrate;
+    init_weights(r);
+
+    /* the window of the first output sample reaches taps/2-1 samples
+       before the start of the input, which is silence */
+    r->bufsize = r->taps*4;
+    r->buf = (S16*)rfx_calloc(r->bufsize*sizeof(S16));
+    r->buflen = r->taps/2-1;
+    r->bufstart = -r->buflen;
+    return r;
+}
+
+void resampler_write(resampler_t*r, const short*samples, int num)
+{
+    if(r->buflen + num > r->bufsize) {
+	/* drop the samples which are left of the current window */
+	S64 drop = r->ipos - (r->taps/2-1) - r->bufstart;
+	if(drop > r->buflen)
+	    drop = r->buflen;
+	if(drop > 0) {
+	    memmove(r->buf, &r->buf[drop], (r->buflen-drop)*sizeof(S16));
+	    r->buflen -= drop;
+	    r->bufstart += drop;
+	}
+    }
+    if(r->buflen + num > r->bufsize) {
+	r->bufsize = r->buflen + num + r->taps*4;
+	r->buf = (S16*)rfx_realloc(r->buf, r->bufsize*sizeof(S16));
+    }
+    memcpy(&r->buf[r->buflen], samples, num*sizeof(S16));
+    r->buflen += num;
+}
+
+void resampler_flush(resampler_t*r)
+{
+    /* the window of the last output sample reaches taps/2 samples past the end */
+    int num = r->taps/2;
+    S16*zero = (S16*)rfx_calloc(num*sizeof(S16));
+    resampler_write(r, zero, num);
+    rfx_free(zero);
+}
+
+static inline S16 convolve(const S16*src, const S16*w, int taps)
+{
+    int acc = 0;
+    int k = 0;
+#ifdef __SSE2__
+    __m128i acc4 = _mm_setzero_si128();
+    for(;k<taps;k+=8) {
+	__m128i s = _mm_loadu_si128((const __m128i*)&src[k]);
+	__m128i ww = _mm_loadu_si128((const __m128i*)&w[k]);
+	acc4 = _mm_add_epi32(acc4, _mm_madd_epi16(s, ww));
+    }
+    acc4 = _mm_add_epi32(acc4, _mm_shuffle_epi32(acc4, _MM_SHUFFLE(1,0,3,2)));
+    acc4 = _mm_add_epi32(acc4, _mm_shuffle_epi32(acc4, _MM_SHUFFLE(2,3,0,1)));
+    acc = _mm_cvtsi128_si32(acc4);
+#else
+    for(;k<taps;k++) {
+	acc += src[k]*w[k];
+    }
+#endif
+    acc = (acc + (1<<(WEIGHT_BITS-1))) >> WEIGHT_BITS;
+    return acc<-32768 ? -32768 : (acc>32767 ? 32767 : acc);
+}
+
+int resampler_read(resampler_t*r, short*samples, int num)
+{
+    int n = 0;
+    while(n < num) {
+	S64 start = r->ipos - (r->taps/2-1) - r->bufstart;
+	int phase;
+	if(start + r->taps > r->buflen)
+	    break;
+	phase = (int)((S64)r->frac * r->phases / r->outrate);
+	samples[n++] = convolve(&r->buf[start], &r->weights[phase*r->taps], r->taps);
+
+	r->ipos += r->step;
+	r->frac += r->stepfrac;
+	if(r->frac >= r->outrate) {
+	    r->frac -= r->outrate;
+	    r->ipos++;
+	}
+    }
+    return n;
+}
+
+void resampler_destroy(resampler_t*r)
+{
+    rfx_free(r->weights);
+    rfx_free(r->buf);
+    rfx_free(r);
+}
@@ -0,0 +1,50 @@
+/* resample.h
+
+   Streaming sample rate conversion for 16 bit mono audio.
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __resample_h__
+#define __resample_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _resampler resampler_t;
+
+/* Windowed sinc (polyphase) resampler. Output sample n is taken at input
+   position n*inrate/outrate, so there's no delay between input and output. */
+resampler_t* resampler_new(int inrate, int outrate);
+
+/* append input samples */
+void resampler_write(resampler_t*r, const short*samples, int num);
+
+/* mark the end of the input. Afterwards, resampler_read() also returns
+   the output samples near the end, which need input from after it. */
+void resampler_flush(resampler_t*r);
+
+/* get up to num output samples. Returns 0 if more input is needed. */
+int resampler_read(resampler_t*r, short*samples, int num);
+
+void resampler_destroy(resampler_t*r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -139,16 +139,34 @@ int swf_GetBlock(TAG * t,U8 * b,int l)
   return l;
 }
 
+void swf_ReserveTag(TAG * t,U32 size)
+{ U32  newmem;
+  U8 * newdata;
+  if (size<=t->memsize)
+    return;
+  if (!t->data && t->pool && size<=TAG_INLINE_SIZE)
+  { // short tags of a pool don't need memory of their own
+    t->data    = t->inline_data;
+    t->memsize = TAG_INLINE_SIZE;
+    return;
+  }
+  // grow geometrically, so that tags which are written in many small
+  // pieces don't get reallocated over and over again
+  newmem = MEMSIZE(size);
+  if (newmem<t->memsize*2) newmem = t->memsize*2;
+  if (t->data==t->inline_data)
+  { newdata = (U8*)rfx_alloc(newmem);
+    memcpy(newdata,t->data,t->len);
+  } else newdata = (U8*)rfx_realloc(t->data,newmem);
+  t->memsize = newmem;
+  t->data    = newdata;
+}
+
 int swf_SetBlock(TAG * t,const U8 * b,int l)
 // Appends Block to the end of Tagdata, returns size
 { U32 newlen = t->len + l;
   swf_ResetWriteBits(t);
-  if (newlen>t->memsize)
-  { U32  newmem  = MEMSIZE(newlen);  
-    U8 * newdata = (U8*)(rfx_realloc(t->data,newmem));
-    t->memsize = newmem;
-    t->data    = newdata;
-  }
+  if (newlen>t->memsize) swf_ReserveTag(t,newlen);
   if (b) memcpy(&t->data[t->len],b,l);
   else memset(&t->data[t->len],0x00,l);
   t->len+=l;
@@ -199,32 +217,53 @@ int swf_SetU32(TAG * t,U32 v)
   return 0;
 }
 
+// readBit/writeBit hold the mask of the next bit in the current byte.
+// Returns the position of that bit (0x01 -> 0, 0x80 -> 7).
+static int bitindex(U8 mask)
+{
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int i = 0;
+  if (mask&0xf0) { i+=4; mask>>=4; }
+  if (mask&0x0c) { i+=2; mask>>=2; }
+  if (mask&0x02) i++;
+  return i;
+#endif
+}
+
 U32 swf_GetBits(TAG * t,int nbits)
-{ U32 res = 0;
+// The bytes containing the bits are collected in a 64 bit buffer, from
+// which the result is taken with shifts.
+{ U64 buf;
+  U8 * p;
+  int bits,n;
   if (!nbits) return 0;
-  if (!t->readBit) t->readBit = 0x80;
-  while (nbits)
-  { res<<=1;
+  bits = nbits + (t->readBit?7-bitindex(t->readBit):0);
 #ifdef DEBUG_RFXSWF
-    if (t->pos>=t->len) 
-    { fprintf(stderr,"GetBits() out of bounds: TagID = %i, pos=%d, len=%d\n",t->id, t->pos, t->len);
-      int i,m=t->len>10?10:t->len;
-      for(i=-1;i<m;i++) {
-        fprintf(stderr, "(%d)%02x ", i, t->data[i]);
-      } 
-      fprintf(stderr, "\n");
-      return res;
-    }
+  if (t->pos+(bits-1)/8>=t->len) 
+  { fprintf(stderr,"GetBits() out of bounds: TagID = %i, pos=%d, len=%d\n",t->id, t->pos, t->len);
+    int i,m=t->len>10?10:t->len;
+    for(i=-1;i<m;i++) {
+      fprintf(stderr, "(%d)%02x ", i, t->data[i]);
+    } 
+    fprintf(stderr, "\n");
+    return 0;
+  }
 #endif
-    if (t->data[t->pos]&t->readBit) res|=1;
-    t->readBit>>=1;
-    nbits--;
-    if (!t->readBit)
-    { if (nbits) t->readBit = 0x80;
-      t->pos++;
-    }
+  p = &t->data[t->pos];
+  t->pos += bits>>3;
+  t->readBit = (bits&7)?0x80>>(bits&7):0;
+  if (t->pos+8<=t->len)
+  { // (at least) 8 bytes left: read them all, the compiler turns this into
+    // a single load
+    buf = (U64)p[0]<<56|(U64)p[1]<<48|(U64)p[2]<<40|(U64)p[3]<<32|
+          (U64)p[4]<<24|(U64)p[5]<<16|(U64)p[6]<<8|(U64)p[7];
+    return (U32)((buf<<(bits-nbits))>>(64-nbits));
   }
-  return res;
+  buf = p[0];
+  for (n=1;n*8<bits;n++) buf = buf<<8|p[n];
+  return (U32)(buf>>(n*8-bits))&(0xffffffff>>(32-nbits));
 }
 
 S32 swf_GetSBits(TAG * t,int nbits)
@@ -243,18 +282,31 @@ S32 reader_GetSBits(reader_t*reader, int nbits)
 }
 
 int swf_SetBits(TAG * t,U32 v,int nbits)
-{ U32 bm = 1<<(nbits-1);
-
-  while (nbits)
-  { if (!t->writeBit)
-    { if (FAILED(swf_SetU8(t,0))) return -1;
-      t->writeBit = 0x80;
-    }
-    if (v&bm) t->data[t->len-1] |= t->writeBit;
-    bm>>=1;
-    t->writeBit>>=1;
-    nbits--;
+// Fills up the free bits of the last byte, and appends the remaining bits
+// bytewise from a 64 bit buffer.
+{ int free = t->writeBit?bitindex(t->writeBit)+1:0;
+  int bytes,n;
+  U64 buf;
+  if (!nbits) return 0;
+  v &= 0xffffffff>>(32-nbits);
+  if (nbits<=free)
+  { t->data[t->len-1] |= v<<(free-nbits);
+    free -= nbits;
+    t->writeBit = free?1<<(free-1):0;
+    return 0;
   }
+  nbits -= free;
+  if (free) t->data[t->len-1] |= v>>nbits;
+  bytes = (nbits+7)>>3;
+  if (t->len+bytes>t->memsize) swf_ReserveTag(t,t->len+bytes);
+  buf = (U64)v<<(bytes*8-nbits);
+  for (n=bytes-1;n>=0;n--)
+  { t->data[t->len+n] = (U8)buf;
+    buf >>= 8;
+  }
+  t->len += bytes;
+  free = bytes*8-nbits;
+  t->writeBit = free?1<<(free-1):0;
   return 0;
 }
 
@@ -1125,10 +1177,99 @@ int swf_VerifyPassword(TAG * t, const char * password)
 
 // Tag List Manipulating Functions
 
+/* Tags are allocated in slabs. All tags of a tag list share one pool: a tag
+   which is created next to a pooled tag is taken from the same pool, and
+   the pool (with all its slabs) is released as soon as its last tag is
+   deleted. Tags created without neighbours are allocated on their own, so
+   that code which frees such tags itself keeps working.
+   A pool is not locked, which is fine as long as a tag list isn't modified
+   by several threads at the same time (which isn't safe anyway). */
+
+#define TAGSLAB_MIN 16
+#define TAGSLAB_MAX 1024
+
+typedef struct _tagslab {
+    struct _tagslab*next;
+    int size;
+    TAG tags[1];
+} tagslab_t;
+
+typedef struct _tagpool {
+    tagslab_t*slabs;
+    int used;       // tags handed out from the first slab
+    TAG*free;       // deleted tags, chained via ->next
+    int num;        // number of live tags
+} tagpool_t;
+
+static TAG* tag_new(TAG*prev, TAG*next)
+{
+    tagpool_t*pool;
+    TAG*t;
+    if(!prev && !next)
+	return (TAG*)rfx_calloc(sizeof(TAG));
+
+    pool = prev?prev->pool:0;
+    if(!pool && next) pool = next->pool;
+    if(!pool && prev && prev->prev) pool = prev->prev->pool;
+    if(!pool) {
+	pool = (tagpool_t*)rfx_calloc(sizeof(tagpool_t));
+    }
+
+    if(pool->free) {
+	t = pool->free;
+	pool->free = t->next;
+    } else {
+	if(!pool->slabs || pool->used == pool->slabs->size) {
+	    int size = pool->slabs?pool->slabs->size*2:TAGSLAB_MIN;
+	    tagslab_t*slab;
+	    if(size>TAGSLAB_MAX) size = TAGSLAB_MAX;
+	    slab = (tagslab_t*)rfx_alloc(sizeof(tagslab_t)+sizeof(TAG)*(size-1));
+	    slab->size = size;
+	    slab->next = pool->slabs;
+	    pool->slabs = slab;
+	    pool->used = 0;
+	}
+	t = &pool->slabs->tags[pool->used++];
+    }
+    memset(t, 0, sizeof(TAG));
+    t->pool = pool;
+    pool->num++;
+    return t;
+}
+
+static void tag_freedata(TAG*t)
+{
+    if(t->data && t->data != t->inline_data)
+	rfx_free(t->data);
+    t->data = 0;
+    t->memsize = 0;
+}
+
+static void tag_free(TAG*t)
+{
+    tagpool_t*pool = t->pool;
+    tag_freedata(t);
+    if(!pool) {
+	rfx_free(t);
+	return;
+    }
+    if(--pool->num) {
+	t->next = pool->free;
+	pool->free = t;
+	return;
+    }
+    while(pool->slabs) {
+	tagslab_t*next = pool->slabs->next;
+	rfx_free(pool->slabs);
+	pool->slabs = next;
+    }
+    rfx_free(pool);
+}
+
 TAG * swf_InsertTag(TAG * after,U16 id)
 { TAG * t;
 
-  t = (TAG *)rfx_calloc(sizeof(TAG));
+  t = tag_new(after, after?after->next:0);
   t->id = id;
   
   if (after)
@@ -1144,7 +1285,7 @@ TAG * swf_InsertTag(TAG * after,U16 id)
 TAG * swf_InsertTagBefore(SWF* swf, TAG * before,U16 id)
 { TAG * t;
 
-  t = (TAG *)rfx_calloc(sizeof(TAG));
+  t = tag_new(before?before->prev:0, before);
   t->id = id;
   
   if (before)
@@ -1162,13 +1303,11 @@ TAG * swf_InsertTagBefore(SWF* swf, TAG * before,U16 id)
 
 void swf_ClearTag(TAG * t)
 {
-  if (t->data) rfx_free(t->data);
-  t->data = 0;
+  tag_freedata(t);
   t->pos = 0;
   t->len = 0;
   t->readBit = 0;
   t->writeBit = 0;
-  t->memsize = 0;
 }
 
 void swf_ResetTag(TAG*tag, U16 id)
@@ -1193,8 +1332,7 @@ TAG* swf_DeleteTag(SWF*swf, TAG * t)
   if (t->prev) t->prev->next = t->next;
   if (t->next) t->next->prev = t->prev;
 
-  if (t->data) rfx_free(t->data);
-  rfx_free(t);
+  tag_free(t);
   return next;
 }
 
@@ -1218,20 +1356,24 @@ TAG * swf_ReadTag(reader_t*reader, TAG * prev)
   if (id==ST_DEFINESPRITE) len = 2*sizeof(U16);
   // Sprite handling fix: Flatten sprite tree
 
-  t = (TAG *)rfx_calloc(sizeof(TAG));
+  t = tag_new(prev, 0);
   
-  t->len = len;
   t->id  = id;
 
-  if (t->len)
-  { t->data = (U8*)rfx_alloc(t->len);
-    t->memsize = t->len;
+  if (len)
+  { if (t->pool && len<=TAG_INLINE_SIZE)
+    { t->data = t->inline_data;
+      t->memsize = TAG_INLINE_SIZE;
+    } else
+    { t->data = (U8*)rfx_alloc(len);
+      t->memsize = len;
+    }
+    t->len = len;
     if (reader->read(reader, t->data, t->len) != t->len) {
       #ifdef DEBUG_RFXSWF
       fprintf(stderr, "rfxswf: Warning: Short read (tagid %d). File truncated?\n", t->id);
       #endif
-      free(t->data);t->data=0;
-      free(t);
+      tag_free(t);
       return NULL;
     }
   }
@@ -1386,8 +1528,8 @@ void swf_UnFoldSprite(TAG * t)
 	break;
   }
   
-  rfx_free(t->data); t->data = 0;
-  t->memsize = t->len = t->pos = 0;
+  tag_freedata(t);
+  t->len = t->pos = 0;
 
   swf_SetU16(t, spriteid);
   swf_SetU16(t, spriteframes);
@@ -1413,9 +1555,8 @@ void swf_FoldSprite(TAG * t)
 
   t->pos = 0;
   id = swf_GetU16(t);
-  rfx_free(t->data);
-  t->len = t->pos = t->memsize = 0;
-  t->data = 0;
+  tag_freedata(t);
+  t->len = t->pos = 0;
 
   frames = 0;
 
@@ -1590,7 +1731,7 @@ int swf_ReadSWF2(reader_t*reader, SWF * swf)   // Reads SWF to memory (malloc'ed
     swf->frameCount = LE_16_TO_NATIVE(swf->frameCount);
 
     /* read tags and connect to list */
-    t1.next = 0;
+    memset(&t1, 0, sizeof(TAG));
     t = &t1;
     while (t) {
       t = swf_ReadTag(reader,t);
@@ -1640,6 +1781,19 @@ void swf_ReadABCfile(char*filename, SWF*swf)
 
 int no_extra_tags = 0;
 
+/* zlib level (-1 = default) and number of threads used for compressing
+   the swf body and lossless bitmaps */
+int swf_compression_level = -1;
+int swf_compression_threads = 1;
+
+void swf_SetCompressionParameters(int level, int threads)
+{
+    if(level>9) level = 9;
+    if(threads<=0) threads = os_get_number_of_cpus();
+    swf_compression_level = level;
+    swf_compression_threads = threads;
+}
+
 int WriteExtraTags(SWF*swf, writer_t*writer)
 {
     TAG*t = swf->firstTag;
@@ -1712,6 +1866,19 @@ int WriteExtraTags(SWF*swf, writer_t*writer)
     return len;
 }
 
+int swf_GetHeaderLength(SWF*swf)
+{
+    TAG t;
+    char b[64];
+    memset(&t,0x00,sizeof(TAG));
+    t.data    = (U8*)b;
+    t.memsize = 64;
+    swf_SetRect(&t, &swf->movieSize);
+    swf_SetU16(&t, swf->frameRate);
+    swf_SetU16(&t, swf->frameCount);
+    return swf_GetTagLen(&t)+8;
+}
+
 int  swf_WriteSWF2(writer_t*writer, SWF * swf)     // Writes SWF to file, returns length or <0 if fails
 { U32 len;
   TAG * t;
@@ -1757,17 +1924,7 @@ int  swf_WriteSWF2(writer_t*writer, SWF * swf)     // Writes SWF to file, return
     t1.data    = (U8*)b;
     t1.memsize = 64;
     
-    { // measure header file size
-      TAG t2;
-      char b2[64];
-      memset(&t2,0x00,sizeof(TAG));
-      t2.data    = (U8*)b2;
-      t2.memsize = 64;
-      swf_SetRect(&t2, &swf->movieSize);
-      swf_SetU16(&t2, swf->frameRate);
-      swf_SetU16(&t2, swf->frameCount);
-      l = swf_GetTagLen(&t2)+8;
-    }
+    l = swf_GetHeaderLength(swf);
     if(swf->compressed == 8) {
       l -= 8;
     }
@@ -1798,7 +1955,7 @@ int  swf_WriteSWF2(writer_t*writer, SWF * swf)     // Writes SWF to file, return
       writer->write(writer, b4, 4);
       
       if(swf->compressed==1 || (swf->compressed==0 && swf->fileVersion>=6)) {
-	writer_init_zlibdeflate(&zwriter, writer);
+	writer_init_zlibdeflate2(&zwriter, writer, swf_compression_level<0?9:swf_compression_level, swf_compression_threads);
 	writer = &zwriter;
       }
     }
@@ -1907,6 +2064,186 @@ int swf_WriteCGI(SWF * swf)
   return swf_WriteSWF(fileno(stdout),swf);
 }
 
+/* ---------------------------- incremental writer ------------------------- */
+
+/* If a compressed file is written to a seekable handle without knowing the
+   frame count in advance, the movie header (rect, frame rate, frame count) goes
+   into a stored (uncompressed) deflate block of its own, followed by a raw
+   deflate stream for the tags. This way, the frame count can be patched in the
+   file afterwards. The adler32 trailer is then computed by us. */
+
+static int swfwriter_adler_write(writer_t*w, void*data, int len)
+{
+    swfwriter_t*sw = (swfwriter_t*)w->internal;
+#ifdef HAVE_ZLIB
+    sw->adler = adler32(sw->adler, (Bytef*)data, len);
+#endif
+    w->pos += len;
+    return sw->zwriter.write(&sw->zwriter, data, len);
+}
+
+static void swfwriter_adler_finish(writer_t*w)
+{
+    memset(w, 0, sizeof(writer_t));
+}
+
+static int swfwriter_start(swfwriter_t*sw, writer_t*writer, SWF*swf)
+{
+    TAG t;
+    U8 b[8];
+
+    sw->output = writer;
+    sw->fileSize = swf->fileSize;
+    sw->frameCount = swf->frameCount;
+    sw->compressed = swf->compressed==1 || (swf->compressed==0 && swf->fileVersion>=6);
+
+    memset(&t, 0, sizeof(TAG));
+    t.data = sw->header;
+    t.memsize = sizeof(sw->header);
+    swf_SetRect(&t, &swf->movieSize);
+    sw->rectlen = t.len;
+    swf_SetU16(&t, swf->frameRate);
+    swf_SetU16(&t, swf->frameCount);
+    sw->headerlen = t.len;
+    sw->len = 8 + sw->headerlen;
+
+    b[0] = sw->compressed?'C':'F';
+    b[1] = 'W';
+    b[2] = 'S';
+    b[3] = swf->fileVersion;
+    PUT32(&b[4], swf->fileSize);
+    if(writer->write(writer, b, 8) != 8)
+	return -1;
+
+    if(!sw->compressed) {
+	sw->writer = writer;
+    } else if(sw->handle>=0 && !sw->frameCount) {
+#ifdef HAVE_ZLIB
+	U8 z[7];
+	z[0] = 0x78; z[1] = 0xda;   // zlib header
+	z[2] = 0;                   // stored block, not the last one
+	PUT16(&z[3], sw->headerlen);
+	PUT16(&z[5], ~sw->headerlen);
+	writer->write(writer, z, 7);
+	sw->headerpos = 8+7;
+	sw->patch_header = 1;
+	writer_init_rawdeflate(&sw->zwriter, writer, swf_compression_level<0?9:swf_compression_level, swf_compression_threads);
+	memset(&sw->adlerwriter, 0, sizeof(writer_t));
+	sw->adlerwriter.write = swfwriter_adler_write;
+	sw->adlerwriter.finish = swfwriter_adler_finish;
+	sw->adlerwriter.internal = sw;
+	sw->adler = adler32(0, 0, 0);
+	sw->writer = &sw->adlerwriter;
+#endif
+    } else {
+	writer_init_zlibdeflate2(&sw->zwriter, writer, swf_compression_level<0?9:swf_compression_level, swf_compression_threads);
+	sw->writer = &sw->zwriter;
+    }
+
+    if(!sw->patch_header) {
+	if(sw->writer->write(sw->writer, sw->header, sw->headerlen) != sw->headerlen)
+	    return -1;
+    } else {
+	/* the header is part of the stored block, so outside of the deflate stream */
+	writer->write(writer, sw->header, sw->headerlen);
+    }
+    return 0;
+}
+
+int swf_WriterStart(swfwriter_t*sw, int handle, SWF*swf)
+{
+    memset(sw, 0, sizeof(swfwriter_t));
+    sw->handle = -1;
+    sw->lastid = -1;
+    sw->startpos = lseek(handle, 0, SEEK_CUR);
+    if(sw->startpos >= 0)
+	sw->handle = handle;
+    writer_init_filewriter(&sw->filewriter, handle);
+    return swfwriter_start(sw, &sw->filewriter, swf);
+}
+
+int swf_WriterStart2(swfwriter_t*sw, writer_t*writer, SWF*swf)
+{
+    memset(sw, 0, sizeof(swfwriter_t));
+    sw->handle = -1;
+    sw->lastid = -1;
+    return swfwriter_start(sw, writer, swf);
+}
+
+int swf_WriterAddTag(swfwriter_t*sw, TAG*t)
+{
+    int l;
+    if(!sw->writer)
+	return -1;
+    l = swf_WriteTag2(sw->writer, t);
+    if(l<0)
+	return -1;
+    sw->len += l;
+
+    if(t->id == ST_DEFINESPRITE && !swf_IsFolded(t)) sw->inSprite++;
+    else if(t->id == ST_END && sw->inSprite) sw->inSprite--;
+    else if(t->id == ST_END && !sw->inSprite) {
+	if(sw->lastid >= 0 && sw->lastid != ST_SHOWFRAME)
+	    sw->frames++;
+    }
+    else if(t->id == ST_SHOWFRAME && !sw->inSprite) sw->frames++;
+    sw->lastid = t->id;
+    return l;
+}
+
+static int swfwriter_patch(swfwriter_t*sw, int pos, U8*data, int len)
+{
+    if(lseek(sw->handle, sw->startpos+pos, SEEK_SET) < 0)
+	return -1;
+    return write(sw->handle, data, len)==len ? 0 : -1;
+}
+
+int swf_WriterFinish(swfwriter_t*sw)
+{
+    int ret = 0;
+    U8 b[4];
+    if(!sw->writer)
+	return -1;
+    if(sw->patch_header) {
+#ifdef HAVE_ZLIB
+	/* fill in the frame count, and append the adler32 of header plus tags */
+	U32 adler;
+	PUT16(&sw->header[sw->rectlen+2], sw->frames);
+	adler = adler32(adler32(0, 0, 0), sw->header, sw->headerlen);
+	adler = adler32_combine(adler, sw->adler, sw->adlerwriter.pos);
+	sw->zwriter.finish(&sw->zwriter);
+	b[0] = adler>>24; b[1] = adler>>16; b[2] = adler>>8; b[3] = adler;
+	sw->output->write(sw->output, b, 4);
+#endif
+    } else if(sw->compressed) {
+	sw->zwriter.finish(&sw->zwriter);
+    }
+    sw->writer = 0;
+    if(sw->handle>=0) {
+	PUT32(b, sw->len);
+	if(sw->len != sw->fileSize && swfwriter_patch(sw, 4, b, 4)<0)
+	    ret = -1;
+	PUT16(b, sw->frames);
+	if(sw->patch_header && swfwriter_patch(sw, sw->headerpos+sw->rectlen+2, b, 2)<0)
+	    ret = -1;
+	if(!sw->compressed && sw->frames != sw->frameCount && swfwriter_patch(sw, 8+sw->rectlen+2, b, 2)<0)
+	    ret = -1;
+	if(lseek(sw->handle, 0, SEEK_END) < 0)
+	    ret = -1;
+	sw->fileSize = sw->len;
+	if(sw->patch_header || !sw->compressed)
+	    sw->frameCount = sw->frames;
+    }
+    if(sw->output == &sw->filewriter)
+	sw->filewriter.finish(&sw->filewriter);
+    if(sw->len != sw->fileSize || sw->frames != sw->frameCount) {
+	fprintf(stderr, "rfxswf: Header says %d bytes/%d frames, but %d bytes/%d frames were written\n",
+		sw->fileSize, sw->frameCount, sw->len, sw->frames);
+	return -1;
+    }
+    return ret<0 ? ret : (int)sw->len;
+}
+
 SWF* swf_CopySWF(SWF*swf)
 {
     SWF*nswf = (SWF*)rfx_alloc(sizeof(SWF));
@@ -1929,8 +2266,7 @@ void swf_FreeTags(SWF * swf)                 // Frees all malloc'ed memory for t
 
   while (t)
   { TAG * tnew = t->next;
-    if (t->data) rfx_free(t->data);
-    rfx_free(t);
+    tag_free(t);
     t = tnew;
   }
   swf->firstTag = 0;
@@ -1953,3 +2289,303 @@ void swf_FreeTags(SWF * swf)                 // Frees all malloc'ed memory for t
 //#include "modules/swfdraw.c"
 //#include "modules/swfrender.c"
 //#include "modules/swffilter.c"
+
+#ifdef MAIN
+/* checks the bit reading/writing functions against straightforward bit-by-bit
+   implementations on random input, and measures the time it takes to parse
+   (and write back) all shapes and placements in the given .swf files.
+   Build with something like
+   gcc -DMAIN -I.. rfxswf.c librfxswf.a libbase.a -ljpeg -lz -lm -lpthread -o rfxswf_bits */
+
+#include <sys/time.h>
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static U32 ref_GetBits(TAG*t, int nbits)
+{
+    U32 res = 0;
+    if(!nbits) return 0;
+    if(!t->readBit) t->readBit = 0x80;
+    while(nbits) {
+	res <<= 1;
+	if(t->data[t->pos]&t->readBit) res |= 1;
+	t->readBit >>= 1;
+	nbits--;
+	if(!t->readBit) {
+	    if(nbits) t->readBit = 0x80;
+	    t->pos++;
+	}
+    }
+    return res;
+}
+
+static void ref_SetBits(TAG*t, U32 v, int nbits)
+{
+    U32 bm = 1<<(nbits-1);
+    while(nbits) {
+	if(!t->writeBit) {
+	    swf_SetU8(t, 0);
+	    t->writeBit = 0x80;
+	}
+	if(v&bm) t->data[t->len-1] |= t->writeBit;
+	bm >>= 1;
+	t->writeBit >>= 1;
+	nbits--;
+    }
+}
+
+static unsigned int ref_readbits(reader_t*r, int num)
+{
+    unsigned int val = 0;
+    while(num--)
+	val = val<<1 | reader_readbit(r);
+    return val;
+}
+
+static void ref_writebits(writer_t*w, unsigned int data, int bits)
+{
+    while(bits--)
+	writer_writebit(w, data>>bits);
+}
+
+static U32 random32()
+{
+    return (U32)rand()<<16 ^ (U32)rand();
+}
+
+#define NUMOPS 200000
+static int ops[NUMOPS], values[NUMOPS];
+
+static void fail(const char*what, int i)
+{
+    fprintf(stderr, "%s: mismatch at operation %d\n", what, i);
+    exit(1);
+}
+
+/* random bit widths (0-32), with an occasional byte aligned access in between */
+static void make_ops(void)
+{
+    int i;
+    for(i=0;i<NUMOPS;i++) {
+	ops[i] = (rand()%17==0) ? -1 : rand()%33;
+	values[i] = random32();
+    }
+}
+
+static void test_tag(void)
+{
+    TAG*t1 = swf_InsertTag(0, ST_DEFINESHAPE);
+    TAG*t2 = swf_InsertTag(0, ST_DEFINESHAPE);
+    int i;
+    make_ops();
+    for(i=0;i<NUMOPS;i++) {
+	if(ops[i]<0) {
+	    swf_SetU8(t1, values[i]);
+	    swf_SetU8(t2, values[i]);
+	} else {
+	    swf_SetBits(t1, values[i], ops[i]);
+	    ref_SetBits(t2, values[i], ops[i]);
+	}
+	if(t1->len != t2->len || t1->writeBit != t2->writeBit ||
+	   (t1->len && t1->data[t1->len-1] != t2->data[t2->len-1]))
+	    fail("swf_SetBits", i);
+    }
+    if(memcmp(t1->data, t2->data, t1->len))
+	fail("swf_SetBits", NUMOPS);
+
+    /* read back with different widths than the ones used for writing */
+    make_ops();
+    for(i=0;i<NUMOPS;i++) {
+	U32 v1, v2;
+	int nbits = ops[i];
+	if(t1->pos + 5 > t1->len)
+	    break;
+	if(nbits<0) {
+	    v1 = swf_GetU8(t1);
+	    v2 = swf_GetU8(t2);
+	} else if((i&1) && nbits && nbits<32) {
+	    v1 = swf_GetSBits(t1, nbits);
+	    v2 = ref_GetBits(t2, nbits);
+	    if(v2&(1<<(nbits-1)))
+		v2 |= 0xffffffff<<nbits;
+	} else {
+	    v1 = swf_GetBits(t1, nbits);
+	    v2 = ref_GetBits(t2, nbits);
+	}
+	if(v1 != v2 || t1->pos != t2->pos || t1->readBit != t2->readBit)
+	    fail("swf_GetBits", i);
+    }
+    swf_DeleteTag(0, t1);
+    swf_DeleteTag(0, t2);
+    printf("swf_GetBits/swf_SetBits: ok\n");
+}
+
+static void test_stream(void)
+{
+    writer_t w1, w2;
+    reader_t r1, r2;
+    U8*d1, *d2;
+    int l1, l2, i;
+    make_ops();
+    writer_init_growingmemwriter(&w1, 4096);
+    writer_init_growingmemwriter(&w2, 4096);
+    for(i=0;i<NUMOPS;i++) {
+	if(ops[i]<0) {
+	    writer_resetbits(&w1);
+	    writer_resetbits(&w2);
+	} else {
+	    writer_writebits(&w1, values[i], ops[i]);
+	    ref_writebits(&w2, values[i], ops[i]);
+	}
+	if(w1.bitpos != w2.bitpos || w1.mybyte != w2.mybyte)
+	    fail("writer_writebits", i);
+    }
+    writer_resetbits(&w1);
+    writer_resetbits(&w2);
+    d1 = writer_growmemwrite_memptr(&w1, &l1);
+    d2 = writer_growmemwrite_memptr(&w2, &l2);
+    if(l1 != l2 || memcmp(d1, d2, l1))
+	fail("writer_writebits", NUMOPS);
+
+    make_ops();
+    reader_init_memreader(&r1, d1, l1);
+    reader_init_memreader(&r2, d1, l1);
+    for(i=0;i<NUMOPS;i++) {
+	U32 v1, v2;
+	if(r1.pos + 5 > l1)
+	    break;
+	if(ops[i]<0) {
+	    reader_resetbits(&r1);
+	    reader_resetbits(&r2);
+	    continue;
+	}
+	v1 = reader_readbits(&r1, ops[i]);
+	v2 = ref_readbits(&r2, ops[i]);
+	if(v1 != v2 || r1.pos != r2.pos || r1.bitpos != r2.bitpos)
+	    fail("reader_readbits", i);
+    }
+    w1.finish(&w1);
+    w2.finish(&w2);
+    printf("reader_readbits/writer_writebits: ok\n");
+}
+
+static void bench_bits(void)
+{
+    TAG*t = swf_InsertTag(0, ST_DEFINESHAPE);
+    double start, t_new, t_ref;
+    U32 sum = 0;
+    int i, round;
+    make_ops();
+    for(i=0;i<NUMOPS;i++)
+	ops[i] = ops[i]<0 ? 1 : ops[i]%20+1; // typical shape record fields
+
+    start = seconds();
+    for(round=0;round<10;round++) {
+	swf_ResetTag(t, ST_DEFINESHAPE);
+	for(i=0;i<NUMOPS;i++)
+	    swf_SetBits(t, values[i], ops[i]);
+    }
+    t_new = seconds() - start;
+    start = seconds();
+    for(round=0;round<10;round++) {
+	swf_ResetTag(t, ST_DEFINESHAPE);
+	for(i=0;i<NUMOPS;i++)
+	    ref_SetBits(t, values[i], ops[i]);
+    }
+    t_ref = seconds() - start;
+    printf("%-26s %8.1f ns/call (bitwise: %.1f)\n", "swf_SetBits",
+	    t_new*1e9/(NUMOPS*10), t_ref*1e9/(NUMOPS*10));
+
+    start = seconds();
+    for(round=0;round<10;round++) {
+	swf_SetTagPos(t, 0);
+	for(i=0;i<NUMOPS;i++)
+	    sum += swf_GetBits(t, ops[i]);
+    }
+    t_new = seconds() - start;
+    start = seconds();
+    for(round=0;round<10;round++) {
+	swf_SetTagPos(t, 0);
+	for(i=0;i<NUMOPS;i++)
+	    sum += ref_GetBits(t, ops[i]);
+    }
+    t_ref = seconds() - start;
+    printf("%-26s %8.1f ns/call (bitwise: %.1f)\n", "swf_GetBits",
+	    t_new*1e9/(NUMOPS*10), t_ref*1e9/(NUMOPS*10));
+    swf_DeleteTag(0, t);
+    if(sum == 1) printf("\n");
+}
+
+static void bench_file(char*filename)
+{
+    SWF swf;
+    TAG*tag;
+    int fi = open(filename, O_RDONLY|O_BINARY);
+    int shapes = 0, places = 0, round, rounds;
+    double start, t_parse, t_write;
+    if(fi<0 || swf_ReadSWF(fi, &swf)<0) {
+	fprintf(stderr, "Couldn't read %s\n", filename);
+	if(fi>=0) close(fi);
+	return;
+    }
+    close(fi);
+    for(tag=swf.firstTag;tag;tag=tag->next) {
+	if(swf_isShapeTag(tag) && tag->id != ST_DEFINEMORPHSHAPE && tag->id != ST_DEFINEMORPHSHAPE2) shapes++;
+	if(swf_isPlaceTag(tag)) places++;
+    }
+    rounds = 1 + 2000000 / (1 + shapes*50 + places);
+
+    start = seconds();
+    for(round=0;round<rounds;round++) {
+	for(tag=swf.firstTag;tag;tag=tag->next) {
+	    if(swf_isShapeTag(tag) && tag->id != ST_DEFINEMORPHSHAPE && tag->id != ST_DEFINEMORPHSHAPE2) {
+		SHAPE2 shape;
+		swf_ParseDefineShape(tag, &shape);
+		swf_Shape2Free(&shape);
+	    } else if(swf_isPlaceTag(tag)) {
+		SWFPLACEOBJECT obj;
+		swf_GetPlaceObject(tag, &obj);
+		swf_PlaceObjectFree(&obj);
+	    }
+	}
+    }
+    t_parse = (seconds() - start) / rounds;
+
+    start = seconds();
+    for(round=0;round<rounds;round++) {
+	for(tag=swf.firstTag;tag;tag=tag->next) {
+	    if(swf_isShapeTag(tag) && tag->id != ST_DEFINEMORPHSHAPE && tag->id != ST_DEFINEMORPHSHAPE2) {
+		SHAPE2 shape;
+		TAG*t = swf_InsertTag(0, tag->id);
+		swf_ParseDefineShape(tag, &shape);
+		swf_SetU16(t, 0);
+		swf_SetShape2(t, &shape);
+		swf_Shape2Free(&shape);
+		swf_DeleteTag(0, t);
+	    }
+	}
+    }
+    t_write = (seconds() - start) / rounds - t_parse;
+
+    printf("%s: %d shapes, %d placements: parse %.3f ms, write %.3f ms\n",
+	    filename, shapes, places, t_parse*1000, t_write*1000);
+    swf_FreeTags(&swf);
+}
+
+int main(int argn, char*argv[])
+{
+    int t;
+    srand(4711);
+    test_tag();
+    test_stream();
+    bench_bits();
+    for(t=1;t<argn;t++)
+	bench_file(argv[t]);
+    return 0;
+}
+#endif
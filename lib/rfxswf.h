@@ -112,10 +112,14 @@ typedef struct _FILTERLIST
     FILTER*filter[8];
 } FILTERLIST;
 
+#define TAG_INLINE_SIZE 16
+
 typedef struct _TAG             // NEVER access a Tag-Struct directly !
 { U16           id;
-  U8 *          data;
+  U8            readBit;        // for Bit-Manipulating Functions [read]
+  U8            writeBit;       // [write]
   U32           memsize;        // to minimize realloc() calls
+  U8 *          data;
 
   U32         len;            // for Set-Access
   U32         pos;            // for Get-Access
@@ -123,8 +127,8 @@ typedef struct _TAG             // NEVER access a Tag-Struct directly !
   struct _TAG * next;
   struct _TAG * prev;
 
-  U8            readBit;        // for Bit-Manipulating Functions [read]
-  U8            writeBit;       // [write]
+  struct _tagpool * pool;       // slab pool the tag was allocated from, or NULL
+  U8            inline_data[TAG_INLINE_SIZE]; // data of short pooled tags
 
 } TAG;
 
@@ -173,6 +177,7 @@ int  swf_ReadSWF(int handle,SWF * swf);     // Reads SWF to memory (malloc'ed),
 int  swf_WriteSWF2(writer_t*writer, SWF * swf);     // Writes SWF via callback, returns length or <0 if fails
 int  swf_WriteSWF(int handle,SWF * swf);    // Writes SWF to file, returns length or <0 if fails
 int  swf_SaveSWF(SWF * swf, char*filename);
+void swf_SetCompressionParameters(int level, int threads); // zlib level (-1=default), threads (0=all cpus)
 int  swf_WriteCGI(SWF * swf);               // Outputs SWF with valid CGI header to stdout
 void swf_FreeTags(SWF * swf);               // Frees all malloc'ed memory for swf
 SWF* swf_CopySWF(SWF*swf);
@@ -183,6 +188,43 @@ int  swf_WriteHeader(int handle,SWF * swf);    // Writes Header of swf to file
 int  swf_WriteHeader2(writer_t*writer,SWF * swf);    // Writes Header of swf to file
 int  swf_WriteTag(int handle,TAG * tag);    // Writes TAG to file
 int  swf_WriteTag2(writer_t*writer, TAG * t); //Write TAG via callback
+TAG* swf_ReadTag(reader_t*reader, TAG * prev); // Reads one TAG, and appends it to prev
+int  swf_GetHeaderLength(SWF * swf);          // Size of the SWF header, in bytes
+
+/* Incremental writer: tags are written out as they are added, so the caller
+   can free them right away. If the output is a seekable file, file size and
+   frame count in the header are fixed up by swf_WriterFinish. Otherwise,
+   swf->fileSize and swf->frameCount need to be the final values already.
+   Unlike swf_WriteSWF, this doesn't add a FILEATTRIBUTES tag for Flash 9
+   files- the caller has to add it as the first tag. */
+typedef struct _swfwriter
+{
+    writer_t*output;
+    writer_t filewriter;
+    writer_t zwriter;
+    writer_t adlerwriter;
+    writer_t*writer;        // where the tags go
+    int handle;             // -1 if the output isn't seekable
+    long startpos;
+    char compressed;
+    char patch_header;      // frame count is in a stored zlib block
+    U8 header[32];          // rect, frame rate, frame count
+    int headerlen;
+    int headerpos;
+    int rectlen;
+    U32 adler;
+    U32 fileSize;           // as announced in the header
+    U16 frameCount;
+    U32 len;                // bytes written, uncompressed
+    int frames;
+    int inSprite;
+    int lastid;
+} swfwriter_t;
+
+int  swf_WriterStart(swfwriter_t*sw, int handle, SWF*swf);       // Writes the header of swf
+int  swf_WriterStart2(swfwriter_t*sw, writer_t*writer, SWF*swf);
+int  swf_WriterAddTag(swfwriter_t*sw, TAG*t);                    // returns tag length or <0
+int  swf_WriterFinish(swfwriter_t*sw);                           // returns file length or <0
 
 int  swf_ReadHeader(reader_t*reader, SWF * swf);   // Reads SWF Header via callback
 
@@ -205,6 +247,7 @@ TAG * swf_InsertTagBefore(SWF*swf, TAG * before,U16 id);     // like InsertTag,
 TAG * swf_DeleteTag(SWF*swf, TAG * t);
 
 void  swf_ClearTag(TAG * t);                //frees tag data
+void  swf_ReserveTag(TAG * t, U32 size);    //makes room for at least size bytes of tag data
 void  swf_ResetTag(TAG*tag, U16 id);        //set's tag position and length to 0, without freeing it
 TAG*  swf_CopyTag(TAG*tag, TAG*to_copy);     //stores a copy of another tag into this taglist
 
@@ -448,6 +491,36 @@ typedef struct _SHAPELINE
     struct _SHAPELINE * next;
 } SHAPELINE;
 
+/* The edges of a shape, as an alternative to the SHAPELINE list: all edges
+   are stored in a few arrays in one block of memory. Edge t ends at
+   (x[t],y[t]) and starts where edge t-1 ended (or at 0,0), with the control
+   point (sx[t],sy[t]) if type[t]==splineTo. Its styles are
+   styles[style[t]], a new entry is made for every style change.
+   Iterate with for(t=0;t<edges->num;t++). */
+typedef struct _EDGESTYLE
+{
+    int fillstyle0;
+    int fillstyle1;
+    int linestyle;
+} EDGESTYLE;
+
+typedef struct _SHAPEEDGES
+{
+    int num;
+    U8 * type;      // enum SHAPELINETYPE
+    S32 * x;
+    S32 * y;
+    S32 * sx;
+    S32 * sy;
+    int * style;
+
+    EDGESTYLE * styles;
+    int numstyles;
+
+    int size;       // allocated edges/styles
+    int stylesize;
+} SHAPEEDGES;
+
 // Shapes
 
 int   swf_ShapeNew(SHAPE ** s);
@@ -498,6 +571,11 @@ void	swf_DumpShape(SHAPE2*shape2);
 void swf_ParseDefineShape(TAG*tag, SHAPE2*shape);
 void swf_SetShape2(TAG*tag, SHAPE2*shape2);
 
+void  swf_ParseDefineShapeEdges(TAG*tag, SHAPE2*shape, SHAPEEDGES*edges); // like swf_ParseDefineShape, without shape->lines
+void  swf_Shape2ToEdges(SHAPE2*shape, SHAPEEDGES*edges);
+SRECT swf_GetShapeEdgesBoundingBox(SHAPE2*shape, SHAPEEDGES*edges);
+void  swf_ShapeEdgesFree(SHAPEEDGES*edges);
+
 void swf_RecodeShapeData(U8*data, int bitlen, int in_bits_fill, int in_bits_line,
                          U8**destdata, U32*destbitlen, int out_bits_fill, int out_bits_line);
 
@@ -727,6 +805,9 @@ void swf_GetJPEGSize(const char * fname, int*width, int*height);
 int swf_SetJPEGBits(TAG * t,const char * fname,int quality);
 void swf_SetJPEGBits2(TAG * t,U16 width,U16 height,RGBA * bitmap,int quality);
 int swf_SetJPEGBits3(TAG * tag,U16 width,U16 height,RGBA* bitmap, int quality);
+int swf_SetJPEGBitsRaw(TAG * t,const U8 * data,int len,int width,int height); // store jpeg file data as-is
+void swf_SetJPEGCompressorReuse(int reuse); // keep a libjpeg compressor around between images (default: 1)
+void swf_FreeJPEGCompressor(); // release the compressor kept by the above
 RGBA* swf_JPEG2TagToImage(TAG*tag, int*width, int*height);
 void swf_RemoveJPEGTables(SWF*swf);
 
@@ -747,10 +828,37 @@ RGBA* swf_DefineLosslessBitsTagToImage(TAG*tag, int*width, int*height);
 
 RGBA* swf_ExtractImage(TAG*tag, int*dwidth, int*dheight);
 TAG* swf_AddImage(TAG*tag, int bitid, RGBA*mem, int width, int height, int quality);
+/* predict: guess the smaller encoding up front instead of always trying both,
+   parallel: if both are tried, run them in two threads */
+TAG* swf_AddImage2(TAG*tag, int bitid, RGBA*mem, int width, int height, int quality, int predict, int parallel);
 
 // swfsound.c
+
+/* an mp3 encoder, with its own settings and state. Independent encoders
+   can be used from different threads at the same time. */
+typedef struct _SOUNDENCODER SOUNDENCODER;
+SOUNDENCODER* swf_SoundEncoderNew(int in_samplerate, int out_samplerate, int channels, int bitrate);
+void swf_SoundEncoderDelete(SOUNDENCODER*enc);
+/* with threads>1, long sounds are split into segments which are encoded in parallel */
+void swf_SoundEncoderSetThreads(SOUNDENCODER*enc, int threads);
+/* mp3 encoder speed, from 0 (slowest, best quality, the default) to 9 (fastest) */
+void swf_SoundEncoderSetQuality(SOUNDENCODER*enc, int quality);
+/* 2 = mp3 (default), 1 = adpcm with adpcm_bits (2-5) bits per sample. adpcm
+   doesn't resample, so the sound is stored at in_samplerate. */
+void swf_SoundEncoderSetCompression(SOUNDENCODER*enc, int compression, int adpcm_bits);
+int swf_SoundEncoderBlockSize(SOUNDENCODER*enc); /* input samples per stream block */
+/* encode numblocks stream blocks ahead of time. The following calls to
+   swf_SetSoundStreamBlock2() take these blocks, in order, instead of
+   encoding their samples. Long streams can be passed in consecutive pieces. */
+void swf_SoundEncoderEncode(SOUNDENCODER*enc, S16*samples, int numblocks);
+void swf_SetSoundStreamHead2(TAG*tag, SOUNDENCODER*enc, int avgnumsamples);
+void swf_SetSoundStreamBlock2(TAG*tag, SOUNDENCODER*enc, S16*samples, int seek, char first);
+void swf_SetSoundDefine2(TAG*tag, SOUNDENCODER*enc, S16*samples, int num);
+
+/* same as above, with the settings taken from swf_mp3_in_samplerate etc. */
 void swf_SetSoundStreamHead(TAG*tag, int avgnumsamples);
 void swf_SetSoundStreamBlock(TAG*tag, S16*samples, int seek, char first); /* expects 2304 samples */
+void swf_SetSoundStreamEnd(TAG*tag);
 void swf_SetSoundDefine(TAG*tag, S16*samples, int num);
 void swf_SetSoundDefineMP3(TAG*tag, U8* data, unsigned length,
                            unsigned SampRate,
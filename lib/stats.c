@@ -0,0 +1,199 @@
+/* stats.c
+
+   Timers and counters for the conversion pipeline.
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../config.h"
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include "mem.h"
+#include "stats.h"
+
+static const char*stats_names[STATS_NUM] = {
+    "pdf_open",
+    "pdf_render",
+    "startclip",
+    "endclip",
+    "stroke",
+    "fill",
+    "fillbitmap",
+    "fillgradient",
+    "addfont",
+    "drawchar",
+    "drawlink",
+    "poly_process",
+    "poly_stroke",
+    "image_encode",
+    "swf_write",
+};
+
+typedef struct _stats_record {
+    int width, height;
+    double starttime;
+    double time;
+    double stage_time[STATS_NUM];
+    int calls[STATS_NUM];
+} stats_record_t;
+
+char stats_enabled = 0;
+
+static stats_record_t document;
+static stats_record_t*pages = 0;
+static int num_pages = 0;
+static int pages_size = 0;
+static stats_record_t*current = 0;
+
+double stats_time()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+void stats_reset()
+{
+    if(pages)
+	free(pages);
+    pages = 0;
+    num_pages = pages_size = 0;
+    memset(&document, 0, sizeof(document));
+    document.starttime = stats_time();
+    current = &document;
+}
+
+void stats_enable(char enable)
+{
+    stats_enabled = enable;
+    if(enable)
+	stats_reset();
+}
+
+void stats_add(stats_id_t id, double starttime)
+{
+    stats_add_time(id, stats_time() - starttime);
+}
+
+void stats_add_time(stats_id_t id, double t)
+{
+    current->stage_time[id] += t;
+    current->calls[id]++;
+    if(current != &document) {
+	document.stage_time[id] += t;
+	document.calls[id]++;
+    }
+}
+
+void stats_startpage(int width, int height)
+{
+    if(!stats_enabled)
+	return;
+    if(num_pages == pages_size) {
+	pages_size = pages_size ? pages_size*2 : 16;
+	pages = (stats_record_t*)rfx_realloc(pages, pages_size*sizeof(stats_record_t));
+    }
+    current = &pages[num_pages++];
+    memset(current, 0, sizeof(stats_record_t));
+    current->width = width;
+    current->height = height;
+    current->starttime = stats_time();
+}
+
+void stats_endpage()
+{
+    if(!stats_enabled || current == &document)
+	return;
+    current->time = stats_time() - current->starttime;
+    current = &document;
+}
+
+static void print_stages(FILE*fi, stats_record_t*r, const char*indent)
+{
+    int t;
+    for(t=0;t<STATS_NUM;t++) {
+	if(!r->calls[t])
+	    continue;
+	fprintf(fi, "%s%-14s %10.3fms %8d calls\n", indent, stats_names[t], r->stage_time[t]*1000.0, r->calls[t]);
+    }
+}
+
+void stats_print(FILE*fi)
+{
+    if(!stats_enabled)
+	return;
+    int t;
+    for(t=0;t<num_pages;t++) {
+	fprintf(fi, "page %d (%dx%d): %.3fms\n", t+1, pages[t].width, pages[t].height, pages[t].time*1000.0);
+	print_stages(fi, &pages[t], "    ");
+    }
+    fprintf(fi, "total: %.3fms\n", (stats_time() - document.starttime)*1000.0);
+    print_stages(fi, &document, "    ");
+}
+
+static void write_stages(FILE*fi, stats_record_t*r, const char*indent)
+{
+    int t;
+    char first = 1;
+    fprintf(fi, "{");
+    for(t=0;t<STATS_NUM;t++) {
+	if(!r->calls[t])
+	    continue;
+	fprintf(fi, "%s\n%s  \"%s\": {\"time\": %.6f, \"calls\": %d}", first?"":",", indent, 
+		stats_names[t], r->stage_time[t], r->calls[t]);
+	first = 0;
+    }
+    fprintf(fi, "\n%s}", indent);
+}
+
+int stats_save_json(const char*filename)
+{
+    if(!stats_enabled)
+	return 0;
+    FILE*fi = fopen(filename, "wb");
+    if(!fi)
+	return -1;
+    int t;
+    fprintf(fi, "{\n  \"time\": %.6f,\n  \"stages\": ", stats_time() - document.starttime);
+    write_stages(fi, &document, "  ");
+    fprintf(fi, ",\n  \"pages\": [");
+    for(t=0;t<num_pages;t++) {
+	fprintf(fi, "%s\n    {\"page\": %d, \"width\": %d, \"height\": %d, \"time\": %.6f,\n     \"stages\": ", 
+		t?",":"", t+1, pages[t].width, pages[t].height, pages[t].time);
+	write_stages(fi, &pages[t], "     ");
+	fprintf(fi, "}");
+    }
+    fprintf(fi, "\n  ]\n}\n");
+    fclose(fi);
+    return 0;
+}
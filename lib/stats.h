@@ -0,0 +1,79 @@
+/* stats.h
+
+   Timers and counters for the conversion pipeline.
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __stats_h__
+#define __stats_h__
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    STATS_PDF_OPEN,       // parsing a document, and the font/info pass
+    STATS_PDF_RENDER,     // interpreting a page
+    STATS_STARTCLIP,      // gfxdevice callbacks, including all the
+    STATS_ENDCLIP,        // devices further down the chain
+    STATS_STROKE,
+    STATS_FILL,
+    STATS_FILLBITMAP,
+    STATS_FILLGRADIENT,
+    STATS_ADDFONT,
+    STATS_DRAWCHAR,
+    STATS_DRAWLINK,
+    STATS_POLY_PROCESS,   // gfxpoly_process()
+    STATS_POLY_STROKE,    // gfxpoly_from_stroke()
+    STATS_IMAGE_ENCODE,   // storing a bitmap in an swf
+    STATS_SWF_WRITE,      // swf_WriteSWF()
+    STATS_NUM
+} stats_id_t;
+
+/* Everything below is a no-op unless stats_enable() was called.
+   Times are measured with a monotonic clock, and are inclusive, e.g. the
+   time spent in gfxpoly_process() also counts towards the fill callback
+   it was called from. */
+
+extern char stats_enabled;
+
+void stats_enable(char enable);
+double stats_time();
+void stats_add(stats_id_t id, double starttime);
+/* for times measured on other threads. Must be called from the thread
+   which does the conversion */
+void stats_add_time(stats_id_t id, double time);
+
+/* everything between stats_startpage() and stats_endpage() is accounted
+   to that page, everything else to the document */
+void stats_startpage(int width, int height);
+void stats_endpage();
+
+void stats_print(FILE*fi);
+int stats_save_json(const char*filename);
+void stats_reset();
+
+#define STATS_START(t) double t = stats_enabled ? stats_time() : 0
+#define STATS_END(id,t) do {if(stats_enabled) stats_add((id), (t));} while(0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__stats_h__
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "wav.h"
+#include "resample.h"
 
 struct WAVBlock {
     char id[5];
@@ -201,16 +202,32 @@ void wav_print(struct WAV*wav)
 	    wav->align, wav->bps, wav->size);
 }
 
+/* mix one sample frame down to a single 16 bit value */
+static inline short downmix(const unsigned char*p, int channels, int bytes)
+{
+    int c, sum = 0;
+    for(c=0;c<channels;c++) {
+	switch(bytes) {
+	    case 1: sum += (p[0]-128)<<8; break;
+	    case 2: sum += (short)(p[0]|p[1]<<8); break;
+	    case 3: sum += (short)(p[1]|p[2]<<8); break;
+	    case 4: sum += (short)(p[2]|p[3]<<8); break;
+	}
+	p += bytes;
+    }
+    return sum / channels;
+}
+
 int wav_convert2mono(struct WAV*src, struct WAV*dest, int rate)
 {
     int samplelen=src->size/src->align;
-    int bps=src->bps;
+    int bytes=src->bps/8;
+    int framesize=src->channels*bytes;
+    int numframes;
     double ratio;
-    double pos = 0;
-    int pos2 = 0;
-    int channels=src->channels;
+    int num, pos = 0;
+    short*out;
     int i;
-    int fill;
 
     dest->sampsPerSec = rate;
     dest->bps = 16;
@@ -220,74 +237,221 @@ int wav_convert2mono(struct WAV*src, struct WAV*dest, int rate)
     dest->bytesPerSec = dest->sampsPerSec*dest->align;
 
     ratio = (double)dest->sampsPerSec/(double)src->sampsPerSec;
-    fill = (int)(ratio+1)*2;
+    num = (int)(samplelen*ratio);
     
-    dest->data = (unsigned char*)malloc((int)(samplelen*ratio*2)+128);
+    dest->data = (unsigned char*)malloc(num*2+128);
     if(!dest->data) 
 	return 0;
-    dest->size = (int)(samplelen*ratio)*2;
+    dest->size = num*2;
+    out = (short*)dest->data;
 
-    if(bps == 8) {
-	if(ratio <= 1) {
-	    for(i=0; i<src->size; i+=channels) {
-		int pos2 = ((int)pos)*2;
-		dest->data[pos2] = 0;
-		dest->data[pos2+1] = src->data[i]+128;
-		pos += ratio;
-	    }
-	} else {
-	    for(i=0; i<src->size; i+=channels) {
-		int j;
-		int pos2 = ((int)pos)*2;
-		for(j=0;j<fill;j+=2) {
-		    dest->data[pos2+j+0] = 0;
-		    dest->data[pos2+j+1] = src->data[i]+128;
+    if(src->bps != 8 && src->bps != 16 && src->bps != 24 && src->bps != 32) {
+	fprintf(stderr, "Unsupported bitspersample value: %d\n", src->bps);
+	memset(dest->data, 0, dest->size);
+	return 0;
+    }
+    numframes = src->size/framesize;
+
+    if(src->sampsPerSec == rate) {
+	for(;pos<num && pos<numframes;pos++) {
+	    out[pos] = downmix(&src->data[pos*framesize], src->channels, bytes);
+	}
+    } else {
+	resampler_t*r = resampler_new(src->sampsPerSec, rate);
+	short tmp[4096];
+	int t = 0;
+	while(pos<num) {
+	    int l = resampler_read(r, &out[pos], num-pos);
+	    pos += l;
+	    if(l)
+		continue;
+	    if(t<numframes) {
+		int n = 0;
+		for(;n<4096 && t<numframes;n++,t++) {
+		    tmp[n] = downmix(&src->data[t*framesize], src->channels, bytes);
 		}
-		pos += ratio;
+		resampler_write(r, tmp, n);
+	    } else if(t==numframes) {
+		resampler_flush(r);
+		t++;
+	    } else {
+		break;
 	    }
 	}
-    } else if(bps == 16) {
-	if(ratio <= 1) {
-	    for(i=0; i<src->size/2; i+=channels) {
-		int pos2 = ((int)pos)*2;
-		dest->data[pos2+0]=src->data[i*2];
-		dest->data[pos2+1]=src->data[i*2+1];
-		pos += ratio;
-	    }
-	} else {
-	    for(i=0; i<src->size/2; i+=channels) {
-		int j;
-		int pos2 = ((int)pos)*2;
-		for(j=0;j<fill;j+=2) {
-		    dest->data[pos2+j+0] = src->data[i*2];
-		    dest->data[pos2+j+1] = src->data[i*2+1];
-		}
-		pos += ratio;
+	resampler_destroy(r);
+    }
+    for(;pos<num;pos++) {
+	out[pos] = 0;
+    }
+
+    /* store the samples in little endian, like in a .wav file */
+    for(i=0;i<num;i++) {
+	short v = out[i];
+	dest->data[i*2+0] = v;
+	dest->data[i*2+1] = v>>8;
+    }
+    return 1;
+}
+
+#define WAVREADER_BUFSIZE 65536
+
+int wav_open(struct WAVReader*r, const char*filename, int rate)
+{
+    struct WAVBlock block;
+    unsigned char b[16];
+    long filesize = -1;
+    char have_fmt = 0;
+
+    memset(r, 0, sizeof(struct WAVReader));
+    r->fi = fopen(filename, "rb");
+    if(!r->fi)
+	return 0;
+    if(!fseek(r->fi, 0, SEEK_END)) {
+	filesize = ftell(r->fi);
+	fseek(r->fi, 0, SEEK_SET);
+    }
+
+    if(!getWAVBlock(r->fi, &block) || strncmp(block.id, "RIFF", 4) ||
+       fread(b, 1, 4, r->fi) < 4 || strncmp((const char*)b, "WAVE", 4)) {
+	fprintf(stderr, "wav_open: not a WAV file\n");
+	wav_close(r);
+	return 0;
+    }
+
+    /* walk the chunks up to the data chunk. Everything after it is ignored. */
+    while(1) {
+	unsigned int skip;
+	if(!getWAVBlock(r->fi, &block)) {
+	    fprintf(stderr, "wav_open: no data block\n");
+	    wav_close(r);
+	    return 0;
+	}
+	skip = block.size;
+	if(!strncmp(block.id, "fmt ", 4)) {
+	    if(block.size < 16 || fread(b, 1, 16, r->fi) < 16) {
+		wav_close(r);
+		return 0;
 	    }
+	    r->wav.tag = b[0]|b[1]<<8;
+	    r->wav.channels = b[2]|b[3]<<8;
+	    r->wav.sampsPerSec = b[4]|b[5]<<8|b[6]<<16|b[7]<<24;
+	    r->wav.bytesPerSec = b[8]|b[9]<<8|b[10]<<16|b[11]<<24;
+	    r->wav.align = b[12]|b[13]<<8;
+	    r->wav.bps = b[14]|b[15]<<8;
+	    have_fmt = 1;
+	    skip -= 16;
+	} else if(!strncmp(block.id, "data", 4)) {
+	    break;
 	}
-    } else if(bps == 32) {
-	if(ratio <= 1) {
-	    for(i=0; i<src->size/4; i+=channels) {
-		int pos2 = ((int)pos)*2;
-		dest->data[pos2+0]=src->data[i*4+2];
-		dest->data[pos2+1]=src->data[i*4+3];
-		pos += ratio;
+	/* chunks are padded to an even size */
+	skip += block.size&1;
+	while(skip) {
+	    int l = skip < sizeof(b) ? skip : sizeof(b);
+	    if(fread(b, 1, l, r->fi) < l) {
+		wav_close(r);
+		return 0;
 	    }
+	    skip -= l;
+	}
+    }
+    if(!have_fmt || !r->wav.channels || !r->wav.sampsPerSec ||
+       (r->wav.bps != 8 && r->wav.bps != 16 && r->wav.bps != 24 && r->wav.bps != 32)) {
+	fprintf(stderr, "wav_open: unsupported format (%d channels, %d bits/sample)\n", r->wav.channels, r->wav.bps);
+	wav_close(r);
+	return 0;
+    }
+    if(r->wav.align < r->wav.channels*r->wav.bps/8)
+	r->wav.align = r->wav.channels*r->wav.bps/8;
+
+    r->wav.size = block.size;
+    if(filesize >= 0 && ftell(r->fi) + (long)block.size > filesize) {
+	long l = filesize - ftell(r->fi);
+	fprintf(stderr, "Warning: data block of size %d is only %ld bytes (%ld bytes missing)\n", block.size, l, block.size-l);
+	r->wav.size = l;
+    }
+    r->left = r->wav.size;
+
+    r->total = (unsigned int)((r->wav.size/r->wav.align)*((double)rate/(double)r->wav.sampsPerSec));
+    if(rate != r->wav.sampsPerSec)
+	r->resampler = resampler_new(r->wav.sampsPerSec, rate);
+    r->buf = (unsigned char*)malloc(WAVREADER_BUFSIZE);
+    return 1;
+}
+
+/* read and downmix up to num sample frames. returns 0 at the end of the data */
+static int wav_next_frames(struct WAVReader*r, short*samples, int num)
+{
+    int bytes = r->wav.bps/8;
+    int framesize = r->wav.channels*bytes;
+    int n = 0;
+
+    while(n < num) {
+	if(r->buflen - r->bufpos < framesize) {
+	    int keep = r->buflen - r->bufpos;
+	    int l = WAVREADER_BUFSIZE - keep;
+	    if(l > r->left)
+		l = r->left;
+	    memmove(r->buf, &r->buf[r->bufpos], keep);
+	    l = l>0 ? fread(&r->buf[keep], 1, l, r->fi) : 0;
+	    r->left -= l;
+	    r->bufpos = 0;
+	    r->buflen = keep + l;
+	    if(r->buflen < framesize)
+		break;
+	}
+	while(n < num && r->buflen - r->bufpos >= framesize) {
+	    samples[n++] = downmix(&r->buf[r->bufpos], r->wav.channels, bytes);
+	    r->bufpos += framesize;
+	}
+    }
+    return n;
+}
+
+int wav_read_mono(struct WAVReader*r, short*samples, int num)
+{
+    int n = 0;
+    if(num > r->total - r->outpos)
+	num = r->total - r->outpos;
+    while(n < num) {
+	int l;
+	if(!r->resampler) {
+	    l = wav_next_frames(r, &samples[n], num-n);
 	} else {
-	    for(i=0; i<src->size/4; i+=channels) {
-		int j;
-		int pos2 = ((int)pos)*2;
-		for(j=0;j<fill;j+=2) {
-		    dest->data[pos2+j+0] = src->data[i*4+2];
-		    dest->data[pos2+j+1] = src->data[i*4+3];
+	    l = resampler_read(r->resampler, &samples[n], num-n);
+	    if(!l) {
+		short tmp[4096];
+		int m = wav_next_frames(r, tmp, 4096);
+		if(m) {
+		    resampler_write(r->resampler, tmp, m);
+		    continue;
+		} else if(!r->flushed) {
+		    resampler_flush(r->resampler);
+		    r->flushed = 1;
+		    continue;
 		}
-		pos += ratio;
 	    }
 	}
-    } else {
-	fprintf(stderr, "Unsupported bitspersample value: %d\n", bps);
+	if(!l) {
+	    /* the data block is shorter than announced, pad with silence */
+	    memset(&samples[n], 0, (num-n)*sizeof(short));
+	    n = num;
+	    break;
+	}
+	n += l;
     }
-    return 1;
+    r->outpos += n;
+    return n;
 }
 
-
+void wav_close(struct WAVReader*r)
+{
+    if(r->fi)
+	fclose(r->fi);
+    if(r->buf)
+	free(r->buf);
+    if(r->resampler)
+	resampler_destroy(r->resampler);
+    r->fi = 0;
+    r->buf = 0;
+    r->resampler = 0;
+}
@@ -22,5 +22,29 @@ struct WAV {
 int wav_read(struct WAV*wav, const char* filename);
 int wav_write(struct WAV*wav, const char*filename);
 void wav_print(struct WAV*wav);
+/* mix all channels down to 16 bit mono, and resample to rate */
 int wav_convert2mono(struct WAV*src, struct WAV*dest, int rate);
 
+/* Incremental reading of .wav files. wav_open() only parses the header,
+   wav_read_mono() then delivers the samples converted to 16 bit mono at
+   the requested rate, one buffer at a time. Memory usage doesn't depend
+   on the length of the file. */
+struct WAVReader {
+    struct WAV wav; /* format of the file. data is 0, size is the size of the data chunk */
+    unsigned int total; /* number of samples wav_read_mono() will return */
+
+    FILE*fi;
+    unsigned int left; /* bytes of the data chunk not yet read */
+    unsigned char*buf;
+    int buflen;
+    int bufpos;
+
+    struct _resampler*resampler; /* 0 if the rate doesn't change */
+    char flushed;
+    unsigned int outpos;
+};
+
+int wav_open(struct WAVReader*r, const char*filename, int rate);
+int wav_read_mono(struct WAVReader*r, short*samples, int num); /* returns the number of samples read, 0 at the end */
+void wav_close(struct WAVReader*r);
+
@@ -641,6 +641,7 @@ int main(int argc, char **argv)
     }
 
     MovieFinish(&swf, t, global.outfile);
+    swf_FreeJPEGCompressor();
 
     return 0;
 }
@@ -36,6 +36,13 @@
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>
 #endif
+#ifndef WIN32
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #include "../lib/args.h"
 #include "../lib/os.h"
@@ -44,9 +51,11 @@
 #include "../lib/devices/polyops.h"
 #include "../lib/devices/record.h"
 #include "../lib/devices/rescale.h"
+#include "../lib/devices/timing.h"
 #include "../lib/gfxfilter.h"
 #include "../lib/pdf/pdf.h"
 #include "../lib/log.h"
+#include "../lib/stats.h"
 
 #define SWFDIR concatPaths(getInstallationPath(), "swfs")
 
@@ -75,6 +84,13 @@ static int flatten = 0;
 
 static char* filters = 0;
 
+static char* stats_file = 0;
+static int print_stats = 0;
+
+static int batch = 0;
+static int num_workers = 0;
+static char* batch_socket = 0;
+
 char* fontpaths[256];
 int fontpathpos = 0;
 
@@ -132,6 +148,7 @@ typedef struct _parameter {
 
 static parameter_t* device_config = 0;
 static parameter_t* device_config_next = 0;
+static parameter_t* job_config = 0;
 static void store_parameter(const char*name, const char*value)
 {
     parameter_t*o = device_config;
@@ -158,6 +175,17 @@ static void store_parameter(const char*name, const char*value)
     }
 }
 
+static void free_parameters(parameter_t*p)
+{
+    while(p) {
+	parameter_t*next = p->next;
+	if(p->name) free((void*)p->name);p->name = 0;
+	if(p->value) free((void*)p->value);p->value =0;
+	p->next = 0;free(p);
+	p = next;
+    }
+}
+
 int args_callback_option(char*name,char*val) {
     if (!strcmp(name, "o"))
     {
@@ -266,7 +294,10 @@ int args_callback_option(char*name,char*val) {
 	if(c && *c && c[1])  {
 	    *c = 0;
 	    c++;
-	    store_parameter(s,c);
+	    if(!strcmp(s, "stats"))
+		stats_file = c;
+	    else
+		store_parameter(s,c);
 	} else if(!strcmp(s,"help")) {
 	    printf("PDF Parameters:\n");
 	    gfxsource_t*pdf = gfxsource_pdf_create();
@@ -301,7 +332,28 @@ int args_callback_option(char*name,char*val) {
 # endif
 	return 1;
     }
+    else if (!strcmp(name, "a"))
+    {
+	batch = 1;
+	return 0;
+    }
+    else if (!strcmp(name, "U"))
+    {
+	batch = 1;
+	batch_socket = val;
+	return 1;
+    }
+    else if (!strcmp(name, "W"))
+    {
+	num_workers = atoi(val);
+	return 1;
+    }
 #endif
+    else if (!strcmp(name, "stats"))
+    {
+	print_stats = 1;
+	return 0;
+    }
     else if (!strcmp(name, "z"))
     {
 	store_parameter("enablezlib", "1");
@@ -485,6 +537,10 @@ static struct options_t options[] = {
 {"Q", "maxtime"},
 {"X", "width"},
 {"Y", "height"},
+{"a", "batch"},
+{"U", "socket"},
+{"W", "workers"},
+{"stats", "stats"},
 {0,0}
 };
 
@@ -536,6 +592,10 @@ void args_callback_usage(char *name)
     printf("-G , --flatten                 Remove as many clip layers from file as possible. \n");
     printf("-I , --info                    Don't do actual conversion, just display a list of all pages in the PDF.\n");
     printf("-Q , --maxtime n               Abort conversion after n seconds. Only available on Unix.\n");
+    printf("-a , --batch                   Read jobs (\"input.pdf output.swf [options]\") from stdin, one per line. Only available on Unix.\n");
+    printf("-U , --socket file             Like --batch, but read jobs from clients connecting to UNIX socket file.\n");
+    printf("-W , --workers n               Convert up to n documents in parallel in batch mode (default: number of CPUs).\n");
+    printf("     --stats                   Print how much time was spent in which part of the conversion, per page. (Use -s stats=file.json to save this as JSON)\n");
     printf("\n");
 }
 
@@ -589,7 +649,7 @@ void show_info(gfxsource_t*driver, char*filename)
 }
 
 
-static gfxdevice_t swf,wrap,rescale;
+static gfxdevice_t swf,wrap,rescale,timing;
 gfxdevice_t*create_output_device()
 {
     gfxdevice_swf_init(&swf);
@@ -617,100 +677,43 @@ gfxdevice_t*create_output_device()
 	gfxfilterchain_destroy(chain);
     }
 
+    if(stats_enabled) {
+        gfxdevice_timing_init(&timing, out);
+        out = &timing;
+    }
+
     /* pass global parameters to output device */
     parameter_t*p = device_config;
     while(p) {
 	out->setparameter(out, p->name, p->value);
 	p = p->next;
     }
+    for(p=job_config;p;p=p->next) {
+	out->setparameter(out, p->name, p->value);
+    }
     return out;
 }
 
-int main(int argn, char *argv[])
+/* convert the pdf in filename to outputname, using the (already configured) driver */
+static int convert_pages()
 {
     int ret;
-    char buf[256];
-    int numfonts = 0;
-    int t;
-    char t1searchpath[1024];
-    int nup_pos = 0;
-    int x,y;
     int one_file_per_page = 0;
-    
-    initLog(0,-1,0,0,-1,loglevel);
 
-    /* not needed anymore since fonts are embedded
-       if(installPath) {
-	fontpaths[fontpathpos++] = concatPaths(installPath, "fonts");
-    }*/
-
-#ifdef HAVE_SRAND48
-    srand48(time(0)*getpid());
-#else
-#ifdef HAVE_SRAND
-    srand(time(0)*getpid());
-#endif
-#endif
-
-    processargs(argn, argv);
-    
-    driver = gfxsource_pdf_create();
-    
-    /* pass global parameters to PDF driver*/
-    parameter_t*p = device_config;
-    while(p) {
-	driver->setparameter(driver, p->name, p->value);
-	p = p->next;
-    }
-
-    if(!filename)
-    {
-	fprintf(stderr, "Please specify an input file\n");
-	exit(1);
-    }
-
-    if (!info_only) {
-        if(!outputname)
-        {
-            if(filename) {
-                outputname = stripFilename(filename, ".swf");
-                msg("<notice> Output filename not given. Writing to %s", outputname);
-            } 
-        }
-            
-        if(!outputname)
-        {
-            fprintf(stderr, "Please use -o to specify an output file\n");
-            exit(1);
-        }
-    }
+    stats_enable(print_stats || stats_file);
 
     // test if the page range is o.k.
     is_in_range(0x7fffffff, pagerange);
 
-    if (!filename) {
-	args_callback_usage(argv[0]);
-	exit(0);
-    }
-    
     char fullname[256];
     if(password && *password) {
 	sprintf(fullname, "%s|%s", filename, password);
 	filename = fullname;
     }
     
-    if(pagerange)
-	driver->setparameter(driver, "pages", pagerange);
-
-    /* add fonts */
-    for(t=0;t<fontpathpos;t++) {
-	driver->setparameter(driver, "fontdir", fontpaths[t]);
-    }
-
-    if(info_only) {
-	show_info(driver, filename);
-	return 0;
-    }
+    /* always set the range- in batch mode, the driver still has the
+       one from the previous job */
+    driver->setparameter(driver, "pages", pagerange?pagerange:"");
 
     char*u = 0;
     if((u = strchr(outputname, '%'))) {
@@ -737,14 +740,17 @@ int main(int argn, char *argv[])
     gfxdocument_t* pdf = driver->open(driver, filename);
     if(!pdf) {
         msg("<error> Couldn't open %s", filename);
-        exit(1);
+        return 1;
     }
     /* pass global parameters document */
-    p = device_config;
+    parameter_t*p = device_config;
     while(p) {
 	pdf->setparameter(pdf, p->name, p->value);
 	p = p->next;
     }
+    for(p=job_config;p;p=p->next) {
+	pdf->setparameter(pdf, p->name, p->value);
+    }
 
     struct mypage_t {
 	int x;
@@ -771,7 +777,8 @@ int main(int argn, char *argv[])
     }
     if(pagerange && !pagenum && frame==1) {
 	fprintf(stderr, "No pages in range %s", pagerange);
-	exit(1);
+	pdf->destroy(pdf);
+	return 1;
     }
 
     pagenum = 0;
@@ -846,6 +853,8 @@ int main(int argn, char *argv[])
 		char buf[1024];
 		sprintf(buf, outputname, pagenr);
 		if(result->save(result, buf) < 0) {
+		    result->destroy(result);
+		    pdf->destroy(pdf);
 		    return 1;
 		}
 		result->destroy(result);result=0;
@@ -864,7 +873,9 @@ int main(int argn, char *argv[])
 	gfxresult_t*result = out->finish(out);
 	msg("<notice> Writing SWF file %s", outputname);
 	if(result->save(result, outputname) < 0) {
-	    exit(1);
+	    result->destroy(result);
+	    pdf->destroy(pdf);
+	    return 1;
 	}
 	int width = (int)(ptroff_t)result->get(result, "width");
 	int height = (int)(ptroff_t)result->get(result, "height");
@@ -905,22 +916,524 @@ int main(int argn, char *argv[])
     }
 
     pdf->destroy(pdf);
-    driver->destroy(driver);
 
-   
-    /* free global parameters */
-    p = device_config;
+    if(print_stats)
+	stats_print(stderr);
+    if(stats_file && stats_save_json(stats_file)<0)
+	msg("<error> Couldn't write %s", stats_file);
+    return 0;
+}
+
+static int convert()
+{
+    /* convert_pages() replaces a % in outputname by a malloc()ed pattern */
+    char*name = outputname;
+    int ret = convert_pages();
+    if(outputname != name) {
+	free(outputname);
+	outputname = name;
+    }
+    return ret;
+}
+
+#ifndef WIN32
+/* Batch mode: pdf2swf stays alive and converts one document per job line,
+   read from stdin or from clients of a UNIX domain socket.
+   A job line looks like
+
+       input.pdf output.swf [-p range] [-P password] [-s name=value ...]
+
+   (with "double quotes" around names that contain spaces). -s parameters
+   go to the document and the output device. Settings of the pdf driver itself
+   (fontdir, zoom, ...) have to be given on the command line.
+   Every job is answered with a line
+
+       <jobnr> OK|FAILED <seconds> input.pdf output.swf
+
+   The pdf driver isn't thread-safe, so jobs are distributed to a pool of
+   forked worker processes. Every worker converts its jobs one after the other,
+   and keeps fonts, glyph outlines and all the other global state
+   warm in between. A worker that crashes (or runs into -Q) only fails the job
+   it was working on, and is replaced by a fresh one. */
+
+typedef struct _worker {
+    pid_t pid;
+    int jobfd;
+    int resultfd;
+    char busy;
+    int jobnr;
+    int client;
+    char*job;
+    double starttime;
+    char buf[256];
+    int buflen;
+} worker_t;
+
+typedef struct _client {
+    int id;
+    int infd;
+    int outfd;
+    char buf[4096];
+    int buflen;
+    char eof;
+} client_t;
+
+#define MAX_CLIENTS 64
+
+static worker_t*workers = 0;
+static client_t clients[MAX_CLIENTS];
+static int num_clients = 0;
+static int client_id = 0;
+static int listenfd = -1;
+
+static double get_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void add_job_parameter(const char*name, const char*value)
+{
+    parameter_t*p = (parameter_t*)malloc(sizeof(parameter_t));
+    p->name = strdup(name);
+    p->value = strdup(value);
+    p->next = job_config;
+    job_config = p;
+}
+
+/* split a job line into whitespace separated words, honoring double quotes */
+static int split_job(char*line, char**argv, int max)
+{
+    int argc = 0;
+    char*s = line;
+    while(1) {
+	while(*s==' ' || *s=='\t' || *s=='\r' || *s=='\n')
+	    s++;
+	if(!*s || argc==max)
+	    break;
+	if(*s=='"') {
+	    argv[argc++] = ++s;
+	    while(*s && *s!='"')
+		s++;
+	} else {
+	    argv[argc++] = s;
+	    while(*s && *s!=' ' && *s!='\t' && *s!='\r' && *s!='\n')
+		s++;
+	}
+	if(!*s)
+	    break;
+	*s++ = 0;
+    }
+    return argc;
+}
+
+static int run_job(char*line)
+{
+    char*argv[64];
+    int argc = split_job(line, argv, 64);
+    if(argc<2) {
+	msg("<error> Invalid job: expected input and output filename");
+	return 1;
+    }
+    filename = argv[0];
+    outputname = argv[1];
+    pagerange = 0;
+    password = 0;
+    char*global_stats_file = stats_file;
+    int ret = 0;
+    int t;
+    for(t=2;t<argc && !ret;t++) {
+	if(!strcmp(argv[t], "-p") && t+1<argc) {
+	    pagerange = argv[++t];
+	} else if(!strcmp(argv[t], "-P") && t+1<argc) {
+	    password = argv[++t];
+	} else if(!strcmp(argv[t], "-s") && t+1<argc) {
+	    char*name = argv[++t];
+	    char*c = strchr(name, '=');
+	    if(c) {
+		*c = 0;
+		if(!strcmp(name, "stats"))
+		    stats_file = c+1;
+		else
+		    add_job_parameter(name, c+1);
+	    } else {
+		add_job_parameter(name, "1");
+	    }
+	} else {
+	    msg("<error> Unsupported job option: %s", argv[t]);
+	    ret = 1;
+	}
+    }
+    if(!ret) {
+	if(max_time)
+	    alarm(max_time);
+	ret = convert();
+	alarm(0);
+    }
+    free_parameters(job_config);
+    job_config = 0;
+    stats_file = global_stats_file;
+    return ret;
+}
+
+static void worker_main(int jobfd, int resultfd)
+{
+    /* stdout is reserved for job results */
+    dup2(2, 1);
+    FILE*fi = fdopen(jobfd, "rb");
+    char line[4096];
+    while(fgets(line, sizeof(line), fi)) {
+	int ret = run_job(line);
+	char result[32];
+	sprintf(result, "%d\n", ret);
+	write(resultfd, result, strlen(result));
+    }
+    exit(0);
+}
+
+static void start_worker(worker_t*w)
+{
+    int jobpipe[2], resultpipe[2];
+    if(pipe(jobpipe) || pipe(resultpipe)) {
+	perror("pipe");
+	exit(1);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid<0) {
+	perror("fork");
+	exit(1);
+    }
+    if(!pid) {
+	close(jobpipe[1]);
+	close(resultpipe[0]);
+	if(listenfd>=0)
+	    close(listenfd);
+	int t;
+	for(t=0;t<num_clients;t++) {
+	    if(clients[t].infd == clients[t].outfd)
+		close(clients[t].infd);
+	}
+	/* don't keep the other workers' pipes open */
+	for(t=0;t<num_workers;t++) {
+	    if(workers[t].pid && &workers[t]!=w) {
+		close(workers[t].jobfd);
+		close(workers[t].resultfd);
+	    }
+	}
+	worker_main(jobpipe[0], resultpipe[1]);
+    }
+    close(jobpipe[0]);
+    close(resultpipe[1]);
+    memset(w, 0, sizeof(worker_t));
+    w->pid = pid;
+    w->jobfd = jobpipe[1];
+    w->resultfd = resultpipe[0];
+}
+
+static void report(worker_t*w, const char*status)
+{
+    char line[4096];
+    snprintf(line, sizeof(line), "%d %s %.3f %s\n", w->jobnr, status, get_time() - w->starttime, w->job);
+    int t;
+    for(t=0;t<num_clients;t++) {
+	if(clients[t].id == w->client) {
+	    write(clients[t].outfd, line, strlen(line));
+	    break;
+	}
+    }
+    free(w->job);w->job = 0;
+    w->busy = 0;
+}
+
+static void close_client(int nr)
+{
+    if(clients[nr].infd == clients[nr].outfd)
+	close(clients[nr].infd);
+    clients[nr] = clients[--num_clients];
+}
+
+static client_t* new_client(int infd, int outfd)
+{
+    client_t*c = &clients[num_clients++];
+    memset(c, 0, sizeof(client_t));
+    c->id = ++client_id;
+    c->infd = infd;
+    c->outfd = outfd;
+    return c;
+}
+
+/* hand the next complete job line from one of the clients to worker w */
+static char dispatch(worker_t*w, int*jobnr)
+{
+    int t;
+    for(t=0;t<num_clients;t++) {
+	client_t*c = &clients[t];
+	char*nl = (char*)memchr(c->buf, '\n', c->buflen);
+	if(!nl && c->eof && c->buflen) {
+	    /* last line without newline */
+	    c->buf[c->buflen++] = '\n';
+	    nl = &c->buf[c->buflen-1];
+	}
+	if(!nl)
+	    continue;
+	int len = nl - c->buf + 1;
+	char*job = (char*)malloc(len);
+	memcpy(job, c->buf, len-1);
+	job[len-1] = 0;
+	memmove(c->buf, nl+1, c->buflen - len);
+	c->buflen -= len;
+	while(strlen(job) && (job[strlen(job)-1]=='\r'))
+	    job[strlen(job)-1] = 0;
+	if(!job[strspn(job, " \t")]) {
+	    free(job);
+	    return 1;
+	}
+	w->busy = 1;
+	w->jobnr = ++*jobnr;
+	w->client = c->id;
+	w->job = job;
+	w->starttime = get_time();
+	write(w->jobfd, job, strlen(job));
+	write(w->jobfd, "\n", 1);
+	return 1;
+    }
+    return 0;
+}
+
+static int batch_main()
+{
+    int t;
+    int jobnr = 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    if(batch_socket) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, batch_socket, sizeof(addr.sun_path)-1);
+	unlink(batch_socket);
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenfd<0 || bind(listenfd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(listenfd, 16)<0) {
+	    perror(batch_socket);
+	    return 1;
+	}
+	msg("<notice> Listening on %s", batch_socket);
+    } else {
+	/* stdin is our only client, and results go to stdout */
+	new_client(0, 1);
+    }
+
+    workers = (worker_t*)calloc(num_workers, sizeof(worker_t));
+    for(t=0;t<num_workers;t++) {
+	start_worker(&workers[t]);
+    }
+    msg("<notice> Started %d workers", num_workers);
+
+    while(1) {
+	/* feed idle workers */
+	int idle = 0;
+	for(t=0;t<num_workers;t++) {
+	    while(!workers[t].busy && dispatch(&workers[t], &jobnr));
+	    if(!workers[t].busy)
+		idle++;
+	}
+	/* clients which are done and don't wait for results anymore */
+	for(t=num_clients-1;t>=0;t--) {
+	    if(clients[t].eof && !clients[t].buflen) {
+		int s;
+		char waiting = 0;
+		for(s=0;s<num_workers;s++)
+		    if(workers[s].busy && workers[s].client == clients[t].id)
+			waiting = 1;
+		if(!waiting)
+		    close_client(t);
+	    }
+	}
+	if(!batch_socket && !num_clients)
+	    break;
+
+	fd_set fds;
+	FD_ZERO(&fds);
+	int maxfd = 0;
+#define WATCH(fd) {FD_SET((fd), &fds);if((fd)>maxfd) maxfd=(fd);}
+	for(t=0;t<num_workers;t++) {
+	    if(workers[t].busy)
+		WATCH(workers[t].resultfd);
+	}
+	/* only read new jobs if there's a worker to take them */
+	if(idle) {
+	    for(t=0;t<num_clients;t++) {
+		if(!clients[t].eof)
+		    WATCH(clients[t].infd);
+	    }
+	    if(listenfd>=0 && num_clients<MAX_CLIENTS)
+		WATCH(listenfd);
+	}
+#undef WATCH
+	if(select(maxfd+1, &fds, 0, 0, 0)<0) {
+	    if(errno == EINTR)
+		continue;
+	    perror("select");
+	    return 1;
+	}
+
+	if(listenfd>=0 && FD_ISSET(listenfd, &fds)) {
+	    int fd = accept(listenfd, 0, 0);
+	    if(fd>=0)
+		new_client(fd, fd);
+	}
+	for(t=0;t<num_clients;t++) {
+	    client_t*c = &clients[t];
+	    if(!c->eof && FD_ISSET(c->infd, &fds)) {
+		int l = read(c->infd, &c->buf[c->buflen], sizeof(c->buf)-1-c->buflen);
+		if(l<=0) {
+		    c->eof = 1;
+		} else {
+		    c->buflen += l;
+		    if(c->buflen == sizeof(c->buf)-1 && !memchr(c->buf, '\n', c->buflen)) {
+			msg("<error> Job line too long");
+			c->eof = 1;
+			c->buflen = 0;
+		    }
+		}
+	    }
+	}
+	for(t=0;t<num_workers;t++) {
+	    worker_t*w = &workers[t];
+	    if(!w->busy || !FD_ISSET(w->resultfd, &fds))
+		continue;
+	    int l = read(w->resultfd, &w->buf[w->buflen], sizeof(w->buf)-1-w->buflen);
+	    if(l<=0) {
+		/* worker died */
+		int status = 0;
+		waitpid(w->pid, &status, 0);
+		close(w->jobfd);
+		close(w->resultfd);
+		w->pid = 0;
+		char why[80];
+		if(WIFSIGNALED(status))
+		    sprintf(why, "FAILED(signal %d)", WTERMSIG(status));
+		else
+		    sprintf(why, "FAILED(exit %d)", WEXITSTATUS(status));
+		report(w, why);
+		start_worker(w);
+		continue;
+	    }
+	    w->buflen += l;
+	    w->buf[w->buflen] = 0;
+	    char*nl = strchr(w->buf, '\n');
+	    if(nl) {
+		report(w, atoi(w->buf)?"FAILED":"OK");
+		w->buflen = 0;
+	    }
+	}
+    }
+
+    for(t=0;t<num_workers;t++) {
+	close(workers[t].jobfd);
+	close(workers[t].resultfd);
+    }
+    for(t=0;t<num_workers;t++) {
+	waitpid(workers[t].pid, 0, 0);
+    }
+    free(workers);
+    return 0;
+}
+#endif
+
+int main(int argn, char *argv[])
+{
+    int t;
+    
+    initLog(0,-1,0,0,-1,loglevel);
+
+    /* not needed anymore since fonts are embedded
+       if(installPath) {
+	fontpaths[fontpathpos++] = concatPaths(installPath, "fonts");
+    }*/
+
+#ifdef HAVE_SRAND48
+    srand48(time(0)*getpid());
+#else
+#ifdef HAVE_SRAND
+    srand(time(0)*getpid());
+#endif
+#endif
+
+    processargs(argn, argv);
+    
+    driver = gfxsource_pdf_create();
+    
+    /* pass global parameters to PDF driver*/
+    parameter_t*p = device_config;
     while(p) {
-	parameter_t*next = p->next;
-	if(p->name) free((void*)p->name);p->name = 0;
-	if(p->value) free((void*)p->value);p->value =0;
-	p->next = 0;free(p);
-	p = next;
+	driver->setparameter(driver, p->name, p->value);
+	p = p->next;
+    }
+
+    /* add fonts */
+    for(t=0;t<fontpathpos;t++) {
+	driver->setparameter(driver, "fontdir", fontpaths[t]);
+    }
+
+    int ret = 0;
+#ifndef WIN32
+    if(batch) {
+	if(filename) {
+	    fprintf(stderr, "No input file allowed in batch mode\n");
+	    exit(1);
+	}
+	/* -Q applies to every single job, not to the batch */
+	alarm(0);
+	if(!num_workers)
+	    num_workers = os_get_number_of_cpus();
+	ret = batch_main();
+	driver->destroy(driver);
+	free_parameters(device_config);
+	return ret;
+    }
+#endif
+
+    if(!filename)
+    {
+	fprintf(stderr, "Please specify an input file\n");
+	exit(1);
+    }
+
+    if (!info_only) {
+        if(!outputname)
+        {
+            if(filename) {
+                outputname = stripFilename(filename, ".swf");
+                msg("<notice> Output filename not given. Writing to %s", outputname);
+            } 
+        }
+            
+        if(!outputname)
+        {
+            fprintf(stderr, "Please use -o to specify an output file\n");
+            exit(1);
+        }
+    }
+
+    if(info_only) {
+	show_info(driver, filename);
+	return 0;
     }
+
+    ret = convert();
+    if(ret)
+	exit(ret);
+
+    driver->destroy(driver);
+
+    /* free global parameters */
+    free_parameters(device_config);
     if(filters) {
 	free(filters);
     }
 
     return 0;
 }
-
@@ -148,11 +148,16 @@ int args_callback_command(char*name,char*val)
 
 #define swf_ResetReadBits(tag)   if (tag->readBit)  { tag->pos++; tag->readBit = 0; }
 
-void swf_Shape2Optimize(SHAPE2*shape)
+static SRECT getShapeBoundingBox(TAG*tag)
 {
-    if(!shape->bbox)
-	shape->bbox = malloc(sizeof(SRECT));
-    *(shape->bbox) = swf_GetShapeBoundingBox(shape);
+    SHAPE2 s;
+    SHAPEEDGES edges;
+    SRECT r;
+    swf_ParseDefineShapeEdges(tag, &s, &edges);
+    r = swf_GetShapeEdgesBoundingBox(&s, &edges);
+    swf_ShapeEdgesFree(&edges);
+    swf_Shape2Free(&s);
+    return r;
 }
 
 /*
@@ -428,21 +433,33 @@ static void swf_OptimizeBoundingBoxes(SWF*swf)
 	    tag->id == ST_DEFINESHAPE2 ||
 	    tag->id == ST_DEFINESHAPE3 ||
 	    tag->id == ST_DEFINESHAPE4) {
-	    SHAPE2 s;
+	    SRECT bbox;
+	    int styles_offset;
+	    int len;
+	    U8*data;
 	    if(verbose) printf("%s\n", swf_TagGetName(tag));
-	    swf_ParseDefineShape(tag, &s);
+	    swf_SetTagPos(tag, 0);
+	    swf_GetU16(tag);
+	    swf_GetRect(tag, &bbox);
+	    swf_ResetReadBits(tag);
+	    styles_offset = tag->pos;
 	    if(optimize)
-		swf_Shape2Optimize(&s);
-	    tag->len = 2;
-	    tag->pos = 0;
-	    if(!s.bbox) {
-		fprintf(stderr, "Internal error (5)\n");
-		exit(1);
-	    }
+		bbox = getShapeBoundingBox(tag);
 	    if(clip || checkclippings) {
-		*s.bbox = clipBBox(tag, swf->movieSize, *s.bbox);
+		bbox = clipBBox(tag, swf->movieSize, bbox);
 	    }
-	    swf_SetShape2(tag, &s);
+
+	    /* only the bbox changes, so there's no need to encode the
+	       shape again- just copy everything after it */
+	    len = tag->len - styles_offset;
+	    data = malloc(len);
+	    memcpy(data, &tag->data[styles_offset], len);
+	    tag->writeBit = 0;
+	    tag->len = 2;
+	    swf_SetRect(tag, &bbox);
+	    swf_SetBlock(tag, data, len);
+	    free(data);
+	    tag->pos = tag->readBit = 0;
 	}
 	if (tag->id == ST_DEFINETEXT || tag->id == ST_DEFINETEXT2) {
 	    SRECT oldbox;
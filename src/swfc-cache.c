@@ -0,0 +1,203 @@
+/* swfc-cache.c
+
+   On-disk cache for the assets of swfc.
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../config.h"
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include "../lib/log.h"
+#include "../lib/q.h"
+#include "swfc-cache.h"
+
+/* bump this whenever the encoders change their output */
+#define CACHE_MAGIC "swfc cache 1\n"
+
+static char* cachedir = 0;
+
+void cache_init(const char*dir)
+{
+    cachedir = strdup(dir);
+#ifdef HAVE_SYS_STAT_H
+#ifdef WIN32
+    mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+#endif
+}
+
+/* The key consists of a CRC32 and a 64 bit FNV-1a hash over the file
+   contents followed by the parameters, and the length of the file. */
+char* cache_key(const char*filename, const char*params)
+{
+    unsigned char buf[65536];
+    unsigned int crc = 0;
+    U64 fnv = 0xcbf29ce484222325ll;
+    unsigned int size = 0;
+    int l, t;
+    FILE*fi;
+    char*key;
+    if(!cachedir)
+	return 0;
+    fi = fopen(filename, "rb");
+    if(!fi)
+	return 0;
+    while((l = fread(buf, 1, sizeof(buf), fi)) > 0) {
+	crc = crc32_add_bytes(crc, buf, l);
+	for(t=0;t<l;t++)
+	    fnv = (fnv ^ buf[t]) * 0x100000001b3ll;
+	size += l;
+    }
+    fclose(fi);
+    l = strlen(params);
+    crc = crc32_add_bytes(crc, params, l);
+    for(t=0;t<l;t++)
+	fnv = (fnv ^ (U8)params[t]) * 0x100000001b3ll;
+
+    key = malloc(8+16+8+1);
+    sprintf(key, "%08x%08x%08x%08x", crc, (unsigned int)(fnv>>32), (unsigned int)fnv, size);
+    return key;
+}
+
+static char* cache_filename(const char*key, const char*suffix)
+{
+    char*name = malloc(strlen(cachedir)+strlen(key)+strlen(suffix)+2);
+    sprintf(name, "%s/%s%s", cachedir, key, suffix);
+    return name;
+}
+
+/* The file format is CACHE_MAGIC, followed by the tags as U16 id, U32 length
+   and data, all in little endian. */
+
+static int read_u16(FILE*fi)
+{
+    U8 b[2];
+    if(fread(b, 2, 1, fi) != 1)
+	return -1;
+    return b[0]|b[1]<<8;
+}
+
+static void write_u16(FILE*fi, U16 v)
+{
+    fputc(v, fi);
+    fputc(v>>8, fi);
+}
+
+TAG* cache_load(const char*key, TAG*after, U16 id)
+{
+    char magic[sizeof(CACHE_MAGIC)];
+    char*name;
+    FILE*fi;
+    TAG*tag = after;
+    int tagid, num = 0, broken = 0;
+    if(!key)
+	return 0;
+    name = cache_filename(key, "");
+    fi = fopen(name, "rb");
+    free(name);
+    if(!fi)
+	return 0;
+    if(fread(magic, sizeof(CACHE_MAGIC)-1, 1, fi) != 1 ||
+       memcmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)-1)) {
+	fclose(fi);
+	return 0;
+    }
+    while((tagid = read_u16(fi)) >= 0) {
+	int lo = read_u16(fi), hi = read_u16(fi);
+	U32 len = lo | hi << 16;
+	U8*data;
+	if(lo < 0 || hi < 0) {
+	    broken = 1;
+	    break;
+	}
+	data = rfx_alloc(len?len:1);
+	if(len && fread(data, len, 1, fi) != 1) {
+	    rfx_free(data);
+	    broken = 1;
+	    break;
+	}
+	tag = swf_InsertTag(tag, tagid);
+	swf_SetBlock(tag, data, len);
+	rfx_free(data);
+	num++;
+    }
+    if(broken || !num) {
+	/* truncated or broken entry- remove whatever we inserted */
+	msg("<warning> Ignoring broken cache entry %s", key);
+	while(tag != after) {
+	    TAG*prev = tag->prev;
+	    swf_DeleteTag(0, tag);
+	    tag = prev;
+	}
+	fclose(fi);
+	return 0;
+    }
+    fclose(fi);
+    if(after->next->len >= 2)
+	PUT16(after->next->data, id);
+    return tag;
+}
+
+void cache_save(const char*key, TAG*first, TAG*last)
+{
+    char*name, *tmpname;
+    char suffix[32];
+    FILE*fo;
+    TAG*tag;
+    if(!key)
+	return;
+    /* the temporary file is private to this process, so that concurrent
+       builds writing the same entry don't interleave */
+#ifdef HAVE_UNISTD_H
+    sprintf(suffix, ".%d.tmp", (int)getpid());
+#else
+    strcpy(suffix, ".tmp");
+#endif
+    name = cache_filename(key, "");
+    tmpname = cache_filename(key, suffix);
+    fo = fopen(tmpname, "wb");
+    if(!fo) {
+	msg("<warning> Couldn't write to cache directory %s", cachedir);
+	free(name);
+	free(tmpname);
+	return;
+    }
+    fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC)-1, 1, fo);
+    for(tag = first; tag; tag = tag->next) {
+	write_u16(fo, tag->id);
+	write_u16(fo, tag->len);
+	write_u16(fo, tag->len>>16);
+	fwrite(tag->data, tag->len, 1, fo);
+	if(tag == last)
+	    break;
+    }
+    /* write to a temporary file first, so that concurrent builds never see
+       a partial entry. rename() replaces an existing entry atomically. */
+    if(fclose(fo) || rename(tmpname, name))
+	unlink(tmpname);
+    free(name);
+    free(tmpname);
+}
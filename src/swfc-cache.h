@@ -0,0 +1,45 @@
+/* swfc-cache.h
+
+   On-disk cache for the assets of swfc.
+
+   Part of the swftools package.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include "../lib/rfxswf.h"
+
+/* An on-disk cache for the defining tags of assets (images, sounds) which
+   are expensive to encode. Entries are keyed by the contents of the source
+   file together with a string describing the encoding parameters. */
+
+/* enable the cache, storing entries in directory dir */
+void cache_init(const char*dir);
+
+/* returns the key for the given file and parameters, or NULL if the cache
+   is disabled or the file can't be read. Free with free(). */
+char* cache_key(const char*filename, const char*params);
+
+/* inserts the cached tags after tag "after", with the character id (the first
+   U16 of the first tag) set to id. Returns the last inserted tag, or NULL if
+   there is no entry for key. */
+TAG* cache_load(const char*key, TAG*after, U16 id);
+
+/* stores the tags from first up to and including last */
+void cache_save(const char*key, TAG*first, TAG*last);
+
+#endif
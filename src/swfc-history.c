@@ -30,6 +30,15 @@ enum
     T_SYMMETRIC
 };
 
+static char* trackNames[P_NUM] =
+{
+    "x", "y", "scalex", "scaley",
+    "cxform.r0", "cxform.g0", "cxform.b0", "cxform.a0",
+    "cxform.r1", "cxform.g1", "cxform.b1", "cxform.a1",
+    "rotate", "shear", "pivot.x", "pivot.y", "pin.x", "pin.y",
+    "blendmode", "flags"
+};
+
 state_t* state_new(U16 frame, int function, float value, interpolation_t* inter)
 {
     state_t* newState = (state_t*)malloc(sizeof(state_t));
@@ -824,26 +833,9 @@ history_t* history_new()
 
 void history_free(history_t* past)
 {
-    state_free(dict_lookup(past->states, "x"));
-    state_free(dict_lookup(past->states, "y"));
-    state_free(dict_lookup(past->states, "scalex"));
-    state_free(dict_lookup(past->states, "scaley"));
-    state_free(dict_lookup(past->states, "cxform.r0"));
-    state_free(dict_lookup(past->states, "cxform.g0"));
-    state_free(dict_lookup(past->states, "cxform.b0"));
-    state_free(dict_lookup(past->states, "cxform.a0"));
-    state_free(dict_lookup(past->states, "cxform.r1"));
-    state_free(dict_lookup(past->states, "cxform.g1"));
-    state_free(dict_lookup(past->states, "cxform.b1"));
-    state_free(dict_lookup(past->states, "cxform.a1"));
-    state_free(dict_lookup(past->states, "rotate"));
-    state_free(dict_lookup(past->states, "shear"));
-    state_free(dict_lookup(past->states, "pivot.x"));
-    state_free(dict_lookup(past->states, "pivot.y"));
-    state_free(dict_lookup(past->states, "pin.x"));
-    state_free(dict_lookup(past->states, "pin.y"));
-    state_free(dict_lookup(past->states, "blendmode"));
-    state_free(dict_lookup(past->states, "flags"));
+    int t;
+    for (t = 0; t < P_NUM; t++)
+    	state_free(dict_lookup(past->states, trackNames[t]));
     filterState_free(dict_lookup(past->states, "filter"));
     dict_destroy(past->states);
     free(past);
@@ -1112,39 +1104,41 @@ float history_value(history_t* past, U16 frame, char* parameter)
     return 0;
 }
 
-float history_rotateValue(history_t* past, U16 frame)
+static float rotateValue(history_t* past, state_t* rotations, state_t* flags, U16 frame)
 {
-    state_t* rotations = dict_lookup(past->states, "rotate");
-    if (rotations)	//should always be true.
+    float angle = state_value(rotations, frame);
+    U16 currentflags = state_value(flags, frame);
+    if (currentflags & IF_FIXED_ALIGNMENT)
     {
-    	float angle = state_value(rotations, frame);
-    	state_t* flags = dict_lookup(past->states, "flags");
-    	U16 currentflags = state_value(flags, frame);
-    	if (currentflags & IF_FIXED_ALIGNMENT)
-    	{
-	    flags = state_at(flags, frame);
-	    if (frame == past->firstFrame)
-	    	frame++;
-	    state_t *x, *y;
-	    float dx, dy, pathAngle;
-	    do
-	    {
-    	    	x = dict_lookup(past->states, "x");
-    	    	dx = state_value(x, frame) - state_value(x, frame - 1);
-    	    	y = dict_lookup(past->states, "y");
-    	    	dy = state_value(y, frame) - state_value(y, frame - 1);
-    	    	frame--;
-	    }
-	    while (dx == 0 && dy == 0 && frame > past->firstFrame);
-	    if (frame == past->firstFrame)
-    	    	pathAngle = 0;
-	    else
-    	    	pathAngle = getAngle(dx, dy) / M_PI * 180;
-    	    return angle + flags->params.instanceAngle + pathAngle - flags->params.pathAngle;
-    	}
+	flags = state_at(flags, frame);
+	if (frame == past->firstFrame)
+	    frame++;
+	// this walks backwards in time, so it has to start at the first state
+	state_t* x = dict_lookup(past->states, "x");
+	state_t* y = dict_lookup(past->states, "y");
+	float dx, dy, pathAngle;
+	do
+	{
+	    dx = state_value(x, frame) - state_value(x, frame - 1);
+	    dy = state_value(y, frame) - state_value(y, frame - 1);
+	    frame--;
+	}
+	while (dx == 0 && dy == 0 && frame > past->firstFrame);
+	if (frame == past->firstFrame)
+	    pathAngle = 0;
 	else
-	    return angle;
+	    pathAngle = getAngle(dx, dy) / M_PI * 180;
+	return angle + flags->params.instanceAngle + pathAngle - flags->params.pathAngle;
     }
+    else
+	return angle;
+}
+
+float history_rotateValue(history_t* past, U16 frame)
+{
+    state_t* rotations = dict_lookup(past->states, "rotate");
+    if (rotations)	//should always be true.
+	return rotateValue(past, rotations, dict_lookup(past->states, "flags"), frame);
     syntaxerror("no history found to get a value for parameter rotate.\n");
 	return 0;
 }
@@ -1166,3 +1160,61 @@ FILTERLIST* history_filterValue(history_t* past, U16 frame)
     syntaxerror("no history found to get a value for parameter filter.\n");
 	return 0;
 }
+
+/* history_compile() prepares a recorded history for being played back frame
+   by frame: every parameter gets a cursor into its state list, which
+   history_advance() moves forward as the frame counter increases. Looking
+   up a value then starts at the cursor instead of at the first state. */
+
+void history_compile(history_t* past)
+// to be called after history_processFlags.
+{
+    int t;
+    for (t = 0; t < P_NUM; t++)
+    {
+    	past->track[t] = dict_lookup(past->states, trackNames[t]);
+    	if (!past->track[t])
+    	    syntaxerror("no history found for parameter %s.\n", trackNames[t]);
+    	past->cursor[t] = past->track[t];
+    }
+    past->filterTrack = dict_lookup(past->states, "filter");
+    if (!past->filterTrack)
+    	syntaxerror("no history found for parameter filter.\n");
+    past->filterCursor = past->filterTrack;
+}
+
+U32 history_advance(history_t* past, U16 frame)
+// frame must not decrease between calls. Returns a bitmask of the
+// parameters which change in frame, with bit P_FILTER for the filters.
+{
+    U32 changed = 0;
+    int t;
+    for (t = 0; t < P_NUM; t++)
+    {
+    	past->cursor[t] = state_at(past->cursor[t], frame);
+    	if (t != P_FLAGS && state_differs(past->cursor[t], frame))
+    	    changed |= 1 << t;
+    }
+    filterState_t* filters = past->filterCursor;
+    while (filters->next && filters->next->frame < frame)
+    	filters = filters->next;
+    past->filterCursor = filters;
+    if (filterState_differs(filters, frame))
+    	changed |= 1 << P_FILTER;
+    return changed;
+}
+
+float history_trackValue(history_t* past, int track, U16 frame)
+{
+    return state_value(past->cursor[track], frame);
+}
+
+float history_trackRotateValue(history_t* past, U16 frame)
+{
+    return rotateValue(past, past->cursor[P_ROTATE], past->cursor[P_FLAGS], frame);
+}
+
+FILTERLIST* history_trackFilterValue(history_t* past, U16 frame)
+{
+    return filterState_value(past->filterCursor, frame);
+}
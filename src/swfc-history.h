@@ -55,6 +55,19 @@ enum
 
 #define IF_FIXED_ALIGNMENT 0x0001
 
+/* the keyframe tracks of an instance, as used by history_compile() */
+enum
+{
+    P_X, P_Y, P_SCALEX, P_SCALEY,
+    P_CX_R0, P_CX_G0, P_CX_B0, P_CX_A0,
+    P_CX_R1, P_CX_G1, P_CX_B1, P_CX_A1,
+    P_ROTATE, P_SHEAR, P_PIVOT_X, P_PIVOT_Y, P_PIN_X, P_PIN_Y,
+    P_BLENDMODE, P_FLAGS,
+    P_NUM
+};
+/* bit set in the result of history_advance() if the filters change */
+#define P_FILTER P_NUM
+
 FILTER* noFilters;
 FILTER_BLUR* noBlur;
 FILTER_BEVEL* noBevel;
@@ -118,6 +131,13 @@ typedef struct _history
     U16 firstFrame, lastFrame;
 	TAG* firstTag;
     dict_t* states;
+
+    /* filled by history_compile(): the tracks of the states dictionary, and
+       for each of them the last state before the current frame */
+    state_t* track[P_NUM];
+    state_t* cursor[P_NUM];
+    filterState_t* filterTrack;
+    filterState_t* filterCursor;
 } history_t;
 
 history_t* history_new();
@@ -135,4 +155,10 @@ float history_rotateValue(history_t* past, U16 frame);
 int history_changeFilter(history_t* past, U16 frame);
 FILTERLIST* history_filterValue(history_t* past, U16 frame);
 
+void history_compile(history_t* past);
+U32 history_advance(history_t* past, U16 frame);
+float history_trackValue(history_t* past, int track, U16 frame);
+float history_trackRotateValue(history_t* past, U16 frame);
+FILTERLIST* history_trackFilterValue(history_t* past, U16 frame);
+
 #endif
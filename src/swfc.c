@@ -39,6 +39,7 @@
 #include "swfc-feedback.h"
 #include "swfc-interpolation.h"
 #include "swfc-history.h"
+#include "swfc-cache.h"
 
 //#define DEBUG
 static char * outputname = "output.swf";
@@ -56,6 +57,7 @@ static struct options_t options[] = {
 {"C", "cgi"},
 {"v", "verbose"},
 {"o", "output"},
+{"c", "cache"},
 {0,0}
 };
 
@@ -82,6 +84,10 @@ int args_callback_option(char*name,char*val)
 	verbose ++;
 	return 0;
     }
+    else if(!strcmp(name, "c")) {
+	cache_init(val);
+	return 1;
+    }
     else {
         printf("Unknown option: -%s\n", name);
 	exit(1);
@@ -102,6 +108,7 @@ void args_callback_usage(char *name)
     printf("-C , --cgi                     Output to stdout (for use in CGI environments)\n");
     printf("-v , --verbose                 Increase verbosity. \n");
     printf("-o , --output <filename>       Set output file to <filename>.\n");
+    printf("-c , --cache <directory>       Keep encoded images and sounds in <directory>, and reuse them on later runs.\n");
     printf("\n");
 }
 int args_callback_command(char*name,char*val)
@@ -188,6 +195,7 @@ static struct level
    U16 olddepth;
    int oldframe;
    dict_t oldinstances;
+   mem_t oldshowframes;
    SRECT oldrect;
    TAG* cut;
 
@@ -211,6 +219,7 @@ static int currentframe; //current frame in current level
 static SRECT currentrect; //current bounding box in current level
 static U16 currentdepth;
 static dict_t instances;
+static mem_t showframes; //the SHOWFRAME tags of the current level
 static dict_t fonts;
 static dict_t sounds;
 static dict_t fontUsage;
@@ -241,6 +250,7 @@ typedef struct _instance {
     U16 depth;
     parameters_t parameters;
     history_t* history;
+    int showframe; //index of the first SHOWFRAME tag following the instance's PLACEOBJECT
 } instance_t;
 
 typedef struct _outline {
@@ -634,6 +644,7 @@ void s_swf(const char*name, SRECT r, int version, int fps, int compress, RGBA ba
     stackpos++;
 
     currentframe = 0;
+    mem_init(&showframes);
     memset(&currentrect, 0, sizeof(currentrect));
     currentdepth = 1;
 
@@ -655,6 +666,7 @@ void s_sprite(const char*name, SRECT*scalegrid, const char*as3name)
     stack[stackpos].olddepth = currentdepth;
     stack[stackpos].oldrect = currentrect;
     stack[stackpos].oldinstances = instances;
+    stack[stackpos].oldshowframes = showframes;
     stack[stackpos].tag = tag;
     stack[stackpos].id = id;
     stack[stackpos].name = strdup(name);
@@ -667,6 +679,7 @@ void s_sprite(const char*name, SRECT*scalegrid, const char*as3name)
 
     /* FIXME: those four fields should be bundled together */
     dict_init(&instances, 16);
+    mem_init(&showframes);
     currentframe = 0;
     currentdepth = 1;
     memset(&currentrect, 0, sizeof(currentrect));
@@ -846,34 +859,6 @@ TAG* removeFromTo(TAG*from, TAG*to)
     return save;
 }
 
-static int parametersChange(history_t* history, int frame)
-{
-    int willChange = 0;
-
-    willChange = willChange || history_change(history, frame, "x");
-    willChange = willChange || history_change(history, frame, "y");
-    willChange = willChange || history_change(history, frame, "scalex");
-    willChange = willChange || history_change(history, frame, "scaley");
-    willChange = willChange || history_change(history, frame, "cxform.r0");
-    willChange = willChange || history_change(history, frame, "cxform.g0");
-    willChange = willChange || history_change(history, frame, "cxform.b0");
-    willChange = willChange || history_change(history, frame, "cxform.a0");
-    willChange = willChange || history_change(history, frame, "cxform.r1");
-    willChange = willChange || history_change(history, frame, "cxform.g1");
-    willChange = willChange || history_change(history, frame, "cxform.b1");
-    willChange = willChange || history_change(history, frame, "cxform.a1");
-    willChange = willChange || history_change(history, frame, "rotate");
-    willChange = willChange || history_change(history, frame, "shear");
-    willChange = willChange || history_change(history, frame, "pivot.x");
-    willChange = willChange || history_change(history, frame, "pivot.y");
-    willChange = willChange || history_change(history, frame, "pin.x");
-    willChange = willChange || history_change(history, frame, "pin.y");
-    willChange = willChange || history_change(history, frame, "blendmode");
-    willChange = willChange || history_changeFilter(history, frame);
-
-    return willChange;
-}
-
 static void free_filterlist(FILTERLIST* f_list)
 {
     int i;
@@ -910,6 +895,39 @@ static void readParameters(history_t* history, parameters_t* p, int frame)
     p->filters = history_filterValue(history, frame);
 }
 
+/* like readParameters, but only updates the parameters which history_advance
+   reported as changed. Uses the cursors set up by history_compile. */
+static void readChangedParameters(history_t* history, parameters_t* p, int frame, U32 changed)
+{
+#define CHANGED(track) (changed & (1 << (track)))
+    if(CHANGED(P_X)) p->x = history_trackValue(history, P_X, frame);
+    if(CHANGED(P_Y)) p->y = history_trackValue(history, P_Y, frame);
+    if(CHANGED(P_SCALEX)) p->scalex = history_trackValue(history, P_SCALEX, frame);
+    if(CHANGED(P_SCALEY)) p->scaley = history_trackValue(history, P_SCALEY, frame);
+    if(CHANGED(P_CX_R0)) p->cxform.r0 = history_trackValue(history, P_CX_R0, frame);
+    if(CHANGED(P_CX_G0)) p->cxform.g0 = history_trackValue(history, P_CX_G0, frame);
+    if(CHANGED(P_CX_B0)) p->cxform.b0 = history_trackValue(history, P_CX_B0, frame);
+    if(CHANGED(P_CX_A0)) p->cxform.a0 = history_trackValue(history, P_CX_A0, frame);
+    if(CHANGED(P_CX_R1)) p->cxform.r1 = history_trackValue(history, P_CX_R1, frame);
+    if(CHANGED(P_CX_G1)) p->cxform.g1 = history_trackValue(history, P_CX_G1, frame);
+    if(CHANGED(P_CX_B1)) p->cxform.b1 = history_trackValue(history, P_CX_B1, frame);
+    if(CHANGED(P_CX_A1)) p->cxform.a1 = history_trackValue(history, P_CX_A1, frame);
+    // with fixed alignment, the rotation also depends on the path
+    p->rotate = history_trackRotateValue(history, frame);
+    if(CHANGED(P_SHEAR)) p->shear = history_trackValue(history, P_SHEAR, frame);
+    if(CHANGED(P_PIVOT_X)) p->pivot.x = history_trackValue(history, P_PIVOT_X, frame);
+    if(CHANGED(P_PIVOT_Y)) p->pivot.y = history_trackValue(history, P_PIVOT_Y, frame);
+    if(CHANGED(P_PIN_X)) p->pin.x = history_trackValue(history, P_PIN_X, frame);
+    if(CHANGED(P_PIN_Y)) p->pin.y = history_trackValue(history, P_PIN_Y, frame);
+    if(CHANGED(P_BLENDMODE)) p->blendmode = history_trackValue(history, P_BLENDMODE, frame);
+    if(CHANGED(P_FILTER)) {
+	if(p->filters)
+	    free_filterlist(p->filters);
+	p->filters = history_trackFilterValue(history, frame);
+    }
+#undef CHANGED
+}
+
 void setPlacement(TAG*tag, U16 id, U16 depth, MATRIX m, const char*name, parameters_t*p, char move)
 {
     SWFPLACEOBJECT po;
@@ -937,16 +955,27 @@ static void writeInstance(void* _i)
     parameters_t p;
     MATRIX m;
     int frame = i->history->firstFrame;
-    TAG* tag = i->history->firstTag;
+    TAG* tag;
+    TAG** showframe = (TAG**)showframes.buffer;
+    int nr = i->showframe, num = showframes.pos / sizeof(TAG*);
+    U32 changed;
     history_processFlags(i->history);
-    while (tag && frame < currentframe)
+    history_compile(i->history);
+    /* p always holds the parameters of the last frame, so that only the
+       parameters which change need to be evaluated */
+    memset(&p, 0, sizeof(p));
+    history_advance(i->history, frame);
+    readChangedParameters(i->history, &p, frame, 0xffffffff);
+    /* the changes for a frame go right after the SHOWFRAME of the frame
+       before it */
+    while (nr < num && frame < currentframe)
     {
         frame++;
-        while (tag && tag->id != ST_SHOWFRAME)
-            tag = tag->next;
-        if(parametersChange(i->history, frame))
+        tag = showframe[nr++];
+        changed = history_advance(i->history, frame);
+        if(changed)
         {
-            readParameters(i->history, &p, frame);
+            readChangedParameters(i->history, &p, frame, changed);
             m = s_instancepos(i->character->size, &p);
 
             if(p.blendmode || p.filters)
@@ -954,12 +983,10 @@ static void writeInstance(void* _i)
             else
         	tag = swf_InsertTag(tag, ST_PLACEOBJECT2);
             setPlacement(tag, 0, i->depth, m, 0, &p, 1);
-            if(p.filters)
-            	free_filterlist(p.filters);
-        } else if(tag) {
-            tag = tag->next;
         }
     }
+    if(p.filters)
+	free_filterlist(p.filters);
 }
 
 void dumpSWF(SWF*swf)
@@ -1014,6 +1041,8 @@ static void s_endSprite()
     currentrect = stack[stackpos].oldrect;
     currentdepth = stack[stackpos].olddepth;
     instances = stack[stackpos].oldinstances;
+    mem_clear(&showframes);
+    showframes = stack[stackpos].oldshowframes;
 
     s_addcharacter(stack[stackpos].name, stack[stackpos].id, stack[stackpos].tag, r);
 
@@ -1036,6 +1065,7 @@ static void s_endSWF()
     char*mc="";
 
     dict_foreach_value(&instances, writeInstance);
+    mem_clear(&showframes);
 
     if(stack[stackpos].cut)
 	tag = removeFromTo(stack[stackpos].cut, tag);
@@ -1141,6 +1171,7 @@ void s_frame(int nr, int cut, const char*name, char anchor)
 
     for(t=currentframe;t<nr;t++) {
 	tag = swf_InsertTag(tag, ST_SHOWFRAME);
+	mem_put(&showframes, &tag, sizeof(TAG*));
 	if(t==nr-1 && name && *name) {
 	    tag = swf_InsertTag(tag, ST_FRAMELABEL);
 	    swf_SetString(tag, name);
@@ -1468,18 +1499,30 @@ void s_image(const char*name, const char*type, const char*filename, int quality)
     SRECT r;
     int imageID = id;
     unsigned width, height;
+    char params[32];
+    char*key = 0;
+    TAG*cached;
     if(!strcmp(type,"jpeg")) {
 #ifndef HAVE_JPEGLIB
 	warning("no jpeg support compiled in");
 	s_box(name, 0, 0, black, 20, 0);
 	return;
 #else
-	tag = swf_InsertTag(tag, ST_DEFINEBITSJPEG2);
-	swf_SetU16(tag, imageID);
+	sprintf(params, "jpeg quality=%d", quality);
+	key = cache_key(filename, params);
+	if((cached = cache_load(key, tag, imageID))) {
+	    msg("<notice> Using cached image \"%s\"", filename);
+	    tag = cached;
+	} else {
+	    tag = swf_InsertTag(tag, ST_DEFINEBITSJPEG2);
+	    swf_SetU16(tag, imageID);
 
-	if(swf_SetJPEGBits(tag, (char*)filename, quality) < 0) {
-	    syntaxerror("Image \"%s\" not found, or contains errors", filename);
+	    if(swf_SetJPEGBits(tag, (char*)filename, quality) < 0) {
+		syntaxerror("Image \"%s\" not found, or contains errors", filename);
+	    }
+	    cache_save(key, tag, tag);
 	}
+	free(key);
 
 	swf_GetJPEGSize(filename, &width, &height);
 
@@ -1495,17 +1538,28 @@ void s_image(const char*name, const char*type, const char*filename, int quality)
 	RGBA*data = 0;
 	swf_SetU16(tag, imageID);
 
-	png_load(filename, &width, &height, (unsigned char**)&data);
+	key = cache_key(filename, "png");
+	if((cached = cache_load(key, tag, imageID))) {
+	    msg("<notice> Using cached image \"%s\"", filename);
+	    tag = cached;
+	    /* id, format, width, height */
+	    width = GET16(&tag->data[3]);
+	    height = GET16(&tag->data[5]);
+	} else {
+	    png_load(filename, &width, &height, (unsigned char**)&data);
 
-	if(!data) {
-	    syntaxerror("Image \"%s\" not found, or contains errors", filename);
-	}
+	    if(!data) {
+		syntaxerror("Image \"%s\" not found, or contains errors", filename);
+	    }
 
-	/*tag = swf_AddImage(tag, imageID, data, width, height, quality)*/
-	tag = swf_InsertTag(tag, ST_DEFINEBITSLOSSLESS);
-	swf_SetU16(tag, imageID);
-	swf_SetLosslessImage(tag, data, width, height);
-    free(data);
+	    /*tag = swf_AddImage(tag, imageID, data, width, height, quality)*/
+	    tag = swf_InsertTag(tag, ST_DEFINEBITSLOSSLESS);
+	    swf_SetU16(tag, imageID);
+	    swf_SetLosslessImage(tag, data, width, height);
+	    free(data);
+	    cache_save(key, tag, tag);
+	}
+	free(key);
 
 	r.xmin = 0;
 	r.ymin = 0;
@@ -1654,72 +1708,79 @@ typedef struct _sound_t
 
 void s_sound(const char*name, const char*filename)
 {
-    struct WAV wav, wav2;
+    struct WAVReader reader;
     struct MP3 mp3;
     sound_t* sound;
     U16*samples = NULL;
     unsigned numsamples = 1;
     unsigned blocksize = 1152;
     int is_mp3 = 0;
+    char*key;
+    TAG*cached;
 
     if(dict_lookup(&sounds, name))
         syntaxerror("sound %s defined twice", name);
 
-    if(wav_read(&wav, filename))
-    {
-        int t;
-        wav_convert2mono(&wav, &wav2, 44100);
-        samples = (U16*)wav2.data;
-        numsamples = wav2.size/2;
-        free(wav.data);
-#ifdef WORDS_BIGENDIAN
-	/* swap bytes */
-        for(t=0;t<numsamples;t++)
-            samples[t] = (samples[t]>>8)&0xff | (samples[t]<<8)&0xff00;
-#endif
-    }
-    else
-        if(mp3_read(&mp3, filename))
-        {
-            fprintf(stderr, "\"%s\" seems to work as a MP3 file...\n", filename);
-            blocksize = 1;
-            is_mp3 = 1;
-        }
-        else
-        {
-            warning("Couldn't read WAV/MP3 file \"%s\"", filename);
-            samples = 0;
-            numsamples = 0;
-        }
+    key = cache_key(filename, "sound");
+    if((cached = cache_load(key, tag, id))) {
+	msg("<notice> Using cached sound \"%s\"", filename);
+	tag = cached;
+    } else {
+	if(wav_open(&reader, filename, 44100))
+	{
+	    int pos = 0, l;
+	    numsamples = reader.total;
+	    samples = malloc(sizeof(U16)*(numsamples+1));
+	    while(pos < numsamples && (l = wav_read_mono(&reader, (S16*)&samples[pos], numsamples-pos)) > 0)
+		pos += l;
+	    wav_close(&reader);
+	}
+	else
+	    if(mp3_read(&mp3, filename))
+	    {
+		fprintf(stderr, "\"%s\" seems to work as a MP3 file...\n", filename);
+		blocksize = 1;
+		is_mp3 = 1;
+	    }
+	    else
+	    {
+		warning("Couldn't read WAV/MP3 file \"%s\"", filename);
+		samples = 0;
+		numsamples = 0;
+	    }
 
-    if(numsamples%blocksize != 0)
-    {
-	// apply padding, so that block is a multiple of blocksize
-        int numblocks = (numsamples+blocksize-1)/blocksize;
-        int numsamples2;
-        U16* samples2;
-        numsamples2 = numblocks * blocksize;
-        samples2 = malloc(sizeof(U16)*numsamples2);
-        memcpy(samples2, samples, numsamples*sizeof(U16));
-        memset(&samples2[numsamples], 0, sizeof(U16)*(numsamples2 - numsamples));
-        numsamples = numsamples2;
-        free(samples);
-        samples = samples2;
-    }
+	if(numsamples%blocksize != 0)
+	{
+	    // apply padding, so that block is a multiple of blocksize
+	    int numblocks = (numsamples+blocksize-1)/blocksize;
+	    int numsamples2;
+	    U16* samples2;
+	    numsamples2 = numblocks * blocksize;
+	    samples2 = malloc(sizeof(U16)*numsamples2);
+	    memcpy(samples2, samples, numsamples*sizeof(U16));
+	    memset(&samples2[numsamples], 0, sizeof(U16)*(numsamples2 - numsamples));
+	    numsamples = numsamples2;
+	    free(samples);
+	    samples = samples2;
+	}
 
-    tag = swf_InsertTag(tag, ST_DEFINESOUND);
-    swf_SetU16(tag, id); //id
-    if(is_mp3)
-    {
-        swf_SetSoundDefineMP3(
-                tag, mp3.data, mp3.size,
-                mp3.SampRate,
-                mp3.Channels,
-                mp3.NumFrames);
-        mp3_clear(&mp3);
+	tag = swf_InsertTag(tag, ST_DEFINESOUND);
+	swf_SetU16(tag, id); //id
+	if(is_mp3)
+	{
+	    swf_SetSoundDefineMP3(
+		    tag, mp3.data, mp3.size,
+		    mp3.SampRate,
+		    mp3.Channels,
+		    mp3.NumFrames);
+	    mp3_clear(&mp3);
+	}
+	else
+	    swf_SetSoundDefine(tag, samples, numsamples);
+	if(is_mp3 || numsamples)
+	    cache_save(key, tag, tag);
     }
-    else
-        swf_SetSoundDefine(tag, samples, numsamples);
+    free(key);
 
     if(do_exports) {
 	tag = swf_InsertTag(tag, ST_NAMECHARACTER);
@@ -2167,6 +2228,7 @@ void s_getParameters(const char*name, parameters_t* p)
 
 void setStartparameters(instance_t* i, parameters_t* p, TAG* tag)
 {
+    i->showframe = showframes.pos / sizeof(TAG*);
     history_begin(i->history, "x", currentframe, tag, p->x);
     history_begin(i->history, "y", currentframe, tag, p->y);
     history_begin(i->history, "scalex", currentframe, tag, p->scalex);
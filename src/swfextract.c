@@ -1144,7 +1144,7 @@ int handlebinary(TAG*tag) {
     FILE *fout = NULL;
     char buf[100];
     char *filename = buf;
-    int len = tag->memsize;
+    int len = tag->len;
     int dx = 6; // offset to binary data
     if (tag->id!=ST_DEFINEBINARY) {
         if (!extractanyids) {
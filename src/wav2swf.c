@@ -46,6 +46,9 @@ static struct options_t options[] = {
 {"S", "stop"},
 {"E", "end"},
 {"b", "bitrate"},
+{"t", "threads"},
+{"p", "preset"},
+{"a", "adpcm"},
 {"v", "verbose"},
 {0,0}
 };
@@ -56,6 +59,22 @@ static int framerate = 0;
 static int samplerate = 11025;
 static int bitrate = 32;
 static int do_cgi = 0;
+static int threads = 1;
+static int quality = 0;
+static int adpcm = 0;
+
+/* mp3 encoder presets, mapped onto lame's quality levels */
+static struct {
+    const char*name;
+    int quality;
+} presets[] = {
+{"best", 0},
+{"high", 2},
+{"standard", 5},
+{"fast", 7},
+{"fastest", 9},
+{0,0}
+};
 
 static int mp3_bitrates[] =
 { 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0};
@@ -95,6 +114,38 @@ int args_callback_option(char*name,char*val)
 	do_cgi = 1;
 	return 0;
     }
+    else if(!strcmp(name, "p")) {
+	int t;
+	for(t=0;presets[t].name;t++) {
+	    if(!strcmp(val, presets[t].name)) {
+		quality = presets[t].quality;
+		return 1;
+	    }
+	}
+	if(val[0]>='0' && val[0]<='9' && !val[1]) {
+	    quality = val[0]-'0';
+	    return 1;
+	}
+	fprintf(stderr, "Invalid preset: %s\n", val);
+	fprintf(stderr, "Allowed presets: best, high, standard, fast, fastest, or 0-9\n");
+	exit(1);
+    }
+    else if(!strcmp(name, "a")) {
+	adpcm = atoi(val);
+	if(adpcm<2 || adpcm>5) {
+	    fprintf(stderr, "ADPCM needs 2 to 5 bits per sample, not %s\n", val);
+	    exit(1);
+	}
+	return 1;
+    }
+    else if(!strcmp(name, "t")) {
+	threads = atoi(val);
+	if(threads<1) {
+	    fprintf(stderr, "Not a valid number of threads: %s\n", val);
+	    exit(1);
+	}
+	return 1;
+    }
     else if(!strcmp(name, "r")) {
 	float f;
 	sscanf(val, "%f", &f);
@@ -168,6 +219,9 @@ void args_callback_usage(char *name)
     printf("-S , --stop                    Stop the movie at frame 0\n");
     printf("-E , --end                     Stop the movie at the end frame\n");
     printf("-b , --bitrate <bps>           Set mp3 bitrate to <bps> (default: 32)\n");
+    printf("-t , --threads <n>             Encode long sounds in <n> parallel segments\n");
+    printf("-p , --preset <name>           mp3 encoder speed: best (default), high, standard, fast, fastest\n");
+    printf("-a , --adpcm <bits>            Use ADPCM with <bits> (2-5) bits per sample instead of mp3\n");
     printf("-v , --verbose                 Be more verbose\n");
     printf("\n");
 }
@@ -181,30 +235,69 @@ int args_callback_command(char*name,char*val)
     return 0;
 }
 
-extern int swf_mp3_bitrate;
-extern int swf_mp3_out_samplerate;
-extern int swf_mp3_in_samplerate;
+/* Unless the swf goes to a CGI, it is written out while encoding: every
+   tag goes to the file (and is freed) as soon as the next one is started,
+   and the header is fixed up at the end. So memory usage doesn't depend
+   on the length of the sound. */
+static int out = -1;
+static int outsize = 0;
+static int outframes = 0;
+static U16 lastid = 0;
+
+static void write_tag(TAG*tag)
+{
+    outsize += swf_WriteTag(out, tag);
+    /* count frames like swf_WriteSWF() does */
+    if(tag->id == ST_SHOWFRAME || (tag->id == ST_END && lastid && lastid != ST_SHOWFRAME))
+	outframes++;
+    lastid = tag->id;
+}
+
+static TAG* insert_tag(SWF*swf, TAG*tag, U16 id)
+{
+    if(out<0) {
+	tag = swf_InsertTag(tag, id);
+	if(!swf->firstTag)
+	    swf->firstTag = tag;
+	return tag;
+    }
+    if(tag) {
+	write_tag(tag);
+	swf_DeleteTag(0, tag);
+    }
+    return swf_InsertTag(0, id);
+}
+
+static void read_samples(struct WAVReader*reader, S16*samples, int num)
+{
+    int pos = 0, l;
+    while(pos < num && (l = wav_read_mono(reader, &samples[pos], num-pos)) > 0)
+	pos += l;
+    /* pad the last block with silence */
+    memset(&samples[pos], 0, (num-pos)*sizeof(S16));
+}
 
 int main (int argc,char ** argv)
 { 
     SWF swf;
     RGBA rgb;
-    SRECT r;
     S32 width=300,height = 300;
-    TAG * tag;
+    TAG * tag = 0;
+    SOUNDENCODER*encoder;
+    struct WAVReader reader;
 
-    int f,i,ls1,fs1;
-    int count;
+    int f;
     int t;
-    struct WAV wav,wav2;
     int blocksize;
     float blockspersecond;
     float framespersecond;
     float samplesperframe;
     float framesperblock;
     float samplesperblock;
-    U16* samples;
+    S16* samples;
     int numsamples;
+    int numblocks;
+    int chunkblocks;
 
     processargs(argc, argv);
 
@@ -227,37 +320,15 @@ int main (int argc,char ** argv)
 	exit(1);
     }
 
-    if(!wav_read(&wav, filename))
+    if(!wav_open(&reader, filename, samplerate))
     {
 	msg("<fatal> Error reading %s", filename);
 	exit(1);
     }
-    wav_convert2mono(&wav,&wav2, samplerate);
-    //wav_print(&wav);
-    //wav_print(&wav2);
-    samples = (U16*)wav2.data;
-    numsamples = wav2.size/2;
-
-#ifdef WORDS_BIGENDIAN
-    /* swap bytes */
-    for(t=0;t<numsamples;t++) {
-        samples[t] = (samples[t]>>8)&0xff | (samples[t]<<8)&0xff00;
-    }
-#endif
 
-    if(numsamples%blocksize != 0)
-    {
-	// apply padding, so that block is a multiple of blocksize
-	int numblocks = (numsamples+blocksize-1)/blocksize;
-	int numsamples2;
-	U16* samples2;
-	numsamples2 = numblocks * blocksize;
-	samples2 = malloc(sizeof(U16)*numsamples2);
-	memcpy(samples2, samples, numsamples*sizeof(U16));
-	memset(&samples2[numsamples], 0, sizeof(U16)*(numsamples2 - numsamples));
-	numsamples = numsamples2;
-	samples = samples2;
-    }
+    /* the sound is padded to a multiple of blocksize */
+    numblocks = (reader.total+blocksize-1)/blocksize;
+    numsamples = numblocks*blocksize;
 
     memset(&swf,0x00,sizeof(SWF));
 
@@ -267,8 +338,16 @@ int main (int argc,char ** argv)
     swf.movieSize.xmax = 20*width;
     swf.movieSize.ymax = 20*height;
 
-    swf.firstTag = swf_InsertTag(NULL,ST_SETBACKGROUNDCOLOR);
-    tag = swf.firstTag;
+    if(!do_cgi) {
+	out = open(outputname,O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644);
+	if(out<0) {
+	    msg("<fatal> Couldn't create %s", outputname);
+	    exit(1);
+	}
+	outsize = swf_WriteHeader(out, &swf);
+    }
+
+    tag = insert_tag(&swf, tag, ST_SETBACKGROUNDCOLOR);
     rgb.r = 0xff;
     rgb.g = 0xff;
     rgb.b = 0xff;
@@ -276,18 +355,20 @@ int main (int argc,char ** argv)
 
     if(stopframe0) {
 	ActionTAG*action = 0;
-	tag = swf_InsertTag(tag, ST_DOACTION);
+	tag = insert_tag(&swf, tag, ST_DOACTION);
 	action = action_Stop(action);
 	action = action_End(action);
 	swf_ActionSet(tag, action);
 	swf_ActionFree(action);
 
-	tag = swf_InsertTag(tag, ST_SHOWFRAME);
+	tag = insert_tag(&swf, tag, ST_SHOWFRAME);
     }
 	
-    swf_mp3_bitrate = bitrate;
-    swf_mp3_out_samplerate = samplerate;
-    swf_mp3_in_samplerate = samplerate;
+    encoder = swf_SoundEncoderNew(samplerate, samplerate, 1, bitrate);
+    swf_SoundEncoderSetThreads(encoder, threads);
+    swf_SoundEncoderSetQuality(encoder, quality);
+    if(adpcm)
+	swf_SoundEncoderSetCompression(encoder, 1, adpcm);
 
     if(!definesound)
     {
@@ -297,26 +378,41 @@ int main (int argc,char ** argv)
 	float samplepos = 0;
 	ActionTAG* a = 0;
 	U16 v1=0,v2=0;
-	tag = swf_InsertTag(tag, ST_SOUNDSTREAMHEAD);
-	swf_SetSoundStreamHead(tag, samplesperframe);
-	msg("<notice> %d blocks", numsamples/blocksize);
-	for(t=0;t<numsamples/blocksize;t++) {
+
+	/* samples are read (and, with threads, encoded) a chunk of blocks at a time */
+	chunkblocks = threads>1 ? threads*256 : 16;
+	samples = (S16*)malloc(chunkblocks*blocksize*sizeof(S16));
+
+	tag = insert_tag(&swf, tag, ST_SOUNDSTREAMHEAD);
+	swf_SetSoundStreamHead2(tag, encoder, samplesperframe);
+	msg("<notice> %d blocks", numblocks);
+	for(t=0;t<numblocks;t++) {
 	    int s;
-	    U16*block1;
+	    S16*block1;
 	    int seek = blocksize - ((int)samplepos - (int)framesamplepos);
 
+	    if(t%chunkblocks == 0) {
+		int num = numblocks-t < chunkblocks ? numblocks-t : chunkblocks;
+		read_samples(&reader, samples, num*blocksize);
+		if(threads>1)
+		    swf_SoundEncoderEncode(encoder, samples, num);
+	    }
+	    block1 = &samples[(t%chunkblocks)*blocksize];
+
 	    if(newframepos!=oldframepos) {
-		tag = swf_InsertTag(tag, ST_SOUNDSTREAMBLOCK);
+		tag = insert_tag(&swf, tag, ST_SOUNDSTREAMBLOCK);
 		msg("<notice> Starting block %d %d+%d", t, (int)samplepos, (int)blocksize);
-		block1 = &samples[t*blocksize];
-		swf_SetSoundStreamBlock(tag, block1, seek, 1);
-		v1 = v2 = GET16(tag->data);
+		swf_SetSoundStreamBlock2(tag, encoder, block1, seek, 1);
+		if(!adpcm)
+		    v1 = v2 = GET16(tag->data);
 	    } else {
 		msg("<notice> Adding data...", t);
-		block1 = &samples[t*blocksize];
-		swf_SetSoundStreamBlock(tag, block1, seek, 0);
-		v1+=v2;
-		PUT16(tag->data, v1);
+		swf_SetSoundStreamBlock2(tag, encoder, block1, seek, 0);
+		if(!adpcm) {
+		    /* update the mp3 sample count */
+		    v1+=v2;
+		    PUT16(tag->data, v1);
+		}
 	    }
 	    samplepos += blocksize;
 
@@ -325,52 +421,62 @@ int main (int argc,char ** argv)
 	    newframepos = (int)framepos;
 
 	    for(s=oldframepos;s<newframepos;s++) {
-		tag = swf_InsertTag(tag, ST_SHOWFRAME);
+		tag = insert_tag(&swf, tag, ST_SHOWFRAME);
 		framesamplepos += samplesperframe;
 	    }
 	}
-	tag = swf_InsertTag(tag, ST_END);
+	tag = insert_tag(&swf, tag, ST_END);
     } else {
 	SOUNDINFO info;
-	tag = swf_InsertTag(tag, ST_DEFINESOUND);
+
+	/* a DefineSound tag holds the whole sound anyway */
+	samples = (S16*)malloc(numsamples*sizeof(S16));
+	read_samples(&reader, samples, numsamples);
+
+	tag = insert_tag(&swf, tag, ST_DEFINESOUND);
 	swf_SetU16(tag, 24); //id
 #ifdef DEFINESOUND_MP3
-        swf_SetSoundDefine(tag, samples, numsamples);
+        swf_SetSoundDefine2(tag, encoder, samples, numsamples);
 #else
         swf_SetU8(tag,(/*compression*/0<<4)|(/*rate*/3<<2)|(/*size*/1<<1)|/*mono*/0);
         swf_SetU32(tag, numsamples); // 44100 -> 11025
-        swf_SetBlock(tag, samples, numsamples*2);
+        swf_SetBlock(tag, (U8*)samples, numsamples*2);
 #endif
 
 
-	tag = swf_InsertTag(tag, ST_STARTSOUND);
+	tag = insert_tag(&swf, tag, ST_STARTSOUND);
 	swf_SetU16(tag, 24); //id
 	memset(&info, 0, sizeof(info));
 	info.loops = loop;
 	swf_SetSoundInfo(tag, &info);
-	tag = swf_InsertTag(tag, ST_SHOWFRAME);
+	tag = insert_tag(&swf, tag, ST_SHOWFRAME);
         if(stopframe1) {
 	    ActionTAG*action = 0;
-	    tag = swf_InsertTag(tag, ST_DOACTION);
+	    tag = insert_tag(&swf, tag, ST_DOACTION);
 	    action = action_Stop(action);
 	    action = action_End(action);
 	    swf_ActionSet(tag, action);
 	    swf_ActionFree(action);
-	    tag = swf_InsertTag(tag, ST_SHOWFRAME);
+	    tag = insert_tag(&swf, tag, ST_SHOWFRAME);
         }
-	tag = swf_InsertTag(tag, ST_END);
+	tag = insert_tag(&swf, tag, ST_END);
     }
+    wav_close(&reader);
+    free(samples);
 
     if(do_cgi) {
 	if FAILED(swf_WriteCGI(&swf)) fprintf(stderr,"WriteCGI() failed.\n");
+	swf_FreeTags(&swf);
     } else {
-	f = open(outputname,O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644);
-	if FAILED(swf_WriteSWF(f,&swf)) fprintf(stderr,"WriteSWF() failed.\n");
-	close(f);
+	write_tag(tag);
+	swf_DeleteTag(0, tag);
+	swf.fileSize = outsize;
+	swf.frameCount = outframes;
+	if(lseek(out, 0, SEEK_SET) < 0 || swf_WriteHeader(out, &swf) < 0)
+	    fprintf(stderr,"WriteSWF() failed.\n");
+	close(out);
     }
 
-    swf_FreeTags(&swf);
+    swf_SoundEncoderDelete(encoder);
     return 0;
 }
-
-